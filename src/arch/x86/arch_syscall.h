@@ -13,4 +13,9 @@
 #define REG_ARG5   edi
 #define REG_ARG6   ebp
 
+/* The mmap variant that takes its arguments in registers. Plain mmap takes a
+ * pointer to them here.
+ */
+#define SYS_MMAP   SYS_mmap2
+
 #endif
@@ -13,4 +13,7 @@
 #define REG_ARG5   r8
 #define REG_ARG6   r9
 
+/* The mmap variant that takes its arguments in registers. */
+#define SYS_MMAP   SYS_mmap
+
 #endif
@@ -1,25 +1,34 @@
+#define _GNU_SOURCE
 #include <assert.h>
 #include "cache.h"
 #include "collection/dict.h"
 #include "constants.h"
 #include "db.h"
 #include "depset.h"
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include "log.h"
+#include <openssl/md5.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/file.h>
 #include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
+#include "toolchain.h"
 #include <unistd.h>
 #include "util.h"
 #include <utime.h>
+#include "watch.h"
 
 /* Subdirectory of the cache root under which to cache file contents of output
  * files.
@@ -28,6 +37,31 @@
 
 #define DB   "cache.db"
 
+/* Subdirectory of the cache root in which files that may become cached data,
+ * like the captured output of a target, are created.
+ */
+#define STAGING "/staging"
+
+/* Age (in seconds) past which a file in the staging directory that nobody has
+ * open is assumed to have been left behind by a process that died.
+ */
+#define STALE_STAGING (60 * 60)
+
+/* Subdirectory of the cache root holding a lock file for each entry being
+ * written in the background.
+ */
+#define PENDING "/pending"
+
+/* Subdirectory of the cache root holding a lock file for each invocation
+ * being traced, so that concurrent identical invocations run it only once.
+ */
+#define LOCKS "/locks"
+
+/* How long (in milliseconds) to wait for xcache-watch to catch up with
+ * outstanding changes before giving up on it and checking inputs ourselves.
+ */
+#define WATCH_SYNC_TIMEOUT 200
+
 struct cache {
 
     /* Underlying data store for metadata about dependency graphs. */
@@ -38,10 +72,76 @@ struct cache {
      */
     char *root;
 
+    /* Path to the top level cache directory. */
+    char *dir;
+
+    /* Path to the staging directory, without a trailing slash. */
+    char *staging;
+
+    /* Change record published by xcache-watch, if it is running. */
+    watch_t *watch;
+
+    /* Context for validating inputs, kept across lookups. This may be NULL if
+     * we ran out of memory, in which case each lookup sets up its own.
+     */
+    stat_ring_t *ring;
+
     /* Whether to keep statistics on database operations or not. */
     bool statistics;
+
+    /* Memo of file hashes we have previously computed, keyed by absolute path.
+     * Entries are only trusted while the file's identity and timestamps are
+     * unchanged. In a short lived xcache process this rarely helps, but xcached
+     * sees the same outputs rewritten by build after build.
+     */
+    dict_t hashes;
+
+    /* Protects 'hashes', as outputs are saved concurrently. */
+    pthread_mutex_t hashes_lock;
 };
 
+/* An entry in the hash memo. */
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+    char *hash;
+} memo_t;
+
+/* Remove files left in the staging directory by processes that died before
+ * moving or removing them. A write lease can only be taken on a file nobody
+ * else has open, so we take one to tell an abandoned file from the output of a
+ * long running target, and hold it while removing the file. Failure here only
+ * leaves the files for next time.
+ */
+static void sweep_staging(const char *staging) {
+    DIR *dir = opendir(staging);
+    if (dir == NULL)
+        return;
+    time_t cutoff = time(NULL) - STALE_STAGING;
+    for (struct dirent *e; (e = readdir(dir)) != NULL; ) {
+        if (e->d_name[0] == '.')
+            continue;
+        struct stat st;
+        if (fstatat(dirfd(dir), e->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+                !S_ISREG(st.st_mode) || st.st_mtime > cutoff)
+            continue;
+        int fd = openat(dirfd(dir), e->d_name,
+            O_RDONLY|O_CLOEXEC|O_NOFOLLOW|O_NONBLOCK);
+        if (fd == -1)
+            continue;
+        if (fcntl(fd, F_SETLEASE, F_WRLCK) == 0) {
+            DEBUG("Removing stale staging file %s/%s\n", staging, e->d_name);
+            (void)unlinkat(dirfd(dir), e->d_name, 0);
+            (void)fcntl(fd, F_SETLEASE, F_UNLCK);
+        }
+        close(fd);
+    }
+    closedir(dir);
+}
+
 cache_t *cache_open(const char *path, bool statistics) {
     cache_t *c = malloc(sizeof(*c));
     if (c == NULL)
@@ -70,6 +170,40 @@ cache_t *cache_open(const char *path, bool statistics) {
         return NULL;
     }
 
+    c->dir = strdup(path);
+    if (c->dir == NULL) {
+        free(c->root);
+        db_close(&c->db);
+        free(c);
+        return NULL;
+    }
+
+    if (dict(&c->hashes) != 0) {
+        free(c->dir);
+        free(c->root);
+        db_close(&c->db);
+        free(c);
+        return NULL;
+    }
+
+    pthread_mutex_init(&c->hashes_lock, NULL);
+
+    c->staging = cache_staging(path);
+    if (c->staging == NULL) {
+        pthread_mutex_destroy(&c->hashes_lock);
+        dict_destroy(&c->hashes);
+        free(c->dir);
+        free(c->root);
+        db_close(&c->db);
+        free(c);
+        return NULL;
+    }
+    sweep_staging(c->staging);
+
+    c->watch = watch_open(path);
+
+    c->ring = stat_ring_new();
+
     c->statistics = statistics;
 
     return c;
@@ -82,6 +216,88 @@ static int get_id(cache_t *c, fingerprint_t *fp) {
     return id;
 }
 
+char *cache_staging(const char *path) {
+    autofree char *staging = aprintf("%s" STAGING, path);
+    if (staging == NULL || mkdirp(staging) != 0)
+        return NULL;
+    /* Files are recognised as staged by their path, so make sure we always
+     * refer to the directory the same way.
+     */
+    return realpath(staging, NULL);
+}
+
+/* Copy a file into the cache as 'cpath'. The copy is made under a temporary
+ * name and then renamed into place, so that anyone else saving or reading the
+ * same data concurrently never sees it partially written. Returns 0 on
+ * success.
+ */
+static int store(cache_t *c, const char *filename, const char *cpath) {
+    autofree char *tmp = aprintf("%s/tmp.XXXXXX", c->staging);
+    if (tmp == NULL)
+        return -1;
+    int fd = mkstemp(tmp);
+    if (fd == -1)
+        return -1;
+    close(fd);
+
+    if (cp(filename, tmp) != 0 || rename(tmp, cpath) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* Move a file from the staging directory into the cache. Returns the hash of
+ * its data on success, as for cache_save.
+ */
+static char *cache_move(cache_t *c, const char *filename) {
+    char *h = filehash(filename);
+    if (h == NULL)
+        return NULL;
+
+    autofree char *cpath = aprintf("%s/%s", c->root, h);
+    if (cpath == NULL) {
+        free(h);
+        return NULL;
+    }
+
+    /* If we already have a copy of this data, the staged file is simply left
+     * for its owner to remove.
+     */
+    if (access(cpath, F_OK) == 0)
+        return h;
+
+    if (rename(filename, cpath) != 0 && store(c, filename, cpath) != 0) {
+        free(h);
+        return NULL;
+    }
+    return h;
+}
+
+/* Save the target of a symlink to the cache, as the data of the link. Returns
+ * the hash of this as for cache_save.
+ */
+static char *cache_save_link(cache_t *c, const char *filename) {
+    char target[PATH_MAX];
+    ssize_t len = readlink(filename, target, sizeof(target));
+    if (len < 0 || (size_t)len >= sizeof(target))
+        return NULL;
+
+    autofree char *tmp = aprintf("%s/tmp.XXXXXX", c->staging);
+    if (tmp == NULL)
+        return NULL;
+    int fd = mkstemp(tmp);
+    if (fd == -1)
+        return NULL;
+    bool ok = write(fd, target, (size_t)len) == len;
+    close(fd);
+
+    char *h = ok ? cache_move(c, tmp) : NULL;
+    /* If we already had this data, the file is still here. */
+    unlink(tmp);
+    return h;
+}
+
 /* Save a file to the cache.
  *
  * c - The cache to save to.
@@ -91,30 +307,281 @@ static int get_id(cache_t *c, fingerprint_t *fp) {
  * caller's responsibility to free the returned pointer.
  */
 static char *cache_save(cache_t *c, const char *filename) {
-    char *h = filehash(filename);
-    if (h == NULL)
+    /* A staged file only ever gets saved once, so there is no point
+     * remembering its hash, and it can be moved into place.
+     */
+    size_t len = strlen(c->staging);
+    if (strncmp(filename, c->staging, len) == 0 && filename[len] == '/')
+        return cache_move(c, filename);
+
+    struct stat st;
+    if (stat(filename, &st) != 0)
         return NULL;
 
+    char *h = NULL;
+    pthread_mutex_lock(&c->hashes_lock);
+    memo_t *m = dict_lookup(&c->hashes, filename);
+    if (m != NULL && m->dev == st.st_dev && m->ino == st.st_ino &&
+            m->size == st.st_size &&
+            m->mtime.tv_sec == st.st_mtim.tv_sec &&
+            m->mtime.tv_nsec == st.st_mtim.tv_nsec &&
+            m->ctime.tv_sec == st.st_ctim.tv_sec &&
+            m->ctime.tv_nsec == st.st_ctim.tv_nsec)
+        h = strdup(m->hash);
+    pthread_mutex_unlock(&c->hashes_lock);
+
+    if (h == NULL) {
+        /* Hash without holding the lock, so others can hash concurrently. */
+        h = filehash(filename);
+        if (h == NULL)
+            return NULL;
+
+        /* Remember this hash for next time. Failure here only costs us a
+         * rehash later, so we ignore it.
+         */
+        pthread_mutex_lock(&c->hashes_lock);
+        m = dict_lookup(&c->hashes, filename);
+        memo_t *n = malloc(sizeof(*n));
+        char *key = strdup(filename);
+        if (n != NULL && key != NULL &&
+                (n->hash = strdup(h)) != NULL) {
+            n->dev = st.st_dev;
+            n->ino = st.st_ino;
+            n->size = st.st_size;
+            n->mtime = st.st_mtim;
+            n->ctime = st.st_ctim;
+            if (m != NULL)
+                free(m->hash);
+            (void)dict_add(&c->hashes, key, n);
+        } else {
+            free(n);
+            free(key);
+        }
+        pthread_mutex_unlock(&c->hashes_lock);
+    }
+
     autofree char *cpath = aprintf("%s/%s", c->root, h);
     if (cpath == NULL) {
         free(h);
         return NULL;
     }
-    if (cp(filename, cpath) != 0) {
+
+    /* The data directory is content addressed, so if we already have a copy
+     * of this data there is no need to write it again.
+     */
+    if (access(cpath, F_OK) == 0)
+        return h;
+
+    if (store(c, filename, cpath) != 0) {
         free(h);
         return NULL;
     }
     return h;
 }
 
-int cache_write(cache_t *cache, int argc, char **argv,
+/* Digest the values of the given environment variables, so an entry's
+ * environment can be checked with a single comparison. 'names' has each name
+ * terminated by a newline, and 'lookup' gives the value of each. Returns NULL
+ * on failure.
+ */
+static char *env_digest(const char *names,
+        const char *(*lookup)(const char *name)) {
+    autofree char *copy = strdup(names);
+    if (copy == NULL)
+        return NULL;
+
+    MD5_CTX ctx;
+    MD5_Init(&ctx);
+    for (char *p = copy, *nl; (nl = strchr(p, '\n')) != NULL; p = nl + 1) {
+        *nl = '\0';
+        MD5_Update(&ctx, p, nl - p + 1);
+
+        /* Distinguish an unset variable from an empty one. */
+        const char *value = lookup(p);
+        unsigned char set = value != NULL;
+        MD5_Update(&ctx, &set, sizeof(set));
+        if (value != NULL)
+            MD5_Update(&ctx, value, strlen(value) + 1);
+    }
+
+    unsigned char h[MD5_DIGEST_LENGTH];
+    MD5_Final(h, &ctx);
+
+    char *digest = malloc(MD5_DIGEST_LENGTH * 2 + 1);
+    if (digest == NULL)
+        return NULL;
+    for (unsigned int i = 0; i < MD5_DIGEST_LENGTH; i++)
+        sprintf(digest + i * 2, "%02x", h[i]);
+    return digest;
+}
+
+static int strcmp_indirect(const void *a, const void *b) {
+    return strcmp(*(const char *const*)a, *(const char *const*)b);
+}
+
+/* Record the environment variables read while tracing an entry, both one by
+ * one and as a digest over them all. Returns 0 on success.
+ */
+static int save_environment(cache_t *cache, int id, dict_t *env) {
+    size_t count = 0, capacity = 0, length = 0;
+    const char **names = NULL;
+    autofree char *joined = NULL;
+    autofree char *digest = NULL;
+    bool digestible = true;
+    int ret = -1;
+
+    int save_env(const char *name, const char *value) {
+        if (db_insert_env(&cache->db, id, name, value) != 0)
+            return -1;
+
+        /* A name we cannot delimit, which no one should ever use, means we
+         * fall back to checking variables individually.
+         */
+        if (strchr(name, '\n') != NULL)
+            digestible = false;
+
+        if (count == capacity) {
+            size_t c = capacity == 0 ? 32 : capacity * 2;
+            const char **ns = realloc(names, c * sizeof(ns[0]));
+            if (ns == NULL)
+                return -1;
+            names = ns;
+            capacity = c;
+        }
+        names[count++] = name;
+        length += strlen(name) + 1;
+        return 0;
+    }
+    if (dict_foreach(env, (int(*)(const char*, void*))save_env) != 0)
+        goto done;
+
+    if (!digestible) {
+        ret = 0;
+        goto done;
+    }
+
+    /* The digest needs to come out the same however the hook happened to
+     * store the variables.
+     */
+    if (count > 0)
+        qsort(names, count, sizeof(names[0]), strcmp_indirect);
+
+    joined = malloc(length + 1);
+    if (joined == NULL)
+        goto done;
+    char *p = joined;
+    for (size_t i = 0; i < count; i++)
+        p += sprintf(p, "%s\n", names[i]);
+    *p = '\0';
+
+    const char *recorded(const char *name) {
+        return dict_lookup(env, name);
+    }
+    digest = env_digest(joined, recorded);
+    if (digest == NULL)
+        goto done;
+
+    ret = db_insert_environment(&cache->db, id, joined, digest);
+
+done:
+    free(names);
+    return ret;
+}
+
+/* A dependency of an entry being written. */
+typedef struct {
+    const char *filename;  /* Path recorded in the entry */
+    const char *source;    /* Path of the data to save, for an output */
+    bool stream;           /* Whether this is the target's stdout or stderr */
+    filetype_t type;
+    time_t mtime;          /* Timestamp of an input */
+
+    /* For an output, the metadata and hash of its data once saved. 'hash' is
+     * left NULL if the output no longer exists.
+     */
+    time_t out_mtime;
+    mode_t mode;
+    char *hash;
+} ingest_t;
+
+int cache_write(cache_t *cache, const char *cwd, int argc, char **argv,
         depset_t *depset, dict_t *env, const char *outfile,
-        const char *errfile) {
-    auto_fingerprint_t *fp = fingerprint((unsigned int)argc, argv);
+        const char *errfile, const char *prefixes, const char *stamp,
+        int status, int signal, unsigned ttl) {
+    auto_fingerprint_t *fp = fingerprint(cwd, (unsigned int)argc, argv);
     if (fp == NULL)
         return -1;
+
+    size_t count = 0, capacity = 0;
+    ingest_t *deps = NULL;
+    bool began = false;
+    int ret = -1;
+
+    int add(const char *filename, const char *source, filetype_t type,
+            time_t mtime) {
+        if (count == capacity) {
+            size_t c = capacity == 0 ? 64 : capacity * 2;
+            ingest_t *ds = realloc(deps, c * sizeof(ds[0]));
+            if (ds == NULL)
+                return -1;
+            deps = ds;
+            capacity = c;
+        }
+        deps[count++] = (ingest_t){
+            .filename = filename,
+            .source = source,
+            .stream = source != filename,
+            .type = type,
+            .mtime = mtime,
+        };
+        return 0;
+    }
+    int add_file(const char *filename, filetype_t type, time_t mtime) {
+        return add(filename, filename, type, mtime);
+    }
+    if (depset_foreach(depset, add_file) != 0)
+        goto done;
+    if (outfile != NULL && add("/dev/stdout", outfile, XC_OUTPUT, 0) != 0)
+        goto done;
+    if (errfile != NULL && add("/dev/stderr", errfile, XC_OUTPUT, 0) != 0)
+        goto done;
+
+    /* Hash and copy the outputs into the cache before touching the database.
+     * This is the bulk of the work for a target with large outputs, and doing
+     * it concurrently outside the transaction means we neither do it serially
+     * nor hold the database lock while we do it.
+     */
+    int ingest(size_t index) {
+        ingest_t *d = &deps[index];
+        if (d->type != XC_OUTPUT && d->type != XC_BOTH)
+            return 0;
+
+        if (!d->stream) {
+            struct stat st;
+            if (lstat(d->source, &st) != 0)
+                return 0;
+            d->out_mtime = st.st_mtime;
+            d->mode = st.st_mode;
+
+            /* A symlink the target created is restored as a symlink, not as
+             * a copy of whatever it points to.
+             */
+            if (S_ISLNK(st.st_mode)) {
+                d->hash = cache_save_link(cache, d->source);
+                return d->hash == NULL ? -1 : 0;
+            }
+        }
+
+        d->hash = cache_save(cache, d->source);
+        return d->hash == NULL ? -1 : 0;
+    }
+    if (parallel(count, 0, ingest) != 0)
+        goto done;
+
+    /* What remains is writing the metadata. */
     if (db_begin(&cache->db) != 0)
-        return -1;
+        goto done;
+    began = true;
 
     int id = get_id(cache, fp);
     if (id != -1) {
@@ -123,76 +590,59 @@ int cache_write(cache_t *cache, int argc, char **argv,
          */
         if (db_remove_id(&cache->db, id) != 0) {
             DEBUG("Failed to remove existing cache entry\n");
-            goto fail;
+            goto done;
         }
     }
     if (db_insert_id(&cache->db, &id, fp) != 0)
-        goto fail;
+        goto done;
 
     assert(id >= 0);
 
     /* Write the inputs and outputs. */
-    int save_file(const char *filename, filetype_t type, time_t mtime) {
-        if (type == XC_INPUT || type == XC_BOTH)
-            if (db_insert_input(&cache->db, id, filename, mtime) != 0)
-                return -1;
-
-        if (type == XC_OUTPUT || type == XC_BOTH) {
-            struct stat st;
-            if (stat(filename, &st) != 0)
-                return 0;
-
-            autofree char *h = cache_save(cache, filename);
-            if (h == NULL)
-                return -1;
-
-            int r = db_insert_output(&cache->db, id, filename, st.st_mtime, st.st_mode, h);
-            return r;
-        }
-
-        return 0;
-    }
-    if (depset_foreach(depset, save_file) != 0)
-        goto fail;
+    for (size_t i = 0; i < count; i++) {
+        const ingest_t *d = &deps[i];
+        if (d->type == XC_INPUT || d->type == XC_BOTH)
+            if (db_insert_input(&cache->db, id, d->filename, d->mtime) != 0)
+                goto done;
 
-    int save_env(const char *name, const char *value) {
-        return db_insert_env(&cache->db, id, name, value);
+        if (d->hash != NULL &&
+                db_insert_output(&cache->db, id, d->filename, d->out_mtime,
+                    d->mode, d->hash) != 0)
+            goto done;
     }
-    if (dict_foreach(env, (int(*)(const char*, void*))save_env) != 0)
-        goto fail;
 
-    if (outfile != NULL) {
-        autofree char *h = cache_save(cache, outfile);
-        if (h == NULL)
-            goto fail;
+    if (save_environment(cache, id, env) != 0)
+        goto done;
 
-        int r = db_insert_output(&cache->db, id, "/dev/stdout", 0, 0, h);
-        if (r != 0)
-            goto fail;
+    if (stamp != NULL) {
+        assert(prefixes != NULL);
+        if (db_insert_toolchain(&cache->db, id, prefixes, stamp) != 0)
+            goto done;
     }
 
-    if (errfile != NULL) {
-        autofree char *h = cache_save(cache, errfile);
-        if (h == NULL)
-            goto fail;
-
-        int r = db_insert_output(&cache->db, id, "/dev/stderr", 0, 0, h);
-        if (r != 0)
-            goto fail;
+    if (status != 0 || signal != 0) {
+        int64_t expiry = ttl == 0 ? -1 : (int64_t)time(NULL) + ttl;
+        if (db_insert_result(&cache->db, id, status, signal, expiry) != 0)
+            goto done;
     }
 
     if (cache->statistics) {
         if (db_insert_event(&cache->db, id, EV_CREATED) != 0)
-            goto fail;
+            goto done;
     }
 
     if (db_commit(&cache->db) != 0)
-        goto fail;
-    return 0;
+        goto done;
+    began = false;
+    ret = 0;
 
-fail:
-    db_rollback(&cache->db);
-    return -1;
+done:
+    if (began)
+        db_rollback(&cache->db);
+    for (size_t i = 0; i < count; i++)
+        free(deps[i].hash);
+    free(deps);
+    return ret;
 }
 
 int cache_clear(cache_t *cache) {
@@ -217,8 +667,140 @@ static char *debug_timestamp(time_t ts) {
     return aprintf("%llu (%s)", (long long unsigned)ts, buf);
 }
 
-int cache_locate(cache_t *cache, int argc, char **argv) {
-    auto_fingerprint_t *fp = fingerprint((unsigned int)argc, argv);
+/* Lookup an environment variable in the given environment. If 'envp' is NULL,
+ * our own environment is used.
+ */
+static const char *env_lookup(char **envp, const char *name) {
+    if (envp == NULL)
+        return getenv(name);
+
+    size_t len = strlen(name);
+    for (char **p = envp; *p != NULL; p++) {
+        if (strncmp(*p, name, len) == 0 && (*p)[len] == '=')
+            return *p + len + 1;
+    }
+    return NULL;
+}
+
+/* Whether a path is reached without passing through any symbolic links or
+ * '.' or '..' components. The watcher only sees changes to the directories
+ * named in an input's path, so a change behind a link would go unnoticed.
+ * Components that do not exist are fine, as their creation would be seen.
+ */
+static bool direct(const char *path) {
+    if (path[0] != '/')
+        return false;
+
+    autofree char *p = strdup(path);
+    if (p == NULL)
+        return false;
+
+    for (char *name = p + 1; ; ) {
+        char *slash = strchr(name, '/');
+        if (slash != NULL)
+            *slash = '\0';
+        if (strcmp(name, "") == 0 || strcmp(name, ".") == 0 ||
+                strcmp(name, "..") == 0)
+            return false;
+
+        struct stat st;
+        if (lstat(p, &st) != 0)
+            return errno == ENOENT || errno == ENOTDIR;
+        if (S_ISLNK(st.st_mode))
+            return false;
+
+        if (slash == NULL)
+            return true;
+        *slash = '/';
+        name = slash + 1;
+    }
+}
+
+/* Confirm that the inputs of a cache entry are unchanged. The inputs are read
+ * up front and then checked as a batch, rather than one at a time as we step
+ * through the query, so the stats can be in flight concurrently.
+ */
+static int check_inputs(cache_t *cache, int id) {
+    size_t count = 0, capacity = 0;
+    char **filenames = NULL;
+    time_t *timestamps = NULL;
+    int ret = -1;
+
+    int collect(const char *filename, time_t timestamp) {
+        if (count == capacity) {
+            size_t c = capacity == 0 ? 64 : capacity * 2;
+            char **fs = realloc(filenames, c * sizeof(fs[0]));
+            if (fs == NULL)
+                return -1;
+            filenames = fs;
+            time_t *ts = realloc(timestamps, c * sizeof(ts[0]));
+            if (ts == NULL)
+                return -1;
+            timestamps = ts;
+            capacity = c;
+        }
+        filenames[count] = strdup(filename);
+        if (filenames[count] == NULL)
+            return -1;
+        timestamps[count] = timestamp;
+        count++;
+        return 0;
+    }
+    if (db_for_inputs(&cache->db, id, collect) != 0)
+        goto done;
+
+    /* The first input found to have changed. Checks may run concurrently, so
+     * this is updated atomically.
+     */
+    size_t changed = SIZE_MAX;
+    int note_change(size_t index) {
+        size_t none = SIZE_MAX;
+        __atomic_compare_exchange_n(&changed, &none, index, false,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+        return -1;
+    }
+
+    int check(size_t index, const struct stat *st, int err) {
+        const char *filename = filenames[index];
+        time_t timestamp = timestamps[index];
+        if (st == NULL) {
+            if (err == ENOENT && timestamp == MISSING)
+                /* The file doesn't exist, but we expected it not to. */
+                return 0;
+            DEBUG("Failed to stat %s\n", filename);
+            return note_change(index);
+        } else if (st->st_mtime != timestamp) {
+            /* This is actually the expected case; that we found the input file
+             * but its timestamp has changed.
+             */
+            autofree char *time1 = debug_timestamp(st->st_mtime);
+            autofree char *time2 = debug_timestamp(timestamp);
+
+            DEBUG("Found %s but its timestamp was %s not %s as expected",
+                filename, time1, time2);
+            return note_change(index);
+        }
+        return 0;
+    }
+    ret = stat_all(cache->ring, count, (const char**)filenames, check);
+
+    /* Remember which input changed, so it is checked early next time. Failure
+     * here only costs us some extra stats in future.
+     */
+    if (changed != SIZE_MAX)
+        (void)db_insert_miss(&cache->db, filenames[changed]);
+
+done:
+    for (size_t i = 0; i < count; i++)
+        free(filenames[i]);
+    free(filenames);
+    free(timestamps);
+    return ret;
+}
+
+int cache_locate(cache_t *cache, const char *cwd, int argc, char **argv,
+        char **envp, bool failures) {
+    auto_fingerprint_t *fp = fingerprint(cwd, (unsigned int)argc, argv);
     if (fp == NULL)
         return -1;
 
@@ -234,97 +816,708 @@ int cache_locate(cache_t *cache, int argc, char **argv) {
         (void)db_insert_event(&cache->db, id, EV_ACCESSED);
     }
 
-    int f(const char *filename, time_t timestamp) {
-        struct stat st;
-        if (stat(filename, &st) != 0) {
-            if (errno == ENOENT && timestamp == MISSING)
-                /* The file doesn't exist, but we expected it not to. */
-                return 0;
-            DEBUG("Failed to stat %s\n", filename);
+    /* Entries of unsuccessful runs are only for callers who asked for them,
+     * and may only be kept for a while, as whatever made the target fail
+     * could well have been transient.
+     */
+    {
+        int status, signal;
+        int64_t expiry;
+        if (db_select_result(&cache->db, id, &status, &signal, &expiry) != 0)
             return -1;
-        } else if (st.st_mtime != timestamp) {
-            /* This is actually the expected case; that we found the input file
-             * but its timestamp has changed.
+        if ((status != 0 || signal != 0) && !failures) {
+            DEBUG("Cache entry is of an unsuccessful run\n");
+            return -1;
+        }
+        if (expiry != -1 && expiry <= (int64_t)time(NULL)) {
+            DEBUG("Cache entry for unsuccessful run has expired\n");
+            if (db_begin(&cache->db) == 0) {
+                if (db_remove_id(&cache->db, id) == 0) {
+                    (void)db_commit(&cache->db);
+                } else {
+                    (void)db_rollback(&cache->db);
+                }
+            }
+            return -1;
+        }
+    }
+
+    /* Check the environment variables the entry read still have the same
+     * values. This is cheap, so we do it before looking at any files.
+     */
+    {
+        autofree char *names = NULL;
+        autofree char *digest = NULL;
+        if (db_select_environment(&cache->db, id, &names, &digest) != 0)
+            return -1;
+        if (digest != NULL) {
+            const char *current(const char *name) {
+                return env_lookup(envp, name);
+            }
+            autofree char *now = env_digest(names, current);
+            if (now == NULL || strcmp(now, digest) != 0) {
+                DEBUG("Environment has changed since entry was created\n");
+                return -1;
+            }
+        } else {
+            /* An entry from before we kept digests, or with unusual variable
+             * names.
              */
-            autofree char *time1 = debug_timestamp(st.st_mtime);
-            autofree char *time2 = debug_timestamp(timestamp);
+            int env_check(const char *name, const char *value) {
+                assert(name != NULL);
+                const char *local_value = env_lookup(envp, name);
+                return !((local_value == NULL && value == NULL) ||
+                         (local_value != NULL && value != NULL &&
+                            strcmp(local_value, value) == 0));
+            }
+            if (db_for_env(&cache->db, id, env_check) != 0)
+                return -1;
+        }
+    }
 
-            DEBUG("Found %s but its timestamp was %s not %s as expected",
-                filename, time1, time2);
+    /* If the entry depends on files under immutable prefixes, check that the
+     * toolchain has not changed since.
+     */
+    {
+        autofree char *prefixes = NULL;
+        autofree char *stamp = NULL;
+        if (db_select_toolchain(&cache->db, id, &prefixes, &stamp) != 0)
             return -1;
+        if (stamp != NULL) {
+            autofree char *current = toolchain_stamp(prefixes);
+            if (current == NULL || strcmp(current, stamp) != 0) {
+                DEBUG("Toolchain has changed since entry was created\n");
+                return -1;
+            }
         }
-        return 0;
     }
-    if (db_for_inputs(&cache->db, id, f) != 0)
+
+    /* If a watcher is running and has seen no changes to any of the inputs
+     * since we last confirmed them, we can skip checking them ourselves.
+     */
+    if (cache->watch != NULL && !watch_alive(cache->watch)) {
+        watch_close(cache->watch);
+        cache->watch = NULL;
+    }
+    if (cache->watch == NULL)
+        cache->watch = watch_open(cache->dir);
+    /* The watcher may not yet have seen a change that has already happened,
+     * so wait for it to catch up before believing anything it says.
+     */
+    bool synced = cache->watch != NULL &&
+        watch_sync(cache->watch, WATCH_SYNC_TIMEOUT);
+    if (cache->watch != NULL && !synced)
+        DEBUG("Watcher did not catch up; checking inputs ourselves\n");
+    bool unchanged = false;
+    int64_t validated;
+    if (synced && db_select_validated(&cache->db, id, &validated) == 0) {
+        int clean(const char *filename,
+                time_t timestamp __attribute__((unused))) {
+            return watch_clean(cache->watch, filename, validated) ? 0 : -1;
+        }
+        if (db_for_inputs(&cache->db, id, clean) == 0) {
+            DEBUG("Watcher reports no changes to inputs\n");
+            unchanged = true;
+        }
+    }
+    int64_t started = watch_time();
+
+    if (!unchanged) {
+        if (check_inputs(cache, id) != 0)
+            return -1;
+
+        /* Note that we confirmed the inputs so the next lookup can rely on the
+         * watcher. Failure only costs us another round of checks next time.
+         * If any input is reached through a symbolic link, the watcher cannot
+         * vouch for it, so we leave it to be checked every time.
+         */
+        if (synced) {
+            int check_direct(const char *filename,
+                    time_t timestamp __attribute__((unused))) {
+                return direct(filename) ? 0 : -1;
+            }
+            if (db_for_inputs(&cache->db, id, check_direct) == 0) {
+                (void)db_insert_validated(&cache->db, id, started);
+            } else {
+                DEBUG("Inputs are reached through symbolic links; not relying "
+                    "on watcher\n");
+                (void)db_remove_validated(&cache->db, id);
+            }
+        }
+    }
+
+    /* We found it with matching inputs, so tracing it paid off. */
+    (void)db_insert_hit(&cache->db, fp);
+
+    return id;
+}
+
+/* Number of threads to restore outputs with. As for stat_all(), this is I/O
+ * bound, so we do not limit it to the number of CPUs.
+ */
+#define RESTORE_THREADS 16
+
+/* An output of a cache entry to restore. */
+typedef struct {
+    char *filename;
+    char *cached_copy;
+    time_t timestamp;
+    mode_t mode;
+} output_t;
+
+static bool is_stream(const char *filename) {
+    return !strcmp(filename, "/dev/stdout") ||
+           !strcmp(filename, "/dev/stderr");
+}
+
+/* Open the cached copy of some data for reading. Data copied into the cache is
+ * not necessarily readable (see cp()), in which case it is made readable long
+ * enough to open it. The same data may be restored to several outputs at once,
+ * so this is done under a lock.
+ */
+static int open_cached(const char *path) {
+    int fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd != -1 || errno != EACCES)
+        return fd;
+
+    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_lock(&lock);
+    struct stat st;
+    if (stat(path, &st) == 0) {
+        chmod(path, 0400);
+        fd = open(path, O_RDONLY|O_CLOEXEC);
+        chmod(path, st.st_mode);
+    }
+    pthread_mutex_unlock(&lock);
+    return fd;
+}
+
+/* Recreate a symlink output, whose cached data is its target. Returns 0 on
+ * success.
+ */
+static int restore_link(const output_t *o) {
+    int in = open_cached(o->cached_copy);
+    if (in == -1)
+        return -1;
+    char target[PATH_MAX];
+    ssize_t len = read(in, target, sizeof(target) - 1);
+    close(in);
+    if (len < 0)
         return -1;
+    target[len] = '\0';
 
-    int env_check(const char *name, const char *value) {
-        assert(name != NULL);
-        char *local_value = getenv(name);
-        return !((local_value == NULL && value == NULL) ||
-                 (local_value != NULL && value != NULL &&
-                    strcmp(local_value, value) == 0));
+    if (unlink(o->filename) != 0 && errno != ENOENT)
+        return -1;
+    if (symlink(target, o->filename) != 0)
+        return -1;
+
+    struct timespec times[] = {
+        { .tv_sec = o->timestamp },
+        { .tv_sec = o->timestamp },
+    };
+    (void)utimensat(AT_FDCWD, o->filename, times, AT_SYMLINK_NOFOLLOW);
+    return 0;
+}
+
+/* Write an output back to where it was produced, with its mode and timestamp.
+ * Returns 0 on success.
+ */
+static int restore(const output_t *o) {
+    if (S_ISLNK(o->mode))
+        return restore_link(o);
+
+    int in = open_cached(o->cached_copy);
+    if (in == -1)
+        return -1;
+
+    struct stat st;
+    if (fstat(in, &st) != 0) {
+        close(in);
+        return -1;
     }
-    if (db_for_env(&cache->db, id, env_check) != 0)
+
+    int out = open(o->filename, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0200);
+    if (out == -1) {
+        close(in);
         return -1;
+    }
 
-    /* We found it with matching inputs. */
-    return id;
+    int ret = 0;
+    for (off_t offset = 0; offset < st.st_size; ) {
+        ssize_t written = sendfile(out, in, &offset, st.st_size - offset);
+        if (written <= 0) {
+            ret = -1;
+            break;
+        }
+    }
+    close(in);
+
+    /* Apply the metadata through the descriptor we already have, rather than
+     * looking the file up again by name.
+     */
+    (void)fchmod(out, o->mode);
+    struct timespec times[] = {
+        { .tv_sec = o->timestamp },
+        { .tv_sec = o->timestamp },
+    };
+    (void)futimens(out, times);
+    close(out);
+
+    if (ret != 0) {
+        /* We somehow failed to copy the entire file. */
+        unlink(o->filename);
+    }
+    return ret;
 }
 
-int cache_dump(cache_t *cache, int id) {
+int cache_dump(cache_t *cache, int id, int outfd, int errfd, int *status,
+        int *signal) {
     if (cache->statistics) {
         /* Ignore the return value as failure is non-critical. */
         (void)db_insert_event(&cache->db, id, EV_USED);
     }
 
-    int f(const char *filename, time_t timestamp, mode_t mode,
+    if (status != NULL) {
+        assert(signal != NULL);
+        int64_t expiry;
+        if (db_select_result(&cache->db, id, status, signal, &expiry) != 0)
+            return -1;
+    }
+
+    /* Gather the outputs up front, so the files can be restored
+     * concurrently. Restoring them one by one is bound by the latency of each
+     * write on slow filesystems.
+     */
+    size_t count = 0, capacity = 0;
+    output_t *outputs = NULL;
+    int ret = -1;
+
+    int collect(const char *filename, time_t timestamp, mode_t mode,
             const char *contents) {
-        char *last_slash = strrchr(filename, '/');
-        /* The path should contain at least one slash because it should be
-         * absolute.
-         */
-        assert(last_slash != NULL);
-        if (filename != last_slash) {
-            /* We're not creating a file in the root directory. */
-            last_slash[0] = '\0';
-            int m = mkdirp(filename);
-            if (m != 0) {
-                ERROR("Failed to create directory %s\n", filename);
+        if (count == capacity) {
+            size_t c = capacity == 0 ? 64 : capacity * 2;
+            output_t *os = realloc(outputs, c * sizeof(os[0]));
+            if (os == NULL)
                 return -1;
-            }
-            last_slash[0] = '/';
+            outputs = os;
+            capacity = c;
         }
-
-        autofree char *cached_copy = aprintf("%s/%s", cache->root, contents);
-        if (cached_copy == NULL) {
-            ERROR("Out of memory while dumping cache entry %s\n", filename);
+        output_t *o = &outputs[count];
+        o->filename = strdup(filename);
+        o->cached_copy = aprintf("%s/%s", cache->root, contents);
+        if (o->filename == NULL || o->cached_copy == NULL) {
+            free(o->filename);
+            free(o->cached_copy);
             return -1;
         }
-        int res = cp(cached_copy, filename);
-        chmod(filename, mode);
-        struct utimbuf ut = {
-            .actime = timestamp,
-            .modtime = timestamp,
-        };
-        utime(filename, &ut);
-        if (res != 0) {
-            ERROR("Failed to write output %s\n", filename);
+        o->timestamp = timestamp;
+        o->mode = mode;
+        count++;
+        return 0;
+    }
+    if (db_for_outputs(&cache->db, id, collect) != 0) {
+        ERROR("Failed to read outputs of cache entry\n");
+        goto done;
+    }
+
+    /* Create the directories the files go in. Outputs tend to share these,
+     * so each is only created once. This is done before the files, as
+     * creating nested directories concurrently would race.
+     */
+    {
+        size_t ndirs = 0;
+        autofree char **dirs = malloc((count + 1) * sizeof(dirs[0]));
+        if (dirs == NULL)
+            goto done;
+        for (size_t i = 0; i < count; i++) {
+            if (is_stream(outputs[i].filename))
+                continue;
+            char *last_slash = strrchr(outputs[i].filename, '/');
+            /* The path should contain at least one slash because it should be
+             * absolute.
+             */
+            assert(last_slash != NULL);
+            if (outputs[i].filename != last_slash) {
+                /* We're not creating a file in the root directory. */
+                *last_slash = '\0';
+                dirs[ndirs++] = outputs[i].filename;
+            }
+        }
+        if (ndirs > 0)
+            qsort(dirs, ndirs, sizeof(dirs[0]), strcmp_indirect);
+        int m = 0;
+        for (size_t i = 0; i < ndirs && m == 0; i++) {
+            if (i > 0 && strcmp(dirs[i - 1], dirs[i]) == 0)
+                continue;
+            m = mkdirp(dirs[i]);
+            if (m != 0)
+                ERROR("Failed to create directory %s\n", dirs[i]);
+        }
+        for (size_t i = 0; i < ndirs; i++)
+            dirs[i][strlen(dirs[i])] = '/';
+        if (m != 0)
+            goto done;
+    }
+
+    int restore_one(size_t index) {
+        const output_t *o = &outputs[index];
+        if (is_stream(o->filename))
+            return 0;
+        if (restore(o) != 0) {
+            ERROR("Failed to write output %s\n", o->filename);
             return -1;
         }
         return 0;
     }
-    if (db_for_outputs(&cache->db, id, f) != 0)
+    if (parallel(count, RESTORE_THREADS, restore_one) != 0)
+        goto done;
+
+    /* Streams are written to the descriptors the caller gave us, or else to
+     * our own, once the files are in place.
+     */
+    for (size_t i = 0; i < count; i++) {
+        const output_t *o = &outputs[i];
+        if (!is_stream(o->filename))
+            continue;
+        int stream = !strcmp(o->filename, "/dev/stdout") ?
+            (outfd == -1 ? STDOUT_FILENO : outfd) :
+            (errfd == -1 ? STDERR_FILENO : errfd);
+        if (cat(o->cached_copy, stream) != 0) {
+            ERROR("Failed to write output %s\n", o->filename);
+            goto done;
+        }
+    }
+
+    ret = 0;
+
+done:
+    for (size_t i = 0; i < count; i++) {
+        free(outputs[i].filename);
+        free(outputs[i].cached_copy);
+    }
+    free(outputs);
+    return ret;
+}
+
+int cache_for_deps(cache_t *cache, int id,
+        int (*cb)(const char *filename, filetype_t type)) {
+    assert(cache != NULL);
+
+    int input(const char *filename,
+            time_t timestamp __attribute__((unused))) {
+        return cb(filename, XC_INPUT);
+    }
+    int r = db_for_inputs(&cache->db, id, input);
+    if (r != 0)
+        return r;
+
+    int output(const char *filename, time_t timestamp __attribute__((unused)),
+            mode_t mode __attribute__((unused)),
+            const char *contents __attribute__((unused))) {
+        if (!strcmp(filename, "/dev/stdout") ||
+                !strcmp(filename, "/dev/stderr"))
+            return 0;
+        return cb(filename, XC_OUTPUT);
+    }
+    return db_for_outputs(&cache->db, id, output);
+}
+
+/* Tracing overhead, as a percentage of the untraced runtime, below which we do
+ * not bother skipping tracing. Such a target costs little to keep trying.
+ */
+#define CHEAP_OVERHEAD 10
+
+bool cache_worth_tracing(cache_t *cache, const char *cwd, int argc,
+        char **argv, unsigned skip_after, unsigned reprobe) {
+    assert(cache != NULL);
+    assert(argc > 0);
+
+    if (skip_after == 0)
+        return true;
+
+    /* On any failure below, fall back to tracing as usual. */
+    auto_fingerprint_t *fp = fingerprint(cwd, (unsigned int)argc, argv);
+    if (fp == NULL)
+        return true;
+
+    bool found;
+    db_outcome_t o;
+    if (db_select_outcome(&cache->db, fp, &found, &o) != 0)
+        return true;
+
+    if (!found) {
+        /* We have never seen this invocation, but may have seen enough of the
+         * program to know how it will go.
+         */
+        int failures;
+        if (db_select_program(&cache->db, argv[0], &failures) != 0 ||
+                failures < (int)skip_after)
+            return true;
+        DEBUG("Not tracing, as the last %d traced runs of %s could not be "
+            "cached\n", failures, argv[0]);
+        return false;
+    }
+
+    if (o.wasted < (int)skip_after)
+        return true;
+
+    if (o.traced_us >= 0 && o.plain_us >= 0 &&
+            (o.traced_us - o.plain_us) * 100 <= o.plain_us * CHEAP_OVERHEAD) {
+        DEBUG("Tracing anyway, as it costs little for this target\n");
+        return true;
+    }
+
+    if (reprobe > 0 && o.skipped >= (int)reprobe) {
+        DEBUG("Tracing again after %d untraced runs, in case this target has "
+            "become cacheable\n", o.skipped);
+        return true;
+    }
+
+    DEBUG("Not tracing, as the last %d traced runs of this target did not pay "
+        "off\n", o.wasted);
+    return false;
+}
+
+int cache_record_outcome(cache_t *cache, const char *cwd, int argc,
+        char **argv, bool traced, const char *reason, bool inherent,
+        int64_t us) {
+    assert(cache != NULL);
+    assert(argc > 0);
+    assert(traced || reason == NULL);
+    assert(reason != NULL || !inherent);
+
+    auto_fingerprint_t *fp = fingerprint(cwd, (unsigned int)argc, argv);
+    if (fp == NULL)
         return -1;
 
-    return 0;
+    bool found;
+    db_outcome_t o;
+    if (db_select_outcome(&cache->db, fp, &found, &o) != 0)
+        return -1;
+    if (!found) {
+        o.wasted = 0;
+        o.skipped = 0;
+        o.traced_us = -1;
+        o.plain_us = -1;
+        /* If we skipped tracing an unseen invocation on the strength of its
+         * program's record, carry that over so we keep skipping it.
+         */
+        if (!traced && db_select_program(&cache->db, argv[0], &o.wasted) != 0)
+            return -1;
+    }
+
+    if (traced) {
+        /* Every traced run is a waste until its entry is found. */
+        o.wasted++;
+        o.skipped = 0;
+        o.traced_us = us;
+        if ((reason == NULL || inherent) &&
+                db_insert_program(&cache->db, argv[0], reason) != 0)
+            return -1;
+    } else {
+        o.skipped++;
+        o.plain_us = us;
+    }
+
+    return db_insert_outcome(&cache->db, fp, &o, reason);
+}
+
+int cache_for_all_inputs(cache_t *cache, int (*cb)(const char *filename)) {
+    assert(cache != NULL);
+    return db_for_all_inputs(&cache->db, cb);
 }
 
 int cache_close(cache_t *cache) {
     assert(cache != NULL);
     if (db_close(&cache->db) != 0)
         return -1;
+    int free_memo(const char *_ __attribute__((unused)), void *value) {
+        memo_t *m = value;
+        free(m->hash);
+        return 0;
+    }
+    (void)dict_foreach(&cache->hashes, free_memo);
+    dict_destroy(&cache->hashes);
+    pthread_mutex_destroy(&cache->hashes_lock);
+    if (cache->watch != NULL)
+        watch_close(cache->watch);
+    stat_ring_free(cache->ring);
+    free(cache->staging);
+    free(cache->dir);
     free(cache->root);
     free(cache);
     return 0;
 }
+
+/* Name a lock file after an invocation, as the hex MD5 of its fingerprint.
+ * Returns 0 on success.
+ */
+static int invocation_name(const char *cwd, int argc, char **argv,
+        char name[MD5_DIGEST_LENGTH * 2 + 1]) {
+    auto_fingerprint_t *fp = fingerprint(cwd, (unsigned int)argc, argv);
+    if (fp == NULL)
+        return -1;
+    MD5_CTX ctx;
+    MD5_Init(&ctx);
+    MD5_Update(&ctx, fp->cwd, strlen(fp->cwd) + 1);
+    MD5_Update(&ctx, fp->arg_lens, fp->arg_lens_sz * sizeof(fp->arg_lens[0]));
+    MD5_Update(&ctx, fp->argv, strlen(fp->argv));
+    unsigned char h[MD5_DIGEST_LENGTH];
+    MD5_Final(h, &ctx);
+    for (unsigned int i = 0; i < MD5_DIGEST_LENGTH; i++)
+        sprintf(name + i * 2, "%02x", h[i]);
+    return 0;
+}
+
+/* Take an exclusive lock on the file at 'path', creating it if necessary. If
+ * another process holds it, wait for up to 'timeout' milliseconds, setting
+ * 'waited'. Returns the descriptor holding the lock, -2 if it is still held by
+ * someone else after the timeout, or -1 on failure.
+ */
+static int lock_file(const char *path, int64_t timeout, bool *waited) {
+    struct timespec start;
+    if (clock_gettime(CLOCK_MONOTONIC, &start) != 0)
+        return -1;
+    long delay = 1000000; /* ns */
+
+    while (true) {
+        int fd = open(path, O_RDONLY|O_CREAT|O_CLOEXEC, 0600);
+        if (fd == -1)
+            return -1;
+
+        if (flock(fd, LOCK_EX|LOCK_NB) != 0) {
+            close(fd);
+            if (errno != EWOULDBLOCK)
+                return -1;
+
+            /* Back off, as we do not know how long the holder will be. */
+            struct timespec t;
+            if (clock_gettime(CLOCK_MONOTONIC, &t) != 0)
+                return -1;
+            int64_t elapsed = (t.tv_sec - start.tv_sec) * 1000 +
+                (t.tv_nsec - start.tv_nsec) / 1000000;
+            if (elapsed >= timeout)
+                return -2;
+            *waited = true;
+            struct timespec pause = { .tv_nsec = delay };
+            (void)nanosleep(&pause, NULL);
+            if (delay < 100000000)
+                delay *= 2;
+            continue;
+        }
+
+        /* If the previous holder removed the file between us opening and
+         * locking it, our lock is on a file no one else can see.
+         */
+        struct stat st1, st2;
+        if (fstat(fd, &st1) == 0 && stat(path, &st2) == 0 &&
+                st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino)
+            return fd;
+        close(fd);
+    }
+}
+
+/* Release a lock taken with lock_file(). The file is removed while we still
+ * hold the lock, so no one else can successfully lock it after we are done.
+ */
+static void unlock_file(char *path, int fd) {
+    (void)unlink(path);
+    close(fd);
+    free(path);
+}
+
+int cache_claim_commit(const char *path, const char *cwd, int argc,
+        char **argv, unsigned limit, char **claim) {
+    assert(path != NULL);
+    assert(claim != NULL);
+
+    autofree char *pending = aprintf("%s" PENDING, path);
+    if (pending == NULL || mkdirp(pending) != 0)
+        return -1;
+
+    /* Count the writes in progress. A lock file whose lock we can take was
+     * left by a writer that died, so we clear it up instead.
+     */
+    DIR *dir = opendir(pending);
+    if (dir == NULL)
+        return -1;
+    unsigned outstanding = 0;
+    for (struct dirent *e; (e = readdir(dir)) != NULL; ) {
+        if (e->d_name[0] == '.')
+            continue;
+        int fd = openat(dirfd(dir), e->d_name, O_RDONLY|O_CLOEXEC);
+        if (fd == -1)
+            continue;
+        if (flock(fd, LOCK_EX|LOCK_NB) == 0) {
+            (void)unlinkat(dirfd(dir), e->d_name, 0);
+        } else {
+            outstanding++;
+        }
+        close(fd);
+    }
+    closedir(dir);
+    if (outstanding >= limit) {
+        DEBUG("%u cache entries are already being written in the "
+            "background\n", outstanding);
+        return -1;
+    }
+
+    /* Name the lock file after the invocation, so we notice when it is
+     * already being written.
+     */
+    char name[MD5_DIGEST_LENGTH * 2 + 1];
+    if (invocation_name(cwd, argc, argv, name) != 0)
+        return -1;
+    char *lock = aprintf("%s/%s", pending, name);
+    if (lock == NULL)
+        return -1;
+
+    bool waited = false;
+    int fd = lock_file(lock, 0, &waited);
+    if (fd < 0) {
+        free(lock);
+        return fd;
+    }
+    *claim = lock;
+    return fd;
+}
+
+void cache_release_commit(char *claim, int fd) {
+    assert(claim != NULL);
+    unlock_file(claim, fd);
+}
+
+int cache_lock_invocation(const char *path, const char *cwd, int argc,
+        char **argv, unsigned timeout, bool *waited, char **lock) {
+    assert(path != NULL);
+    assert(waited != NULL);
+    assert(lock != NULL);
+
+    autofree char *locks = aprintf("%s" LOCKS, path);
+    if (locks == NULL || mkdirp(locks) != 0)
+        return -1;
+
+    char name[MD5_DIGEST_LENGTH * 2 + 1];
+    if (invocation_name(cwd, argc, argv, name) != 0)
+        return -1;
+    char *l = aprintf("%s/%s", locks, name);
+    if (l == NULL)
+        return -1;
+
+    /* A holder that died released its lock with its descriptors, so we only
+     * time out on one that is still running.
+     */
+    *waited = false;
+    int fd = lock_file(l, (int64_t)timeout * 1000, waited);
+    if (fd < 0) {
+        free(l);
+        return -1;
+    }
+    *lock = l;
+    return fd;
+}
+
+void cache_unlock_invocation(char *lock, int fd) {
+    assert(lock != NULL);
+    unlock_file(lock, fd);
+}
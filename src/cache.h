@@ -4,25 +4,136 @@
 #include "depset.h"
 #include "collection/dict.h"
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 typedef struct cache cache_t;
 
 cache_t *cache_open(const char *path, bool statistics);
 
+/* Return the absolute path to the staging directory of the cache at 'path',
+ * creating it if necessary. Files created here, like the captured output of a target, are
+ * moved into the cache when written to an entry, rather than copied. Returns
+ * NULL on failure. It is the caller's responsibility to free the returned
+ * pointer.
+ */
+char *cache_staging(const char *path);
+
 int cache_clear(cache_t *cache);
 
-int cache_locate(cache_t *cache, int argc, char **argv);
+/* Find a cache entry for the given invocation whose inputs are unchanged.
+ *
+ * cache - Cache to search.
+ * cwd - Working directory of the invocation, or NULL for our own.
+ * argc, argv - Command line of the invocation.
+ * envp - Environment of the invocation, or NULL for our own.
+ * failures - Whether to accept an entry of an unsuccessful run.
+ *
+ * Returns the identifier of a matching entry or -1 if there is none.
+ */
+int cache_locate(cache_t *cache, const char *cwd, int argc, char **argv,
+    char **envp, bool failures);
 
 /* Extract the cached outputs associated with a particular identifier and write
- * them out as if the original program had written them. Returns 0 on success,
- * -1 on failure.
+ * them out as if the original program had written them. The original
+ * program's stdout and stderr are written to 'outfd' and 'errfd'
+ * respectively. If 'status' is non-NULL, it and 'signal' are set to the exit
+ * status of the original program and the signal that terminated it, or 0 if
+ * it exited. Returns 0 on success, -1 on failure.
+ */
+int cache_dump(cache_t *cache, int id, int outfd, int errfd, int *status,
+    int *signal);
+
+/* Call 'cb' once for each input and each output of a cache entry, other than
+ * its stdout and stderr. Iteration stops early if 'cb' returns non-zero, in
+ * which case that value is returned.
  */
-int cache_dump(cache_t *cache, int id);
+int cache_for_deps(cache_t *cache, int id,
+    int (*cb)(const char *filename, filetype_t type));
 
 int cache_close(cache_t *cache);
 
-int cache_write(cache_t *cache, int argc, char **argv, depset_t *depset,
-    dict_t *env, const char *outfile, const char *errfile);
+/* Call 'cb' once for each distinct file that is an input to any cache entry.
+ * Iteration stops early if 'cb' returns non-zero, in which case that value is
+ * returned.
+ */
+int cache_for_all_inputs(cache_t *cache, int (*cb)(const char *filename));
+
+/* Record the results of a traced invocation.
+ *
+ * prefixes, stamp - The immutable prefixes the target read files from and the
+ *   toolchain stamp taken before it ran (see toolchain.h), or NULL if it did
+ *   not depend on any immutable files.
+ * status, signal - The exit status of the target and the signal that
+ *   terminated it, or 0 if it exited.
+ * ttl - If the target was unsuccessful, the number of seconds for which the
+ *   entry may be used, or 0 for no limit.
+ */
+int cache_write(cache_t *cache, const char *cwd, int argc, char **argv,
+    depset_t *depset, dict_t *env, const char *outfile, const char *errfile,
+    const char *prefixes, const char *stamp, int status, int signal,
+    unsigned ttl);
+
+/* Decide whether it is worth tracing an invocation, from how tracing it, or
+ * other invocations of the same program, went before.
+ *
+ * skip_after - Number of consecutive traced runs that did not pay off after
+ *   which to stop tracing, or 0 to always trace.
+ * reprobe - Number of untraced runs after which to trace it again anyway, in
+ *   case it has become cacheable, or 0 never to.
+ *
+ * Returns false if the target should be run without tracing.
+ */
+bool cache_worth_tracing(cache_t *cache, const char *cwd, int argc,
+    char **argv, unsigned skip_after, unsigned reprobe);
+
+/* Record how running an invocation went.
+ *
+ * traced - Whether it was traced.
+ * reason - If it was traced but could not be cached, why not. NULL otherwise.
+ * inherent - Whether 'reason' lies in what the program does, like a syscall we
+ *   cannot follow, rather than in how this run went, like a non-zero exit.
+ *   Only the former count against other invocations of the same program.
+ * us - How long it ran for, in microseconds.
+ */
+int cache_record_outcome(cache_t *cache, const char *cwd, int argc,
+    char **argv, bool traced, const char *reason, bool inherent, int64_t us);
+
+/* Claim the right to write an entry for an invocation in the background, so
+ * that at most one process at a time does so and only a bounded number of such
+ * writes are outstanding.
+ *
+ * path - Cache directory.
+ * limit - Maximum number of outstanding background writes.
+ * claim - Set to a path identifying the claim on success.
+ *
+ * Returns a descriptor holding the claim, to be passed to
+ * cache_release_commit() once the entry is written. Returns -1 if the entry
+ * should be written in the foreground instead, or -2 if another process is
+ * already writing an entry for the same invocation.
+ */
+int cache_claim_commit(const char *path, const char *cwd, int argc,
+    char **argv, unsigned limit, char **claim);
+
+/* Release a claim made by cache_claim_commit(). */
+void cache_release_commit(char *claim, int fd);
+
+/* Lock an invocation, so that concurrent identical invocations run the target
+ * one at a time and those after the first can use the entry it wrote. If
+ * another process holds the lock, wait for it to be released.
+ *
+ * path - Cache directory.
+ * timeout - Maximum number of seconds to wait.
+ * waited - Set to whether another process held the lock.
+ * lock - Set to a path identifying the lock on success.
+ *
+ * Returns a descriptor holding the lock, to be passed to
+ * cache_unlock_invocation(), or -1 if the lock could not be taken in time.
+ */
+int cache_lock_invocation(const char *path, const char *cwd, int argc,
+    char **argv, unsigned timeout, bool *waited, char **lock);
+
+/* Release a lock taken with cache_lock_invocation(). */
+void cache_unlock_invocation(char *lock, int fd);
 
 #endif
@@ -0,0 +1,76 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include "classify.h"
+#include <fcntl.h>
+#include "filetype.h"
+
+/* Sanity checks on open flags because checking for O_RDONLY is awkward. */
+static_assert(O_RDONLY == 00 && O_WRONLY == 01 && O_RDWR == 02,
+    "unexpected file open flag values");
+/* See usage of this below. */
+static const int FLAG_MASK = O_RDONLY | O_WRONLY | O_RDWR;
+
+int flags_to_mode(int flags) {
+    return flags & FLAG_MASK;
+}
+
+filetype_t classify_open_entry(int flags) {
+    int mode = flags_to_mode(flags);
+
+    /* A descriptor opened with O_PATH cannot be used to read the file, only
+     * to refer to it, as in checking whether it is a directory. Only its
+     * existence matters, unless we later see it written.
+     */
+#ifdef O_PATH
+    if (flags & O_PATH)
+        return XC_AMBIGUOUS;
+#endif
+
+    /* Anything written to a file opened with O_APPEND ends up
+     * after its existing contents, so these are an input too.
+     */
+    if ((flags & O_APPEND) && !(flags & O_TRUNC))
+        return XC_INPUT;
+
+    /* If we're opening this file write-only, we don't need to
+     * do any measurement before opening as this file is purely
+     * an output.
+     */
+    if (mode == O_WRONLY)
+        return XC_NONE;
+
+    /* If we're opening this file read-write, there are some
+     * extra conditions that may lead us to bail out.
+     */
+    if (mode == O_RDWR) {
+
+        /* If a file is opened with O_CREAT and O_EXCL, the
+         * open fails if the file exists. In other words, even
+         * if we are opening this file O_RDWR, we are treating
+         * it as only an output.
+         */
+        if ((flags & O_CREAT) && (flags & O_EXCL))
+            return XC_NONE;
+
+        /* If a file is opened with O_TRUNC, we're ignoring its
+         * current contents and hence treating it purely as an
+         * output. O_TRUNC actually has no effect if the file is
+         * a device or a fifo, but regardless the caller is
+         * clearly not expecting to depend on the existing
+         * contents.
+         */
+        if (flags & O_TRUNC)
+            return XC_NONE;
+
+    }
+
+    return XC_INPUT;
+}
+
+filetype_t classify_open_exit(int flags) {
+    int mode = flags_to_mode(flags);
+    if (mode == O_WRONLY || mode == O_RDWR)
+        return XC_OUTPUT;
+
+    return XC_NONE;
+}
@@ -0,0 +1,25 @@
+/* Classification of file accesses into dependency types. These are shared
+ * between the ptrace tracer and libinterpose, so that both backends agree on
+ * what a given access means.
+ */
+
+#ifndef _XCACHE_CLASSIFY_H_
+#define _XCACHE_CLASSIFY_H_
+
+#include "filetype.h"
+
+/* Extract the access mode (O_RDONLY, O_WRONLY or O_RDWR) from open flags. */
+int flags_to_mode(int flags);
+
+/* Determine the type of an input or output we're opening based on the flags
+ * passed. Note that we return XC_NONE unless this is an input because we're
+ * only considering how we want to treat this before the file is opened.
+ */
+filetype_t classify_open_entry(int flags);
+
+/* Determine how we want to treat an input or output we're opening once the
+ * open has completed.
+ */
+filetype_t classify_open_exit(int flags);
+
+#endif
@@ -0,0 +1,246 @@
+#include <assert.h>
+#include "client.h"
+#include "collection/dict.h"
+#include "comm-protocol.h"
+#include "depset.h"
+#include <errno.h>
+#include <fcntl.h>
+#include "log.h"
+#include "server-protocol.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include "util.h"
+
+/* Open a connection to the server for the given cache directory. Returns a
+ * connected socket or -1 if no server is listening. In the latter case, errno
+ * is ECONNREFUSED whether there was a stale socket or none at all.
+ */
+static int connect_server(const char *cache_dir) {
+    autofree char *path = server_socket(cache_dir);
+    if (path == NULL)
+        return -1;
+
+    struct sockaddr_un addr = {
+        .sun_family = AF_UNIX,
+    };
+    strcpy(addr.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return -1;
+
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        int err = errno;
+        close(sock);
+        errno = err == ENOENT ? ECONNREFUSED : err;
+        return -1;
+    }
+
+    return sock;
+}
+
+/* Helper for closing a socket on scope exit. */
+static void autoclose_(void *p) {
+    int *fd = p;
+    if (*fd >= 0)
+        close(*fd);
+}
+#define autoclose __attribute__((cleanup(autoclose_)))
+
+/* The argument count is only needed to check the list is terminated, as the
+ * protocol sends the list itself, so it goes unused in release builds.
+ */
+int client_locate(const char *cache_dir, const char *cwd,
+        int argc __attribute__((unused)), char **argv, char **envp,
+        bool failures) {
+    autoclose int sock = connect_server(cache_dir);
+    if (sock < 0)
+        return -1;
+
+    autofree char *dir = cwd == NULL ? getcwd(NULL, 0) : strdup(cwd);
+    if (dir == NULL)
+        goto fail;
+
+    extern char **environ;
+    if (envp == NULL)
+        envp = environ;
+
+    assert(argv[argc] == NULL);
+    if (write_int(sock, REQ_LOCATE) != 0 ||
+            write_string(sock, dir) != 0 ||
+            write_strings(sock, argv) != 0 ||
+            write_strings(sock, envp) != 0 ||
+            write_int(sock, failures ? 1 : 0) != 0)
+        goto fail;
+
+    int id;
+    if (read_int(sock, &id) != 0)
+        goto fail;
+    errno = 0;
+    return id;
+
+fail:
+    /* The server was there, so this is not the caller's cue to go it alone. */
+    if (errno == ECONNREFUSED)
+        errno = EIO;
+    return -1;
+}
+
+int client_dump(const char *cache_dir, int id, int *status, int *signal) {
+    autoclose int sock = connect_server(cache_dir);
+    if (sock < 0)
+        return -1;
+
+    if (write_int(sock, REQ_DUMP) != 0 ||
+            write_int(sock, id) != 0 ||
+            write_fd(sock, STDOUT_FILENO) != 0 ||
+            write_fd(sock, STDERR_FILENO) != 0)
+        return -1;
+
+    /* On success, the server follows up with how the target ended. */
+    int r;
+    if (read_int(sock, &r) != 0)
+        return -1;
+    if (r != 0)
+        return r;
+    int st, sig;
+    if (read_int(sock, &st) != 0 || read_int(sock, &sig) != 0)
+        return -1;
+    if (status != NULL) {
+        assert(signal != NULL);
+        *status = st;
+        *signal = sig;
+    }
+    return 0;
+}
+
+int client_worth_tracing(const char *cache_dir, const char *cwd,
+        int argc __attribute__((unused)), char **argv, unsigned skip_after,
+        unsigned reprobe) {
+    autoclose int sock = connect_server(cache_dir);
+    if (sock < 0)
+        return -1;
+
+    autofree char *dir = cwd == NULL ? getcwd(NULL, 0) : strdup(cwd);
+    if (dir == NULL)
+        return -1;
+
+    assert(argv[argc] == NULL);
+    if (write_int(sock, REQ_WORTH) != 0 ||
+            write_string(sock, dir) != 0 ||
+            write_strings(sock, argv) != 0 ||
+            write_int(sock, (int)skip_after) != 0 ||
+            write_int(sock, (int)reprobe) != 0)
+        return -1;
+
+    int worth;
+    if (read_int(sock, &worth) != 0)
+        return -1;
+    return worth ? 1 : 0;
+}
+
+int client_record_outcome(const char *cache_dir, const char *cwd,
+        int argc __attribute__((unused)), char **argv, bool traced,
+        const char *reason, bool inherent, int64_t us) {
+    autoclose int sock = connect_server(cache_dir);
+    if (sock < 0)
+        return -1;
+
+    autofree char *dir = cwd == NULL ? getcwd(NULL, 0) : strdup(cwd);
+    if (dir == NULL)
+        return -1;
+
+    assert(argv[argc] == NULL);
+    if (write_int(sock, REQ_OUTCOME) != 0 ||
+            write_string(sock, dir) != 0 ||
+            write_strings(sock, argv) != 0 ||
+            write_int(sock, traced ? 1 : 0) != 0 ||
+            write_string(sock, reason) != 0 ||
+            write_int(sock, inherent ? 1 : 0) != 0 ||
+            write_data(sock, (unsigned char*)&us, sizeof(us)) != 0)
+        return -1;
+
+    int r;
+    if (read_int(sock, &r) != 0)
+        return -1;
+    return r;
+}
+
+/* Send an optional file to the server by passing an open descriptor to it. */
+static int write_file(int sock, const char *path) {
+    if (path == NULL)
+        return write_int(sock, 0);
+
+    autoclose int fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    if (write_int(sock, 1) != 0 || write_fd(sock, fd) != 0)
+        return -1;
+    return 0;
+}
+
+int client_write(const char *cache_dir, const char *cwd,
+        int argc __attribute__((unused)), char **argv, depset_t *depset, dict_t *env, const char *outfile,
+        const char *errfile, const char *prefixes, const char *stamp,
+        int status, int signal, unsigned ttl) {
+    autoclose int sock = connect_server(cache_dir);
+    if (sock < 0)
+        return -1;
+
+    autofree char *dir = cwd == NULL ? getcwd(NULL, 0) : strdup(cwd);
+    if (dir == NULL)
+        return -1;
+
+    assert(argv[argc] == NULL);
+    if (write_int(sock, REQ_WRITE) != 0 ||
+            write_string(sock, dir) != 0 ||
+            write_strings(sock, argv) != 0)
+        return -1;
+
+    /* The dependency set is sent as a sequence of entries terminated by a
+     * NULL filename.
+     */
+    int send_dep(const char *filename, filetype_t type, time_t mtime) {
+        if (write_string(sock, filename) != 0 ||
+                write_int(sock, (int)type) != 0 ||
+                write_data(sock, (unsigned char*)&mtime, sizeof(mtime)) != 0)
+            return -1;
+        return 0;
+    }
+    if (depset_foreach(depset, send_dep) != 0 ||
+            write_string(sock, NULL) != 0)
+        return -1;
+
+    /* Similarly for the environment variables read by the target. */
+    int send_env(const char *name, void *value) {
+        if (write_string(sock, name) != 0 ||
+                write_string(sock, (const char*)value) != 0)
+            return -1;
+        return 0;
+    }
+    if (dict_foreach(env, send_env) != 0 ||
+            write_string(sock, NULL) != 0)
+        return -1;
+
+    if (write_file(sock, outfile) != 0 ||
+            write_file(sock, errfile) != 0 ||
+            write_string(sock, prefixes) != 0 ||
+            write_string(sock, stamp) != 0 ||
+            write_int(sock, status) != 0 ||
+            write_int(sock, signal) != 0 ||
+            write_int(sock, (int)ttl) != 0)
+        return -1;
+
+    int r;
+    if (read_int(sock, &r) != 0)
+        return -1;
+    if (r != 0)
+        DEBUG("xcached failed to write cache entry\n");
+    return r;
+}
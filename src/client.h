@@ -0,0 +1,43 @@
+/* Client side of the xcached protocol. Each of these functions mirrors the
+ * corresponding function in cache.h, but has the work performed by a running
+ * xcached instead of in-process. This saves the per-invocation cost of opening
+ * the cache and lets the server keep its state warm across invocations.
+ */
+
+#ifndef _XCACHE_CLIENT_H_
+#define _XCACHE_CLIENT_H_
+
+#include "collection/dict.h"
+#include "depset.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/* As for cache_locate. Returns -1 on a miss or if the server failed. If no
+ * xcached instance is serving the given cache directory, errno is also set to
+ * ECONNREFUSED, and callers should fall back to using the cache directly.
+ */
+int client_locate(const char *cache_dir, const char *cwd, int argc,
+    char **argv, char **envp, bool failures);
+
+/* As for cache_dump. Cached stdout and stderr are written to our own stdout
+ * and stderr. Returns 0 on success.
+ */
+int client_dump(const char *cache_dir, int id, int *status, int *signal);
+
+/* As for cache_worth_tracing. Returns 1 if the target should be traced, 0 if
+ * not or -1 if the server failed.
+ */
+int client_worth_tracing(const char *cache_dir, const char *cwd, int argc,
+    char **argv, unsigned skip_after, unsigned reprobe);
+
+/* As for cache_record_outcome. Returns 0 on success. */
+int client_record_outcome(const char *cache_dir, const char *cwd, int argc,
+    char **argv, bool traced, const char *reason, bool inherent, int64_t us);
+
+/* As for cache_write. Returns 0 on success. */
+int client_write(const char *cache_dir, const char *cwd, int argc,
+    char **argv, depset_t *depset, dict_t *env, const char *outfile,
+    const char *errfile, const char *prefixes, const char *stamp, int status,
+    int signal, unsigned ttl);
+
+#endif
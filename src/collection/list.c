@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <glib.h>
 #include "list.h"
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -32,6 +33,11 @@ void *list_remove(list_t *l, void *key) {
     return elem;
 }
 
+bool list_empty(const list_t *l) {
+    assert(l != NULL);
+    return l->head == NULL;
+}
+
 int list_foreach(list_t *l, void (*f)(void *value, void *data), void *data) {
     g_slist_foreach(l->head, f, data);
     return 0;
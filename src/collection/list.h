@@ -10,6 +10,7 @@
  */
 
 #include <glib.h>
+#include <stdbool.h>
 
 /* A linked-list. */
 typedef struct {
@@ -34,6 +35,9 @@ void *list_find(list_t *l, void *key);
  */
 void *list_remove(list_t *l, void *key);
 
+/* Whether the list has no items. */
+bool list_empty(const list_t *l);
+
 /* Perform some action on each item in the list. This is generally used for
  * constructing a loop pattern over a list.
  */
@@ -8,13 +8,31 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
+/* Read exactly 'len' bytes, as pipes may return less than we asked for.
+ * Returns the number of bytes read, which is only short at EOF, or -1 on
+ * error.
+ */
+static ssize_t read_all(int fd, void *buf, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t sz = read(fd, (unsigned char*)buf + done, len - done);
+        if (sz < 0)
+            return -1;
+        if (sz == 0)
+            break;
+        done += (size_t)sz;
+    }
+    return (ssize_t)done;
+}
+
 ssize_t read_data(int fd, unsigned char **data) {
     assert(data != NULL);
 
     size_t len;
-    ssize_t sz = read(fd, &len, sizeof(len));
+    ssize_t sz = read_all(fd, &len, sizeof(len));
     if (sz == 0)
         return -2;
     if (sz != sizeof(len))
@@ -29,7 +47,7 @@ ssize_t read_data(int fd, unsigned char **data) {
     if (*data == NULL)
         return -1;
 
-    sz = read(fd, *data, len);
+    sz = read_all(fd, *data, len);
     if (sz < 0 || (size_t)sz != len) {
         free(*data);
         return -1;
@@ -53,3 +71,96 @@ int write_data(int fd, const unsigned char *data, size_t len) {
 
     return 0;
 }
+
+void pack_data(unsigned char *buf, size_t size, size_t *offset,
+        const unsigned char *data, size_t len) {
+    assert(offset != NULL);
+
+    size_t total = sizeof(len) + len;
+    if (buf != NULL && *offset <= size && size - *offset >= total) {
+        memcpy(buf + *offset, &len, sizeof(len));
+        if (len > 0)
+            memcpy(buf + *offset + sizeof(len), data, len);
+    }
+    *offset += total;
+}
+
+ssize_t unpack_data(const unsigned char *buf, size_t size, size_t *offset,
+        unsigned char **data) {
+    assert(offset != NULL);
+    assert(data != NULL);
+
+    size_t len;
+    if (*offset > size || size - *offset < sizeof(len))
+        return -1;
+    memcpy(&len, buf + *offset, sizeof(len));
+    if (size - *offset - sizeof(len) < len)
+        return -1;
+
+    if (len == 0) {
+        *data = NULL;
+    } else {
+        *data = malloc(len);
+        if (*data == NULL)
+            return -1;
+        memcpy(*data, buf + *offset + sizeof(len), len);
+    }
+    *offset += sizeof(len) + len;
+    return (ssize_t)len;
+}
+
+int write_fd(int sock, int fd) {
+    char dummy = 0;
+    struct iovec iov = {
+        .iov_base = &dummy,
+        .iov_len = sizeof(dummy),
+    };
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } u;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = u.buf,
+        .msg_controllen = sizeof(u.buf),
+    };
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(c), &fd, sizeof(int));
+
+    if (sendmsg(sock, &msg, 0) != sizeof(dummy))
+        return -1;
+    return 0;
+}
+
+int read_fd(int sock) {
+    char dummy;
+    struct iovec iov = {
+        .iov_base = &dummy,
+        .iov_len = sizeof(dummy),
+    };
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } u;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = u.buf,
+        .msg_controllen = sizeof(u.buf),
+    };
+    if (recvmsg(sock, &msg, 0) != sizeof(dummy))
+        return -1;
+
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    if (c == NULL || c->cmsg_level != SOL_SOCKET ||
+            c->cmsg_type != SCM_RIGHTS || c->cmsg_len != CMSG_LEN(sizeof(int)))
+        return -1;
+
+    int fd;
+    memcpy(&fd, CMSG_DATA(c), sizeof(int));
+    return fd;
+}
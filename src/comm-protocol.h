@@ -15,4 +15,29 @@ ssize_t read_data(int fd, unsigned char **data);
 /* Write from the pointer 'data'. Returns 0 on success, -1 on error. */
 int write_data(int fd, const unsigned char *data, size_t len);
 
+/* Serialise 'data' as write_data would, into 'buf' at offset '*offset'. The
+ * offset is advanced by the size of the serialised form, even if it does not
+ * fit in 'size' bytes, in which case nothing is written. This allows callers
+ * to compute the space they need with a NULL 'buf'.
+ */
+void pack_data(unsigned char *buf, size_t size, size_t *offset,
+    const unsigned char *data, size_t len);
+
+/* Deserialise data packed with pack_data from 'buf' at offset '*offset', as
+ * read_data would, advancing the offset past it. Returns -1 if 'buf' is too
+ * short.
+ */
+ssize_t unpack_data(const unsigned char *buf, size_t size, size_t *offset,
+    unsigned char **data);
+
+/* Pass an open file descriptor over a UNIX domain socket. Returns 0 on
+ * success, -1 on error.
+ */
+int write_fd(int sock, int fd);
+
+/* Receive a file descriptor sent with write_fd. Returns the new descriptor or
+ * -1 on error.
+ */
+int read_fd(int sock);
+
 #endif
@@ -0,0 +1,96 @@
+#include <assert.h>
+#include "cwd.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* An immutable string, shared between contexts. */
+typedef struct {
+    unsigned refcount;
+    char path[];
+} path_t;
+
+struct cwd {
+    /* Number of processes sharing this context. */
+    unsigned refcount;
+
+    path_t *path;
+};
+
+static path_t *path_new(const char *path) {
+    size_t len = strlen(path);
+    path_t *p = malloc(sizeof(*p) + len + 1);
+    if (p == NULL)
+        return NULL;
+    p->refcount = 1;
+    memcpy(p->path, path, len + 1);
+    return p;
+}
+
+static void path_release(path_t *p) {
+    assert(p->refcount > 0);
+    if (--p->refcount == 0)
+        free(p);
+}
+
+cwd_t *cwd_new(const char *path) {
+    assert(path != NULL);
+
+    cwd_t *c = malloc(sizeof(*c));
+    if (c == NULL)
+        return NULL;
+    c->path = path_new(path);
+    if (c->path == NULL) {
+        free(c);
+        return NULL;
+    }
+    c->refcount = 1;
+    return c;
+}
+
+cwd_t *cwd_share(cwd_t *c) {
+    assert(c != NULL);
+    c->refcount++;
+    return c;
+}
+
+cwd_t *cwd_fork(const cwd_t *c) {
+    assert(c != NULL);
+
+    cwd_t *f = malloc(sizeof(*f));
+    if (f == NULL)
+        return NULL;
+    f->path = c->path;
+    f->path->refcount++;
+    f->refcount = 1;
+    return f;
+}
+
+void cwd_release(cwd_t *c) {
+    if (c == NULL)
+        return;
+    assert(c->refcount > 0);
+    if (--c->refcount > 0)
+        return;
+    path_release(c->path);
+    free(c);
+}
+
+const char *cwd_get(const cwd_t *c) {
+    assert(c != NULL);
+    return c->path->path;
+}
+
+int cwd_set(cwd_t *c, const char *path) {
+    assert(c != NULL);
+    assert(path != NULL);
+
+    if (strcmp(c->path->path, path) == 0)
+        return 0;
+
+    path_t *p = path_new(path);
+    if (p == NULL)
+        return -1;
+    path_release(c->path);
+    c->path = p;
+    return 0;
+}
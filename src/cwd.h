@@ -0,0 +1,40 @@
+#ifndef _XCACHE_CWD_H_
+#define _XCACHE_CWD_H_
+
+/* Tracking of the working directories of traced processes.
+ *
+ * Most processes we trace never change directory, so rather than give each
+ * its own copy of its working directory, processes refer to a shared,
+ * reference-counted string. A forked child starts out referring to its
+ * parent's string and only gets a new one if it changes directory. Threads
+ * created with CLONE_FS additionally share the context holding the string, so
+ * a change of directory in one is seen by all of them.
+ */
+
+typedef struct cwd cwd_t;
+
+/* Create a new context with the given working directory. Returns NULL on
+ * failure.
+ */
+cwd_t *cwd_new(const char *path);
+
+/* Take another reference to a context, for a process created with CLONE_FS. */
+cwd_t *cwd_share(cwd_t *c);
+
+/* Create a new context with the same working directory, for a forked process.
+ * Returns NULL on failure.
+ */
+cwd_t *cwd_fork(const cwd_t *c);
+
+/* Drop a reference to a context, deallocating it if this was the last. */
+void cwd_release(cwd_t *c);
+
+/* Retrieve the working directory. The returned string is only valid until the
+ * working directory is next changed.
+ */
+const char *cwd_get(const cwd_t *c);
+
+/* Change the working directory. Returns 0 on success. */
+int cwd_set(cwd_t *c, const char *path);
+
+#endif
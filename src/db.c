@@ -3,13 +3,39 @@
 #include <limits.h>
 #include <sqlite3.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
-/* Wrapper around sqlite3_prepare_v2. */
+/* Wrapper around sqlite3_prepare_v2. Statements are cached by the address of
+ * their query text, so callers are expected to pass string literals. Repeated
+ * calls with the same query get back the same, already compiled, statement.
+ * Callers only reset the statements they get back, so a query that does not
+ * fit in the cache fails rather than being compiled afresh and leaked.
+ */
 static int prepare(db_t *db, sqlite3_stmt **s, const char *query) {
-    return sqlite3_prepare_v2(db->handle, query, -1, s, NULL);
+    unsigned int i;
+    for (i = 0; i < sizeof(db->stmts) / sizeof(db->stmts[0]); i++) {
+        if (db->stmts[i].query == query) {
+            *s = db->stmts[i].stmt;
+            return SQLITE_OK;
+        }
+        if (db->stmts[i].query == NULL)
+            break;
+    }
+    if (i == sizeof(db->stmts) / sizeof(db->stmts[0])) {
+        /* DB_STATEMENTS is too small for the number of queries in use. */
+        *s = NULL;
+        return SQLITE_FULL;
+    }
+
+    int r = sqlite3_prepare_v2(db->handle, query, -1, s, NULL);
+    if (r == SQLITE_OK) {
+        db->stmts[i].query = query;
+        db->stmts[i].stmt = *s;
+    }
+    return r;
 }
 
 /* Wrapper around sqlite3_exec. */
@@ -17,19 +43,35 @@ static int exec(db_t *db, const char *query) {
     return sqlite3_exec(db->handle, query, NULL, NULL, NULL);
 }
 
-/* Helper to avoid having to remember to finalise statements all the time. */
-static void autofinalize_(void *p) {
+/* How long to wait for another process to release the database, in
+ * milliseconds.
+ */
+#define DB_BUSY_TIMEOUT 10000
+
+/* Helper to avoid having to remember to reset statements all the time. Note
+ * that statements are owned by the cache in 'prepare' and only finalised when
+ * the database is closed.
+ */
+static void autoreset_(void *p) {
     sqlite3_stmt **s = p;
-    if (*s != NULL)
-        sqlite3_finalize(*s);
+    if (*s != NULL) {
+        sqlite3_reset(*s);
+        sqlite3_clear_bindings(*s);
+    }
 }
-#define auto_sqlite3_stmt __attribute__((cleanup(autofinalize_))) sqlite3_stmt
+#define auto_sqlite3_stmt __attribute__((cleanup(autoreset_))) sqlite3_stmt
 
 int db_open(db_t *db, const char *path) {
+    memset(db->stmts, 0, sizeof(db->stmts));
     int r = sqlite3_open(path, &db->handle);
     if (r != SQLITE_OK)
         return -1;
 
+    /* Other xcache processes may be using the database at the same time, so
+     * wait for them rather than failing.
+     */
+    (void)sqlite3_busy_timeout(db->handle, DB_BUSY_TIMEOUT);
+
     char *query =
         "create table if not exists trace ("
         "    id integer primary key autoincrement,"
@@ -58,7 +100,56 @@ int db_open(db_t *db, const char *path) {
         "create table if not exists statistics ("
         "    fk_trace integer references trace(id),"
         "    event integer not null,"
-        "    timestamp integer not null default current_timestamp);";
+        "    timestamp integer not null default current_timestamp);"
+
+        "create table if not exists validated ("
+        "    fk_trace integer primary key references trace(id),"
+        "    timestamp integer not null);"
+
+        "create table if not exists volatility ("
+        "    filename text primary key,"
+        "    misses integer not null default 0);"
+
+        "create table if not exists toolchain ("
+        "    fk_trace integer primary key references trace(id),"
+        "    prefixes text not null,"
+        "    stamp text not null);"
+
+        "create table if not exists environment ("
+        "    fk_trace integer primary key references trace(id),"
+        "    names text not null,"
+        "    digest text not null);"
+
+        "create table if not exists result ("
+        "    fk_trace integer primary key references trace(id),"
+        "    status integer not null,"
+        "    signal integer not null,"
+        "    expiry integer not null);"
+
+        "create table if not exists outcome ("
+        "    cwd text not null,"
+        "    arg_lens blob not null,"
+        "    arg_lens_sz integer not null,"
+        "    argv text not null,"
+        "    wasted integer not null default 0,"
+        "    skipped integer not null default 0,"
+        "    traced_us integer not null default -1,"
+        "    plain_us integer not null default -1,"
+        "    reason text,"
+        "    primary key (cwd, arg_lens, arg_lens_sz, argv));"
+
+        "create table if not exists program ("
+        "    exe text primary key,"
+        "    failures integer not null default 0,"
+        "    reason text);"
+
+        /* Entries are looked up by their fingerprint, and their details by
+         * entry.
+         */
+        "create index if not exists trace_fingerprint on trace (cwd, argv);"
+        "create index if not exists input_trace on input (fk_trace);"
+        "create index if not exists output_trace on output (fk_trace);"
+        "create index if not exists env_trace on env (fk_trace);";
     if (exec(db, query) != 0) {
         db_close(db);
         return -1;
@@ -68,7 +159,11 @@ int db_open(db_t *db, const char *path) {
 }
 
 int db_begin(db_t *db) {
-    return exec(db, "begin transaction");
+    /* Our transactions all write, so take the write lock up front. A deferred
+     * transaction that reads first can only fail, rather than wait, when it
+     * finds another writer in the way.
+     */
+    return exec(db, "begin immediate transaction");
 }
 int db_commit(db_t *db) {
     return exec(db, "commit transaction");
@@ -83,10 +178,22 @@ int db_clear(db_t *db) {
         "delete from output;"
         "delete from trace;"
         "delete from env;"
-        "delete from statistics;");
+        "delete from statistics;"
+        "delete from validated;"
+        "delete from volatility;"
+        "delete from toolchain;"
+        "delete from environment;"
+        "delete from result;"
+        "delete from outcome;"
+        "delete from program;");
 }
 
 int db_close(db_t *db) {
+    for (unsigned int i = 0; i < sizeof(db->stmts) / sizeof(db->stmts[0]) &&
+            db->stmts[i].query != NULL; i++) {
+        sqlite3_finalize(db->stmts[i].stmt);
+        db->stmts[i].query = NULL;
+    }
     if (sqlite3_close(db->handle) != SQLITE_OK)
         return -1;
     return 0;
@@ -212,6 +319,55 @@ int db_remove_id(db_t *db, int id) {
             return -1;
     }
 
+    {
+        auto_sqlite3_stmt *s = NULL;
+        char *deletevalidated = "delete from validated where fk_trace = @id;";
+
+        if (prepare(db, &s, deletevalidated) != SQLITE_OK)
+            return -1;
+        if (bind_int(s, "@id", id) != SQLITE_OK)
+            return -1;
+        if (sqlite3_step(s) != SQLITE_DONE)
+            return -1;
+    }
+
+    {
+        auto_sqlite3_stmt *s = NULL;
+        char *deletetoolchain = "delete from toolchain where fk_trace = @id;";
+
+        if (prepare(db, &s, deletetoolchain) != SQLITE_OK)
+            return -1;
+        if (bind_int(s, "@id", id) != SQLITE_OK)
+            return -1;
+        if (sqlite3_step(s) != SQLITE_DONE)
+            return -1;
+    }
+
+    {
+        auto_sqlite3_stmt *s = NULL;
+        char *deleteenvironment = "delete from environment where "
+            "fk_trace = @id;";
+
+        if (prepare(db, &s, deleteenvironment) != SQLITE_OK)
+            return -1;
+        if (bind_int(s, "@id", id) != SQLITE_OK)
+            return -1;
+        if (sqlite3_step(s) != SQLITE_DONE)
+            return -1;
+    }
+
+    {
+        auto_sqlite3_stmt *s = NULL;
+        char *deleteresult = "delete from result where fk_trace = @id;";
+
+        if (prepare(db, &s, deleteresult) != SQLITE_OK)
+            return -1;
+        if (bind_int(s, "@id", id) != SQLITE_OK)
+            return -1;
+        if (sqlite3_step(s) != SQLITE_DONE)
+            return -1;
+    }
+
     {
         auto_sqlite3_stmt *s = NULL;
         char *deletetrace = "delete from trace where id = @id;";
@@ -327,8 +483,13 @@ int db_for_inputs(db_t *db, int id,
         int (*cb)(const char *filename, time_t timestamp)) {
     auto_sqlite3_stmt *s = NULL;
 
-    char *getinputs = "select filename, timestamp from input where "
-        "fk_trace = @fk_trace;";
+    /* Inputs that have changed most often in the past come first, so callers
+     * stopping at the first changed input get there sooner.
+     */
+    char *getinputs = "select input.filename, input.timestamp from input "
+        "left join volatility on input.filename = volatility.filename "
+        "where input.fk_trace = @fk_trace "
+        "order by coalesce(volatility.misses, 0) desc;";
     if (prepare(db, &s, getinputs) != SQLITE_OK)
         return -1;
 
@@ -429,3 +590,399 @@ int db_for_env(db_t *db, int id,
 
     assert(!"unreachable");
 }
+
+int db_select_validated(db_t *db, int id, int64_t *timestamp) {
+    auto_sqlite3_stmt *s = NULL;
+
+    char *getvalidated = "select timestamp from validated where "
+        "fk_trace = @fk_trace;";
+    if (prepare(db, &s, getvalidated) != SQLITE_OK)
+        return -1;
+
+    if (bind_int(s, "@fk_trace", id) != SQLITE_OK)
+        return -1;
+
+    if (sqlite3_step(s) != SQLITE_ROW)
+        return -1;
+
+    assert(sqlite3_column_count(s) == 1);
+    *timestamp = column_int64_t(s, 0);
+
+    return 0;
+}
+
+int db_insert_validated(db_t *db, int id, int64_t timestamp) {
+    auto_sqlite3_stmt *s = NULL;
+    char *add = "insert or replace into validated (fk_trace, timestamp) "
+        "values (@fk_trace, @timestamp);";
+    if (prepare(db, &s, add) != SQLITE_OK)
+        return -1;
+
+    if (bind_int(s, "@fk_trace", id) != SQLITE_OK ||
+            bind_int64_t(s, "@timestamp", timestamp) != SQLITE_OK)
+        return -1;
+
+    if (sqlite3_step(s) != SQLITE_DONE)
+        return -1;
+
+    return 0;
+}
+
+int db_remove_validated(db_t *db, int id) {
+    auto_sqlite3_stmt *s = NULL;
+    char *remove = "delete from validated where fk_trace = @fk_trace;";
+    if (prepare(db, &s, remove) != SQLITE_OK)
+        return -1;
+
+    if (bind_int(s, "@fk_trace", id) != SQLITE_OK)
+        return -1;
+
+    if (sqlite3_step(s) != SQLITE_DONE)
+        return -1;
+
+    return 0;
+}
+
+int db_select_toolchain(db_t *db, int id, char **prefixes, char **stamp) {
+    auto_sqlite3_stmt *s = NULL;
+
+    char *gettoolchain = "select prefixes, stamp from toolchain where "
+        "fk_trace = @fk_trace;";
+    if (prepare(db, &s, gettoolchain) != SQLITE_OK)
+        return -1;
+
+    if (bind_int(s, "@fk_trace", id) != SQLITE_OK)
+        return -1;
+
+    switch (sqlite3_step(s)) {
+        case SQLITE_DONE:
+            *prefixes = NULL;
+            *stamp = NULL;
+            return 0;
+
+        case SQLITE_ROW:
+            assert(sqlite3_column_count(s) == 2);
+            *prefixes = strdup(column_text(s, 0));
+            if (*prefixes == NULL)
+                return -1;
+            *stamp = strdup(column_text(s, 1));
+            if (*stamp == NULL) {
+                free(*prefixes);
+                return -1;
+            }
+            return 0;
+
+        default:
+            return -1;
+    }
+}
+
+int db_insert_toolchain(db_t *db, int id, const char *prefixes,
+        const char *stamp) {
+    auto_sqlite3_stmt *s = NULL;
+    char *add = "insert into toolchain (fk_trace, prefixes, stamp) values "
+        "(@fk_trace, @prefixes, @stamp);";
+    if (prepare(db, &s, add) != SQLITE_OK)
+        return -1;
+
+    if (bind_int(s, "@fk_trace", id) != SQLITE_OK ||
+            bind_text(s, "@prefixes", prefixes) != SQLITE_OK ||
+            bind_text(s, "@stamp", stamp) != SQLITE_OK)
+        return -1;
+
+    if (sqlite3_step(s) != SQLITE_DONE)
+        return -1;
+
+    return 0;
+}
+
+int db_select_environment(db_t *db, int id, char **names, char **digest) {
+    auto_sqlite3_stmt *s = NULL;
+
+    char *getenvironment = "select names, digest from environment where "
+        "fk_trace = @fk_trace;";
+    if (prepare(db, &s, getenvironment) != SQLITE_OK)
+        return -1;
+
+    if (bind_int(s, "@fk_trace", id) != SQLITE_OK)
+        return -1;
+
+    switch (sqlite3_step(s)) {
+        case SQLITE_DONE:
+            *names = NULL;
+            *digest = NULL;
+            return 0;
+
+        case SQLITE_ROW:
+            assert(sqlite3_column_count(s) == 2);
+            *names = strdup(column_text(s, 0));
+            if (*names == NULL)
+                return -1;
+            *digest = strdup(column_text(s, 1));
+            if (*digest == NULL) {
+                free(*names);
+                return -1;
+            }
+            return 0;
+
+        default:
+            return -1;
+    }
+}
+
+int db_insert_environment(db_t *db, int id, const char *names,
+        const char *digest) {
+    auto_sqlite3_stmt *s = NULL;
+    char *add = "insert into environment (fk_trace, names, digest) values "
+        "(@fk_trace, @names, @digest);";
+    if (prepare(db, &s, add) != SQLITE_OK)
+        return -1;
+
+    if (bind_int(s, "@fk_trace", id) != SQLITE_OK ||
+            bind_text(s, "@names", names) != SQLITE_OK ||
+            bind_text(s, "@digest", digest) != SQLITE_OK)
+        return -1;
+
+    if (sqlite3_step(s) != SQLITE_DONE)
+        return -1;
+
+    return 0;
+}
+
+int db_select_result(db_t *db, int id, int *status, int *signal,
+        int64_t *expiry) {
+    auto_sqlite3_stmt *s = NULL;
+
+    char *getresult = "select status, signal, expiry from result where "
+        "fk_trace = @fk_trace;";
+    if (prepare(db, &s, getresult) != SQLITE_OK)
+        return -1;
+
+    if (bind_int(s, "@fk_trace", id) != SQLITE_OK)
+        return -1;
+
+    switch (sqlite3_step(s)) {
+        case SQLITE_DONE:
+            *status = 0;
+            *signal = 0;
+            *expiry = -1;
+            return 0;
+
+        case SQLITE_ROW:
+            assert(sqlite3_column_count(s) == 3);
+            *status = column_int(s, 0);
+            *signal = column_int(s, 1);
+            *expiry = column_int64_t(s, 2);
+            return 0;
+
+        default:
+            return -1;
+    }
+}
+
+int db_insert_result(db_t *db, int id, int status, int signal,
+        int64_t expiry) {
+    auto_sqlite3_stmt *s = NULL;
+    char *add = "insert or replace into result (fk_trace, status, signal, "
+        "expiry) values (@fk_trace, @status, @signal, @expiry);";
+    if (prepare(db, &s, add) != SQLITE_OK)
+        return -1;
+
+    if (bind_int(s, "@fk_trace", id) != SQLITE_OK ||
+            bind_int(s, "@status", status) != SQLITE_OK ||
+            bind_int(s, "@signal", signal) != SQLITE_OK ||
+            bind_int64_t(s, "@expiry", expiry) != SQLITE_OK)
+        return -1;
+
+    if (sqlite3_step(s) != SQLITE_DONE)
+        return -1;
+
+    return 0;
+}
+
+int db_insert_miss(db_t *db, const char *filename) {
+    auto_sqlite3_stmt *s = NULL;
+    char *add = "insert or ignore into volatility (filename) values "
+        "(@filename);";
+    if (prepare(db, &s, add) != SQLITE_OK)
+        return -1;
+
+    if (bind_text(s, "@filename", filename) != SQLITE_OK)
+        return -1;
+
+    if (sqlite3_step(s) != SQLITE_DONE)
+        return -1;
+
+    auto_sqlite3_stmt *u = NULL;
+    char *increment = "update volatility set misses = misses + 1 where "
+        "filename = @filename;";
+    if (prepare(db, &u, increment) != SQLITE_OK)
+        return -1;
+
+    if (bind_text(u, "@filename", filename) != SQLITE_OK)
+        return -1;
+
+    if (sqlite3_step(u) != SQLITE_DONE)
+        return -1;
+
+    return 0;
+}
+
+int db_for_all_inputs(db_t *db, int (*cb)(const char *filename)) {
+    auto_sqlite3_stmt *s = NULL;
+
+    char *getinputs = "select distinct filename from input;";
+    if (prepare(db, &s, getinputs) != SQLITE_OK)
+        return -1;
+
+    while (true) {
+        switch (sqlite3_step(s)) {
+            case SQLITE_DONE:
+                return 0;
+
+            case SQLITE_ROW:
+                assert(sqlite3_column_count(s) == 1);
+                const char *filename = column_text(s, 0);
+                assert(filename != NULL);
+                int r = cb(filename);
+                if (r != 0)
+                    return r;
+                break;
+
+            default:
+                return -1;
+        }
+    }
+
+    assert(!"unreachable");
+}
+
+int db_select_outcome(db_t *db, const fingerprint_t *fp, bool *found,
+        db_outcome_t *outcome) {
+    auto_sqlite3_stmt *s = NULL;
+    char *getoutcome = "select wasted, skipped, traced_us, plain_us from "
+        "outcome where cwd = @cwd and arg_lens = @arg_lens and "
+        "arg_lens_sz = @arg_lens_sz and argv = @argv;";
+    if (prepare(db, &s, getoutcome) != SQLITE_OK)
+        return -1;
+
+    if (bind_text(s, "@cwd", fp->cwd) != SQLITE_OK ||
+            bind_blob(s, "@arg_lens", fp->arg_lens,
+                fp->arg_lens_sz * sizeof(*fp->arg_lens)) != SQLITE_OK ||
+            bind_int(s, "@arg_lens_sz", fp->arg_lens_sz) != SQLITE_OK ||
+            bind_text(s, "@argv", fp->argv) != SQLITE_OK)
+        return -1;
+
+    switch (sqlite3_step(s)) {
+        case SQLITE_DONE:
+            *found = false;
+            return 0;
+
+        case SQLITE_ROW:
+            assert(sqlite3_column_count(s) == 4);
+            outcome->wasted = column_int(s, 0);
+            outcome->skipped = column_int(s, 1);
+            outcome->traced_us = column_int64_t(s, 2);
+            outcome->plain_us = column_int64_t(s, 3);
+            *found = true;
+            return 0;
+
+        default:
+            return -1;
+    }
+}
+
+int db_insert_outcome(db_t *db, const fingerprint_t *fp,
+        const db_outcome_t *outcome, const char *reason) {
+    auto_sqlite3_stmt *s = NULL;
+    char *add = "insert or replace into outcome (cwd, arg_lens, arg_lens_sz, "
+        "argv, wasted, skipped, traced_us, plain_us, reason) values (@cwd, "
+        "@arg_lens, @arg_lens_sz, @argv, @wasted, @skipped, @traced_us, "
+        "@plain_us, @reason);";
+    if (prepare(db, &s, add) != SQLITE_OK)
+        return -1;
+
+    if (bind_text(s, "@cwd", fp->cwd) != SQLITE_OK ||
+            bind_blob(s, "@arg_lens", fp->arg_lens,
+                fp->arg_lens_sz * sizeof(*fp->arg_lens)) != SQLITE_OK ||
+            bind_int(s, "@arg_lens_sz", fp->arg_lens_sz) != SQLITE_OK ||
+            bind_text(s, "@argv", fp->argv) != SQLITE_OK ||
+            bind_int(s, "@wasted", outcome->wasted) != SQLITE_OK ||
+            bind_int(s, "@skipped", outcome->skipped) != SQLITE_OK ||
+            bind_int64_t(s, "@traced_us", outcome->traced_us) != SQLITE_OK ||
+            bind_int64_t(s, "@plain_us", outcome->plain_us) != SQLITE_OK ||
+            (reason != NULL &&
+                bind_text(s, "@reason", reason) != SQLITE_OK))
+        return -1;
+
+    if (sqlite3_step(s) != SQLITE_DONE)
+        return -1;
+
+    return 0;
+}
+
+int db_insert_hit(db_t *db, const fingerprint_t *fp) {
+    auto_sqlite3_stmt *s = NULL;
+    char *reset = "update outcome set wasted = 0 where cwd = @cwd and "
+        "arg_lens = @arg_lens and arg_lens_sz = @arg_lens_sz and "
+        "argv = @argv;";
+    if (prepare(db, &s, reset) != SQLITE_OK)
+        return -1;
+
+    if (bind_text(s, "@cwd", fp->cwd) != SQLITE_OK ||
+            bind_blob(s, "@arg_lens", fp->arg_lens,
+                fp->arg_lens_sz * sizeof(*fp->arg_lens)) != SQLITE_OK ||
+            bind_int(s, "@arg_lens_sz", fp->arg_lens_sz) != SQLITE_OK ||
+            bind_text(s, "@argv", fp->argv) != SQLITE_OK)
+        return -1;
+
+    if (sqlite3_step(s) != SQLITE_DONE)
+        return -1;
+
+    return 0;
+}
+
+int db_select_program(db_t *db, const char *exe, int *failures) {
+    auto_sqlite3_stmt *s = NULL;
+    char *getprogram = "select failures from program where exe = @exe;";
+    if (prepare(db, &s, getprogram) != SQLITE_OK)
+        return -1;
+
+    if (bind_text(s, "@exe", exe) != SQLITE_OK)
+        return -1;
+
+    switch (sqlite3_step(s)) {
+        case SQLITE_DONE:
+            *failures = 0;
+            return 0;
+
+        case SQLITE_ROW:
+            assert(sqlite3_column_count(s) == 1);
+            *failures = column_int(s, 0);
+            return 0;
+
+        default:
+            return -1;
+    }
+}
+
+int db_insert_program(db_t *db, const char *exe, const char *reason) {
+    auto_sqlite3_stmt *s = NULL;
+    char *add = "insert into program (exe, failures, reason) values (@exe, "
+        "@failures, @reason) on conflict (exe) do update set failures = "
+        "case when @reason is null then 0 else failures + 1 end, "
+        "reason = @reason;";
+    if (prepare(db, &s, add) != SQLITE_OK)
+        return -1;
+
+    if (bind_text(s, "@exe", exe) != SQLITE_OK ||
+            bind_int(s, "@failures", reason == NULL ? 0 : 1) != SQLITE_OK ||
+            (reason != NULL &&
+                bind_text(s, "@reason", reason) != SQLITE_OK))
+        return -1;
+
+    if (sqlite3_step(s) != SQLITE_DONE)
+        return -1;
+
+    return 0;
+}
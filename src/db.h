@@ -7,11 +7,27 @@
 
 #include "fingerprint.h"
 #include <sqlite3.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <time.h>
 
+/* Number of prepared statements a db_t can keep. This needs to be at least the
+ * number of distinct queries in db.c, or the queries that do not fit will fail.
+ */
+#define DB_STATEMENTS 64
+
 typedef struct {
     sqlite3 *handle;
+
+    /* Prepared statements kept for reuse across calls. This is mainly of
+     * benefit to long running users like xcached, but also saves recompiling
+     * the insertion queries for every file in a dependency set.
+     */
+    struct {
+        const char *query;
+        sqlite3_stmt *stmt;
+    } stmts[DB_STATEMENTS];
 } db_t;
 
 int db_open(db_t *db, const char *path);
@@ -47,6 +63,7 @@ int db_insert_event(db_t *db, int id, db_event_t event);
  */
 int db_remove_id(db_t *db, int id);
 
+/* Loop over the inputs of an entry, most frequently changed first. */
 int db_for_inputs(db_t *db, int id,
     int (*cb)(const char *filename, time_t timestamp));
 int db_for_outputs(db_t *db, int id,
@@ -55,4 +72,77 @@ int db_for_outputs(db_t *db, int id,
 int db_for_env(db_t *db, int id,
         int (*cb)(const char *name, const char *value));
 
+/* Retrieve, set or forget the time (as per watch_time()) at which the inputs
+ * of an entry were last confirmed unchanged by stat-ing them. Return 0 on
+ * success.
+ */
+int db_select_validated(db_t *db, int id, int64_t *timestamp);
+int db_insert_validated(db_t *db, int id, int64_t timestamp);
+int db_remove_validated(db_t *db, int id);
+
+/* Retrieve or set the toolchain stamp of an entry (see toolchain.h). If the
+ * entry has none, db_select_toolchain sets both outputs to NULL. Otherwise it
+ * is the caller's responsibility to free them.
+ */
+int db_select_toolchain(db_t *db, int id, char **prefixes, char **stamp);
+int db_insert_toolchain(db_t *db, int id, const char *prefixes,
+    const char *stamp);
+
+/* Retrieve or set the digest of the environment variables an entry read (see
+ * cache.c), along with their names, each terminated by a newline. If the entry
+ * has none, db_select_environment sets both outputs to NULL. Otherwise it is
+ * the caller's responsibility to free them.
+ */
+int db_select_environment(db_t *db, int id, char **names, char **digest);
+int db_insert_environment(db_t *db, int id, const char *names,
+    const char *digest);
+
+/* Retrieve or set how the run an entry was traced from ended: its exit status,
+ * the signal that terminated it (or 0) and the time in seconds since the epoch
+ * after which the entry should no longer be used (or -1). Only entries of
+ * unsuccessful runs have these recorded. For others, db_select_result reports
+ * a status of 0 with no signal and no expiry.
+ */
+int db_select_result(db_t *db, int id, int *status, int *signal,
+    int64_t *expiry);
+int db_insert_result(db_t *db, int id, int status, int signal,
+    int64_t expiry);
+
+/* Record that a change to the given input caused a cache miss. */
+int db_insert_miss(db_t *db, const char *filename);
+
+/* Loop over the distinct inputs of every entry. */
+int db_for_all_inputs(db_t *db, int (*cb)(const char *filename));
+
+/* How running an invocation has gone in the past, used to decide whether it
+ * is worth tracing it again.
+ */
+typedef struct {
+    int wasted;        /* Traced runs since the entry was last found */
+    int skipped;       /* Untraced runs since it was last traced */
+    int64_t traced_us; /* Duration of the last traced run, or -1 */
+    int64_t plain_us;  /* Duration of the last untraced run, or -1 */
+} db_outcome_t;
+
+/* Retrieve or set the outcome of an invocation. If there is none recorded,
+ * db_select_outcome sets 'found' to false and leaves 'outcome' untouched.
+ * 'reason' is why the last traced run could not be cached, or NULL.
+ */
+int db_select_outcome(db_t *db, const fingerprint_t *fp, bool *found,
+    db_outcome_t *outcome);
+int db_insert_outcome(db_t *db, const fingerprint_t *fp,
+    const db_outcome_t *outcome, const char *reason);
+
+/* Record that a cache entry for an invocation was found, so tracing it was
+ * worthwhile.
+ */
+int db_insert_hit(db_t *db, const fingerprint_t *fp);
+
+/* Retrieve the number of consecutive traced runs of a program that could not
+ * be cached, or record another such run. A NULL 'reason' records a run that
+ * was cached, resetting the count.
+ */
+int db_select_program(db_t *db, const char *exe, int *failures);
+int db_insert_program(db_t *db, const char *exe, const char *reason);
+
 #endif
@@ -38,7 +38,11 @@ typedef struct {
     time_t mtime;
 } entry_t;
 
-int depset_add(depset_t *d, char *filename, filetype_t type) {
+/* Common implementation of depset_add and depset_insert. If 'measured' is
+ * false, we stat the file ourselves to determine its timestamp.
+ */
+static int add(depset_t *d, const char *filename, filetype_t type,
+        bool measured, time_t mtime) {
     assert(!d->finalised);
 
     if (type == XC_BOTH) {
@@ -53,7 +57,8 @@ int depset_add(depset_t *d, char *filename, filetype_t type) {
         if (e == NULL)
             return -1;
         e->type = type;
-        if (type == XC_INPUT || type == XC_AMBIGUOUS) {
+        e->mtime = mtime;
+        if (!measured && (type == XC_INPUT || type == XC_AMBIGUOUS)) {
             /* We need to measure this file now. */
             struct stat buf;
             int r = stat(filename, &buf);
@@ -70,8 +75,12 @@ int depset_add(depset_t *d, char *filename, filetype_t type) {
             return -1;
         }
     } else if (e->type == XC_INPUT && type == XC_OUTPUT) {
-        /* Writing to something we previously read from. */
-        e->type = XC_BOTH;
+        /* Writing to something we previously read from. If it did not exist
+         * when we measured it, there was nothing to read and it is simply
+         * something the target created. This is typical of a linker that
+         * removes its output and then opens it read-write.
+         */
+        e->type = e->mtime == MISSING ? XC_OUTPUT : XC_BOTH;
     } else if (e->type == XC_AMBIGUOUS) {
         /* If the type of this item was previously ambiguous, we may have just
          * clarified its ambiguity. Note that this is a no-op if the caller has
@@ -82,6 +91,23 @@ int depset_add(depset_t *d, char *filename, filetype_t type) {
     return 0;
 }
 
+int depset_add(depset_t *d, const char *filename, filetype_t type) {
+    return add(d, filename, type, false, UNSET);
+}
+
+int depset_insert(depset_t *d, const char *filename, filetype_t type,
+        time_t mtime) {
+    if (type == XC_BOTH) {
+        /* Unlike depset_add, we are replaying a relationship that was already
+         * established, so split it into its constituent parts.
+         */
+        if (add(d, filename, XC_INPUT, true, mtime) != 0)
+            return -1;
+        type = XC_OUTPUT;
+    }
+    return add(d, filename, type, true, mtime);
+}
+
 int depset_foreach(depset_t *d, int (*f)(const char *filename, filetype_t type, time_t mtime)) {
     int wrapper(const char *filename, void *value) {
         entry_t *e = value;
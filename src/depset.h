@@ -11,18 +11,9 @@
  */
 
 #include "collection/dict.h"
+#include "filetype.h"
 #include <time.h>
 
-/* The type of a file dependency. */
-typedef enum {
-    XC_NONE,         /* irrelevant (used as a placeholder) */
-    XC_INPUT,        /* the target reads this file */
-    XC_OUTPUT,       /* the target writes this file */
-    XC_BOTH,         /* the target reads and writes this file */
-    XC_AMBIGUOUS,    /* the target does "something" with this file;
-                        annoying quirk to handle `stat` */
-} filetype_t;
-
 /* A collection of file dependencies. */
 typedef struct depset depset_t;
 
@@ -32,7 +23,14 @@ depset_t *depset_new(void);
 /* Add a file to the dependency set with the given relationship. Returns 0 on
  * success.
  */
-int depset_add(depset_t *d, char *filename, filetype_t type);
+int depset_add(depset_t *d, const char *filename, filetype_t type);
+
+/* Add a file to the dependency set whose timestamp has already been measured.
+ * This is for reconstructing a dependency set that was built elsewhere, e.g.
+ * one sent to xcached by a client. Returns 0 on success.
+ */
+int depset_insert(depset_t *d, const char *filename, filetype_t type,
+    time_t mtime);
 
 /* Deallocate resources associated with a dependency set. It is undefined what
  * will happen if you attempt to use a dependency set after you have destroyed
@@ -0,0 +1,225 @@
+#include <assert.h>
+#include "fdtable.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    /* Absolute path this descriptor was opened with, or NULL if unknown. */
+    char *path;
+    bool cloexec;
+    /* Tag given by whoever opened this descriptor. */
+    const void *owner;
+} entry_t;
+
+struct fdtable {
+    /* Entries indexed by descriptor. Descriptors are allocated lowest first,
+     * so this stays dense.
+     */
+    entry_t *entries;
+    size_t size;
+
+    /* Number of processes sharing this table. */
+    unsigned refcount;
+};
+
+fdtable_t *fdtable_new(void) {
+    fdtable_t *t = calloc(1, sizeof(*t));
+    if (t == NULL)
+        return NULL;
+    t->refcount = 1;
+    return t;
+}
+
+fdtable_t *fdtable_share(fdtable_t *t) {
+    assert(t != NULL);
+    t->refcount++;
+    return t;
+}
+
+fdtable_t *fdtable_copy(const fdtable_t *t) {
+    assert(t != NULL);
+
+    fdtable_t *c = fdtable_new();
+    if (c == NULL)
+        return NULL;
+
+    if (t->size > 0) {
+        c->entries = calloc(t->size, sizeof(c->entries[0]));
+        if (c->entries == NULL) {
+            free(c);
+            return NULL;
+        }
+        c->size = t->size;
+    }
+
+    for (size_t i = 0; i < t->size; i++) {
+        if (t->entries[i].path == NULL)
+            continue;
+        c->entries[i].path = strdup(t->entries[i].path);
+        if (c->entries[i].path == NULL) {
+            fdtable_release(c);
+            return NULL;
+        }
+        c->entries[i].cloexec = t->entries[i].cloexec;
+        c->entries[i].owner = t->entries[i].owner;
+    }
+
+    return c;
+}
+
+void fdtable_release(fdtable_t *t) {
+    if (t == NULL)
+        return;
+    assert(t->refcount > 0);
+    if (--t->refcount > 0)
+        return;
+    for (size_t i = 0; i < t->size; i++)
+        free(t->entries[i].path);
+    free(t->entries);
+    free(t);
+}
+
+int fdtable_unshare(fdtable_t **t) {
+    assert(t != NULL);
+    assert(*t != NULL);
+
+    if ((*t)->refcount > 1) {
+        fdtable_t *c = fdtable_copy(*t);
+        if (c == NULL)
+            return -1;
+        fdtable_release(*t);
+        *t = c;
+    }
+    return 0;
+}
+
+int fdtable_exec(fdtable_t **t) {
+    if (fdtable_unshare(t) != 0)
+        return -1;
+
+    for (size_t i = 0; i < (*t)->size; i++) {
+        if ((*t)->entries[i].cloexec)
+            fdtable_forget(*t, (int)i);
+    }
+
+    return 0;
+}
+
+/* Make sure there is an entry for 'fd'. Returns 0 on success. */
+static int reserve(fdtable_t *t, int fd) {
+    assert(fd >= 0);
+    if ((size_t)fd < t->size)
+        return 0;
+
+    size_t size = t->size == 0 ? 64 : t->size;
+    while (size <= (size_t)fd)
+        size *= 2;
+
+    entry_t *e = realloc(t->entries, size * sizeof(e[0]));
+    if (e == NULL)
+        return -1;
+    memset(&e[t->size], 0, (size - t->size) * sizeof(e[0]));
+    t->entries = e;
+    t->size = size;
+    return 0;
+}
+
+int fdtable_set(fdtable_t *t, int fd, const char *path, bool cloexec,
+        const void *owner) {
+    assert(t != NULL);
+    assert(path != NULL);
+
+    if (fd < 0)
+        return -1;
+
+    /* On failure, make sure we do not leave a stale entry behind. */
+    char *p = strdup(path);
+    if (p == NULL) {
+        fdtable_forget(t, fd);
+        return -1;
+    }
+
+    if (reserve(t, fd) != 0) {
+        free(p);
+        return -1;
+    }
+
+    free(t->entries[fd].path);
+    t->entries[fd].path = p;
+    t->entries[fd].cloexec = cloexec;
+    t->entries[fd].owner = owner;
+    return 0;
+}
+
+int fdtable_dup(fdtable_t *t, int oldfd, int newfd, bool cloexec) {
+    assert(t != NULL);
+
+    if (oldfd == newfd)
+        return 0;
+
+    const char *path = fdtable_get(t, oldfd);
+    if (path == NULL) {
+        /* The new descriptor refers to something we do not know either. */
+        fdtable_forget(t, newfd);
+        return 0;
+    }
+
+    return fdtable_set(t, newfd, path, cloexec, fdtable_owner(t, oldfd));
+}
+
+void fdtable_setcloexec(fdtable_t *t, int fd, bool cloexec) {
+    assert(t != NULL);
+    if (fd >= 0 && (size_t)fd < t->size)
+        t->entries[fd].cloexec = cloexec;
+}
+
+void fdtable_forget(fdtable_t *t, int fd) {
+    assert(t != NULL);
+    if (fd < 0 || (size_t)fd >= t->size)
+        return;
+    free(t->entries[fd].path);
+    t->entries[fd].path = NULL;
+    t->entries[fd].cloexec = false;
+    t->entries[fd].owner = NULL;
+}
+
+void fdtable_close_range(fdtable_t *t, unsigned first, unsigned last,
+        bool cloexec) {
+    assert(t != NULL);
+    for (size_t i = first; i <= last && i < t->size; i++) {
+        if (cloexec) {
+            t->entries[i].cloexec = true;
+        } else {
+            fdtable_forget(t, (int)i);
+        }
+    }
+}
+
+int fdtable_foreach(const fdtable_t *t,
+        int (*f)(int fd, const char *path, bool cloexec)) {
+    assert(t != NULL);
+    for (size_t i = 0; i < t->size; i++) {
+        if (t->entries[i].path == NULL)
+            continue;
+        int r = f((int)i, t->entries[i].path, t->entries[i].cloexec);
+        if (r != 0)
+            return r;
+    }
+    return 0;
+}
+
+const char *fdtable_get(const fdtable_t *t, int fd) {
+    assert(t != NULL);
+    if (fd < 0 || (size_t)fd >= t->size)
+        return NULL;
+    return t->entries[fd].path;
+}
+
+const void *fdtable_owner(const fdtable_t *t, int fd) {
+    assert(t != NULL);
+    if (fd < 0 || (size_t)fd >= t->size)
+        return NULL;
+    return t->entries[fd].owner;
+}
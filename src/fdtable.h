@@ -0,0 +1,89 @@
+#ifndef _XCACHE_FDTABLE_H_
+#define _XCACHE_FDTABLE_H_
+
+/* A mirror of a traced process's file descriptor table.
+ *
+ * Rather than asking the kernel what a descriptor refers to each time a
+ * syscall uses one, the tracer records the path of each descriptor as it is
+ * opened and follows it through dups and closes. Like the kernel's own table,
+ * a mirror can be shared between processes created with CLONE_FILES.
+ *
+ * A mirror only knows about descriptors it has seen created. Lookups of any
+ * others return NULL and the caller is expected to fall back to asking the
+ * kernel.
+ */
+
+#include <stdbool.h>
+
+typedef struct fdtable fdtable_t;
+
+/* Create a new, empty table. Returns NULL on failure. */
+fdtable_t *fdtable_new(void);
+
+/* Take another reference to a table, for a process sharing it. */
+fdtable_t *fdtable_share(fdtable_t *t);
+
+/* Create an independent copy of a table, for a forked process. Returns NULL
+ * on failure.
+ */
+fdtable_t *fdtable_copy(const fdtable_t *t);
+
+/* Drop a reference to a table, deallocating it if this was the last. */
+void fdtable_release(fdtable_t *t);
+
+/* Give a process its own copy of a table, if it is currently shared. Returns 0
+ * on success.
+ */
+int fdtable_unshare(fdtable_t **t);
+
+/* Apply the effects of exec to a process's table. The table is unshared from
+ * any other processes and close-on-exec descriptors are dropped. Returns 0 on
+ * success.
+ */
+int fdtable_exec(fdtable_t **t);
+
+/* Record that 'fd' refers to the absolute path 'path'. Any previous entry for
+ * 'fd' is replaced. 'owner' is an opaque tag identifying who opened it, which
+ * is only ever compared. Returns 0 on success.
+ */
+int fdtable_set(fdtable_t *t, int fd, const char *path, bool cloexec,
+    const void *owner);
+
+/* Record that 'newfd' is a duplicate of 'oldfd', with the same owner. Returns 0
+ * on success.
+ */
+int fdtable_dup(fdtable_t *t, int oldfd, int newfd, bool cloexec);
+
+/* Update the close-on-exec flag of a descriptor. */
+void fdtable_setcloexec(fdtable_t *t, int fd, bool cloexec);
+
+/* Forget a descriptor, either because it was closed or because it now refers
+ * to something we do not track.
+ */
+void fdtable_forget(fdtable_t *t, int fd);
+
+/* Apply close_range to a table. If 'cloexec', the descriptors in the range are
+ * marked close-on-exec rather than closed.
+ */
+void fdtable_close_range(fdtable_t *t, unsigned first, unsigned last,
+    bool cloexec);
+
+/* Call 'f' for each descriptor whose path we know, in ascending order.
+ * Iteration stops early if 'f' returns non-zero, in which case that value is
+ * returned.
+ */
+int fdtable_foreach(const fdtable_t *t,
+    int (*f)(int fd, const char *path, bool cloexec));
+
+/* Look up the path of a descriptor. The returned string is owned by the table
+ * and only valid until the table is next modified. Returns NULL if the
+ * descriptor is unknown.
+ */
+const char *fdtable_get(const fdtable_t *t, int fd);
+
+/* Look up the owner a descriptor was recorded with. Returns NULL if the
+ * descriptor is unknown.
+ */
+const void *fdtable_owner(const fdtable_t *t, int fd);
+
+#endif
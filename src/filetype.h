@@ -0,0 +1,16 @@
+#ifndef _XCACHE_FILETYPE_H_
+#define _XCACHE_FILETYPE_H_
+
+/* The type of a file dependency. This lives apart from depset.h so that it can
+ * be used by the preloaded libraries, which do not link against GLib.
+ */
+typedef enum {
+    XC_NONE,         /* irrelevant (used as a placeholder) */
+    XC_INPUT,        /* the target reads this file */
+    XC_OUTPUT,       /* the target writes this file */
+    XC_BOTH,         /* the target reads and writes this file */
+    XC_AMBIGUOUS,    /* the target does "something" with this file;
+                        annoying quirk to handle `stat` */
+} filetype_t;
+
+#endif
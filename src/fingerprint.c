@@ -3,12 +3,12 @@
 #include <string.h>
 #include <unistd.h>
 
-fingerprint_t *fingerprint(unsigned int argc, char **argv) {
+fingerprint_t *fingerprint(const char *cwd, unsigned int argc, char **argv) {
     fingerprint_t *f = calloc(1, sizeof(*f));
     if (f == NULL)
         goto fail;
 
-    f->cwd = getcwd(NULL, 0);
+    f->cwd = cwd == NULL ? getcwd(NULL, 0) : strdup(cwd);
     if (f->cwd == NULL)
         goto fail;
 
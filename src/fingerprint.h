@@ -22,8 +22,11 @@ typedef struct {
     char *argv;
 } fingerprint_t;
 
-/* Create a fingerprint for the given invocation. Returns NULL on failure. */
-fingerprint_t *fingerprint(unsigned int argc, char **argv);
+/* Create a fingerprint for the given invocation. If 'cwd' is NULL, the
+ * invocation is assumed to be from our own working directory. Returns NULL on
+ * failure.
+ */
+fingerprint_t *fingerprint(const char *cwd, unsigned int argc, char **argv);
 
 /* Deallocate memory associated with a fingerprint. */
 void fingerprint_destroy(fingerprint_t *fp);
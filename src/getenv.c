@@ -6,15 +6,17 @@
  * wants to, in addition to observing the target's syscalls, observe the
  * target's access to environment variables. In order to do this, Xcache can
  * LD_PRELOAD this library into the target. Note that communication via the
- * 'out' file needs to be cooperative, in the sense that this library and
- * Xcache need to speak the same protocol.
+ * shared ring or the 'out' file needs to be cooperative, in the sense that
+ * this library and Xcache need to speak the same protocol.
  */
 
 #define _GNU_SOURCE
 #include <assert.h>
 #include <fcntl.h>
 #include "message-protocol.h"
+#include "ring.h"
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -81,15 +83,142 @@ static int out_pipe(void) {
     return out_fd;
 }
 
-/* Hooked version of getenv. We lookup environment variables, as expected, but
- * we also pass any accessed environment variables to Xcache, that we are
- * expecting to be tracing us.
+/* The ring shared with Xcache, or NULL if there is none. */
+static ring_t *out_ring(void) {
+    static ring_t *ring = NULL;
+    static bool initialised = false;
+
+    if (!__atomic_load_n(&initialised, __ATOMIC_ACQUIRE)) {
+        ring_t *r = NULL;
+
+        char *xcache_ring = internal_getenv(XCACHE_RING);
+        if (xcache_ring != NULL) {
+            char *end;
+            int memfd = strtol(xcache_ring, &end, 10);
+            if (*end == ',') {
+                int efd = strtol(end + 1, &end, 10);
+                if (*end == '\0' && fcntl(memfd, F_GETFD) != -1 &&
+                        fcntl(efd, F_GETFD) != -1)
+                    r = ring_attach(memfd, efd);
+            }
+        }
+
+        /* If two threads race to get here, the loser's mapping is leaked.
+         * This is harmless and should not happen anyway, for the reasons
+         * given in getenv() below.
+         */
+        ring_t *expected = NULL;
+        if (r != NULL)
+            (void)__atomic_compare_exchange_n(&ring, &expected, r, false,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+        __atomic_store_n(&initialised, true, __ATOMIC_RELEASE);
+    }
+
+    return __atomic_load_n(&ring, __ATOMIC_ACQUIRE);
+}
+
+/* Variables we have already reported, so that a target looking up the same
+ * variable over and over, as many do, sends us each lookup only once. This is
+ * an open addressing hash table that stops taking new entries when it gets
+ * too full, after which further variables are just always reported.
  */
-char *getenv(const char *name) {
-    char *v = internal_getenv(name);
+#define SEEN_SLOTS 256
+static struct {
+    uint64_t hash;
+    char *name;
+    char *value;
+} seen[SEEN_SLOTS];
+static unsigned seen_count;
 
-    if (name == NULL)
-        return v;
+/* Taken while using 'seen'. A thread that finds it taken reports its lookup
+ * regardless, which is always safe.
+ */
+static bool seen_lock;
+
+static uint64_t seen_hash(const char *name, const char *value) {
+    /* FNV-1a */
+    uint64_t h = 14695981039346656037ull;
+    for (const char *p = name; *p != '\0'; p++)
+        h = (h ^ (unsigned char)*p) * 1099511628211ull;
+    h = (h ^ 0xff) * 1099511628211ull;
+    if (value != NULL) {
+        for (const char *p = value; *p != '\0'; p++)
+            h = (h ^ (unsigned char)*p) * 1099511628211ull;
+    }
+    return h;
+}
+
+static bool seen_equal(const char *a, const char *b) {
+    if (a == NULL || b == NULL)
+        return a == b;
+    return strcmp(a, b) == 0;
+}
+
+/* Find the slot for a variable. Returns its index, with '*found' set if it has
+ * already been reported, or -1 if there is no room for it.
+ */
+static int seen_find(uint64_t hash, const char *name, const char *value,
+        bool *found) {
+    for (unsigned i = 0; i < SEEN_SLOTS; i++) {
+        unsigned slot = (hash + i) % SEEN_SLOTS;
+        if (seen[slot].name == NULL) {
+            *found = false;
+            return seen_count < SEEN_SLOTS / 4 * 3 ? (int)slot : -1;
+        }
+        if (seen[slot].hash == hash && strcmp(seen[slot].name, name) == 0 &&
+                seen_equal(seen[slot].value, value)) {
+            *found = true;
+            return (int)slot;
+        }
+    }
+    *found = false;
+    return -1;
+}
+
+/* Remember a variable as reported in the given slot. If we are out of memory,
+ * we simply do not remember it.
+ */
+static void seen_add(int slot, uint64_t hash, const char *name,
+        const char *value) {
+    char *n = strdup(name);
+    char *v = value == NULL ? NULL : strdup(value);
+    if (n == NULL || (value != NULL && v == NULL)) {
+        free(n);
+        free(v);
+        return;
+    }
+    seen[slot].hash = hash;
+    seen[slot].name = n;
+    seen[slot].value = v;
+    seen_count++;
+}
+
+/* Send a report of a lookup to Xcache. Returns 0 on success. */
+static int report(const char *name, const char *value) {
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmissing-field-initializers"
+    /* XXX: For some reason, GCC doesn't seem to notice that we *are*
+     * initialising 'value' here.
+     */
+    message_t message = {
+        .tag = MSG_GETENV,
+        .key = (char*)name,
+        .value = (char*)value,
+    };
+#pragma GCC diagnostic pop
+
+    /* Prefer the shared ring, as writing to it does not need a syscall. If the
+     * message does not fit, or Xcache has fallen behind and the ring is full,
+     * use the pipe.
+     */
+    ring_t *ring = out_ring();
+    if (ring != NULL) {
+        unsigned char buffer[4096];
+        size_t len = pack_message(&message, buffer, sizeof(buffer));
+        if (len > 0 && len <= sizeof(buffer) &&
+                ring_put(ring, buffer, len) == 0)
+            return 0;
+    }
 
     int out_fd = out_pipe();
 
@@ -98,21 +227,36 @@ char *getenv(const char *name) {
      * actually should not happen because it is undefined to call getenv in a
      * multithreaded program.
      */
+    int r = -1;
     if (out_fd != -1 && flock(out_fd, LOCK_EX) == 0) {
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wmissing-field-initializers"
-        /* XXX: For some reason, GCC doesn't seem to notice that we *are*
-         * initialising 'value' here.
-         */
-        message_t message = {
-            .tag = MSG_GETENV,
-            .key = (char*)name,
-            .value = v,
-        };
-#pragma GCC diagnostic pop
-        write_message(out_fd, &message);
+        r = write_message(out_fd, &message);
         flock(out_fd, LOCK_UN);
     }
 
+    return r;
+}
+
+/* Hooked version of getenv. We lookup environment variables, as expected, but
+ * we also pass any accessed environment variables to Xcache, that we are
+ * expecting to be tracing us.
+ */
+char *getenv(const char *name) {
+    char *v = internal_getenv(name);
+
+    if (name == NULL)
+        return v;
+
+    if (__atomic_test_and_set(&seen_lock, __ATOMIC_ACQUIRE)) {
+        (void)report(name, v);
+        return v;
+    }
+
+    uint64_t hash = seen_hash(name, v);
+    bool found;
+    int slot = seen_find(hash, name, v, &found);
+    if (!found && report(name, v) == 0 && slot != -1)
+        seen_add(slot, hash, name, v);
+
+    __atomic_clear(&seen_lock, __ATOMIC_RELEASE);
     return v;
 }
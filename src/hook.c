@@ -1,13 +1,20 @@
+#define _GNU_SOURCE
 #include <assert.h>
 #include "message-protocol.h"
 #include "collection/dict.h"
+#include <errno.h>
+#include <fcntl.h>
 #include "hook.h"
+#include "log.h"
+#include "ring.h"
 #include <poll.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 /* Non-blocking check of whether a file descriptor is ready to read from. */
@@ -23,27 +30,86 @@ static bool ready(int fd) {
     return false;
 }
 
-/* Drain an input file descriptor and replicate its contents into two output
- * descriptors.
- */
-ssize_t tee(int in, int out1, int out2) {
-    assert(in >= 0);
-    assert(out1 >= 0);
-    assert(out2 >= 0);
+/* A stream of the target's output that we capture. */
+typedef struct {
+    int in;    /* Read end of the pipe the target writes to */
+    int file;  /* Temporary file we log the stream to */
+    int out;   /* Our own stream we replicate it on */
 
-    /* This function is only expected to be called on descriptors that are
-     * ready to be read from.
+    /* Pipe we duplicate the data into on its way to 'out', if 'out' is not a
+     * pipe itself. tee(2) only works between pipes.
      */
-    assert(ready(in));
+    int copy[2];
 
-    ssize_t total = 0;
-    ssize_t len;
-    char buffer[1024];
-    do {
-        len = read(in, buffer, sizeof(buffer));
-        assert(len <= (ssize_t)sizeof(buffer));
+    /* Whether to move data with tee and splice. We fall back to copying it
+     * ourselves if these are unsupported on either of the outputs.
+     */
+    bool zero_copy;
+} stream_t;
+
+static void stream_init(stream_t *s, int in, int file, int out) {
+    s->in = in;
+    s->file = file;
+    s->out = out;
+    s->copy[0] = s->copy[1] = -1;
+
+    struct stat st;
+    s->zero_copy = fstat(out, &st) == 0;
+    if (s->zero_copy && !S_ISFIFO(st.st_mode)) {
+        s->zero_copy = pipe2(s->copy, O_CLOEXEC) == 0;
+        if (s->zero_copy)
+            (void)fcntl(s->copy[1], F_SETPIPE_SZ, fcntl(in, F_GETPIPE_SZ));
+    }
+}
+
+static void stream_close(stream_t *s) {
+    if (s->copy[0] != -1) {
+        close(s->copy[0]);
+        close(s->copy[1]);
+    }
+}
+
+/* Move exactly '*len' bytes from a pipe to another descriptor. Returns 0 on
+ * success. On failure, '*len' is left as the number of bytes not moved.
+ */
+static int splice_all(int in, int out, size_t *len) {
+    while (*len > 0) {
+        ssize_t r = splice(in, NULL, out, NULL, *len, SPLICE_F_MOVE);
+        if (r <= 0)
+            return -1;
+        *len -= (size_t)r;
+    }
+    return 0;
+}
+
+/* As for splice_all, but copying through a buffer. Failure to write is
+ * ignored, as in drain_copy, so that the bytes are always consumed from 'in'.
+ * Returns 0 on success.
+ */
+static int copy_all(int in, int out, size_t len) {
+    char buffer[64 * 1024];
+    while (len > 0) {
+        ssize_t r = read(in, buffer,
+            len < sizeof(buffer) ? len : sizeof(buffer));
+        if (r <= 0)
+            return -1;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-result"
+        (void)write(out, buffer, r);
+#pragma GCC diagnostic pop
+        len -= (size_t)r;
+    }
+    return 0;
+}
 
-        if (len == -1)
+/* Drain a stream with read and write, for outputs splice does not support,
+ * like a file opened with O_APPEND.
+ */
+static void drain_copy(stream_t *s) {
+    char buffer[64 * 1024];
+    do {
+        ssize_t len = read(s->in, buffer, sizeof(buffer));
+        if (len <= 0)
             break;
 
         /* We ignore the number of bytes written because there's not much we can
@@ -51,101 +117,235 @@ ssize_t tee(int in, int out1, int out2) {
          */
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-result"
-        (void)write(out1, buffer, len);
-        (void)write(out2, buffer, len);
+        (void)write(s->file, buffer, len);
+        (void)write(s->out, buffer, len);
 #pragma GCC diagnostic pop
 
-        total += len;
-        
         /* Loop to make sure we completely drain the input. */
-    } while (len == sizeof(buffer) && ready(in));
+    } while (ready(s->in));
+}
+
+/* Drain the data currently in a stream's pipe and replicate it into the
+ * temporary file and our own stream. We tee it into our stream (or the pipe
+ * leading to it) and then splice the same bytes into the file, so the data
+ * never passes through userspace.
+ */
+static void drain(stream_t *s) {
+    while (s->zero_copy) {
+        /* Only ever ask for what is there, so that we do not block waiting for
+         * more.
+         */
+        int available;
+        if (ioctl(s->in, FIONREAD, &available) != 0 || available <= 0)
+            return;
+
+        int dup = s->copy[1] == -1 ? s->out : s->copy[1];
+        ssize_t len = tee(s->in, dup, (size_t)available, 0);
+        if (len <= 0) {
+            s->zero_copy = false;
+            break;
+        }
+
+        size_t left = (size_t)len;
+        if (splice_all(s->in, s->file, &left) != 0) {
+            /* We have already replicated this data on our own stream, so the
+             * rest of it must go only to the file. Left in the pipe, it would
+             * be written to our stream a second time by drain_copy.
+             */
+            DEBUG("failed to splice output into temporary file\n");
+            s->zero_copy = false;
+            if (copy_all(s->in, s->file, left) != 0)
+                DEBUG("failed to copy output into temporary file\n");
+        }
+
+        left = (size_t)len;
+        if (s->copy[1] != -1 && splice_all(s->copy[0], s->out, &left) != 0) {
+            /* Flush whatever is stuck in our pipe the slow way. */
+            DEBUG("failed to splice output, falling back to copying it\n");
+            s->zero_copy = false;
+            stream_t flush = { .in = s->copy[0], .file = -1, .out = s->out };
+            if (ready(flush.in))
+                drain_copy(&flush);
+            break;
+        }
+    }
 
-    return total;
+    if (ready(s->in))
+        drain_copy(s);
+}
+
+/* Act on a message from the tracee. Takes ownership of the message. Returns 0
+ * on success or -1 if we can no longer track the tracee.
+ */
+static int receive(target_t *target, message_t *message) {
+    if (message->tag == MSG_FILE) {
+        /* A file access reported by libinterpose. */
+        if (target->interpose == NULL ||
+                target->interpose(message->path, message->filetype,
+                    message->mtime, message->directory) != 0)
+            __atomic_store_n(&target->bailout, true, __ATOMIC_RELEASE);
+        free(message->path);
+        free(message);
+        return 0;
+    }
+    if (message->tag == MSG_BAILOUT) {
+        DEBUG("libinterpose cannot follow the target: %s\n",
+            message->reason == NULL ? "unknown reason" : message->reason);
+        __atomic_store_n(&target->bailout, true, __ATOMIC_RELEASE);
+        free(message->reason);
+        free(message);
+        return 0;
+    }
+    if (message->tag != MSG_GETENV) {
+        /* Received a call we don't handle. */
+        free(message);
+        return -1;
+    }
+
+    /* FIXME: cope with NULL key below */
+
+    /* The target may have changed its environment before this lookup, as GCC
+     * does to pass settings to its subprocesses. What matters for a later
+     * cache lookup is the value the target was started with, which is our own.
+     */
+    free(message->value);
+    const char *initial = getenv(message->key);
+    message->value = initial == NULL ? NULL : strdup(initial);
+    if (initial != NULL && message->value == NULL) {
+        free(message->key);
+        free(message);
+        return -1;
+    }
+
+    if (dict_contains(&target->env, message->key)) {
+        free(message->key);
+        free(message->value);
+    } else {
+        if (dict_add(&target->env, message->key, message->value) != 0) {
+            free(message->key);
+            free(message->value);
+            free(message);
+            return -1;
+        }
+    }
+    free(message);
+    return 0;
+}
+
+/* Handle every message waiting in the tracee's ring. Returns 0 on success. */
+static int drain_ring(target_t *target) {
+    if (target->ring == NULL)
+        return 0;
+
+    int cb(const void *data, size_t len) {
+        message_t *message = unpack_message(data, len);
+        if (message == NULL) {
+            DEBUG("malformed message in ring\n");
+            return -1;
+        }
+        return receive(target, message);
+    }
+    return ring_drain(target->ring, cb);
 }
 
 /* Monitor (and log) all the relevant file descriptor operations performed by a
  * tracee. This currently covers:
  *  - stdout logging (ala tee)
  *  - stderr logging similarly
- *  - processing messages from the message pipe (predominantly getenv calls)
+ *  - processing messages from the message ring and pipe (predominantly getenv
+ *    calls)
  * This function also listens for bytes on the signal pipe and takes this as a
  * command to clean up and exit.
  */
 static void hook(target_t *target) {
+    stream_t out, err;
+    stream_init(&out, target->stdout_pipe[0], target->outfd, STDOUT_FILENO);
+    stream_init(&err, target->stderr_pipe[0], target->errfd, STDERR_FILENO);
+
+    int ring_fd = target->ring == NULL ? -1 : ring_eventfd(target->ring);
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1)
+        goto done;
+    int fds[] = { target->stdout_pipe[0], target->stderr_pipe[0],
+        target->msg_pipe[0], target->sig_pipe[0], ring_fd };
+    for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+        if (fds[i] == -1)
+            continue;
+        struct epoll_event ev = {
+            .events = EPOLLIN,
+            .data.fd = fds[i],
+        };
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &ev) != 0)
+            goto done;
+    }
+
     while (true) {
-        /* Setup a mask of all the file descriptors we need to monitor. */
-        fd_set fs;
-        FD_ZERO(&fs);
-        FD_SET(target->stdout_pipe[0], &fs);
-        int nfds = target->stdout_pipe[0];
-        FD_SET(target->stderr_pipe[0], &fs);
-        if (target->stderr_pipe[0] > nfds)
-            nfds = target->stderr_pipe[0];
-        FD_SET(target->msg_pipe[0], &fs);
-        if (target->msg_pipe[0] > nfds)
-            nfds = target->msg_pipe[0];
-        FD_SET(target->sig_pipe[0], &fs);
-        if (target->sig_pipe[0] > nfds)
-            nfds = target->sig_pipe[0];
-        nfds++;
-
-        int selected = select(nfds, &fs, NULL, NULL, NULL);
-        if (selected == -1) {
-            /* Select failed. */
-            return;
+        /* Producers only signal the eventfd when we have told them we are
+         * waiting, so make sure the ring is empty before doing so.
+         */
+        if (target->ring != NULL && !ring_sleep(target->ring)) {
+            if (drain_ring(target) != 0)
+                goto done;
+            continue;
+        }
+
+        struct epoll_event events[sizeof(fds) / sizeof(fds[0])];
+        int n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]),
+            -1);
+        if (target->ring != NULL)
+            ring_wake(target->ring);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            goto done;
+        }
+
+        bool stdout_ready = false, stderr_ready = false, msg_ready = false,
+             sig_ready = false;
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd == target->stdout_pipe[0])
+                stdout_ready = true;
+            else if (events[i].data.fd == target->stderr_pipe[0])
+                stderr_ready = true;
+            else if (events[i].data.fd == target->msg_pipe[0])
+                msg_ready = true;
+            else if (events[i].data.fd == target->sig_pipe[0])
+                sig_ready = true;
         }
 
         /* Log stdout data to our temporary file and replicate it on the actual
          * stdout.
          */
-        if (FD_ISSET(target->stdout_pipe[0], &fs)) {
-            assert(ready(target->stdout_pipe[0]) &&
-                "stdout not ready after claiming to be; someone else reading it?");
-            (void)tee(target->stdout_pipe[0], target->outfd, STDOUT_FILENO);
-        }
+        if (stdout_ready)
+            drain(&out);
 
         /* As above for stderr. */
-        if (FD_ISSET(target->stderr_pipe[0], &fs)) {
-            assert(ready(target->stderr_pipe[0]) &&
-                "stderr not ready after claiming to be; someone else reading it?");
-            (void)tee(target->stderr_pipe[0], target->errfd, STDERR_FILENO);
-        }
+        if (stderr_ready)
+            drain(&err);
 
-        /* Handle any messages we received from the tracee. */
-        if (FD_ISSET(target->msg_pipe[0], &fs)) {
+        /* Handle any messages we received from the tracee. Messages that did
+         * not fit in the ring come through the pipe instead, so there is no
+         * ordering between the two, but none is needed.
+         */
+        if (drain_ring(target) != 0)
+            goto done;
+        if (msg_ready) {
             assert(ready(target->msg_pipe[0]) &&
                 "message pipe not ready after claiming to be; someone else reading it?");
             do {
                 message_t *message = read_message(target->msg_pipe[0]);
                 if (message == NULL) {
                     /* Failed to read a message. OOM? */
-                    return;
+                    goto done;
                 }
-                if (message->tag != MSG_GETENV) {
-                    /* Received a call we don't handle. */
-                    free(message);
-                    return;
-                }
-
-                /* FIXME: cope with NULL key or value below */
-
-                if (dict_contains(&target->env, message->key)) {
-                    free(message->key);
-                    free(message->value);
-                } else {
-                    if (dict_add(&target->env, message->key, message->value) != 0) {
-                        free(message->key);
-                        free(message->value);
-                        free(message);
-                        return;
-                    }
-                }
-                free(message);
+                if (receive(target, message) != 0)
+                    goto done;
             } while (ready(target->msg_pipe[0]));
         }
 
         /* Check whether the main thread has notified us to exit. */
-        if (FD_ISSET(target->sig_pipe[0], &fs)) {
+        if (sig_ready) {
             /* We don't actually care about the byte that's in the signal pipe,
              * but weird kernel buffer settings could mean the main thread is
              * actually blocked on its write to the pipe.
@@ -156,17 +356,34 @@ static void hook(target_t *target) {
             (void)read(target->sig_pipe[0], &ignored, 1);
 #pragma GCC diagnostic pop
 
-            /* XXX: I don't *think* an fd flush is required here, but should
-             * double check this.
+            /* The target has exited, but may have left output in the pipes
+             * that we have not yet been woken for.
+             */
+            drain(&out);
+            drain(&err);
+
+            /* Likewise for messages in the ring. If anything is still
+             * outstanding after that, a process died while writing to the ring
+             * and we may have lost what it was telling us.
              */
+            if (drain_ring(target) != 0)
+                goto done;
+            if (target->ring != NULL && !ring_empty(target->ring)) {
+                DEBUG("incomplete message left in ring\n");
+                __atomic_store_n(&target->bailout, true, __ATOMIC_RELEASE);
+            }
 
             /* Clean exit. */
-            return;
+            goto done;
         }
 
     }
 
-    assert(!"unreachable");
+done:
+    if (epfd != -1)
+        close(epfd);
+    stream_close(&err);
+    stream_close(&out);
 }
 
 int hook_create(target_t *target) {
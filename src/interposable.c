@@ -0,0 +1,128 @@
+#define _GNU_SOURCE
+#include <elf.h>
+#include <fcntl.h>
+#include "interposable.h"
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+/* Limit on the number of #! interpreters we follow. The kernel has a similar
+ * limit.
+ */
+#define MAX_DEPTH 4
+
+/* Whether an ELF file has a PT_INTERP header, naming a dynamic loader. */
+static bool has_interp(int fd, unsigned char class) {
+#define SCAN(Ehdr, Phdr) \
+    do { \
+        Ehdr eh; \
+        if (pread(fd, &eh, sizeof(eh), 0) != (ssize_t)sizeof(eh)) \
+            return true; \
+        for (unsigned i = 0; i < eh.e_phnum; i++) { \
+            Phdr ph; \
+            off_t off = (off_t)(eh.e_phoff + (off_t)i * eh.e_phentsize); \
+            if (pread(fd, &ph, sizeof(ph), off) != (ssize_t)sizeof(ph)) \
+                return true; \
+            if (ph.p_type == PT_INTERP) \
+                return true; \
+        } \
+        return false; \
+    } while (0)
+
+    if (class == ELFCLASS64)
+        SCAN(Elf64_Ehdr, Elf64_Phdr);
+    if (class == ELFCLASS32)
+        SCAN(Elf32_Ehdr, Elf32_Phdr);
+    return true;
+
+#undef SCAN
+}
+
+static bool check(const char *path, unsigned depth) {
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return true;
+
+    /* The loader runs setuid and setgid programs in secure mode, where it
+     * ignores preloads from outside the system library directories.
+     */
+    if (st.st_mode & (S_ISUID|S_ISGID))
+        return false;
+
+    int fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd == -1)
+        return true;
+
+    char header[PATH_MAX + 2];
+    ssize_t len = read(fd, header, sizeof(header) - 1);
+    if (len < 0) {
+        close(fd);
+        return true;
+    }
+    header[len] = '\0';
+
+    bool result = true;
+    if (len >= 2 && header[0] == '#' && header[1] == '!') {
+        /* A script; what matters is its interpreter. */
+        char *interp = header + 2;
+        interp += strspn(interp, " \t");
+        interp[strcspn(interp, " \t\n")] = '\0';
+        if (depth >= MAX_DEPTH) {
+            result = false;
+        } else if (*interp != '\0') {
+            result = check(interp, depth + 1);
+        }
+    } else if (len >= SELFMAG && memcmp(header, ELFMAG, SELFMAG) == 0 &&
+            len > EI_CLASS) {
+        result = has_interp(fd, (unsigned char)header[EI_CLASS]);
+    }
+
+    close(fd);
+    return result;
+}
+
+bool interposable(const char *path) {
+    return check(path, 0);
+}
+
+bool search_path(const char *file,
+        bool (*visit)(const char *candidate, void *data), void *data) {
+    if (strchr(file, '/') != NULL)
+        return visit(file, data);
+
+    const char *path = getenv("PATH");
+    if (path == NULL)
+        path = "/bin:/usr/bin";
+
+    while (true) {
+        size_t len = strcspn(path, ":");
+        char candidate[PATH_MAX];
+        int r = snprintf(candidate, sizeof(candidate), "%.*s%s%s", (int)len,
+            path, len == 0 ? "" : "/", file);
+        if (r > 0 && (size_t)r < sizeof(candidate) && visit(candidate, data))
+            return true;
+        if (path[len] == '\0')
+            break;
+        path += len + 1;
+    }
+
+    return false;
+}
+
+static bool check_candidate(const char *candidate, void *data) {
+    if (access(candidate, X_OK) != 0)
+        return false;
+    *(bool*)data = interposable(candidate);
+    return true;
+}
+
+bool interposable_search(const char *file) {
+    bool result = true;
+    (void)search_path(file, check_candidate, &result);
+    return result;
+}
@@ -0,0 +1,32 @@
+/* Checks for whether libinterpose can observe a program. This is shared
+ * between xcache, to choose a tracing backend, and libinterpose, to notice
+ * when a traced program is about to exec something it cannot follow.
+ */
+
+#ifndef _XCACHE_INTERPOSABLE_H_
+#define _XCACHE_INTERPOSABLE_H_
+
+#include <stdbool.h>
+
+/* Determine whether the dynamic loader will honour LD_PRELOAD when 'path' is
+ * exec'ed. This is false for statically linked executables and for setuid or
+ * setgid executables, where the loader is either absent or ignores our
+ * library. Scripts are judged by their interpreter. 'path' is interpreted as
+ * execve would. If in doubt, for example because the file does not exist, this
+ * returns true, as the exec will not run anything we could miss.
+ */
+bool interposable(const char *path);
+
+/* Walk the candidates execvp would try for 'file', calling 'visit' for each
+ * until it returns true. If 'file' contains a slash, it is the only candidate.
+ * Returns true if 'visit' stopped the walk.
+ */
+bool search_path(const char *file,
+    bool (*visit)(const char *candidate, void *data), void *data);
+
+/* As for interposable, but resolving 'file' through $PATH as execvp would if
+ * it contains no slash.
+ */
+bool interposable_search(const char *file);
+
+#endif
@@ -0,0 +1,1012 @@
+/* A library for observing the file accesses of a target without ptrace. Like
+ * getenv.c, this is *NOT* compiled into xcache; it is compiled into a separate
+ * library that xcache LD_PRELOADs into the target when asked to interpose.
+ *
+ * Each wrapper below reports the access it is about to make, or has just made,
+ * to xcache through the message pipe and then defers to the next definition of
+ * the symbol, normally libc's. Inputs are measured here, at the time of
+ * access, so xcache does not race the target when it processes the reports
+ * later. Operations the ptrace backend bails out on, and execs of programs
+ * this library will not be loaded into, are reported as MSG_BAILOUT.
+ *
+ * Unlike ptrace, we cannot see syscalls made without going through these
+ * wrappers, like those made internally by libc or the dynamic loader's search
+ * for libraries. We report the libraries the loader ended up using when we
+ * are loaded and after each dlopen.
+ */
+
+#define _GNU_SOURCE
+#include "classify.h"
+#include "constants.h"
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include "filetype.h"
+#include "interposable.h"
+#include <limits.h>
+#include <link.h>
+#include "message-protocol.h"
+#include <poll.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/auxv.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <utime.h>
+
+/* Look up the definition of a symbol that we are shadowing. */
+#define NEXT(fn) ({ \
+        static __typeof__(fn) *next_; \
+        if (next_ == NULL) \
+            next_ = (__typeof__(fn)*)dlsym(RTLD_NEXT, #fn); \
+        next_; \
+    })
+
+/* Entry points that newer versions of glibc no longer declare, but that
+ * programs built against older versions still call.
+ */
+int __xstat(int ver, const char *path, struct stat *buf);
+int __xstat64(int ver, const char *path, struct stat64 *buf);
+int __lxstat(int ver, const char *path, struct stat *buf);
+int __lxstat64(int ver, const char *path, struct stat64 *buf);
+int __fxstatat(int ver, int dirfd, const char *path, struct stat *buf,
+    int flags);
+int __fxstatat64(int ver, int dirfd, const char *path, struct stat64 *buf,
+    int flags);
+
+/* Non-zero while we are doing our own work, so that the wrappers pass calls
+ * we make straight through.
+ */
+static __thread unsigned busy;
+
+static int out_pipe(void) {
+    static bool initialised = false;
+    static int out_fd = -1;
+
+    if (!initialised) {
+        initialised = true;
+
+        /* As in getenv.c, look this up directly rather than through a getenv
+         * that may itself be hooked.
+         */
+        const char *xcache_pipe = NULL;
+        size_t len = strlen(XCACHE_PIPE);
+        for (char **p = environ; p != NULL && *p != NULL; p++) {
+            if (strncmp(*p, XCACHE_PIPE, len) == 0 && (*p)[len] == '=') {
+                xcache_pipe = *p + len + 1;
+                break;
+            }
+        }
+        if (xcache_pipe == NULL)
+            return -1;
+
+        char *end;
+        int fd = strtol(xcache_pipe, &end, 10);
+        if (*xcache_pipe == '\0' || *end != '\0')
+            return -1;
+
+        if (fcntl(fd, F_GETFD) == -1)
+            return -1;
+
+        out_fd = fd;
+    }
+
+    return out_fd;
+}
+
+/* Write a packed message in one go. Returns 0 on success. */
+static int send_packed(int out, const unsigned char *buffer, size_t len) {
+    while (true) {
+        ssize_t r = write(out, buffer, len);
+        if (r == (ssize_t)len)
+            return 0;
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r == -1 && errno == EAGAIN) {
+            /* Someone made the pipe non-blocking. Wait for room. */
+            struct pollfd fds[] = { { .fd = out, .events = POLLOUT } };
+            if (poll(fds, 1, -1) >= 0 || errno == EINTR)
+                continue;
+        }
+        /* A write of at most PIPE_BUF bytes to a pipe is never partial, so
+         * this is a real failure.
+         */
+        return -1;
+    }
+}
+
+/* Send a message to xcache. Messages are written with a single write of at
+ * most PIPE_BUF bytes, so the kernel does not interleave them with those of
+ * other processes sharing the pipe. If one cannot be sent, what xcache hears
+ * from us is incomplete, so we try to tell it to bail out instead.
+ */
+static void emit(const message_t *message) {
+    int out = out_pipe();
+    if (out == -1)
+        return;
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmissing-field-initializers"
+    message_t bailout = {
+        .tag = MSG_BAILOUT,
+    };
+#pragma GCC diagnostic pop
+
+    unsigned char buffer[PIPE_BUF];
+    size_t len = pack_message(message, buffer, sizeof(buffer));
+    if (len == 0 || len > sizeof(buffer)) {
+        bailout.reason = "report too large for the message pipe";
+    } else if (send_packed(out, buffer, len) != 0) {
+        bailout.reason = "failed to send a report";
+    } else {
+        return;
+    }
+
+    len = pack_message(&bailout, buffer, sizeof(buffer));
+    (void)send_packed(out, buffer, len);
+}
+
+/* Tell xcache it cannot trust what we report for this target. */
+static void bailout(const char *reason) {
+    if (busy > 0)
+        return;
+    busy++;
+    int saved = errno;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmissing-field-initializers"
+    message_t message = {
+        .tag = MSG_BAILOUT,
+        .reason = (char*)reason,
+    };
+#pragma GCC diagnostic pop
+    emit(&message);
+    errno = saved;
+    busy--;
+}
+
+/* Report an access to 'path', relative to 'dirfd', to xcache. */
+static void report(int dirfd, const char *path, filetype_t type) {
+    if (busy > 0 || path == NULL || *path == '\0')
+        return;
+    busy++;
+    int saved = errno;
+
+    char absolute[PATH_MAX];
+    char base[PATH_MAX];
+    bool ok = true;
+    if (path[0] == '/') {
+        ok = strlen(path) < sizeof(absolute);
+        if (ok)
+            strcpy(absolute, path);
+    } else {
+        if (dirfd == AT_FDCWD) {
+            ok = getcwd(base, sizeof(base)) != NULL;
+        } else {
+            char fdpath[sizeof("/proc/self/fd/") + 20];
+            snprintf(fdpath, sizeof(fdpath), "/proc/self/fd/%d", dirfd);
+            ssize_t len = readlink(fdpath, base, sizeof(base) - 1);
+            ok = len > 0;
+            if (ok)
+                base[len] = '\0';
+        }
+        if (ok) {
+            int len = snprintf(absolute, sizeof(absolute), "%s/%s", base,
+                path);
+            ok = len > 0 && (size_t)len < sizeof(absolute);
+        }
+    }
+
+    if (!ok) {
+        busy--;
+        bailout("failed to resolve an accessed path");
+        errno = saved;
+        return;
+    }
+
+    struct stat st;
+    bool exists = stat(absolute, &st) == 0;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmissing-field-initializers"
+    message_t message = {
+        .tag = MSG_FILE,
+        .path = absolute,
+        .filetype = type,
+        .mtime = exists ? st.st_mtime : MISSING,
+        .directory = exists && S_ISDIR(st.st_mode),
+    };
+#pragma GCC diagnostic pop
+    emit(&message);
+
+    errno = saved;
+    busy--;
+}
+
+/* Report the shared objects currently loaded into this process. */
+static int report_object(struct dl_phdr_info *info,
+        size_t size __attribute__((unused)),
+        void *data __attribute__((unused))) {
+    if (info->dlpi_name != NULL && info->dlpi_name[0] == '/')
+        report(AT_FDCWD, info->dlpi_name, XC_INPUT);
+    return 0;
+}
+
+static void report_objects(void) {
+    dl_iterate_phdr(report_object, NULL);
+}
+
+__attribute__((constructor))
+static void init(void) {
+    /* The program we are running in, as named to execve. */
+    const char *execfn = (const char*)getauxval(AT_EXECFN);
+    if (execfn != NULL)
+        report(AT_FDCWD, execfn, XC_INPUT);
+
+    /* Files the loader consults before we are running. */
+    report(AT_FDCWD, "/etc/ld.so.preload", XC_INPUT);
+    report(AT_FDCWD, "/etc/ld.so.cache", XC_INPUT);
+
+    report_objects();
+}
+
+/******************************************************************************
+ * Opening files                                                              *
+ ******************************************************************************/
+
+/* Whether an open creates an unnamed temporary file, which is not a
+ * dependency.
+ */
+static bool is_tmpfile(int flags) {
+#ifdef O_TMPFILE
+    return (flags & O_TMPFILE) == O_TMPFILE;
+#else
+    (void)flags;
+    return false;
+#endif
+}
+
+static void before_open(int dirfd, const char *path, int flags) {
+    if (is_tmpfile(flags))
+        return;
+    filetype_t type = classify_open_entry(flags);
+    if (type != XC_NONE)
+        report(dirfd, path, type);
+}
+
+static void after_open(int dirfd, const char *path, int flags, bool success) {
+    if (!success || is_tmpfile(flags))
+        return;
+    filetype_t type = classify_open_exit(flags);
+    if (type != XC_NONE)
+        report(dirfd, path, type);
+}
+
+/* Retrieve the mode argument of an open call, if it has one. */
+#define OPEN_MODE(flags) ({ \
+        mode_t mode_ = 0; \
+        if ((flags) & O_CREAT || is_tmpfile(flags)) { \
+            va_list ap; \
+            va_start(ap, flags); \
+            mode_ = va_arg(ap, mode_t); \
+            va_end(ap); \
+        } \
+        mode_; \
+    })
+
+int open(const char *path, int flags, ...) {
+    mode_t mode = OPEN_MODE(flags);
+    before_open(AT_FDCWD, path, flags);
+    int fd = NEXT(open)(path, flags, mode);
+    after_open(AT_FDCWD, path, flags, fd >= 0);
+    return fd;
+}
+
+int open64(const char *path, int flags, ...) {
+    mode_t mode = OPEN_MODE(flags);
+    before_open(AT_FDCWD, path, flags);
+    int fd = NEXT(open64)(path, flags, mode);
+    after_open(AT_FDCWD, path, flags, fd >= 0);
+    return fd;
+}
+
+int openat(int dirfd, const char *path, int flags, ...) {
+    mode_t mode = OPEN_MODE(flags);
+    before_open(dirfd, path, flags);
+    int fd = NEXT(openat)(dirfd, path, flags, mode);
+    after_open(dirfd, path, flags, fd >= 0);
+    return fd;
+}
+
+int openat64(int dirfd, const char *path, int flags, ...) {
+    mode_t mode = OPEN_MODE(flags);
+    before_open(dirfd, path, flags);
+    int fd = NEXT(openat64)(dirfd, path, flags, mode);
+    after_open(dirfd, path, flags, fd >= 0);
+    return fd;
+}
+
+int creat(const char *path, mode_t mode) {
+    int flags = O_CREAT|O_WRONLY|O_TRUNC;
+    before_open(AT_FDCWD, path, flags);
+    int fd = NEXT(creat)(path, mode);
+    after_open(AT_FDCWD, path, flags, fd >= 0);
+    return fd;
+}
+
+int creat64(const char *path, mode_t mode) {
+    int flags = O_CREAT|O_WRONLY|O_TRUNC;
+    before_open(AT_FDCWD, path, flags);
+    int fd = NEXT(creat64)(path, mode);
+    after_open(AT_FDCWD, path, flags, fd >= 0);
+    return fd;
+}
+
+/* libc creates temporary files with its own internal open, which we do not
+ * see. Without these, a temporary file would first appear to us when another
+ * process reads it, making it look like an input.
+ */
+
+int mkstemp(char *template) {
+    int fd = NEXT(mkstemp)(template);
+    if (fd >= 0)
+        report(AT_FDCWD, template, XC_OUTPUT);
+    return fd;
+}
+
+int mkostemp(char *template, int flags) {
+    int fd = NEXT(mkostemp)(template, flags);
+    if (fd >= 0)
+        report(AT_FDCWD, template, XC_OUTPUT);
+    return fd;
+}
+
+int mkstemps(char *template, int suffixlen) {
+    int fd = NEXT(mkstemps)(template, suffixlen);
+    if (fd >= 0)
+        report(AT_FDCWD, template, XC_OUTPUT);
+    return fd;
+}
+
+int mkostemps(char *template, int suffixlen, int flags) {
+    int fd = NEXT(mkostemps)(template, suffixlen, flags);
+    if (fd >= 0)
+        report(AT_FDCWD, template, XC_OUTPUT);
+    return fd;
+}
+
+char *mkdtemp(char *template) {
+    char *dir = NEXT(mkdtemp)(template);
+    if (dir != NULL)
+        report(AT_FDCWD, dir, XC_OUTPUT);
+    return dir;
+}
+
+/* Translate an fopen mode string into the equivalent open flags. */
+static int fopen_flags(const char *mode) {
+    int flags;
+    switch (mode[0]) {
+        case 'w':
+            flags = O_CREAT|O_TRUNC;
+            break;
+        case 'a':
+            flags = O_CREAT|O_APPEND;
+            break;
+        default:
+            flags = 0;
+    }
+    bool plus = strchr(mode, '+') != NULL;
+    if (mode[0] == 'r')
+        flags |= plus ? O_RDWR : O_RDONLY;
+    else
+        flags |= plus ? O_RDWR : O_WRONLY;
+    if (strchr(mode, 'x') != NULL)
+        flags |= O_EXCL;
+    return flags;
+}
+
+FILE *fopen(const char *path, const char *mode) {
+    int flags = fopen_flags(mode);
+    before_open(AT_FDCWD, path, flags);
+    FILE *f = NEXT(fopen)(path, mode);
+    after_open(AT_FDCWD, path, flags, f != NULL);
+    return f;
+}
+
+FILE *fopen64(const char *path, const char *mode) {
+    int flags = fopen_flags(mode);
+    before_open(AT_FDCWD, path, flags);
+    FILE *f = NEXT(fopen64)(path, mode);
+    after_open(AT_FDCWD, path, flags, f != NULL);
+    return f;
+}
+
+FILE *freopen(const char *path, const char *mode, FILE *stream) {
+    int flags = fopen_flags(mode);
+    before_open(AT_FDCWD, path, flags);
+    FILE *f = NEXT(freopen)(path, mode, stream);
+    after_open(AT_FDCWD, path, flags, f != NULL);
+    return f;
+}
+
+FILE *freopen64(const char *path, const char *mode, FILE *stream) {
+    int flags = fopen_flags(mode);
+    before_open(AT_FDCWD, path, flags);
+    FILE *f = NEXT(freopen64)(path, mode, stream);
+    after_open(AT_FDCWD, path, flags, f != NULL);
+    return f;
+}
+
+DIR *opendir(const char *path) {
+    report(AT_FDCWD, path, XC_INPUT);
+    return NEXT(opendir)(path);
+}
+
+/******************************************************************************
+ * Examining files                                                            *
+ ******************************************************************************/
+
+int stat(const char *path, struct stat *buf) {
+    report(AT_FDCWD, path, XC_AMBIGUOUS);
+    return NEXT(stat)(path, buf);
+}
+
+int stat64(const char *path, struct stat64 *buf) {
+    report(AT_FDCWD, path, XC_AMBIGUOUS);
+    return NEXT(stat64)(path, buf);
+}
+
+int lstat(const char *path, struct stat *buf) {
+    report(AT_FDCWD, path, XC_AMBIGUOUS);
+    return NEXT(lstat)(path, buf);
+}
+
+int lstat64(const char *path, struct stat64 *buf) {
+    report(AT_FDCWD, path, XC_AMBIGUOUS);
+    return NEXT(lstat64)(path, buf);
+}
+
+int fstatat(int dirfd, const char *path, struct stat *buf, int flags) {
+    report(dirfd, path, XC_AMBIGUOUS);
+    return NEXT(fstatat)(dirfd, path, buf, flags);
+}
+
+int fstatat64(int dirfd, const char *path, struct stat64 *buf, int flags) {
+    report(dirfd, path, XC_AMBIGUOUS);
+    return NEXT(fstatat64)(dirfd, path, buf, flags);
+}
+
+int statx(int dirfd, const char *path, int flags, unsigned mask,
+        struct statx *buf) {
+    report(dirfd, path, XC_AMBIGUOUS);
+    return NEXT(statx)(dirfd, path, flags, mask, buf);
+}
+
+/* The older stat entry points may not exist in the libc we are running
+ * against, so we check before calling them.
+ */
+#define CALL_OLD(fn, ...) ({ \
+        __typeof__(fn) *next = NEXT(fn); \
+        int r_ = -1; \
+        if (next == NULL) \
+            errno = ENOSYS; \
+        else \
+            r_ = next(__VA_ARGS__); \
+        r_; \
+    })
+
+int __xstat(int ver, const char *path, struct stat *buf) {
+    report(AT_FDCWD, path, XC_AMBIGUOUS);
+    return CALL_OLD(__xstat, ver, path, buf);
+}
+
+int __xstat64(int ver, const char *path, struct stat64 *buf) {
+    report(AT_FDCWD, path, XC_AMBIGUOUS);
+    return CALL_OLD(__xstat64, ver, path, buf);
+}
+
+int __lxstat(int ver, const char *path, struct stat *buf) {
+    report(AT_FDCWD, path, XC_AMBIGUOUS);
+    return CALL_OLD(__lxstat, ver, path, buf);
+}
+
+int __lxstat64(int ver, const char *path, struct stat64 *buf) {
+    report(AT_FDCWD, path, XC_AMBIGUOUS);
+    return CALL_OLD(__lxstat64, ver, path, buf);
+}
+
+int __fxstatat(int ver, int dirfd, const char *path, struct stat *buf,
+        int flags) {
+    report(dirfd, path, XC_AMBIGUOUS);
+    return CALL_OLD(__fxstatat, ver, dirfd, path, buf, flags);
+}
+
+int __fxstatat64(int ver, int dirfd, const char *path, struct stat64 *buf,
+        int flags) {
+    report(dirfd, path, XC_AMBIGUOUS);
+    return CALL_OLD(__fxstatat64, ver, dirfd, path, buf, flags);
+}
+
+int access(const char *path, int mode) {
+    report(AT_FDCWD, path, XC_INPUT);
+    return NEXT(access)(path, mode);
+}
+
+int faccessat(int dirfd, const char *path, int mode, int flags) {
+    report(dirfd, path, XC_INPUT);
+    return NEXT(faccessat)(dirfd, path, mode, flags);
+}
+
+ssize_t readlink(const char *path, char *buf, size_t size) {
+    report(AT_FDCWD, path, XC_INPUT);
+    return NEXT(readlink)(path, buf, size);
+}
+
+ssize_t readlinkat(int dirfd, const char *path, char *buf, size_t size) {
+    report(dirfd, path, XC_INPUT);
+    return NEXT(readlinkat)(dirfd, path, buf, size);
+}
+
+/******************************************************************************
+ * Modifying files                                                            *
+ ******************************************************************************/
+
+/* Paths that are about to be removed need to be measured beforehand. As for
+ * the ptrace backend, only their existence matters.
+ */
+
+int unlink(const char *path) {
+    report(AT_FDCWD, path, XC_AMBIGUOUS);
+    return NEXT(unlink)(path);
+}
+
+int unlinkat(int dirfd, const char *path, int flags) {
+    report(dirfd, path, XC_AMBIGUOUS);
+    return NEXT(unlinkat)(dirfd, path, flags);
+}
+
+int rmdir(const char *path) {
+    report(AT_FDCWD, path, XC_AMBIGUOUS);
+    return NEXT(rmdir)(path);
+}
+
+int mkdir(const char *path, mode_t mode) {
+    int r = NEXT(mkdir)(path, mode);
+    if (r == 0)
+        report(AT_FDCWD, path, XC_OUTPUT);
+    return r;
+}
+
+int mkdirat(int dirfd, const char *path, mode_t mode) {
+    int r = NEXT(mkdirat)(dirfd, path, mode);
+    if (r == 0)
+        report(dirfd, path, XC_OUTPUT);
+    return r;
+}
+
+int chmod(const char *path, mode_t mode) {
+    int r = NEXT(chmod)(path, mode);
+    if (r == 0)
+        report(AT_FDCWD, path, XC_OUTPUT);
+    return r;
+}
+
+int fchmodat(int dirfd, const char *path, mode_t mode, int flags) {
+    int r = NEXT(fchmodat)(dirfd, path, mode, flags);
+    if (r == 0)
+        report(dirfd, path, XC_OUTPUT);
+    return r;
+}
+
+/* Paths that are created or replaced are only outputs if this succeeded.
+ * Otherwise they may be unrelated files that already existed.
+ */
+
+int rename(const char *old, const char *new) {
+    report(AT_FDCWD, old, XC_AMBIGUOUS);
+    int r = NEXT(rename)(old, new);
+    if (r == 0)
+        report(AT_FDCWD, new, XC_OUTPUT);
+    return r;
+}
+
+int renameat(int olddirfd, const char *old, int newdirfd, const char *new) {
+    report(olddirfd, old, XC_AMBIGUOUS);
+    int r = NEXT(renameat)(olddirfd, old, newdirfd, new);
+    if (r == 0)
+        report(newdirfd, new, XC_OUTPUT);
+    return r;
+}
+
+int renameat2(int olddirfd, const char *old, int newdirfd, const char *new,
+        unsigned flags) {
+    report(olddirfd, old, XC_AMBIGUOUS);
+    if (flags & RENAME_EXCHANGE)
+        report(newdirfd, new, XC_AMBIGUOUS);
+    int r = NEXT(renameat2)(olddirfd, old, newdirfd, new, flags);
+    if (r == 0) {
+        report(newdirfd, new, XC_OUTPUT);
+        if (flags & RENAME_EXCHANGE)
+            report(olddirfd, old, XC_OUTPUT);
+    }
+    return r;
+}
+
+int link(const char *old, const char *new) {
+    int r = NEXT(link)(old, new);
+    if (r == 0) {
+        report(AT_FDCWD, old, XC_INPUT);
+        report(AT_FDCWD, new, XC_OUTPUT);
+    }
+    return r;
+}
+
+int linkat(int olddirfd, const char *old, int newdirfd, const char *new,
+        int flags) {
+    int r = NEXT(linkat)(olddirfd, old, newdirfd, new, flags);
+    if (r == 0) {
+        report(olddirfd, old, XC_INPUT);
+        report(newdirfd, new, XC_OUTPUT);
+    }
+    return r;
+}
+
+int symlink(const char *target, const char *path) {
+    int r = NEXT(symlink)(target, path);
+    if (r == 0)
+        report(AT_FDCWD, path, XC_OUTPUT);
+    return r;
+}
+
+int symlinkat(const char *target, int dirfd, const char *path) {
+    int r = NEXT(symlinkat)(target, dirfd, path);
+    if (r == 0)
+        report(dirfd, path, XC_OUTPUT);
+    return r;
+}
+
+/* Truncating to anything other than zero keeps some of the existing
+ * contents.
+ */
+
+int truncate(const char *path, off_t length) {
+    if (length != 0)
+        report(AT_FDCWD, path, XC_INPUT);
+    int r = NEXT(truncate)(path, length);
+    if (r == 0)
+        report(AT_FDCWD, path, XC_OUTPUT);
+    return r;
+}
+
+int truncate64(const char *path, off64_t length) {
+    if (length != 0)
+        report(AT_FDCWD, path, XC_INPUT);
+    int r = NEXT(truncate64)(path, length);
+    if (r == 0)
+        report(AT_FDCWD, path, XC_OUTPUT);
+    return r;
+}
+
+int utime(const char *path, const struct utimbuf *times) {
+    int r = NEXT(utime)(path, times);
+    if (r == 0)
+        report(AT_FDCWD, path, XC_OUTPUT);
+    return r;
+}
+
+int utimes(const char *path, const struct timeval times[2]) {
+    int r = NEXT(utimes)(path, times);
+    if (r == 0)
+        report(AT_FDCWD, path, XC_OUTPUT);
+    return r;
+}
+
+int utimensat(int dirfd, const char *path, const struct timespec times[2],
+        int flags) {
+    int r = NEXT(utimensat)(dirfd, path, times, flags);
+    if (r == 0)
+        report(dirfd, path, XC_OUTPUT);
+    return r;
+}
+
+int futimesat(int dirfd, const char *path, const struct timeval times[2]) {
+    int r = NEXT(futimesat)(dirfd, path, times);
+    if (r == 0)
+        report(dirfd, path, XC_OUTPUT);
+    return r;
+}
+
+/* Operations the ptrace backend does not handle either. */
+
+int chown(const char *path, uid_t owner, gid_t group) {
+    bailout("chown");
+    return NEXT(chown)(path, owner, group);
+}
+
+int lchown(const char *path, uid_t owner, gid_t group) {
+    bailout("lchown");
+    return NEXT(lchown)(path, owner, group);
+}
+
+int fchownat(int dirfd, const char *path, uid_t owner, gid_t group,
+        int flags) {
+    bailout("fchownat");
+    return NEXT(fchownat)(dirfd, path, owner, group, flags);
+}
+
+int mknod(const char *path, mode_t mode, dev_t dev) {
+    bailout("mknod");
+    return NEXT(mknod)(path, mode, dev);
+}
+
+int mknodat(int dirfd, const char *path, mode_t mode, dev_t dev) {
+    bailout("mknodat");
+    return NEXT(mknodat)(dirfd, path, mode, dev);
+}
+
+int chroot(const char *path) {
+    bailout("chroot");
+    return NEXT(chroot)(path);
+}
+
+int mount(const char *source, const char *target, const char *type,
+        unsigned long flags, const void *data) {
+    bailout("mount");
+    return NEXT(mount)(source, target, type, flags, data);
+}
+
+int umount2(const char *target, int flags) {
+    bailout("umount2");
+    return NEXT(umount2)(target, flags);
+}
+
+/******************************************************************************
+ * Protecting the message pipe                                                *
+ ******************************************************************************/
+
+/* Our pipe sits at a descriptor the target does not know about, but it may
+ * still close it along with everything else, or replace it. Either would send
+ * our reports somewhere else, so we pretend to close it and refuse to replace
+ * it.
+ */
+
+static bool is_pipe(int fd) {
+    return fd >= 0 && fd == out_pipe();
+}
+
+int close(int fd) {
+    if (is_pipe(fd))
+        return 0;
+    return NEXT(close)(fd);
+}
+
+int dup2(int oldfd, int newfd) {
+    if (is_pipe(newfd) && oldfd != newfd) {
+        errno = EBUSY;
+        return -1;
+    }
+    return NEXT(dup2)(oldfd, newfd);
+}
+
+int dup3(int oldfd, int newfd, int flags) {
+    if (is_pipe(newfd) && oldfd != newfd) {
+        errno = EBUSY;
+        return -1;
+    }
+    return NEXT(dup3)(oldfd, newfd, flags);
+}
+
+/* Apply close_range to [first, last], which does not contain our pipe. */
+static int next_close_range(unsigned first, unsigned last, int flags) {
+    if (first > last)
+        return 0;
+    return CALL_OLD(close_range, first, last, flags);
+}
+
+int close_range(unsigned first, unsigned last, int flags) {
+    int fd = out_pipe();
+    if (fd < 0 || (unsigned)fd < first || (unsigned)fd > last)
+        return next_close_range(first, last, flags);
+
+    /* Leave a hole for our pipe. */
+    if (next_close_range(first, (unsigned)fd - 1, flags) != 0)
+        return -1;
+    if ((unsigned)fd == UINT_MAX)
+        return 0;
+    return next_close_range((unsigned)fd + 1, last, flags);
+}
+
+void closefrom(int lowfd) {
+    int fd = out_pipe();
+    if (fd < 0 || fd < lowfd) {
+        NEXT(closefrom)(lowfd);
+        return;
+    }
+    if (fd > lowfd &&
+            next_close_range((unsigned)lowfd, (unsigned)fd - 1, 0) != 0) {
+        for (int i = lowfd; i < fd; i++)
+            (void)NEXT(close)(i);
+    }
+    NEXT(closefrom)(fd + 1);
+}
+
+/******************************************************************************
+ * Running programs                                                           *
+ ******************************************************************************/
+
+/* Whether an environment still carries us and our pipe. */
+static bool carries_us(char *const envp[]) {
+    bool preload = false, pipe = false;
+    size_t len = strlen(XCACHE_PIPE);
+    for (char *const *p = envp; p != NULL && *p != NULL; p++) {
+        if (strncmp(*p, "LD_PRELOAD=", sizeof("LD_PRELOAD=") - 1) == 0 &&
+                strstr(*p, "libinterpose.so") != NULL)
+            preload = true;
+        if (strncmp(*p, XCACHE_PIPE, len) == 0 && (*p)[len] == '=')
+            pipe = true;
+    }
+    return preload && pipe;
+}
+
+/* Report a program about to be exec'ed and warn xcache if we will not be able
+ * to follow it.
+ */
+static void before_exec(const char *path, char *const envp[]) {
+    report(AT_FDCWD, path, XC_INPUT);
+
+    busy++;
+    bool followable = interposable(path);
+    busy--;
+
+    if (!followable) {
+        bailout("exec of a static or setuid program");
+    } else if (!carries_us(envp)) {
+        bailout("exec with an environment that drops libinterpose");
+    }
+}
+
+int execve(const char *path, char *const argv[], char *const envp[]) {
+    before_exec(path, envp);
+    return NEXT(execve)(path, argv, envp);
+}
+
+int execv(const char *path, char *const argv[]) {
+    return execve(path, argv, environ);
+}
+
+/* Search $PATH for 'file' as execvp does. libc's implementation calls its
+ * internal execve, which would bypass our wrapper, so we do the search
+ * ourselves.
+ */
+int execvpe(const char *file, char *const argv[], char *const envp[]) {
+    if (*file == '\0') {
+        errno = ENOENT;
+        return -1;
+    }
+    if (strchr(file, '/') != NULL)
+        return execve(file, argv, envp);
+
+    const char *path = getenv("PATH");
+    if (path == NULL)
+        path = "/bin:/usr/bin";
+
+    bool denied = false;
+    while (true) {
+        size_t len = strcspn(path, ":");
+        char candidate[PATH_MAX];
+        int r = snprintf(candidate, sizeof(candidate), "%.*s%s%s", (int)len,
+            path, len == 0 ? "" : "/", file);
+        if (r > 0 && (size_t)r < sizeof(candidate)) {
+            (void)execve(candidate, argv, envp);
+
+            if (errno == ENOEXEC) {
+                /* A script without a #! line, which execvp runs with the
+                 * shell.
+                 */
+                size_t argc = 0;
+                while (argv[argc] != NULL)
+                    argc++;
+                char *script_argv[argc + 2];
+                script_argv[0] = "/bin/sh";
+                script_argv[1] = candidate;
+                for (size_t i = 1; i <= argc; i++)
+                    script_argv[i + 1] = argv[i];
+                return execve(script_argv[0], script_argv, envp);
+            }
+
+            if (errno == EACCES) {
+                denied = true;
+            } else if (errno != ENOENT && errno != ENOTDIR &&
+                       errno != ESTALE && errno != ENODEV &&
+                       errno != ETIMEDOUT) {
+                return -1;
+            }
+        }
+        if (path[len] == '\0')
+            break;
+        path += len + 1;
+    }
+
+    if (denied)
+        errno = EACCES;
+    return -1;
+}
+
+int execvp(const char *file, char *const argv[]) {
+    return execvpe(file, argv, environ);
+}
+
+/* Collect the variadic arguments of the execl family into an array. */
+#define COLLECT_ARGS(arg, argv) \
+    va_list ap; \
+    size_t argc_ = 1; \
+    va_start(ap, arg); \
+    while (va_arg(ap, char*) != NULL) \
+        argc_++; \
+    va_end(ap); \
+    char *argv[argc_ + 1]; \
+    argv[0] = (char*)arg; \
+    va_start(ap, arg); \
+    for (size_t i_ = 1; i_ <= argc_; i_++) \
+        argv[i_] = va_arg(ap, char*)
+
+int execl(const char *path, const char *arg, ...) {
+    COLLECT_ARGS(arg, argv);
+    va_end(ap);
+    return execv(path, argv);
+}
+
+int execlp(const char *file, const char *arg, ...) {
+    COLLECT_ARGS(arg, argv);
+    va_end(ap);
+    return execvp(file, argv);
+}
+
+int execle(const char *path, const char *arg, ...) {
+    COLLECT_ARGS(arg, argv);
+    char *const *envp = va_arg(ap, char *const*);
+    va_end(ap);
+    return execve(path, argv, envp);
+}
+
+int posix_spawn(pid_t *pid, const char *path,
+        const posix_spawn_file_actions_t *file_actions,
+        const posix_spawnattr_t *attrp, char *const argv[],
+        char *const envp[]) {
+    before_exec(path, envp);
+    return NEXT(posix_spawn)(pid, path, file_actions, attrp, argv, envp);
+}
+
+/* Report a candidate posix_spawnp will try, stopping at the one it will run. */
+static bool spawn_candidate(const char *candidate, void *data) {
+    busy++;
+    bool runnable = access(candidate, X_OK) == 0;
+    busy--;
+    if (runnable) {
+        before_exec(candidate, data);
+        return true;
+    }
+    report(AT_FDCWD, candidate, XC_INPUT);
+    return false;
+}
+
+int posix_spawnp(pid_t *pid, const char *file,
+        const posix_spawn_file_actions_t *file_actions,
+        const posix_spawnattr_t *attrp, char *const argv[],
+        char *const envp[]) {
+    (void)search_path(file, spawn_candidate, (void*)envp);
+    return NEXT(posix_spawnp)(pid, file, file_actions, attrp, argv, envp);
+}
+
+void *dlopen(const char *filename, int flags) {
+    void *handle = NEXT(dlopen)(filename, flags);
+    if (handle != NULL && filename != NULL)
+        report_objects();
+    return handle;
+}
@@ -1,15 +1,37 @@
+#include "arch_syscall.h"
 #include <assert.h>
 #include "cache.h"
+#include "classify.h"
+#include "client.h"
+#include "comm-protocol.h"
+#include "constants.h"
 #include "depset.h"
+#include <errno.h>
 #include <fcntl.h>
+#include "interposable.h"
+#include <limits.h>
 #include "log.h"
+#include "pipeline.h"
+#include "policy.h"
+#include <poll.h>
+#include <pthread.h>
+#include <linux/fs.h>
+#include "server-protocol.h"
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include "toolchain.h"
 #include "trace.h"
 #include "translate-syscall.h"
 #include <unistd.h>
@@ -25,28 +47,103 @@ static bool directories = false;
 
 static bool statistics = true;
 
-/* Paths to never consider as inputs. This is to avoid tracking things that are
- * not conceptually files, but rather Linux APIs. Entries to this array should
- * be path prefixes.
- */
-static const struct {
-    const char *prefix;
-    size_t length;
-} exclude[] = {
-#define EXCLUDE_ENTRY(pref) { .prefix = pref, .length = sizeof(pref) - 1 }
-    EXCLUDE_ENTRY("/dev/"),
-    EXCLUDE_ENTRY("/proc/"),
-#undef EXCLUDE_ENTRY
-};
-static const size_t exclude_sz = sizeof(exclude) / sizeof(exclude[0]);
+static bool use_server = true;
+
+static bool interpose = false;
+
+static bool cache_subprocess = false;
+
+static bool cache_failures = false;
+
+/* Whether to write cache entries from a background process, and how many such
+ * writes may be outstanding at once before we write in the foreground again.
+ */
+static bool async_commit = false;
+static unsigned async_limit = 8;
+
+/* How long to wait for another xcache running the same target, in seconds,
+ * and the lock we hold on the target while running it ourselves.
+ */
+static unsigned lock_timeout = 300;
+static char *flight_lock = NULL;
+static int flight = -1;
+
+/* Whether to read commands to run from stdin rather than our command line,
+ * and how many to run at once. We remember where these options were so we
+ * can pass the others on to the xcache processes we start.
+ */
+static bool batch = false;
+static unsigned jobs = 0;
+static int batch_arg = 0;
+static int jobs_arg = 0;
+
+/* Number of seconds for which an entry of an unsuccessful run is used, or 0
+ * for no limit.
+ */
+static unsigned failure_ttl = 3600;
+
+/* Upper bound on --tracers. */
+#define MAX_TRACERS 64
+
+/* Number of threads to process dependencies while tracing. */
+static unsigned workers = 2;
+
+/* Number of threads to trace the target with. */
+static unsigned tracers = 1;
+
+/* Number of consecutive traced runs of a target that did not pay off after
+ * which we stop tracing it, and number of untraced runs after which we try
+ * tracing it again. See cache_worth_tracing().
+ */
+static unsigned skip_after = 3;
+static unsigned reprobe = 16;
+
+/* Whether the target read any files under an immutable prefix. If so, its
+ * cache entry needs a toolchain stamp.
+ */
+static bool used_immutable = false;
+
+/* Number of traced processes currently inside a syscall that may modify the
+ * filesystem. See queue() below.
+ */
+static unsigned modifying = 0;
+
+/* Pipeline of dependencies, shared by all tracers. */
+static pipeline_t *pipeline;
+
+/* The root of the target, which is never cached as a subprocess. */
+static proc_t *root;
+
+/* The target, for recognising the channels libhook reports to us on. */
+static target_t *traced;
+
+/* Set when we kept tracing past something we could not follow, so that we
+ * could still cache subprocesses. The target as a whole is then uncacheable.
+ */
+static bool incomplete = false;
+
+/* The last unhandled syscall we saw, if any, to explain why the target could
+ * not be cached.
+ */
+static const char *unhandled = NULL;
 
 static void usage(const char *prog) {
     fprintf(stderr, "Usage:\n"
         "  %s [options] command args...\n"
         "\n"
         "Options:\n"
+        "  --async-commit     Exit as soon as the target does, writing its cache\n"
+        "                     entry from a background process.\n"
+        "  --async-limit <n>  Write entries in the foreground while <n> background\n"
+        "                     writes are outstanding (default 8).\n"
+        "  --batch            Read commands from stdin, rather than taking one on\n"
+        "                     the command line. See README.md.\n"
         "  --cache-dir <dir>\n"
         "  -c <dir>           Locate cache in <dir>.\n"
+        "  --cache-failures   Also cache targets that exit unsuccessfully or\n"
+        "                     crash, and replay their exit.\n"
+        "  --cache-subprocess Also cache each program the target runs on its own,\n"
+        "                     and replay these from cache where possible.\n"
         "  --directories\n"
         "  -d                 Track directories as well as files.\n"
         "  --dry-run\n"
@@ -55,17 +152,46 @@ static void usage(const char *prog) {
         "  -D                 Do not track directories; only files.\n"
         "  --no-getenv\n"
         "  -e                 Do not hook getenv.\n"
+        "  --no-immutable     Track all files individually, including those under\n"
+        "                     prefixes given earlier with --immutable.\n"
+        "  --no-server        Do not use xcached, even if it is running.\n"
+        "  --failure-ttl <seconds>\n"
+        "                     Stop using an entry cached with --cache-failures\n"
+        "                     after <seconds> (default 3600). 0 never expires it.\n"
         "  --help\n"
         "  -?                 Print this help information and exit.\n"
+        "  --interpose        Observe the target by preloading libinterpose, rather\n"
+        "                     than with ptrace, where it is dynamically linked.\n"
+        "  --immutable <prefix>\n"
+        "                     Treat files under <prefix> as only changing with\n"
+        "                     system packages. Other edits beneath <prefix> go\n"
+        "                     unnoticed.\n"
+        "  --immutable-system Treat the locations of system packages, like\n"
+        "                     /usr/include and /usr/lib, as with --immutable.\n"
+        "  --lock-timeout <seconds>\n"
+        "                     Wait up to <seconds> for another xcache running the\n"
+        "                     same target to cache it, before running it too\n"
+        "                     (default 300). 0 never waits.\n"
+        "  --jobs <n>         With --batch, run up to <n> commands at once (default\n"
+        "                     the number of CPUs).\n"
         "  --log <file>\n"
         "  -l <file>          Direct any output to <file>. Defaults to stderr.\n"
         "  --no-statistics    Do not log statistics in cache database.\n"
+        "  --reprobe <n>      Trace a target we stopped tracing again after <n>\n"
+        "                     untraced runs (default 16). 0 never does.\n"
         "  --quiet\n"
         "  -q                 Show less output.\n"
+        "  --skip-after <n>   Run a target without tracing it once <n> traced runs\n"
+        "                     in a row did not pay off (default 3). 0 always\n"
+        "                     traces.\n"
         "  --statistics       Log statistics in cache database (default).\n"
         "  --verbose\n"
         "  -v                 Show more output.\n"
+        "  --tracers <n>      Trace the target with <n> threads (default 1). Children\n"
+        "                     forked while a thread is idle are handed off to it.\n"
         "  --version          Output version information and then exit.\n"
+        "  --workers <n>      Process dependencies in <n> threads while tracing\n"
+        "                     (default 2). 0 processes them in the tracer.\n"
         , prog);
 }
 
@@ -87,10 +213,27 @@ static char *default_cache_dir(void) {
 static int parse_arguments(int argc, char **argv) {
     int index;
     for (index = 1; index < argc; index++) {
-        if ((!strcmp(argv[index], "--cache-dir") ||
+        if (!strcmp(argv[index], "--async-commit")) {
+            async_commit = true;
+        } else if (!strcmp(argv[index], "--async-limit") && index < argc - 1) {
+            char *end;
+            unsigned long n = strtoul(argv[++index], &end, 10);
+            if (*argv[index] == '\0' || *end != '\0' || n > UINT_MAX) {
+                usage(argv[0]);
+                exit(-1);
+            }
+            async_limit = (unsigned)n;
+        } else if (!strcmp(argv[index], "--batch")) {
+            batch = true;
+            batch_arg = index;
+        } else if ((!strcmp(argv[index], "--cache-dir") ||
              !strcmp(argv[index], "-c")) &&
             index < argc - 1) {
             cache_dir = argv[++index];
+        } else if (!strcmp(argv[index], "--cache-failures")) {
+            cache_failures = true;
+        } else if (!strcmp(argv[index], "--cache-subprocess")) {
+            cache_subprocess = true;
         } else if (!strcmp(argv[index], "--directories") ||
                    !strcmp(argv[index], "-d")) {
             directories = true;
@@ -103,6 +246,45 @@ static int parse_arguments(int argc, char **argv) {
         } else if (!strcmp(argv[index], "--no-getenv") ||
                    !strcmp(argv[index], "-e")) {
             hook_getenv = false;
+        } else if (!strcmp(argv[index], "--failure-ttl") && index < argc - 1) {
+            char *end;
+            unsigned long n = strtoul(argv[++index], &end, 10);
+            if (*argv[index] == '\0' || *end != '\0' || n > INT_MAX) {
+                usage(argv[0]);
+                exit(-1);
+            }
+            failure_ttl = (unsigned)n;
+        } else if (!strcmp(argv[index], "--immutable") && index < argc - 1) {
+            if (policy_add(argv[++index], POLICY_IMMUTABLE) != 0) {
+                ERROR("Failed to add immutable prefix\n");
+                exit(-1);
+            }
+        } else if (!strcmp(argv[index], "--immutable-system")) {
+            if (policy_add_system() != 0) {
+                ERROR("Failed to add immutable prefixes\n");
+                exit(-1);
+            }
+        } else if (!strcmp(argv[index], "--interpose")) {
+            interpose = true;
+        } else if (!strcmp(argv[index], "--no-immutable")) {
+            policy_clear(POLICY_IMMUTABLE);
+        } else if (!strcmp(argv[index], "--jobs") && index < argc - 1) {
+            jobs_arg = index;
+            char *end;
+            unsigned long n = strtoul(argv[++index], &end, 10);
+            if (*argv[index] == '\0' || *end != '\0' || n == 0 || n > 1024) {
+                usage(argv[0]);
+                exit(-1);
+            }
+            jobs = (unsigned)n;
+        } else if (!strcmp(argv[index], "--lock-timeout") && index < argc - 1) {
+            char *end;
+            unsigned long n = strtoul(argv[++index], &end, 10);
+            if (*argv[index] == '\0' || *end != '\0' || n > UINT_MAX / 1000) {
+                usage(argv[0]);
+                exit(-1);
+            }
+            lock_timeout = (unsigned)n;
         } else if ((!strcmp(argv[index], "--log") ||
                     !strcmp(argv[index], "-l")) &&
                    index < argc - 1) {
@@ -110,16 +292,51 @@ static int parse_arguments(int argc, char **argv) {
                 usage(argv[0]);
                 exit(-1);
             }
+        } else if (!strcmp(argv[index], "--no-server")) {
+            use_server = false;
         } else if (!strcmp(argv[index], "--no-statistics")) {
             statistics = false;
         } else if (!strcmp(argv[index], "--quiet") ||
                    !strcmp(argv[index], "-q")) {
             verbosity--;
+        } else if (!strcmp(argv[index], "--reprobe") && index < argc - 1) {
+            char *end;
+            unsigned long n = strtoul(argv[++index], &end, 10);
+            if (*argv[index] == '\0' || *end != '\0' || n > UINT_MAX) {
+                usage(argv[0]);
+                exit(-1);
+            }
+            reprobe = (unsigned)n;
+        } else if (!strcmp(argv[index], "--skip-after") && index < argc - 1) {
+            char *end;
+            unsigned long n = strtoul(argv[++index], &end, 10);
+            if (*argv[index] == '\0' || *end != '\0' || n > UINT_MAX) {
+                usage(argv[0]);
+                exit(-1);
+            }
+            skip_after = (unsigned)n;
         } else if (!strcmp(argv[index], "--statistics")) {
             statistics = true;
         } else if (!strcmp(argv[index], "--verbose") ||
                    !strcmp(argv[index], "-v")) {
             verbosity++;
+        } else if (!strcmp(argv[index], "--workers") && index < argc - 1) {
+            char *end;
+            unsigned long n = strtoul(argv[++index], &end, 10);
+            if (*argv[index] == '\0' || *end != '\0' || n > 64) {
+                usage(argv[0]);
+                exit(-1);
+            }
+            workers = (unsigned)n;
+        } else if (!strcmp(argv[index], "--tracers") && index < argc - 1) {
+            char *end;
+            unsigned long n = strtoul(argv[++index], &end, 10);
+            if (*argv[index] == '\0' || *end != '\0' || n == 0 ||
+                    n > MAX_TRACERS) {
+                usage(argv[0]);
+                exit(-1);
+            }
+            tracers = (unsigned)n;
         } else if (!strcmp(argv[index], "--version")) {
             printf("xcache %d.%02d\n", VERSION_MAJOR, VERSION_MINOR);
             exit(0);
@@ -134,15 +351,34 @@ static int parse_arguments(int argc, char **argv) {
     return index;
 }
 
-/* Add an item to a dependency set. */
-static int add_from_string(depset_t *d, const char *cwd, char *path,
-        filetype_t type) {
-    autofree char *absolute = abspath(cwd, path);
-    if (absolute == NULL) {
-        DEBUG("Failed to resolve path \"%s\"\n", path);
-        return -1;
+/* Determine whether to record an access to an absolute path, according to
+ * our policy.
+ */
+static bool wanted(const char *absolute, filetype_t type) {
+    switch (policy_lookup(absolute)) {
+        case POLICY_EXCLUDE:
+            return false;
+
+        case POLICY_IMMUTABLE:
+            /* Reads of these are covered by the toolchain stamp. Writes are
+             * unusual, but we record them as normal.
+             */
+            if (type == XC_INPUT) {
+                __atomic_store_n(&used_immutable, true, __ATOMIC_RELAXED);
+                return false;
+            }
+            break;
+
+        case POLICY_TRACK:
+            break;
     }
+    return true;
+}
 
+/* Add an absolute path to a dependency set. This is called from the worker
+ * threads of our pipeline.
+ */
+static int process(depset_t *d, const char *absolute, filetype_t type) {
     if (!directories) {
         struct stat st;
         /* Return without adding the file if this is a directory and we're not
@@ -154,10 +390,8 @@ static int add_from_string(depset_t *d, const char *cwd, char *path,
         }
     }
 
-    for (unsigned int i = 0; i < exclude_sz; i++) {
-        if (strncmp(exclude[i].prefix, absolute, exclude[i].length) == 0)
-            return 0;
-    }
+    if (!wanted(absolute, type))
+        return 0;
 
     if (depset_add(d, absolute, type) != 0) {
         DEBUG("Failed to add %s \"%s\"\n",
@@ -171,7 +405,229 @@ static int add_from_string(depset_t *d, const char *cwd, char *path,
     return 0;
 }
 
-static int add_from_reg(depset_t *d, syscall_t *syscall, int argno, filetype_t type) {
+/* A program run by a descendant of the target, which we may cache as an entry
+ * of its own (see --cache-subprocess). These form a tree mirroring the
+ * processes of the target. What a process does is attributed to the
+ * subprocess it belongs to and all enclosing ones, so each of these ends up
+ * with the dependencies of its whole subtree. Members other than the key are
+ * protected by 'exec_lock'.
+ */
+typedef struct exec {
+    struct exec *parent;
+
+    /* Number of processes and nested subprocesses referring to this one. */
+    unsigned refs;
+
+    /* The process that ran the program. */
+    pid_t pid;
+
+    /* Whether its execve has not yet returned. */
+    bool pending;
+
+    /* Whether we have followed everything the subtree did. */
+    bool cacheable;
+
+    /* Wait status of 'pid', or -1 if we have not seen it exit. */
+    int status;
+
+    /* Key of the cache entry: the working directory, and the path of the
+     * program followed by its arguments, its environment and what the
+     * descriptors it inherits refer to. The strings point into 'args', 'env'
+     * and 'fds'.
+     */
+    char *cwd;
+    int argc;
+    char **argv;
+    char *path;
+    char **args;
+    char **env;
+    char **fds;
+    size_t nfds;
+
+    depset_t *deps;
+} exec_t;
+
+static pthread_mutex_t exec_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Cache to look up and record subprocesses in. This is used by all tracers. */
+static cache_t *subprocess_cache;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Toolchain stamp to record with subprocess entries, if any. */
+static const char *subprocess_prefixes, *subprocess_stamp;
+
+static void exec_free(exec_t *e) {
+    if (e->deps != NULL)
+        depset_destroy(e->deps);
+    free(e->cwd);
+    free(e->argv);
+    free(e->path);
+    free(e->args);
+    free(e->env);
+    for (size_t i = 0; i < e->nfds; i++)
+        free(e->fds[i]);
+    free(e->fds);
+    free(e);
+}
+
+/* Attribute an access to a path to a subprocess and all enclosing ones. */
+static void exec_record(exec_t *e, const char *absolute, filetype_t type) {
+    pthread_mutex_lock(&exec_lock);
+    for (; e != NULL; e = e->parent) {
+        if (e->cacheable && process(e->deps, absolute, type) != 0)
+            e->cacheable = false;
+    }
+    pthread_mutex_unlock(&exec_lock);
+}
+
+/* Note that a process did something we cannot replay, which rules out caching
+ * the subprocesses it belongs to.
+ */
+static void exec_taint(exec_t *e) {
+    pthread_mutex_lock(&exec_lock);
+    for (; e != NULL; e = e->parent) {
+        if (e->cacheable)
+            IDEBUG("not caching subprocess %s\n", e->argv[0]);
+        e->cacheable = false;
+    }
+    pthread_mutex_unlock(&exec_lock);
+}
+
+/* Note that a process used a descriptor opened while 'owner' was its current
+ * subprocess (NULL if we do not know). Replaying a subprocess rewrites whole
+ * files, which cannot reproduce what it did through a descriptor it was handed,
+ * like appending to one opened with O_APPEND or reading from its current
+ * offset. So only the subprocesses enclosing the one that opened it can still
+ * be cached.
+ */
+static void exec_inherited(exec_t *e, const void *owner) {
+    pthread_mutex_lock(&exec_lock);
+    for (; e != NULL && e != owner; e = e->parent) {
+        if (e->cacheable)
+            IDEBUG("not caching subprocess %s\n", e->argv[0]);
+        e->cacheable = false;
+    }
+    pthread_mutex_unlock(&exec_lock);
+}
+
+/* Whether any subprocess a process belongs to may still be cached. */
+static bool exec_live(exec_t *e) {
+    pthread_mutex_lock(&exec_lock);
+    while (e != NULL && !e->cacheable)
+        e = e->parent;
+    pthread_mutex_unlock(&exec_lock);
+    return e != NULL;
+}
+
+/* Record a subprocess whose subtree has finished, if it succeeded and we saw
+ * everything it did, and deallocate it.
+ */
+static void exec_finish(exec_t *e) {
+    if (e->cacheable && !e->pending && e->status == 0 &&
+            depset_finalise(e->deps) == 0) {
+        /* The environment is part of the key, so there is nothing to check on
+         * lookup.
+         */
+        dict_t env;
+        int r = dict(&env);
+        if (r == 0) {
+            pthread_mutex_lock(&cache_lock);
+            r = cache_write(subprocess_cache, e->cwd, e->argc, e->argv,
+                e->deps, &env, NULL, NULL, subprocess_prefixes,
+                subprocess_stamp, 0, 0, 0);
+            pthread_mutex_unlock(&cache_lock);
+            dict_destroy(&env);
+        }
+        if (r == 0) {
+            DEBUG("Added cache entry for subprocess %s\n", e->path);
+        } else {
+            DEBUG("Failed to write entry for subprocess %s\n", e->path);
+        }
+    }
+    exec_free(e);
+}
+
+/* Drop a reference to a subprocess. Once nothing refers to it, its subtree has
+ * finished and it in turn drops its reference to the enclosing subprocess.
+ */
+static void exec_put(exec_t *e) {
+    while (e != NULL) {
+        pthread_mutex_lock(&exec_lock);
+        assert(e->refs > 0);
+        bool last = --e->refs == 0;
+        pthread_mutex_unlock(&exec_lock);
+        if (!last)
+            return;
+        exec_t *parent = e->parent;
+        exec_finish(e);
+        e = parent;
+    }
+}
+
+/* A forked child belongs to the same subprocess as its parent. */
+static void follow_fork(proc_t *parent, proc_t *child) {
+    exec_t *e = parent->data;
+    if (e == NULL)
+        return;
+    pthread_mutex_lock(&exec_lock);
+    e->refs++;
+    pthread_mutex_unlock(&exec_lock);
+    child->data = e;
+}
+
+static void follow_exit(proc_t *proc, int status) {
+    exec_t *e = proc->data;
+    if (e == NULL)
+        return;
+    /* A process may have run several programs in turn, such as a shell that
+     * execs its last command. These all finish with it.
+     */
+    pthread_mutex_lock(&exec_lock);
+    for (exec_t *x = e; x != NULL; x = x->parent) {
+        if (x->pid == proc->pid)
+            x->status = status;
+    }
+    pthread_mutex_unlock(&exec_lock);
+    proc->data = NULL;
+    exec_put(e);
+}
+
+/* Hand an absolute path to the pipeline. Flushing before we let a modifying
+ * syscall through only covers inputs queued before it. Another process may
+ * read a file after that, while the modifying syscall is still in progress,
+ * and a deferred measurement could then see the modification. So while any
+ * such syscall is in progress, we measure inputs before resuming the process
+ * that read them. A process that dies mid-syscall leaves the count raised,
+ * which only costs us deferral. Subprocesses the process belongs to measure
+ * the path straight away.
+ */
+static int queue(pipeline_t *p, proc_t *proc, char *path, filetype_t type) {
+    if (proc->data != NULL)
+        exec_record(proc->data, path, type);
+    if (pipeline_add(p, path, type) != 0)
+        return -1;
+    if (type != XC_OUTPUT &&
+            __atomic_load_n(&modifying, __ATOMIC_SEQ_CST) > 0)
+        return pipeline_flush(p);
+    return 0;
+}
+
+/* Queue an item for addition to the dependency set. We only resolve the path
+ * here, so that we can let the target continue as soon as possible.
+ */
+static int add_from_string(pipeline_t *p, proc_t *proc, char *path,
+        filetype_t type) {
+    char *absolute = abspath(cwd_get(proc->cwd), path);
+    if (absolute == NULL) {
+        DEBUG("Failed to resolve path \"%s\"\n", path);
+        return -1;
+    }
+
+    return queue(p, proc, absolute, type);
+}
+
+static int add_from_reg(pipeline_t *p, syscall_t *syscall, int argno,
+        filetype_t type) {
     assert(argno > 0);
     autofree char *filename = syscall_getstring(syscall, argno);
     if (filename == NULL) {
@@ -187,12 +643,41 @@ static int add_from_reg(depset_t *d, syscall_t *syscall, int argno, filetype_t t
         return -1;
     }
 
-    int r = add_from_string(d, syscall->proc->cwd, filename, type);
+    int r = add_from_string(p, syscall->proc, filename, type);
     return r;
 }
 
-static int add_from_fd_and_reg(depset_t *d, syscall_t *syscall, int fdarg,
+/* Add the file a descriptor argument to a syscall refers to. */
+static int add_from_fd(pipeline_t *p, syscall_t *syscall, int fdarg,
+        filetype_t type) {
+    char *path = syscall_getfd(syscall, fdarg);
+    if (path == NULL) {
+        DEBUG("Failed to retrieve file descriptor argument %d from syscall %s "
+            "(%ld)\n", fdarg, translate_syscall(syscall->call), syscall->call);
+        return -1;
+    }
+
+    if (path[0] != '/') {
+        /* Something other than a file, like a pipe or socket. */
+        free(path);
+        return 0;
+    }
+
+    return queue(p, syscall->proc, path, type);
+}
+
+/* Add a path given as a directory file descriptor and a path relative to it,
+ * as for the *at() family of syscalls.
+ */
+static int add_from_fd_and_reg(pipeline_t *p, syscall_t *syscall, int fdarg,
         int argno, filetype_t type) {
+    if (syscall_getarg(syscall, argno) == 0) {
+        /* A NULL path, which some of these syscalls (e.g. utimensat) take to
+         * mean the descriptor itself.
+         */
+        return add_from_fd(p, syscall, fdarg, type);
+    }
+
     autofree char *filename = syscall_getstring(syscall, argno);
     if (filename == NULL) {
         DEBUG("Failed to retrieve string argument %d from syscall %s (%ld)\n",
@@ -201,6 +686,18 @@ static int add_from_fd_and_reg(depset_t *d, syscall_t *syscall, int fdarg,
     }
     IDEBUG("%s: retrieved filename \"%s\"\n", __func__, filename);
 
+    if (filename[0] == '\0') {
+        /* With AT_EMPTY_PATH, the descriptor itself, which we recorded when it
+         * was opened. Otherwise, the syscall will fail with ENOENT.
+         */
+        return 0;
+    }
+
+    if (filename[0] == '/') {
+        /* The descriptor is ignored, so save looking it up. */
+        return add_from_string(p, syscall->proc, filename, type);
+    }
+
     autofree char *fdpath = syscall_getfd(syscall, fdarg);
     if (fdpath == NULL) {
         DEBUG("Failed to retrieve file descriptor argument %d from syscall %s "
@@ -209,365 +706,1599 @@ static int add_from_fd_and_reg(depset_t *d, syscall_t *syscall, int fdarg,
     }
     IDEBUG("%s: retrieved fd path \"%s\"\n", __func__, fdpath);
 
+    if (fdpath[0] != '/') {
+        /* Not a directory, so the syscall will fail with ENOTDIR. */
+        return 0;
+    }
+
     autofree char *path = abspath(fdpath, filename);
     if (path == NULL) {
         DEBUG("Failed to resolve absolute path from syscall %s (%ld)\n",
             translate_syscall(syscall->call), syscall->call);
         return -1;
     }
-    IDEBUG("%s: normalised path to \"%s\"\n", __func__, fdpath);
+    IDEBUG("%s: normalised path to \"%s\"\n", __func__, path);
 
-    int r = add_from_string(d, syscall->proc->cwd, path, type);
+    int r = add_from_string(p, syscall->proc, path, type);
     return r;
 }
 
-/* Sanity checks on open flags because checking for O_RDONLY is awkward. */
-static_assert(O_RDONLY == 00 && O_WRONLY == 01 && O_RDWR == 02,
-    "unexpected file open flag values");
-/* See usage of this below. */
-static const int FLAG_MASK = O_RDONLY | O_WRONLY | O_RDWR;
+/* Account for a read or write through a descriptor argument to a syscall.
+ * The subprocesses the process belongs to can only be replayed if this is a
+ * file they opened themselves, which is then a dependency of theirs as if it
+ * had been opened by path. Anything else, like a pipe, a terminal or a file
+ * they inherited, rules them out.
+ */
+static void exec_io(syscall_t *s, int fdarg, filetype_t type) {
+    exec_t *e = s->proc->data;
+    if (e == NULL || !exec_live(e))
+        return;
+
+    autofree char *path = syscall_getfd(s, fdarg);
+    if (path != NULL && !strcmp(path, "/dev/null"))
+        return;
+
+    /* libhook talking to us is not part of what the process does. */
+    if (path != NULL && path[0] != '/' &&
+            target_channel(traced, (int)syscall_getarg(s, fdarg)))
+        return;
+
+    struct stat st;
+    if (path == NULL || path[0] != '/' || stat(path, &st) != 0 ||
+            !S_ISREG(st.st_mode)) {
+        exec_taint(e);
+        return;
+    }
 
-static int flags_to_mode(int flags) {
-    return flags & FLAG_MASK;
+    int fd = (int)syscall_getarg(s, fdarg);
+    exec_inherited(e, s->proc->fds == NULL ? NULL :
+        fdtable_owner(s->proc->fds, fd));
+    exec_record(e, path, type);
 }
 
-/* Determine the type of an input or output we're opening based on the flags
- * passed. Note that we return XC_NONE unless this is an input because we're
- * only considering how we want to treat this on syscall entry.
- */
-static filetype_t classify_open_entry(int flags) {
-    int mode = flags_to_mode(flags);
+/* Replay a cached subprocess in place of running it. Returns 0 on success. */
+static int replay(pipeline_t *p, proc_t *proc, int id) {
+    filetype_t wanted_type;
+    int add(const char *filename, filetype_t type) {
+        if (type != wanted_type)
+            return 0;
+        char *path = strdup(filename);
+        return path == NULL ? -1 : queue(p, proc, path, type);
+    }
 
-    /* If we're opening this file write-only, we don't need to
-     * do any measurement before opening as this file is purely
-     * an output.
+    /* Writing out the entry modifies the filesystem, so inputs need to be
+     * measured first, as for a modifying syscall.
      */
-    if (mode == O_WRONLY)
-        return XC_NONE;
+    __atomic_add_fetch(&modifying, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&cache_lock);
+    wanted_type = XC_INPUT;
+    int r = cache_for_deps(subprocess_cache, id, add);
+    if (r == 0)
+        r = pipeline_flush(p);
+    if (r == 0)
+        r = cache_dump(subprocess_cache, id, -1, -1, NULL, NULL);
+    wanted_type = XC_OUTPUT;
+    if (r == 0)
+        r = cache_for_deps(subprocess_cache, id, add);
+    pthread_mutex_unlock(&cache_lock);
+    __atomic_sub_fetch(&modifying, 1, __ATOMIC_SEQ_CST);
+    return r;
+}
 
-    /* If we're opening this file read-write, there are some
-     * extra conditions that may lead us to bail out.
-     */
-    if (mode == O_RDWR) {
+/* Whether an environment entry is one of the variables we use to reach
+ * libhook. Their values are descriptor numbers that vary from run to run, so
+ * they must not be part of a subprocess's key.
+ */
+static bool internal_variable(const char *entry) {
+    static const char *const names[] = { XCACHE_PIPE, XCACHE_RING };
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+        size_t len = strlen(names[i]);
+        if (strncmp(entry, names[i], len) == 0 && entry[len] == '=')
+            return true;
+    }
+    return false;
+}
 
-        /* If a file is opened with O_CREAT and O_EXCL, the
-         * open fails if the file exists. In other words, even
-         * if we are opening this file O_RDWR, we are treating
-         * it as only an output.
-         */
-        if ((flags & O_CREAT) && (flags & O_EXCL))
-            return XC_NONE;
-
-        /* If a file is opened with O_TRUNC, we're ignoring its
-         * current contents and hence treating it purely as an
-         * output. O_TRUNC actually has no effect if the file is
-         * a device or a fifo, but regardless the caller is
-         * clearly not expecting to depend on the existing
-         * contents.
+/* Describe the descriptors a program inherits, as part of its cache key. Two
+ * runs of a program with different files as stdout, for example, are
+ * different invocations. We include the standard streams and any other
+ * descriptors we know to refer to files. Returns 0 on success.
+ */
+static int describe_fds(proc_t *proc, exec_t *e) {
+    int add(int fd, const char *path) {
+        char **fds = realloc(e->fds, sizeof(fds[0]) * (e->nfds + 1));
+        if (fds == NULL)
+            return -1;
+        e->fds = fds;
+        /* Something other than a file, like a pipe, is only identified by
+         * its kind. Its contents are never replayed.
          */
-        if (flags & O_TRUNC)
-            return XC_NONE;
+        int len = path == NULL ? 0 :
+            path[0] == '/' ? (int)strlen(path) : (int)strcspn(path, ":");
+        e->fds[e->nfds] = aprintf("%d:%.*s", fd, len, path == NULL ? "" : path);
+        if (e->fds[e->nfds] == NULL)
+            return -1;
+        e->nfds++;
+        return 0;
+    }
 
+    for (int fd = STDIN_FILENO; fd <= STDERR_FILENO; fd++) {
+        autofree char *path = proc_getfd(proc, fd);
+        if (add(fd, path) != 0)
+            return -1;
     }
 
-    return XC_INPUT;
+    if (proc->fds == NULL)
+        return 0;
+    int inherited(int fd, const char *path, bool cloexec) {
+        if (fd <= STDERR_FILENO || cloexec)
+            return 0;
+        return add(fd, path);
+    }
+    return fdtable_foreach(proc->fds, inherited);
 }
 
-/* Determine how we want to treat an input or output we're opening on syscall
- * exit.
+/* Handle entry to an execve in subprocess caching mode. If we have a cache
+ * entry for the program being run, we replay it and turn the syscall into an
+ * exit, as the program would have done. Otherwise, we start tracking it as a
+ * new subprocess. Returns true if the syscall was replayed.
  */
-static filetype_t classify_open_exit(int flags) {
-    int mode = flags_to_mode(flags);
-    if (mode == O_WRONLY || mode == O_RDWR)
-        return XC_OUTPUT;
-
-    return XC_NONE;
-}
+static bool exec_enter(pipeline_t *p, syscall_t *s) {
+    proc_t *proc = s->proc;
+    if (proc == root)
+        return false;
 
-int main(int argc, char **argv) {
-    int index = parse_arguments(argc, argv);
+    exec_t *e = calloc(1, sizeof(*e));
+    if (e == NULL)
+        return false;
 
-    if (argc - index == 0) {
-        ERROR("No target command supplied\n");
-        usage(argv[0]);
-        return -1;
+    /* Failing any of this, the program is simply part of the enclosing
+     * subprocess, if any.
+     */
+    autofree char *filename = syscall_getstring(s, 1);
+    if (filename == NULL ||
+            (e->cwd = strdup(cwd_get(proc->cwd))) == NULL ||
+            (e->path = abspath(e->cwd, filename)) == NULL ||
+            (e->args = syscall_getstrings(s, 2)) == NULL ||
+            (e->env = syscall_getstrings(s, 3)) == NULL) {
+        exec_free(e);
+        return false;
     }
 
-    if (cache_dir == NULL) {
-        cache_dir = default_cache_dir();
-        if (cache_dir == NULL) {
-            ERROR("Failed to determine default cache directory\n");
-            return -1;
-        }
+    if (describe_fds(proc, e) != 0) {
+        exec_free(e);
+        return false;
     }
 
-    if (mkdirp(cache_dir) != 0) {
-        ERROR("Failed to create cache directory \"%s\"\n", cache_dir);
-        return -1;
+    size_t argc = 0, envc = 0;
+    while (e->args[argc] != NULL)
+        argc++;
+    for (size_t i = 0; e->env[i] != NULL; i++) {
+        if (!internal_variable(e->env[i]))
+            envc++;
     }
-
-    cache_t *cache = cache_open(cache_dir, statistics);
-    if (cache == NULL) {
-        ERROR("Failed to create cache\n");
-        return -1;
+    e->argc = (int)(1 + argc + envc + e->nfds);
+    e->argv = malloc(sizeof(e->argv[0]) * (size_t)e->argc);
+    if (e->argv == NULL) {
+        exec_free(e);
+        return false;
     }
+    e->argv[0] = e->path;
+    memcpy(&e->argv[1], e->args, sizeof(e->argv[0]) * argc);
+    for (size_t i = 0, j = 1 + argc; e->env[i] != NULL; i++) {
+        if (!internal_variable(e->env[i]))
+            e->argv[j++] = e->env[i];
+    }
+    memcpy(&e->argv[1 + argc + envc], e->fds, sizeof(e->argv[0]) * e->nfds);
 
-    int id = cache_locate(cache, argc - index, &argv[index]);
+    pthread_mutex_lock(&cache_lock);
+    int id = cache_locate(subprocess_cache, e->cwd, e->argc, e->argv, NULL,
+        false);
+    pthread_mutex_unlock(&cache_lock);
     if (id >= 0) {
-        /* Excellent news! We found a cache entry and don't need to run the
-         * target program.
-         */
-        DEBUG("Found matching cache entry\n");
-        int res = cache_dump(cache, id);
-        cache_close(cache);
-        return res;
+        DEBUG("Found matching cache entry for subprocess %s\n", e->path);
+        if (replay(p, proc, id) == 0 && syscall_exit_group(s, 0) == 0) {
+            exec_free(e);
+            return true;
+        }
+        /* Running the program instead rewrites anything we wrote out. */
+        DEBUG("Failed to replay subprocess %s\n", e->path);
     }
 
-    /* If we've reached this point, we failed to locate a suitable cached entry
-     * for this execution. We need to actually run the program itself.
-     */
-
-    depset_t *deps = depset_new();
-    if (deps == NULL) {
-        ERROR("Failed to create dependency set\n");
-        return -1;
+    e->deps = depset_new();
+    if (e->deps == NULL) {
+        exec_free(e);
+        return false;
     }
+    e->refs = 1;
+    e->pid = proc->pid;
+    e->pending = true;
+    e->cacheable = true;
+    e->status = -1;
+
+    /* The process's reference to its previous subprocess is now held by the
+     * new one.
+     */
+    e->parent = proc->data;
+    proc->data = e;
+    return false;
+}
 
-    target_t target;
-    if (trace(&target, &argv[index], hook_getenv ? argv[0] : NULL) != 0) {
-        ERROR("Failed to start and trace target %s\n", argv[index]);
-        return -1;
+/* Handle exit from an execve in subprocess caching mode. */
+static void exec_return(syscall_t *s) {
+    exec_t *e = s->proc->data;
+    if (e == NULL || !e->pending || e->pid != s->proc->pid)
+        return;
+
+    if (s->result == 0) {
+        pthread_mutex_lock(&exec_lock);
+        e->pending = false;
+        pthread_mutex_unlock(&exec_lock);
+        return;
     }
 
-    bool success = false;
+    /* The process carries on running its previous program. Anything we
+     * attributed to the failed one was also attributed to the enclosing
+     * subprocesses.
+     */
+    assert(e->refs == 1);
+    s->proc->data = e->parent;
+    exec_free(e);
+}
 
-    syscall_t *s;
-    while ((s = next_syscall(&target)) != NULL) {
+/* Retrieve the flags of an open-like syscall. Returns 0 on success. */
+static int get_open_flags(syscall_t *s, int *flags) {
+    switch (s->call) {
+        case SYS_open:
+            *flags = (int)syscall_getarg(s, 2);
+            return 0;
 
-        /* Any syscall we receive may be the kernel entry or exit. Handle entry
-         * separately first because there are relatively few syscalls where
-         * entry is relevant for us. The relevant ones are essentially ones
-         * that destroy some resource we need to measure before it disappears.
-         */
-        if (s->enter) {
-            IDEBUG("trapped entry of %s from pid %u\n",
-                translate_syscall(s->call), s->proc->pid);
+        case SYS_openat:
+            *flags = (int)syscall_getarg(s, 3);
+            return 0;
 
-            switch (s->call) {
+#ifdef SYS_openat2
+        case SYS_openat2: {
+            /* The flags are the first member of the struct open_how this
+             * points to.
+             */
+            uint64_t how_flags;
+            if (syscall_getdata(s, 3, &how_flags, sizeof(how_flags)) != 0) {
+                DEBUG("Failed to retrieve open_how argument to openat2\n");
+                return -1;
+            }
+            *flags = (int)how_flags;
+            return 0;
+        }
+#endif
 
-                /* We need to handle execve on kernel entry because our
-                 * original address space containing the input argument is gone
-                 * on kernel exit.
-                 */
-                case SYS_execve:
-                    if (add_from_reg(deps, s, 1, XC_INPUT) != 0)
-                        goto bailout;
-                    break;
+        default:
+            assert(!"unexpected open-like syscall");
+            return -1;
+    }
+}
 
-                case SYS_open: {
-                    /* In the case where a file is being opened RW, we need to
-                     * do our measurement beforehand in case the user is using
-                     * a flag like O_CREAT that makes measurement ambiguous
-                     * when done afterwards. To simplify things, we handle RO
-                     * open here as well.
-                     */
-                    int flags = (int)syscall_getarg(s, 2);
-                    filetype_t type = classify_open_entry(flags);
-                    if (type != XC_NONE)
-                        if (add_from_reg(deps, s, 1, type) != 0)
-                            goto bailout;
-                    break;
-                }
-
-                case SYS_openat: {
-                    /* As for open() but we need to handle prefixing from a file
-                     * descriptor.
-                     */
-                    int flags = (int)syscall_getarg(s, 3);
-                    filetype_t type = classify_open_entry(flags);
-                    if (type != XC_NONE)
-                        if (add_from_fd_and_reg(deps, s, 1, 2, type) != 0)
-                            goto bailout;
-                    break;
-                }
+/* Whether a renameat2 call swaps its source and destination. */
+static bool renames_exchange(syscall_t *s) {
+#ifdef SYS_renameat2
+    return s->call == SYS_renameat2 &&
+        ((unsigned)syscall_getarg(s, 5) & RENAME_EXCHANGE);
+#else
+    (void)s;
+    return false;
+#endif
+}
 
-                case SYS_rename:
-                    if (add_from_reg(deps, s, 1, XC_INPUT) != 0)
-                        goto bailout;
-                    break;
+/* Whether a descriptor argument to a syscall refers to a regular file the
+ * process opened while we were watching. Writing through one modifies that
+ * file as surely as opening it for writing would. Descriptors we know nothing
+ * about are the standard streams and the like, which are generally not files
+ * the target also reads.
+ */
+static bool writes_file(syscall_t *s, int fdarg) {
+    if (s->proc->fds == NULL)
+        return false;
 
-                case SYS_unlink:
-                    if (add_from_reg(deps, s, 1, XC_INPUT) != 0)
-                        goto bailout;
-                    break;
+    const char *path = fdtable_get(s->proc->fds,
+        (int)syscall_getarg(s, fdarg));
+    if (path == NULL)
+        return false;
 
-                case SYS_rmdir:
-                    if (add_from_reg(deps, s, 1, XC_INPUT) != 0)
-                        goto bailout;
-                    break;
+    struct stat st;
+    return stat(path, &st) != 0 || S_ISREG(st.st_mode);
+}
 
-                case SYS_renameat:
-                case SYS_unlinkat:
-                    DEBUG("bailing out due to unhandled syscall %s (%ld)\n",
-                        translate_syscall(s->call), s->call);
-                    goto bailout;
+/* Determine whether a syscall may modify the filesystem when we let it
+ * proceed from entry. Before letting one through, any inputs we have queued
+ * need to have been measured, lest we measure them after modification.
+ */
+static bool may_modify(syscall_t *s) {
+    switch (s->call) {
 
-                default:
-                    IDEBUG("irrelevant syscall entry %s (%ld)\n",
-                        translate_syscall(s->call), s->call);
-            }
-            IDEBUG("resuming entry of %s for pid %u\n",
-                translate_syscall(s->call), s->proc->pid);
-            acknowledge_syscall(s);
-            continue;
+        case SYS_pwrite64:
+        case SYS_pwritev:
+#ifdef SYS_pwritev2
+        case SYS_pwritev2:
+#endif
+        case SYS_sendfile:
+        case SYS_write:
+        case SYS_writev:
+            return writes_file(s, 1);
+
+        case SYS_copy_file_range:
+        case SYS_splice:
+            return writes_file(s, 3);
+
+        case SYS_MMAP:
+            return (syscall_getarg(s, 3) & PROT_WRITE) &&
+                (syscall_getarg(s, 4) & MAP_SHARED) && writes_file(s, 5);
+
+        case SYS_open:
+        case SYS_openat:
+#ifdef SYS_openat2
+        case SYS_openat2:
+#endif
+        {
+            int flags;
+            if (get_open_flags(s, &flags) != 0)
+                return true;
+            return flags_to_mode(flags) != O_RDONLY ||
+                (flags & (O_CREAT|O_TRUNC));
         }
 
-        /* We should now only be handling syscall exits. */
-        assert(!s->enter);
+        case SYS_chmod:
+        case SYS_creat:
+        case SYS_fallocate:
+        case SYS_fchmod:
+        case SYS_fchmodat:
+        case SYS_ftruncate:
+        case SYS_futimesat:
+        case SYS_link:
+        case SYS_linkat:
+        case SYS_mkdir:
+        case SYS_mkdirat:
+        case SYS_mknod:
+        case SYS_mknodat:
+        case SYS_rename:
+        case SYS_renameat:
+#ifdef SYS_renameat2
+        case SYS_renameat2:
+#endif
+        case SYS_rmdir:
+        case SYS_symlink:
+        case SYS_symlinkat:
+        case SYS_truncate:
+        case SYS_unlink:
+        case SYS_unlinkat:
+        case SYS_utime:
+        case SYS_utimensat:
+        case SYS_utimes:
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+/* Handle a syscall from the target, resuming the process that made it.
+ * Returns 0 on success or -1 if we cannot follow the target, in which case the
+ * process is left stopped.
+ */
+static int handle(pipeline_t *pipeline, syscall_t *s) {
 
-        IDEBUG("trapped exit of %s from pid %u\n", translate_syscall(s->call),
-            s->proc->pid);
+    /* Any syscall we receive may be the kernel entry or exit. Handle entry
+     * separately first because there are relatively few syscalls where
+     * entry is relevant for us. The relevant ones are essentially ones
+     * that destroy some resource we need to measure before it disappears.
+     */
+    if (s->enter) {
+        IDEBUG("trapped entry of %s from pid %u\n",
+            translate_syscall(s->call), s->proc->pid);
 
         switch (s->call) {
 
-            case SYS_access:
-                if (add_from_reg(deps, s, 1, XC_INPUT) != 0)
-                    goto bailout;
-                break;
-
-            case SYS_chdir:
-                if (s->result != 0) {
-                    /* The target failed to change directory; no action
-                     * required.
-                     */
+            /* We need to handle execve on kernel entry because our
+             * original address space containing the input argument is gone
+             * on kernel exit.
+             */
+            case SYS_execve:
+                if (cache_subprocess && exec_enter(pipeline, s))
                     break;
-                }
-                /* Here, we could read the new working directory of the process
-                 * out of the argument to their syscall, but rather than have
-                 * to deal with complications involving relative paths we just
-                 * do a standard update. If anything, this should be faster as
-                 * we read directly from /proc instead of mmaping.
-                 */
-                if (proc_update_cwd(s->proc) != 0) {
-                    DEBUG("bailing out due to failure to read current working "
-                        "directory\n");
-                    goto bailout;
-                }
+                if (add_from_reg(pipeline, s, 1, XC_INPUT) != 0)
+                    return -1;
                 break;
 
-            case SYS_chmod:
-                if (add_from_reg(deps, s, 1, XC_OUTPUT) != 0)
-                    goto bailout;
-                break;
-
-            case SYS_creat:
-                if (add_from_reg(deps, s, 1, XC_OUTPUT) != 0)
-                    goto bailout;
-                break;
-
-            case SYS_mkdir:
-                if (add_from_reg(deps, s, 1, XC_OUTPUT) != 0)
-                    goto bailout;
+            case SYS_execveat:
+                if (add_from_fd_and_reg(pipeline, s, 1, 2, XC_INPUT) != 0)
+                    return -1;
                 break;
 
             case SYS_open: {
-                /* Note that we are only handling the 'write' aspects of an
-                 * open call here, because the 'read' aspects were handled on
-                 * syscall entry.
+                /* In the case where a file is being opened RW, we need to
+                 * do our measurement beforehand in case the user is using
+                 * a flag like O_CREAT that makes measurement ambiguous
+                 * when done afterwards. To simplify things, we handle RO
+                 * open here as well.
                  */
                 int flags = (int)syscall_getarg(s, 2);
-                filetype_t type = classify_open_exit(flags);
+                filetype_t type = classify_open_entry(flags);
                 if (type != XC_NONE)
-                    if (add_from_reg(deps, s, 1, type) != 0)
-                        goto bailout;
+                    if (add_from_reg(pipeline, s, 1, type) != 0)
+                        return -1;
                 break;
             }
 
-            case SYS_openat: {
-                int flags = (int)syscall_getarg(s, 3);
-                filetype_t type = classify_open_exit(flags);
+            case SYS_openat:
+#ifdef SYS_openat2
+            case SYS_openat2:
+#endif
+            {
+                /* As for open() but we need to handle prefixing from a file
+                 * descriptor.
+                 */
+                int flags;
+                if (get_open_flags(s, &flags) != 0)
+                    return -1;
+                filetype_t type = classify_open_entry(flags);
                 if (type != XC_NONE)
-                    if (add_from_fd_and_reg(deps, s, 1, 2, type) != 0)
-                        goto bailout;
+                    if (add_from_fd_and_reg(pipeline, s, 1, 2, type) != 0)
+                        return -1;
                 break;
             }
 
-            case SYS_readlink:
-                if (add_from_reg(deps, s, 1, XC_INPUT) != 0)
-                    goto bailout;
+            /* The following remove a path, so we need to measure it
+             * before it is gone. The target does not depend on the
+             * contents, only on whether the path existed, so these are
+             * ambiguous. In particular, a linker removing its output
+             * before writing it anew should not make that output an
+             * input.
+             */
+            case SYS_rename:
+            case SYS_rmdir:
+            case SYS_unlink:
+                if (add_from_reg(pipeline, s, 1, XC_AMBIGUOUS) != 0)
+                    return -1;
                 break;
 
-            case SYS_stat:
-                if (add_from_reg(deps, s, 1, XC_AMBIGUOUS) != 0)
-                    goto bailout;
+            case SYS_renameat:
+#ifdef SYS_renameat2
+            case SYS_renameat2:
+#endif
+                if (add_from_fd_and_reg(pipeline, s, 1, 2,
+                        XC_AMBIGUOUS) != 0)
+                    return -1;
+                if (renames_exchange(s) &&
+                        add_from_fd_and_reg(pipeline, s, 3, 4,
+                            XC_AMBIGUOUS) != 0)
+                    return -1;
+                break;
+
+            case SYS_unlinkat:
+                if (add_from_fd_and_reg(pipeline, s, 1, 2,
+                        XC_AMBIGUOUS) != 0)
+                    return -1;
                 break;
 
-            /* XXX: The syscalls that follow are known to be relevant, but are
-             * not yet handled. Implement handlers for these on demand.
-             */
-            case SYS__sysctl:
-            case SYS_acct:
-            case SYS_chown:
-            case SYS_chroot:
-            case SYS_fchdir:
-            case SYS_link:
-            case SYS_linkat:
-            case SYS_mkdirat:
-            case SYS_mknod:
-            case SYS_mknodat:
-            case SYS_mount:
-            case SYS_pivot_root:
-            case SYS_readlinkat:
-            case SYS_rename:
-            case SYS_renameat:
-            case SYS_statfs:
-            case SYS_swapoff:
-            case SYS_swapon:
-            case SYS_symlink:
-            case SYS_symlinkat:
             case SYS_truncate:
-#if __WORDSIZE == 32
-            /* umount is not available on a 64-bit kernel. */
-            case SYS_umount:
+                /* Truncating to anything other than zero keeps some of the
+                 * existing contents.
+                 */
+                if (syscall_getarg(s, 2) != 0 &&
+                        add_from_reg(pipeline, s, 1, XC_INPUT) != 0)
+                    return -1;
+                break;
+
+            /* Reads and writes through descriptors only concern the
+             * subprocesses the process belongs to.
+             */
+            case SYS_pread64:
+            case SYS_preadv:
+#ifdef SYS_preadv2
+            case SYS_preadv2:
 #endif
-            case SYS_umount2:
-            case SYS_uselib:
-                DEBUG("bailing out due to unhandled syscall %s (%ld)\n",
-                    translate_syscall(s->call), s->call);
-                goto bailout;
+            case SYS_read:
+            case SYS_readv:
+            case SYS_recvfrom:
+            case SYS_recvmmsg:
+            case SYS_recvmsg:
+                exec_io(s, 1, XC_INPUT);
+                break;
+
+            case SYS_pwrite64:
+            case SYS_pwritev:
+#ifdef SYS_pwritev2
+            case SYS_pwritev2:
+#endif
+            case SYS_sendmmsg:
+            case SYS_sendmsg:
+            case SYS_sendto:
+            case SYS_vmsplice:
+            case SYS_write:
+            case SYS_writev:
+                exec_io(s, 1, XC_OUTPUT);
+                break;
+
+            case SYS_sendfile:
+                exec_io(s, 2, XC_INPUT);
+                exec_io(s, 1, XC_OUTPUT);
+                break;
+
+            case SYS_copy_file_range:
+            case SYS_splice:
+                exec_io(s, 1, XC_INPUT);
+                exec_io(s, 3, XC_OUTPUT);
+                break;
+
+            case SYS_tee:
+                exec_io(s, 1, XC_INPUT);
+                exec_io(s, 2, XC_OUTPUT);
+                break;
 
             default:
-                IDEBUG("irrelevant syscall exit %s (%ld)\n",
+                IDEBUG("irrelevant syscall entry %s (%ld)\n",
                     translate_syscall(s->call), s->call);
         }
 
-        IDEBUG("resuming exit of %s for pid %u\n", translate_syscall(s->call),
-            s->proc->pid);
+        if (may_modify(s)) {
+            /* Count the syscall before flushing, so that any tracer queueing
+             * an input after the flush measures it straight away.
+             */
+            s->proc->modifying = true;
+            __atomic_add_fetch(&modifying, 1, __ATOMIC_SEQ_CST);
+            if (pipeline_flush(pipeline) != 0)
+                return -1;
+
+            /* A shared, writable mapping can modify the file at any point
+             * from now on, without another syscall. So we leave the count
+             * raised for the rest of the run.
+             */
+            if (s->call == SYS_MMAP) {
+                DEBUG("pid %u mapped a file for writing; no longer deferring "
+                    "inputs\n", s->proc->pid);
+                s->proc->modifying = false;
+            }
+        }
+
+        IDEBUG("resuming entry of %s for pid %u\n",
+            translate_syscall(s->call), s->proc->pid);
         acknowledge_syscall(s);
+        return 0;
+    }
+
+    /* We should now only be handling syscall exits. */
+    assert(!s->enter);
 
+    IDEBUG("trapped exit of %s from pid %u\n", translate_syscall(s->call),
+        s->proc->pid);
+
+    if (s->proc->modifying) {
+        s->proc->modifying = false;
+        __atomic_sub_fetch(&modifying, 1, __ATOMIC_SEQ_CST);
     }
 
-    /* If we've reached here (i.e. not jumped to 'bailout'), we successfully
-     * traced the target. Hence we can now cache its dependency set for
-     * retrieval on a later run.
+    switch (s->call) {
+
+        case SYS_access:
+            if (add_from_reg(pipeline, s, 1, XC_INPUT) != 0)
+                return -1;
+            break;
+
+        case SYS_chdir:
+        case SYS_fchdir:
+            if (s->result != 0) {
+                /* The target failed to change directory; no action
+                 * required.
+                 */
+                break;
+            }
+            /* We cannot work out the new directory from the argument, as
+             * the kernel resolves any symlink in it and then resolves ".."
+             * relative to wherever that led. Ask the kernel instead.
+             */
+            if (proc_update_cwd(s->proc) != 0) {
+                DEBUG("bailing out due to failure to read current working "
+                    "directory\n");
+                return -1;
+            }
+            break;
+
+        case SYS_chmod:
+            if (add_from_reg(pipeline, s, 1, XC_OUTPUT) != 0)
+                return -1;
+            break;
+
+        /* The following modify a file through a descriptor. */
+        case SYS_fallocate:
+        case SYS_fchmod:
+        case SYS_ftruncate:
+            if (s->result == 0 &&
+                    add_from_fd(pipeline, s, 1, XC_OUTPUT) != 0)
+                return -1;
+            break;
+
+        case SYS_creat:
+            if (add_from_reg(pipeline, s, 1, XC_OUTPUT) != 0)
+                return -1;
+            break;
+
+        case SYS_execve:
+            if (cache_subprocess)
+                exec_return(s);
+            break;
+
+        case SYS_mkdir:
+            if (add_from_reg(pipeline, s, 1, XC_OUTPUT) != 0)
+                return -1;
+            break;
+
+        case SYS_open: {
+            /* Note that we are only handling the 'write' aspects of an
+             * open call here, because the 'read' aspects were handled on
+             * syscall entry.
+             */
+            int flags = (int)syscall_getarg(s, 2);
+            filetype_t type = classify_open_exit(flags);
+            if (type != XC_NONE)
+                if (add_from_reg(pipeline, s, 1, type) != 0)
+                    return -1;
+            break;
+        }
+
+        case SYS_openat:
+#ifdef SYS_openat2
+        case SYS_openat2:
+#endif
+        {
+            int flags;
+            if (get_open_flags(s, &flags) != 0)
+                return -1;
+            filetype_t type = classify_open_exit(flags);
+            if (type != XC_NONE)
+                if (add_from_fd_and_reg(pipeline, s, 1, 2, type) != 0)
+                    return -1;
+            break;
+        }
+
+        case SYS_readlink:
+            if (add_from_reg(pipeline, s, 1, XC_INPUT) != 0)
+                return -1;
+            break;
+
+        case SYS_stat:
+        case SYS_lstat:
+            if (add_from_reg(pipeline, s, 1, XC_AMBIGUOUS) != 0)
+                return -1;
+            break;
+
+        /* Which filesystem a path is on depends only on the path existing,
+         * as for access.
+         */
+        case SYS_statfs:
+            if (add_from_reg(pipeline, s, 1, XC_INPUT) != 0)
+                return -1;
+            break;
+
+#ifdef SYS_newfstatat
+        case SYS_newfstatat:
+#endif
+#ifdef SYS_fstatat64
+        case SYS_fstatat64:
+#endif
+#ifdef SYS_statx
+        case SYS_statx:
+#endif
+            if (add_from_fd_and_reg(pipeline, s, 1, 2, XC_AMBIGUOUS) != 0)
+                return -1;
+            break;
+
+        case SYS_faccessat:
+#ifdef SYS_faccessat2
+        case SYS_faccessat2:
+#endif
+        case SYS_readlinkat:
+            if (add_from_fd_and_reg(pipeline, s, 1, 2, XC_INPUT) != 0)
+                return -1;
+            break;
+
+        case SYS_fchmodat:
+        case SYS_futimesat:
+        case SYS_mkdirat:
+        case SYS_utimensat:
+            if (add_from_fd_and_reg(pipeline, s, 1, 2, XC_OUTPUT) != 0)
+                return -1;
+            break;
+
+        case SYS_utime:
+        case SYS_utimes:
+            if (add_from_reg(pipeline, s, 1, XC_OUTPUT) != 0)
+                return -1;
+            break;
+
+        /* For the following, which create or replace a path, the path is
+         * only an output if the syscall succeeded. Otherwise it may be an
+         * unrelated file that already existed. The source of a rename was
+         * measured on entry; a link's source is only read.
+         */
+        case SYS_link:
+            if (s->result == 0 &&
+                    (add_from_reg(pipeline, s, 1, XC_INPUT) != 0 ||
+                     add_from_reg(pipeline, s, 2, XC_OUTPUT) != 0))
+                return -1;
+            break;
+
+        case SYS_linkat:
+            if (s->result == 0 &&
+                    (add_from_fd_and_reg(pipeline, s, 1, 2,
+                        XC_INPUT) != 0 ||
+                     add_from_fd_and_reg(pipeline, s, 3, 4,
+                        XC_OUTPUT) != 0))
+                return -1;
+            break;
+
+        case SYS_rename:
+        case SYS_symlink:
+            if (s->result == 0 &&
+                    add_from_reg(pipeline, s, 2, XC_OUTPUT) != 0)
+                return -1;
+            break;
+
+        case SYS_renameat:
+#ifdef SYS_renameat2
+        case SYS_renameat2:
+#endif
+            if (s->result == 0 &&
+                    add_from_fd_and_reg(pipeline, s, 3, 4, XC_OUTPUT) != 0)
+                return -1;
+            if (s->result == 0 && renames_exchange(s) &&
+                    add_from_fd_and_reg(pipeline, s, 1, 2, XC_OUTPUT) != 0)
+                return -1;
+            break;
+
+        case SYS_symlinkat:
+            if (s->result == 0 &&
+                    add_from_fd_and_reg(pipeline, s, 2, 3, XC_OUTPUT) != 0)
+                return -1;
+            break;
+
+        case SYS_truncate:
+            if (s->result == 0 &&
+                    add_from_reg(pipeline, s, 1, XC_OUTPUT) != 0)
+                return -1;
+            break;
+
+        /* XXX: The syscalls that follow are known to be relevant, but are
+         * not yet handled. Implement handlers for these on demand.
+         */
+        case SYS__sysctl:
+        case SYS_acct:
+        case SYS_chown:
+        case SYS_chroot:
+        case SYS_mknod:
+        case SYS_mknodat:
+        case SYS_mount:
+        case SYS_pivot_root:
+        case SYS_swapoff:
+        case SYS_swapon:
+#if __WORDSIZE == 32
+        /* umount is not available on a 64-bit kernel. */
+        case SYS_umount:
+#endif
+        case SYS_umount2:
+        case SYS_uselib:
+            __atomic_store_n(&unhandled, translate_syscall(s->call),
+                __ATOMIC_RELAXED);
+            if (!cache_subprocess) {
+                DEBUG("bailing out due to unhandled syscall %s (%ld)\n",
+                    translate_syscall(s->call), s->call);
+                return -1;
+            }
+            /* Rather than give up on the whole target, keep tracing so that
+             * the subprocesses this one is not part of can still be cached.
+             */
+            DEBUG("not caching target due to unhandled syscall %s (%ld)\n",
+                translate_syscall(s->call), s->call);
+            exec_taint(s->proc->data);
+            __atomic_store_n(&incomplete, true, __ATOMIC_RELAXED);
+            break;
+
+        default:
+            IDEBUG("irrelevant syscall exit %s (%ld)\n",
+                translate_syscall(s->call), s->call);
+    }
+
+    IDEBUG("resuming exit of %s for pid %u\n", translate_syscall(s->call),
+        s->proc->pid);
+    acknowledge_syscall(s);
+    return 0;
+}
+
+/* Trace the processes of one tracer. This runs in the thread of the tracer.
+ * Returns 0 if we could follow all of them.
+ */
+static int run(tracer_t *tracer) {
+    syscall_t *s;
+    while ((s = next_syscall(tracer)) != NULL) {
+        if (handle(pipeline, s) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Whether a signal that killed the target says something about the target
+ * itself, like a crash or a failed assertion. Anything else, like an interrupt
+ * or a timeout, was done to the target from outside and would likely not
+ * happen again.
+ */
+static bool deterministic_signal(int sig) {
+    switch (sig) {
+        case SIGABRT:
+        case SIGBUS:
+        case SIGFPE:
+        case SIGILL:
+        case SIGSEGV:
+        case SIGSYS:
+        case SIGTRAP:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/* Returns a monotonic time in microseconds, for timing the target. */
+static int64_t now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Run the target without tracing it. Returns its exit status, as complete()
+ * would, or -1 if it could not be started.
+ */
+static int run_untraced(char **argv) {
+    pid_t pid = fork();
+    if (pid == -1)
+        return -1;
+
+    if (pid == 0) {
+        execvp(argv[0], argv);
+        ERROR("Failed to execute %s\n", argv[0]);
+        _exit(127);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR)
+            return -1;
+    }
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    assert(WIFSIGNALED(status));
+    return (1 << 7)|WTERMSIG(status);
+}
+
+/* Write the cache entry for the target from a detached process, so that we
+ * can exit without waiting for it. 'write_entry' writes the entry with the
+ * given cache, opening one if it is NULL. On success, the background process
+ * takes care of removing the target's captured output. Returns 0 if the entry
+ * is being written in the background, -2 if it need not be written because
+ * another process is already writing it, or -1 if it should be written in the
+ * foreground instead.
+ */
+static int commit_in_background(int argc, char **argv, int64_t elapsed,
+        const char *outfile, const char *errfile,
+        int (*write_entry)(cache_t **c)) {
+    char *claim;
+    int fd = cache_claim_commit(cache_dir, NULL, argc, argv, async_limit,
+        &claim);
+    if (fd < 0)
+        return fd;
+
+    /* Fork twice, so the writer is not our child and nothing has to wait for
+     * it.
      */
-    success = true;
+    pid_t pid = fork();
+    if (pid == 0) {
+        (void)setsid();
+        pid_t writer = fork();
+        if (writer != 0)
+            _exit(writer == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
+
+        /* Let go of our caller's streams, so that whoever is reading them does
+         * not wait for us. The database connection we inherited belongs to
+         * our parent, so open the cache afresh.
+         */
+        int null = open("/dev/null", O_RDWR);
+        if (null != -1) {
+            (void)dup2(null, STDIN_FILENO);
+            (void)dup2(null, STDOUT_FILENO);
+            (void)dup2(null, STDERR_FILENO);
+            if (null > STDERR_FILENO)
+                close(null);
+        }
+        cache_t *c = NULL;
+        int r = write_entry(&c);
+        if (r != 0) {
+            if (c == NULL)
+                c = cache_open(cache_dir, statistics);
+            if (c != NULL)
+                (void)cache_record_outcome(c, NULL, argc, argv, true,
+                    "could not write entry", false, elapsed);
+        }
+        if (c != NULL)
+            cache_close(c);
+        if (outfile != NULL)
+            unlink(outfile);
+        if (errfile != NULL)
+            unlink(errfile);
+        cache_release_commit(claim, fd);
+
+        /* We inherited the lock on the target, so anyone waiting on it now
+         * finds the entry.
+         */
+        if (flight != -1)
+            cache_unlock_invocation(flight_lock, flight);
+        _exit(r == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    int status;
+    if (pid == -1 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+            WEXITSTATUS(status) != EXIT_SUCCESS) {
+        DEBUG("Failed to start background writer\n");
+        cache_release_commit(claim, fd);
+        return -1;
+    }
+
+    DEBUG("Writing cache entry in the background\n");
+    close(fd);
+    free(claim);
+    if (flight != -1) {
+        /* The lock on the target is released when the background process is
+         * done with it.
+         */
+        close(flight);
+        free(flight_lock);
+        flight = -1;
+    }
+    return 0;
+}
+
+/* Exit as a target replayed from cache did. Returns the exit status to use if
+ * we are still around.
+ */
+static int replicate(int status, int sig) {
+    if (sig == 0)
+        return status;
+
+    DEBUG("Replaying termination by signal %d\n", sig);
+
+    /* We only pretend to crash, so do not leave a core dump behind. */
+    struct rlimit none = { 0 };
+    (void)setrlimit(RLIMIT_CORE, &none);
 
-bailout:;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, sig);
+    signal(sig, SIG_DFL);
+    sigprocmask(SIG_UNBLOCK, &set, NULL);
+    raise(sig);
+
+    /* The signal did not kill us, so report it as a shell would. */
+    return (1 << 7)|sig;
+}
+
+/* Open the file a batch command's output should go to, relative to its
+ * working directory. Returns a descriptor or -1 on failure.
+ */
+static int open_output(const char *cwd, const char *path) {
+    if (path == NULL)
+        return open("/dev/null", O_WRONLY|O_CLOEXEC);
+    autofree char *absolute = path[0] == '/' ? strdup(path) :
+        aprintf("%s/%s", cwd, path);
+    if (absolute == NULL)
+        return -1;
+    return open(absolute, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666);
+}
+
+/* Run commands read from stdin, as if each were passed to its own xcache, and
+ * report how each went on stdout. 'options' are the arguments we were given
+ * before the (empty) command.
+ *
+ * Each request is a working directory, a command line and an environment,
+ * followed by the paths to write the command's stdout and stderr to, in the
+ * encoding of server-protocol.h. Each reply is the number of the request,
+ * counting from 0, its exit status (-1 if it could not be run) and whether it
+ * was replayed from cache. Replies are sent as commands finish, which need not
+ * be in the order they were requested.
+ *
+ * Lookups are done here against a single open cache. Commands that miss are
+ * run by xcache processes of their own, as tracing relies on process-wide
+ * state, up to 'jobs' at a time.
+ */
+static int serve_batch(int noptions, char **options) {
+    cache_t *cache = cache_open(cache_dir, statistics);
+    if (cache == NULL) {
+        ERROR("Failed to open cache\n");
+        return -1;
+    }
+
+    /* The command line for the xcaches we start, to which each command is
+     * appended.
+     */
+    autofree char **base = calloc(noptions + 3, sizeof(base[0]));
+    if (base == NULL) {
+        cache_close(cache);
+        return -1;
+    }
+    int nbase = 0;
+    base[nbase++] = options[0];
+    for (int i = 1; i < noptions; i++) {
+        if (i == batch_arg)
+            continue;
+        if (jobs_arg > 0 && (i == jobs_arg || i == jobs_arg + 1))
+            continue;
+        base[nbase++] = options[i];
+    }
+    /* Our default cache directory comes from an environment the command may
+     * not share.
+     */
+    base[nbase++] = "--cache-dir";
+    base[nbase++] = (char*)cache_dir;
+
+    if (jobs == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        jobs = cpus < 1 ? 1 : (unsigned)cpus;
+    }
+    autofree pid_t *running = calloc(jobs, sizeof(running[0]));
+    autofree int *ids = calloc(jobs, sizeof(ids[0]));
+    if (running == NULL || ids == NULL) {
+        cache_close(cache);
+        return -1;
+    }
+    unsigned nrunning = 0;
+
+    /* We find out about commands finishing through a signalfd, so we can wait
+     * for them and further requests together.
+     */
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigset_t old;
+    sigprocmask(SIG_BLOCK, &chld, &old);
+    int sfd = signalfd(-1, &chld, SFD_CLOEXEC|SFD_NONBLOCK);
+    if (sfd == -1) {
+        ERROR("Failed to create signalfd\n");
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        cache_close(cache);
+        return -1;
+    }
+
+    /* A client that stops listening should not kill us mid-command. */
+    signal(SIGPIPE, SIG_IGN);
+
+    int reply(int id, int status, bool hit) {
+        if (write_int(STDOUT_FILENO, id) != 0 ||
+                write_int(STDOUT_FILENO, status) != 0 ||
+                write_int(STDOUT_FILENO, hit) != 0) {
+            ERROR("Failed to reply to request %d\n", id);
+            return -1;
+        }
+        return 0;
+    }
+
+    /* Start an xcache to run a command. Returns 0 on success. */
+    int start(int id, const char *cwd, char **argv, char **envp,
+            const char *outpath, const char *errpath) {
+        pid_t pid = fork();
+        if (pid == -1)
+            return -1;
+
+        if (pid == 0) {
+            sigprocmask(SIG_SETMASK, &old, NULL);
+            signal(SIGPIPE, SIG_DFL);
+            if (chdir(cwd) != 0)
+                _exit(127);
+            int in = open("/dev/null", O_RDONLY);
+            int out = open_output(cwd, outpath);
+            int err = open_output(cwd, errpath);
+            if (in == -1 || out == -1 || err == -1 ||
+                    dup2(in, STDIN_FILENO) == -1 ||
+                    dup2(out, STDOUT_FILENO) == -1 ||
+                    dup2(err, STDERR_FILENO) == -1)
+                _exit(127);
+
+            int argc = 0;
+            while (argv[argc] != NULL)
+                argc++;
+            char **args = calloc(nbase + argc + 1, sizeof(args[0]));
+            if (args == NULL)
+                _exit(127);
+            memcpy(args, base, nbase * sizeof(args[0]));
+            memcpy(&args[nbase], argv, argc * sizeof(args[0]));
+            execve("/proc/self/exe", args, envp);
+            _exit(127);
+        }
+
+        running[nrunning] = pid;
+        ids[nrunning] = id;
+        nrunning++;
+        return 0;
+    }
+
+    /* Read and act on a request. Returns 0 on success, 1 at the end of the
+     * requests or -1 on failure.
+     */
+    int next_id = 0;
+    int request(void) {
+        char *cwd;
+        ssize_t len = read_data(STDIN_FILENO, (unsigned char**)&cwd);
+        if (len == -2)
+            return 1;
+        if (len <= 0 || cwd[len - 1] != '\0' || cwd[0] != '/') {
+            if (len > 0)
+                free(cwd);
+            ERROR("Malformed request\n");
+            return -1;
+        }
+
+        int ret = -1;
+        int argc;
+        char **argv = read_strings(STDIN_FILENO, &argc);
+        char **envp = argv == NULL ? NULL : read_strings(STDIN_FILENO, NULL);
+        char *outpath = NULL, *errpath = NULL;
+        if (envp == NULL || argc == 0 ||
+                read_string(STDIN_FILENO, &outpath) != 0 ||
+                read_string(STDIN_FILENO, &errpath) != 0) {
+            ERROR("Malformed request\n");
+            goto done;
+        }
+
+        int id = next_id++;
+        int lookup = cache_locate(cache, cwd, argc, argv, envp,
+            cache_failures);
+        if (lookup >= 0) {
+            DEBUG("Found matching cache entry for request %d\n", id);
+            int outfd = open_output(cwd, outpath);
+            int errfd = open_output(cwd, errpath);
+            int status, sig;
+            int r = outfd == -1 || errfd == -1 ? -1 :
+                cache_dump(cache, lookup, outfd, errfd, &status, &sig);
+            if (errfd != -1)
+                close(errfd);
+            if (outfd != -1)
+                close(outfd);
+            if (r == 0) {
+                ret = reply(id, sig == 0 ? status : (1 << 7)|sig, true);
+                goto done;
+            }
+            DEBUG("Failed to replay cache entry; running request %d\n", id);
+        }
+
+        if (start(id, cwd, argv, envp, outpath, errpath) != 0) {
+            DEBUG("Failed to start request %d\n", id);
+            ret = reply(id, -1, false);
+            goto done;
+        }
+        ret = 0;
+
+done:
+        free(errpath);
+        free(outpath);
+        free_strings(envp);
+        free_strings(argv);
+        free(cwd);
+        return ret;
+    }
+
+    /* Reap whichever commands have finished. Returns 0 on success. */
+    int reap(void) {
+        struct signalfd_siginfo info;
+        while (read(sfd, &info, sizeof(info)) == sizeof(info));
+
+        for (unsigned i = 0; i < nrunning; ) {
+            int status;
+            pid_t pid = waitpid(running[i], &status, WNOHANG);
+            if (pid == 0 || (pid == -1 && errno == EINTR)) {
+                i++;
+                continue;
+            }
+            int ret = pid == -1 ? -1 : WIFEXITED(status) ?
+                WEXITSTATUS(status) : (1 << 7)|WTERMSIG(status);
+            int id = ids[i];
+            nrunning--;
+            running[i] = running[nrunning];
+            ids[i] = ids[nrunning];
+            if (reply(id, ret, false) != 0)
+                return -1;
+        }
+        return 0;
+    }
+
+    int ret = 0;
+    bool more = true;
+    while (more || nrunning > 0) {
+        /* Only take on more work while we have room for it. */
+        struct pollfd fds[] = {
+            { .fd = sfd, .events = POLLIN },
+            { .fd = more && nrunning < jobs ? STDIN_FILENO : -1,
+              .events = POLLIN },
+        };
+        if (poll(fds, sizeof(fds) / sizeof(fds[0]), -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            ret = -1;
+            break;
+        }
+
+        if ((fds[0].revents & POLLIN) && reap() != 0) {
+            ret = -1;
+            more = false;
+        }
+
+        if (fds[1].revents & (POLLIN|POLLHUP)) {
+            int r = request();
+            if (r != 0) {
+                more = false;
+                if (r < 0)
+                    ret = -1;
+            }
+        } else if (fds[1].revents & (POLLERR|POLLNVAL)) {
+            more = false;
+        }
+    }
+
+    close(sfd);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    cache_close(cache);
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    int index = parse_arguments(argc, argv);
+
+    if (batch) {
+        if (argc - index != 0) {
+            ERROR("--batch takes commands from stdin, not the command line\n");
+            usage(argv[0]);
+            return -1;
+        }
+        if (cache_dir == NULL)
+            cache_dir = default_cache_dir();
+        if (cache_dir == NULL || mkdirp(cache_dir) != 0) {
+            ERROR("Failed to create cache directory\n");
+            return -1;
+        }
+        return serve_batch(index, argv);
+    }
+
+    if (argc - index == 0) {
+        ERROR("No target command supplied\n");
+        usage(argv[0]);
+        return -1;
+    }
+
+    if (cache_dir == NULL) {
+        cache_dir = default_cache_dir();
+        if (cache_dir == NULL) {
+            ERROR("Failed to determine default cache directory\n");
+            return -1;
+        }
+    }
+
+    if (mkdirp(cache_dir) != 0) {
+        ERROR("Failed to create cache directory \"%s\"\n", cache_dir);
+        return -1;
+    }
+
+    bool server = use_server;
+    cache_t *cache = NULL;
+
+    /* Look for a matching entry. Returns its ID or -1 if there is none. */
+    int locate(void) {
+        return server ?
+            client_locate(cache_dir, NULL, argc - index, &argv[index], NULL,
+                cache_failures) :
+            cache_locate(cache, NULL, argc - index, &argv[index], NULL,
+                cache_failures);
+    }
+
+    /* Replay the given entry, returning our exit status. */
+    int replay(int id) {
+        /* Excellent news! We found a cache entry and don't need to run the
+         * target program.
+         */
+        DEBUG("Found matching cache entry\n");
+        int status = 0, sig = 0;
+        int res = server ? client_dump(cache_dir, id, &status, &sig) :
+            cache_dump(cache, id, STDOUT_FILENO, STDERR_FILENO, &status, &sig);
+        if (cache != NULL)
+            cache_close(cache);
+        return res != 0 ? res : replicate(status, sig);
+    }
+
+    /* If there is a server running for this cache, we can let it do the
+     * lookup for us and skip opening the cache ourselves. Rather than checking
+     * for one first, we just ask, and only go it alone if nobody answers.
+     */
+    int id = -1;
+    if (server) {
+        id = locate();
+        if (id < 0 && errno == ECONNREFUSED) {
+            server = false;
+        } else {
+            DEBUG("Using xcached for cache operations\n");
+        }
+    }
+    if (!server) {
+        cache = cache_open(cache_dir, statistics);
+        if (cache == NULL) {
+            ERROR("Failed to create cache\n");
+            return -1;
+        }
+        id = locate();
+    }
+    if (id >= 0)
+        return replay(id);
+
+    /* If we've reached this point, we failed to locate a suitable cached entry
+     * for this execution. We need to actually run the program itself.
+     */
+
+    /* Record how this run went, through the server if we have one. A server
+     * that has gone away since our lookup costs us only this record.
+     */
+    void record_outcome(bool traced, const char *reason, bool inherent,
+            int64_t us) {
+        if (server)
+            (void)client_record_outcome(cache_dir, NULL, argc - index,
+                &argv[index], traced, reason, inherent, us);
+        else if (cache != NULL)
+            (void)cache_record_outcome(cache, NULL, argc - index, &argv[index],
+                traced, reason, inherent, us);
+    }
+
+    /* If tracing this target has not paid off lately, just run it. If the
+     * server fails to tell us, we trace it as usual.
+     */
+    bool worth = true;
+    if (skip_after > 0)
+        worth = server ?
+            client_worth_tracing(cache_dir, NULL, argc - index, &argv[index],
+                skip_after, reprobe) != 0 :
+            cache_worth_tracing(cache, NULL, argc - index, &argv[index],
+                skip_after, reprobe);
+    if (!worth) {
+        DEBUG("Running target without tracing\n");
+        int64_t started = now();
+        int ret = run_untraced(&argv[index]);
+        if (ret != -1)
+            record_outcome(false, NULL, false, now() - started);
+        if (cache != NULL)
+            cache_close(cache);
+        return ret;
+    }
+
+    /* If another xcache is running this same target, wait for it to finish
+     * and use the entry it wrote rather than running the target again.
+     */
+    if (lock_timeout > 0) {
+        bool waited;
+        flight = cache_lock_invocation(cache_dir, NULL, argc - index,
+            &argv[index], lock_timeout, &waited, &flight_lock);
+        if (flight == -1) {
+            DEBUG("Gave up waiting for another xcache running this target\n");
+        } else if (waited) {
+            DEBUG("Waited for another xcache running this target\n");
+            id = locate();
+            if (id >= 0) {
+                cache_unlock_invocation(flight_lock, flight);
+                return replay(id);
+            }
+        }
+    }
+
+    depset_t *deps = depset_new();
+    if (deps == NULL) {
+        ERROR("Failed to create dependency set\n");
+        return -1;
+    }
+
+    /* Take the toolchain stamp before running the target, so that we do not
+     * record a stamp reflecting changes made while it was running.
+     */
+    autofree char *prefixes = policy_prefixes(POLICY_IMMUTABLE);
+    autofree char *stamp = prefixes == NULL ? NULL : toolchain_stamp(prefixes);
+    if (prefixes != NULL && stamp == NULL) {
+        ERROR("Failed to compute toolchain stamp\n");
+        return -1;
+    }
+
+    /* Interposition cannot see into static or setuid programs, for which we
+     * need ptrace.
+     */
+    bool interposing = interpose && interposable_search(argv[index]);
+    if (interpose && !interposing)
+        DEBUG("Cannot interpose on %s; tracing it instead\n", argv[index]);
+
+    /* Subprocesses are looked up and recorded as we trace, so we need the
+     * cache open ourselves even if there is a server.
+     */
+    if (interposing)
+        cache_subprocess = false;
+    if (cache_subprocess) {
+        if (cache == NULL)
+            cache = cache_open(cache_dir, statistics);
+        if (cache == NULL) {
+            DEBUG("Failed to open cache for subprocesses\n");
+            cache_subprocess = false;
+        }
+        subprocess_cache = cache;
+        subprocess_prefixes = prefixes;
+        subprocess_stamp = stamp;
+    }
+
+    pipeline = pipeline_new(interposing ? 0 : workers, process);
+    if (pipeline == NULL) {
+        ERROR("Failed to create dependency pipeline\n");
+        return -1;
+    }
+
+    /* Record a file access reported by libinterpose. These arrive already
+     * measured, so they bypass the pipeline.
+     */
+    int record(const char *path, filetype_t type, time_t mtime,
+            bool directory) {
+        autofree char *absolute = abspath("/", (char*)path);
+        if (absolute == NULL) {
+            DEBUG("Failed to resolve path \"%s\"\n", path);
+            return -1;
+        }
+        if (directory && !directories) {
+            IDEBUG("Skipping directory %s\n", absolute);
+            return 0;
+        }
+        if (!wanted(absolute, type))
+            return 0;
+        return depset_insert(deps, absolute, type, mtime);
+    }
+
+    if (interposing) {
+        /* libinterpose only sees the target once it is running, so record
+         * the candidates execvp will try to reach it, as ptrace would.
+         */
+        bool probe(const char *candidate, void *data __attribute__((unused))) {
+            struct stat st;
+            bool exists = stat(candidate, &st) == 0;
+            if (record(candidate, XC_INPUT, exists ? st.st_mtime : MISSING,
+                    exists && S_ISDIR(st.st_mode)) != 0)
+                interposing = false;
+            return exists && access(candidate, X_OK) == 0;
+        }
+        (void)search_path(argv[index], probe, NULL);
+        if (!interposing) {
+            ERROR("Failed to record candidates for %s\n", argv[index]);
+            return -1;
+        }
+    }
+
+    /* Capture the target's output within the cache, so that it can be moved
+     * into an entry rather than copied. Failing that, /tmp does.
+     */
+    autofree char *staging = cache_staging(cache_dir);
+
+    int64_t started = now();
+    target_t target;
+    if (trace(&target, &argv[index], argv[0], hook_getenv,
+            interposing ? record : NULL, staging) != 0) {
+        ERROR("Failed to start and trace target %s\n", argv[index]);
+        return -1;
+    }
+
+    traced = &target;
+
+    if (cache_subprocess) {
+        root = &target.root;
+        target.on_fork = follow_fork;
+        target.on_exit = follow_exit;
+    }
+
+    if (!interposing && tracers > 1 &&
+            add_tracers(&target, tracers - 1, run) != 0)
+        DEBUG("Failed to start all additional tracers\n");
+
+    /* With libinterpose, the hook records what the target does and notes in
+     * target.bailout if it cannot.
+     */
+    bool success = interposing || run(&target.tracer) == 0;
 
     int ret = complete(&target);
+    int64_t elapsed = now() - started;
+
+    /* Why we could not cache the target, if we could not. */
+    autofree char *reason = NULL;
+    if (unhandled != NULL) {
+        reason = aprintf("unhandled syscall %s", unhandled);
+    } else if (!success || target.bailout || incomplete) {
+        reason = strdup("could not follow target");
+    }
+    /* Any later reason is down to this particular run. */
+    bool inherent = reason != NULL;
+
+    if (pipeline_finish(pipeline, deps) != 0)
+        success = false;
+
+    if (target.bailout || incomplete)
+        success = false;
+
+    /* Anything we only saw the target stat or remove is an input on whether
+     * it exists.
+     */
+    if (success && depset_finalise(deps) != 0)
+        success = false;
+
+    if (reason == NULL && !success)
+        reason = strdup("could not record dependencies");
+    if (reason == NULL && target.exit_signal != 0 &&
+            !deterministic_signal(target.exit_signal))
+        reason = aprintf("killed by signal %d", target.exit_signal);
+    if (reason == NULL && ret != 0 && !cache_failures)
+        reason = aprintf("exited with status %d", ret);
 
     const char *outfile = get_stdout(&target),
                *errfile = get_stderr(&target);
 
-    if (success && ret == 0) {
+    /* Unless asked to, do not cache a target that failed. Even then, only
+     * cache one that would fail the same way again.
+     */
+    if (reason == NULL) {
         DEBUG("Adding cache entry\n");
-        if (cache_write(cache, argc - index, &argv[index], deps, &target.env,
-                outfile, errfile) != 0)
+        if (!used_immutable) {
+            /* No need to record a stamp the entry does not depend on. */
+            free(prefixes);
+            prefixes = NULL;
+            free(stamp);
+            stamp = NULL;
+        }
+        /* The status of a target killed by a signal is only our rendering of
+         * it, so record the signal alone.
+         */
+        int status = target.exit_signal == 0 ? ret : 0;
+        int write_entry(cache_t **c) {
+            int r = -1;
+            if (server)
+                r = client_write(cache_dir, NULL, argc - index, &argv[index],
+                    deps, &target.env, outfile, errfile, prefixes, stamp,
+                    status, target.exit_signal, failure_ttl);
+            if (r != 0 && *c == NULL) {
+                /* The server went away while we were tracing. */
+                *c = cache_open(cache_dir, statistics);
+            }
+            if (r != 0 && *c != NULL)
+                r = cache_write(*c, NULL, argc - index, &argv[index], deps,
+                    &target.env, outfile, errfile, prefixes, stamp, status,
+                    target.exit_signal, failure_ttl);
+            return r;
+        }
+
+        int r = -1;
+        if (async_commit)
+            r = commit_in_background(argc - index, &argv[index], elapsed,
+                outfile, errfile, write_entry);
+        if (r == 0) {
+            /* The background process owns the captured output now. */
+            outfile = errfile = NULL;
+        } else if (r == -2) {
+            DEBUG("Cache entry is already being written in the background\n");
+        } else if (write_entry(&cache) != 0) {
             /* This failure is non-critical in a sense. */
             DEBUG("Failed to write entry to cache\n");
+            reason = strdup("could not write entry");
+        }
     }
 
+    if (reason != NULL)
+        DEBUG("Target could not be cached: %s\n", reason);
+    record_outcome(true, reason, inherent, elapsed);
+
     depset_destroy(deps);
 
     if (outfile != NULL)
@@ -575,7 +2306,12 @@ bailout:;
     if (errfile != NULL)
         unlink(errfile);
 
-    cache_close(cache);
+    /* Let anyone waiting on us look for the entry we wrote. */
+    if (flight != -1)
+        cache_unlock_invocation(flight_lock, flight);
+
+    if (cache != NULL)
+        cache_close(cache);
     delete(&target);
     return ret;
 }
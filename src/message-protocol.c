@@ -1,117 +1,257 @@
 #include <assert.h>
 #include "comm-protocol.h"
+#include <errno.h>
 #include "message-protocol.h"
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+/* Where the fields of a message are read from: either a descriptor, or a
+ * buffer holding a message serialised with pack_message.
+ */
+typedef struct {
+    int fd;
+    const unsigned char *buf;
+    size_t size;
+    size_t offset;
+} source_t;
+
+/* Read a field, as read_data does. */
+static ssize_t read_field(source_t *src, unsigned char **data) {
+    if (src->buf == NULL)
+        return read_data(src->fd, data);
+    return unpack_data(src->buf, src->size, &src->offset, data);
+}
+
+/* Read a fixed size value. */
+static int read_value(source_t *src, void *value, size_t size) {
+    unsigned char *data;
+    ssize_t len = read_field(src, &data);
+    if (len != (ssize_t)size) {
+        if (len > 0)
+            free(data);
+        return -1;
+    }
+    memcpy(value, data, size);
+    free(data);
+    return 0;
+}
 
 /* Read a MSG_GETENV message. */
-static int read_getenv(int fd, message_t *message) {
+static int read_getenv(source_t *src, message_t *message) {
     assert(message != NULL);
 
     message->tag = MSG_GETENV;
 
-    if (read_data(fd, (unsigned char**)&message->key) < 0)
+    if (read_field(src, (unsigned char**)&message->key) < 0)
         return -1;
 
-    if (read_data(fd, (unsigned char**)&message->value) < 0)
+    if (read_field(src, (unsigned char**)&message->value) < 0) {
+        free(message->key);
         return -1;
+    }
 
     return 0;
 }
 
 /* Read a MSG_EXEC_ERROR message. */
-static int read_exec_error(int fd, message_t *message) {
+static int read_exec_error(source_t *src, message_t *message) {
     assert(message != NULL);
 
     message->tag = MSG_EXEC_ERROR;
 
-    unsigned char *data;
-    ssize_t len = read_data(fd, &data);
-    if (len != sizeof(message->errnumber)) {
-        if (len > 0)
-            free(data);
+    return read_value(src, &message->errnumber, sizeof(message->errnumber));
+}
+
+/* Read a MSG_FILE message. */
+static int read_file(source_t *src, message_t *message) {
+    assert(message != NULL);
+
+    message->tag = MSG_FILE;
+
+    if (read_field(src, (unsigned char**)&message->path) <= 0)
+        return -1;
+
+    if (read_value(src, &message->filetype, sizeof(message->filetype)) != 0 ||
+            read_value(src, &message->mtime, sizeof(message->mtime)) != 0 ||
+            read_value(src, &message->directory,
+                sizeof(message->directory)) != 0) {
+        free(message->path);
         return -1;
     }
-    memcpy(&message->errnumber, data, sizeof(message->errnumber));
-    free(data);
 
     return 0;
 }
 
-message_t *read_message(int fd) {
+/* Read a MSG_BAILOUT message. */
+static int read_bailout(source_t *src, message_t *message) {
+    assert(message != NULL);
+
+    message->tag = MSG_BAILOUT;
+
+    if (read_field(src, (unsigned char**)&message->reason) < 0)
+        return -1;
+
+    return 0;
+}
+
+static message_t *read_from(source_t *src) {
     /* Read the message tag. */
-    unsigned char *data;
-    ssize_t len = read_data(fd, &data);
-    if (len != sizeof(message_tag_t))
+    message_tag_t tag;
+    if (read_value(src, &tag, sizeof(tag)) != 0)
         return NULL;
-    message_tag_t *tag = (message_tag_t*)data;
 
     message_t *message = malloc(sizeof(*message));
     if (message == NULL)
         return NULL;
 
-    switch (*tag) {
+    int r;
+    switch (tag) {
         case MSG_GETENV:
-            if (read_getenv(fd, message) != 0) {
-                free(message);
-                return NULL;
-            }
+            r = read_getenv(src, message);
             break;
 
         case MSG_EXEC_ERROR:
-            if (read_exec_error(fd, message) != 0) {
-                free(message);
-                return NULL;
-            }
+            r = read_exec_error(src, message);
+            break;
+
+        case MSG_FILE:
+            r = read_file(src, message);
+            break;
+
+        case MSG_BAILOUT:
+            r = read_bailout(src, message);
             break;
 
         default:
             /* Unknown tag. */
-            free(message);
-            return NULL;
+            r = -1;
     }
 
+    if (r != 0) {
+        free(message);
+        return NULL;
+    }
     return message;
 }
 
-/* Write a MSG_GETENV message. */
-static int write_getenv(int fd, message_t *message) {
-    assert(message->tag == MSG_GETENV);
-
-    if (write_data(fd, (unsigned char*)message->key,
-            message->key == NULL ? 0 : strlen(message->key) + 1) != 0)
-        return -1;
+message_t *read_message(int fd) {
+    source_t src = {
+        .fd = fd,
+    };
+    return read_from(&src);
+}
 
-    if (write_data(fd, (unsigned char*)message->value,
-            message->value == NULL ? 0 : strlen(message->value) + 1) != 0)
-        return -1;
+message_t *unpack_message(const unsigned char *buf, size_t size) {
+    assert(buf != NULL);
+    source_t src = {
+        .fd = -1,
+        .buf = buf,
+        .size = size,
+    };
+    message_t *message = read_from(&src);
+    if (message != NULL && src.offset != size) {
+        /* Trailing garbage. */
+        free_message(message);
+        return NULL;
+    }
+    return message;
+}
 
-    return 0;
+/* Serialise a string, including its terminator. NULL is encoded as length 0. */
+static void pack_string(unsigned char *buf, size_t size, size_t *offset,
+        const char *s) {
+    pack_data(buf, size, offset, (const unsigned char*)s,
+        s == NULL ? 0 : strlen(s) + 1);
 }
 
-/* Write a MSG_EXEC_ERROR message. */
-static int write_exec_error(int fd, message_t *message) {
-    assert(message->tag == MSG_EXEC_ERROR);
+size_t pack_message(const message_t *message, unsigned char *buf,
+        size_t size) {
+    size_t offset = 0;
 
-    if (write_data(fd, (unsigned char*)&message->errnumber,
-            sizeof(message->errnumber)) != 0)
-        return -1;
+    pack_data(buf, size, &offset, (const unsigned char*)&message->tag,
+        sizeof(message->tag));
 
-    return 0;
+    switch (message->tag) {
+        case MSG_GETENV:
+            pack_string(buf, size, &offset, message->key);
+            pack_string(buf, size, &offset, message->value);
+            break;
+
+        case MSG_EXEC_ERROR:
+            pack_data(buf, size, &offset,
+                (const unsigned char*)&message->errnumber,
+                sizeof(message->errnumber));
+            break;
+
+        case MSG_FILE:
+            if (message->path == NULL)
+                return 0;
+            pack_string(buf, size, &offset, message->path);
+            pack_data(buf, size, &offset,
+                (const unsigned char*)&message->filetype,
+                sizeof(message->filetype));
+            pack_data(buf, size, &offset,
+                (const unsigned char*)&message->mtime,
+                sizeof(message->mtime));
+            pack_data(buf, size, &offset,
+                (const unsigned char*)&message->directory,
+                sizeof(message->directory));
+            break;
+
+        case MSG_BAILOUT:
+            pack_string(buf, size, &offset, message->reason);
+            break;
+
+        default:
+            return 0;
+    }
+
+    return offset;
 }
 
 int write_message(int fd, message_t *message) {
-    if (write_data(fd, (unsigned char*)&message->tag, sizeof(message->tag)) < 0)
+    size_t len = pack_message(message, NULL, 0);
+    if (len == 0)
         return -1;
 
-    switch (message->tag) {
-        case MSG_GETENV:
-            return write_getenv(fd, message);
+    unsigned char *buf = malloc(len);
+    if (buf == NULL)
+        return -1;
+    (void)pack_message(message, buf, len);
 
-        case MSG_EXEC_ERROR:
-            return write_exec_error(fd, message);
+    size_t written = 0;
+    while (written < len) {
+        ssize_t r = write(fd, buf + written, len - written);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            free(buf);
+            return -1;
+        }
+        written += (size_t)r;
+    }
+
+    free(buf);
+    return 0;
+}
 
+void free_message(message_t *message) {
+    if (message == NULL)
+        return;
+    switch (message->tag) {
+        case MSG_GETENV:
+            free(message->key);
+            free(message->value);
+            break;
+        case MSG_FILE:
+            free(message->path);
+            break;
+        case MSG_BAILOUT:
+            free(message->reason);
+            break;
         default:
-            return -1;
+            break;
     }
+    free(message);
 }
@@ -6,10 +6,17 @@
 #ifndef _XCACHE_MESSAGE_PROTOCOL_H_
 #define _XCACHE_MESSAGE_PROTOCOL_H_
 
+#include "filetype.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
 /* Type of a message. */
 typedef enum {
     MSG_GETENV,      /* Call to getenv() */
     MSG_EXEC_ERROR,  /* Error calling execvp() */
+    MSG_FILE,        /* File access seen by libinterpose */
+    MSG_BAILOUT,     /* libinterpose cannot follow the target */
 } message_tag_t;
 
 /* A message content. */
@@ -23,13 +30,39 @@ typedef struct {
         struct /* MSG_EXEC_ERROR */ {
             int errnumber;
         };
+        struct /* MSG_FILE */ {
+            char *path;
+            filetype_t filetype;
+            time_t mtime;      /* Measured by the sender, or MISSING */
+            bool directory;
+        };
+        struct /* MSG_BAILOUT */ {
+            char *reason;
+        };
     };
 } message_t;
 
 /* Read a message from a file descriptor. Returns NULL on error. */
 message_t *read_message(int fd);
 
-/* Write a message to a file descriptor. Returns non-zero on error. */
+/* Deserialise a message from a buffer, as written by pack_message. Returns
+ * NULL if the buffer does not hold exactly one valid message.
+ */
+message_t *unpack_message(const unsigned char *buf, size_t size);
+
+/* Deallocate a message and the fields it owns. */
+void free_message(message_t *message);
+
+/* Serialise a message into 'buf', as write_message would send it. Returns the
+ * number of bytes the message needs, which may exceed 'size', in which case
+ * 'buf' is left incomplete. Returns 0 for a malformed message.
+ */
+size_t pack_message(const message_t *message, unsigned char *buf, size_t size);
+
+/* Write a message to a file descriptor. The message is sent with a single
+ * write, so messages up to PIPE_BUF bytes from different writers to the same
+ * pipe do not interleave. Returns non-zero on error.
+ */
 int write_message(int fd, message_t *message);
 
 #endif
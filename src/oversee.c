@@ -74,13 +74,13 @@ int main(int argc, char **argv) {
     int index = parse_arguments(argc, argv);
 
     target_t t;
-    if (trace(&t, &argv[index], hook_getenv ? argv[0] : NULL) != 0) {
+    if (trace(&t, &argv[index], argv[0], hook_getenv, NULL, NULL) != 0) {
         ERROR("failed to start and trace target %s\n", argv[index]);
         return -1;
     }
 
     syscall_t *s;
-    while ((s = next_syscall(&t)) != NULL) {
+    while ((s = next_syscall(&t.tracer)) != NULL) {
         INFO("%s %s from pid %u\n", translate_syscall(s->call),
             s->enter ? "enter" : "exit", s->proc->pid);
         acknowledge_syscall(s);
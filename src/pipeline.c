@@ -0,0 +1,258 @@
+#include <assert.h>
+#include "depset.h"
+#include <errno.h>
+#include "pipeline.h"
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "util.h"
+
+/* Number of paths each worker's queue can hold. Must be a power of two. */
+#define QUEUE_SIZE 1024
+
+/* A slot in a queue. 'seq' says whose turn it is: the producer that claims
+ * position 'pos' may fill the slot once 'seq' is 'pos', and the worker may
+ * take it once 'seq' is 'pos + 1'. The worker then sets it to
+ * 'pos + QUEUE_SIZE', handing the slot to the producer of the next lap.
+ */
+typedef struct {
+    size_t seq;
+    char *path;
+    filetype_t type;
+} item_t;
+
+/* Queue of work for one worker. There may be several tracers adding to the
+ * queue, which claim positions by advancing 'tail' with a compare-and-swap
+ * and then fill their slots independently. Only the worker advances 'head'.
+ * Neither side takes a lock.
+ */
+typedef struct {
+    item_t items[QUEUE_SIZE];
+    size_t head;
+    size_t tail;
+
+    /* Count of items available to the worker. */
+    sem_t ready;
+
+    pthread_t thread;
+    bool started;
+
+    /* Dependencies this worker has found. */
+    depset_t *shard;
+
+    pipeline_t *owner;
+} queue_t;
+
+struct pipeline {
+    unsigned workers;
+    queue_t *queues;
+
+    /* Dependencies found when processing inline (workers == 0), protected by
+     * 'lock'.
+     */
+    depset_t *shard;
+    pthread_mutex_t lock;
+
+    int (*process)(depset_t *d, const char *path, filetype_t type);
+
+    /* Set if any processing has failed. */
+    int failed;
+
+    /* Set when workers should exit once their queues are empty. */
+    int stopping;
+};
+
+static void *work(void *arg) {
+    queue_t *q = arg;
+    pipeline_t *p = q->owner;
+
+    while (true) {
+        if (sem_wait(&q->ready) != 0) {
+            assert(errno == EINTR);
+            continue;
+        }
+
+        size_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+        if (q->head == tail) {
+            /* No work, so we must have been woken to exit. */
+            assert(__atomic_load_n(&p->stopping, __ATOMIC_ACQUIRE));
+            return NULL;
+        }
+
+        /* The producer that claimed this slot may not have filled it yet, even
+         * if a later one has filled theirs and woken us.
+         */
+        item_t *item = &q->items[q->head % QUEUE_SIZE];
+        while (__atomic_load_n(&item->seq, __ATOMIC_ACQUIRE) != q->head + 1)
+            sched_yield();
+
+        if (!__atomic_load_n(&p->failed, __ATOMIC_ACQUIRE) &&
+                p->process(q->shard, item->path, item->type) != 0)
+            __atomic_store_n(&p->failed, 1, __ATOMIC_RELEASE);
+        free(item->path);
+
+        __atomic_store_n(&item->seq, q->head + QUEUE_SIZE, __ATOMIC_RELEASE);
+        __atomic_store_n(&q->head, q->head + 1, __ATOMIC_RELEASE);
+    }
+}
+
+pipeline_t *pipeline_new(unsigned workers,
+        int (*process)(depset_t *d, const char *path, filetype_t type)) {
+    assert(process != NULL);
+
+    pipeline_t *p = calloc(1, sizeof(*p));
+    if (p == NULL)
+        return NULL;
+    p->workers = workers;
+    p->process = process;
+
+    if (workers == 0) {
+        p->shard = depset_new();
+        if (p->shard == NULL) {
+            free(p);
+            return NULL;
+        }
+        if (pthread_mutex_init(&p->lock, NULL) != 0) {
+            depset_destroy(p->shard);
+            free(p);
+            return NULL;
+        }
+        return p;
+    }
+
+    p->queues = calloc(workers, sizeof(p->queues[0]));
+    if (p->queues == NULL) {
+        free(p);
+        return NULL;
+    }
+
+    for (unsigned i = 0; i < workers; i++) {
+        queue_t *q = &p->queues[i];
+        q->owner = p;
+        for (size_t j = 0; j < QUEUE_SIZE; j++)
+            q->items[j].seq = j;
+        q->shard = depset_new();
+        if (q->shard == NULL || sem_init(&q->ready, 0, 0) != 0 ||
+                pthread_create(&q->thread, NULL, work, q) != 0) {
+            (void)pipeline_finish(p, NULL);
+            return NULL;
+        }
+        q->started = true;
+    }
+
+    return p;
+}
+
+int pipeline_add(pipeline_t *p, char *path, filetype_t type) {
+    assert(p != NULL);
+    assert(path != NULL);
+
+    if (p->workers == 0) {
+        pthread_mutex_lock(&p->lock);
+        int r = p->process(p->shard, path, type);
+        pthread_mutex_unlock(&p->lock);
+        free(path);
+        if (r != 0)
+            __atomic_store_n(&p->failed, 1, __ATOMIC_RELEASE);
+        return r;
+    }
+
+    queue_t *q = &p->queues[hash(path, strlen(path)) % p->workers];
+
+    /* Claim the next position. Positions are handed out in the order tracers
+     * reach here, which is the order the worker will process them in.
+     */
+    size_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    item_t *item;
+    while (true) {
+        item = &q->items[pos % QUEUE_SIZE];
+        size_t seq = __atomic_load_n(&item->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, true,
+                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+                break;
+            /* Someone else got it first; 'pos' now holds the new tail. */
+        } else if (seq < pos) {
+            /* The slot still holds an item from the previous lap, so the
+             * worker has fallen a long way behind. Wait for it to catch up.
+             */
+            sched_yield();
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        } else {
+            /* Our view of the tail is out of date. */
+            pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    item->path = path;
+    item->type = type;
+    __atomic_store_n(&item->seq, pos + 1, __ATOMIC_RELEASE);
+
+    if (sem_post(&q->ready) != 0)
+        return -1;
+    return 0;
+}
+
+int pipeline_flush(pipeline_t *p) {
+    assert(p != NULL);
+
+    for (unsigned i = 0; i < p->workers; i++) {
+        queue_t *q = &p->queues[i];
+        /* Other tracers may be adding to the queue while we wait. We only
+         * need to see the paths queued before we started.
+         */
+        size_t tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+        while (__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) < tail)
+            sched_yield();
+    }
+
+    return __atomic_load_n(&p->failed, __ATOMIC_ACQUIRE) ? -1 : 0;
+}
+
+int pipeline_finish(pipeline_t *p, depset_t *d) {
+    assert(p != NULL);
+
+    __atomic_store_n(&p->stopping, 1, __ATOMIC_RELEASE);
+    for (unsigned i = 0; i < p->workers; i++) {
+        queue_t *q = &p->queues[i];
+        if (q->started) {
+            (void)sem_post(&q->ready);
+            pthread_join(q->thread, NULL);
+            sem_destroy(&q->ready);
+        }
+    }
+
+    int ret = p->failed ? -1 : 0;
+
+    /* Each path only ever reaches a single shard, so merging them cannot
+     * produce conflicts.
+     */
+    int merge(const char *filename, filetype_t type, time_t mtime) {
+        return depset_insert(d, filename, type, mtime);
+    }
+
+    if (p->workers == 0) {
+        if (ret == 0 && d != NULL && depset_foreach(p->shard, merge) != 0)
+            ret = -1;
+        depset_destroy(p->shard);
+        pthread_mutex_destroy(&p->lock);
+    }
+
+    for (unsigned i = 0; i < p->workers; i++) {
+        queue_t *q = &p->queues[i];
+        if (q->shard == NULL)
+            continue;
+        if (ret == 0 && d != NULL && depset_foreach(q->shard, merge) != 0)
+            ret = -1;
+        depset_destroy(q->shard);
+    }
+
+    free(p->queues);
+    free(p);
+    return ret;
+}
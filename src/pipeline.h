@@ -0,0 +1,60 @@
+#ifndef _XCACHE_PIPELINE_H_
+#define _XCACHE_PIPELINE_H_
+
+/* Deferred processing of dependencies.
+ *
+ * While we are deciding what to do with a path a traced process passed to a
+ * syscall, that process is stopped. Most of this time goes on classifying the
+ * path and measuring it, rather than on retrieving it from the tracee. The
+ * pipeline lets the tracer capture just the path and hand it to worker
+ * threads, so the tracee can be resumed straight away.
+ *
+ * Paths are sharded across workers by hash, with each worker owning the
+ * dependency set for its shard. All events for a given path therefore reach
+ * the same worker and are processed in the order they were captured. This
+ * holds even when several tracer threads share a pipeline, as long as each
+ * queues a path before resuming the process it came from. The shards are
+ * merged when the pipeline is finished.
+ *
+ * Measurement of inputs can only be deferred as long as nothing modifies them
+ * in the meantime. Callers must use pipeline_flush() before letting through
+ * any syscall that may modify the filesystem, and must not defer inputs while
+ * such a syscall is still in progress.
+ */
+
+#include "depset.h"
+
+typedef struct pipeline pipeline_t;
+
+/* Create a new pipeline.
+ *
+ * workers - Number of worker threads. If 0, paths are processed immediately
+ *   by the caller of pipeline_add.
+ * process - Function to process a path into a dependency set. This is called
+ *   from worker threads and must be safe to call concurrently for different
+ *   dependency sets.
+ *
+ * Returns NULL on failure.
+ */
+pipeline_t *pipeline_new(unsigned workers,
+    int (*process)(depset_t *d, const char *path, filetype_t type));
+
+/* Queue an absolute path for processing. This may be called from several
+ * threads at once. The pipeline takes ownership of 'path', which must have
+ * been allocated with malloc. Returns 0 on success.
+ * Failures encountered by workers are reported later by pipeline_flush or
+ * pipeline_finish.
+ */
+int pipeline_add(pipeline_t *p, char *path, filetype_t type);
+
+/* Wait for all paths queued before the call to be processed. Returns 0 if all
+ * processing so far has succeeded.
+ */
+int pipeline_flush(pipeline_t *p);
+
+/* Stop the workers, merge their results into 'd' and deallocate the pipeline.
+ * If 'd' is NULL, results are discarded. Returns 0 if all processing succeeded.
+ */
+int pipeline_finish(pipeline_t *p, depset_t *d);
+
+#endif
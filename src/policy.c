@@ -0,0 +1,161 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "policy.h"
+#include "util.h"
+
+typedef struct {
+    char *prefix;
+    size_t length;
+    policy_t policy;
+} entry_t;
+
+static entry_t *table = NULL;
+static size_t table_sz = 0;
+
+/* Prefixes we start with. */
+static const struct {
+    const char *prefix;
+    policy_t policy;
+} defaults[] = {
+    { "/dev/", POLICY_EXCLUDE },
+    { "/proc/", POLICY_EXCLUDE },
+};
+
+/* Locations managed by the system package manager, whose database contributes
+ * to the toolchain stamp.
+ */
+static const char *system_prefixes[] = {
+    "/bin/",
+    "/lib/",
+    "/lib64/",
+    "/usr/bin/",
+    "/usr/include/",
+    "/usr/lib/",
+    "/usr/lib64/",
+    "/usr/libexec/",
+};
+
+static bool initialised = false;
+
+static int init(void) {
+    if (initialised)
+        return 0;
+    initialised = true;
+    for (size_t i = 0; i < sizeof(defaults) / sizeof(defaults[0]); i++) {
+        if (policy_add(defaults[i].prefix, defaults[i].policy) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+int policy_add(const char *prefix, policy_t policy) {
+    assert(prefix != NULL);
+
+    if (init() != 0)
+        return -1;
+
+    for (size_t i = 0; i < table_sz; i++) {
+        if (strcmp(table[i].prefix, prefix) == 0) {
+            table[i].policy = policy;
+            return 0;
+        }
+    }
+
+    char *p = strdup(prefix);
+    if (p == NULL)
+        return -1;
+
+    entry_t *t = realloc(table, (table_sz + 1) * sizeof(t[0]));
+    if (t == NULL) {
+        free(p);
+        return -1;
+    }
+    table = t;
+    table[table_sz].prefix = p;
+    table[table_sz].length = strlen(p);
+    table[table_sz].policy = policy;
+    table_sz++;
+    return 0;
+}
+
+int policy_add_system(void) {
+    for (size_t i = 0; i < sizeof(system_prefixes) / sizeof(system_prefixes[0]);
+            i++) {
+        if (policy_add(system_prefixes[i], POLICY_IMMUTABLE) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+void policy_clear(policy_t policy) {
+    (void)init();
+
+    size_t j = 0;
+    for (size_t i = 0; i < table_sz; i++) {
+        if (table[i].policy == policy)
+            free(table[i].prefix);
+        else
+            table[j++] = table[i];
+    }
+    table_sz = j;
+}
+
+policy_t policy_lookup(const char *path) {
+    assert(path != NULL);
+
+    (void)init();
+
+    policy_t policy = POLICY_TRACK;
+    size_t longest = 0;
+    for (size_t i = 0; i < table_sz; i++) {
+        if (table[i].length > longest &&
+                strncmp(table[i].prefix, path, table[i].length) == 0) {
+            policy = table[i].policy;
+            longest = table[i].length;
+        }
+    }
+    return policy;
+}
+
+char *policy_prefixes(policy_t policy) {
+    if (init() != 0)
+        return NULL;
+
+    size_t count = 0, length = 0;
+    for (size_t i = 0; i < table_sz; i++) {
+        if (table[i].policy == policy) {
+            count++;
+            length += table[i].length + 1;
+        }
+    }
+    if (count == 0)
+        return NULL;
+
+    autofree const char **prefixes = malloc(count * sizeof(prefixes[0]));
+    if (prefixes == NULL)
+        return NULL;
+    for (size_t i = 0, j = 0; i < table_sz; i++) {
+        if (table[i].policy == policy)
+            prefixes[j++] = table[i].prefix;
+    }
+
+    /* Sort so the result does not depend on the order options were given. */
+    int cmp(const void *a, const void *b) {
+        return strcmp(*(const char**)a, *(const char**)b);
+    }
+    qsort(prefixes, count, sizeof(prefixes[0]), cmp);
+
+    char *result = malloc(length + 1);
+    if (result == NULL)
+        return NULL;
+    char *p = result;
+    for (size_t i = 0; i < count; i++) {
+        p = stpcpy(p, prefixes[i]);
+        *p++ = '\n';
+    }
+    *p = '\0';
+    return result;
+}
@@ -0,0 +1,41 @@
+#ifndef _XCACHE_POLICY_H_
+#define _XCACHE_POLICY_H_
+
+/* How to treat paths encountered while tracing.
+ *
+ * Paths are matched against a table of prefixes, with the longest matching
+ * prefix deciding. Paths that match nothing are tracked as normal.
+ */
+
+typedef enum {
+    POLICY_TRACK,      /* record as an input or output (the default) */
+    POLICY_EXCLUDE,    /* never record; these are Linux APIs, not files */
+    POLICY_IMMUTABLE,  /* do not record as an input, but cover by the
+                          toolchain stamp (see toolchain.h) */
+} policy_t;
+
+/* Add a prefix to the table, replacing any existing policy for it. Returns 0
+ * on success.
+ */
+int policy_add(const char *prefix, policy_t policy);
+
+/* Add the locations managed by the system package manager as immutable. These
+ * are not immutable by default, as the toolchain stamp only notices changes
+ * made through the package manager or to the prefix directories themselves.
+ * Returns 0 on success.
+ */
+int policy_add_system(void);
+
+/* Remove all prefixes with the given policy, including the defaults. */
+void policy_clear(policy_t policy);
+
+/* Determine how to treat a given absolute path. */
+policy_t policy_lookup(const char *path);
+
+/* Return the prefixes with the given policy, each terminated by a newline and
+ * in sorted order, or NULL if there are none or on failure. It is the caller's
+ * responsibility to free the returned pointer.
+ */
+char *policy_prefixes(policy_t policy);
+
+#endif
@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <linux/limits.h>
 #include "log.h"
@@ -11,32 +12,31 @@
 #include <sys/ptrace.h>
 #include <sys/types.h>
 #include <sys/wait.h>
-#include "tkill.h"
 #include <unistd.h>
 #include "util.h"
 
-long pt_traceme(void) {
-    long r = ptrace(PTRACE_TRACEME, 0, NULL, NULL);
-    if (r != 0)
-        return r;
-    /* Induce a trap to give our parent (the tracer) an opportunity to attach
-     * before we call execve.
-     */
+long pt_stopme(void) {
     return raise(SIGSTOP);
 }
 
-long pt_setoptions(pid_t pid) {
-    return ptrace(PTRACE_SETOPTIONS, pid, NULL, 0
+long pt_seize(pid_t pid) {
+    return ptrace(PTRACE_SEIZE, pid, NULL, 0
             /* trace children */
         |PTRACE_O_TRACEEXEC|PTRACE_O_TRACEFORK|PTRACE_O_TRACEVFORK|PTRACE_O_TRACECLONE
             /* allow us to discriminate between syscalls and signals */
-        |PTRACE_O_TRACESYSGOOD);
+        |PTRACE_O_TRACESYSGOOD
+            /* do not leave the target running untraced if we die */
+        |PTRACE_O_EXITKILL);
 }
 
 long pt_runtosyscall(pid_t pid) {
     return ptrace(PTRACE_SYSCALL, pid, NULL, NULL);
 }
 
+long pt_deliver(pid_t pid, int sig) {
+    return ptrace(PTRACE_SYSCALL, pid, NULL, sig);
+}
+
 long pt_peekreg(pid_t pid, off_t reg) {
     return ptrace(PTRACE_PEEKUSER, pid, (void*)reg, NULL);
 }
@@ -82,12 +82,120 @@ char *pt_peekstring(pid_t pid, off_t reg) {
     return s;
 }
 
-char *pt_peekfd(pid_t pid, const char *cwd, off_t reg) {
-    int fd = (int)pt_peekreg(pid, reg);
+int pt_peekdata(pid_t pid, off_t reg, void *buf, size_t len) {
+    void *addr = (void*)pt_peekreg(pid, reg);
+    if (addr == NULL)
+        return -1;
+
+    /* As for pt_peekstring, reading through /proc is faster than
+     * PTRACE_PEEKDATA for anything beyond a single word.
+     */
+    autofree char *filename = aprintf("/proc/%d/mem", pid);
+    if (filename == NULL)
+        return -1;
+    int fd = open(filename, O_RDONLY|O_CLOEXEC);
+    if (fd == -1) {
+        DEBUG("failed to open %s to read data\n", filename);
+        return -1;
+    }
+
+    ssize_t r = pread(fd, buf, len, (off_t)addr);
+    close(fd);
+    if (r < 0 || (size_t)r != len)
+        return -1;
+
+    return 0;
+}
+
+char **pt_peekstrings(pid_t pid, off_t reg) {
+    void *addr = (void*)pt_peekreg(pid, reg);
+    if (addr == NULL)
+        return NULL;
+
+    autofree char *filename = aprintf("/proc/%d/mem", pid);
+    if (filename == NULL)
+        return NULL;
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+        DEBUG("failed to open %s to read strings\n", filename);
+        return NULL;
+    }
+
+    /* Read the array of pointers first, as reading the strings moves us
+     * around the file.
+     */
+    autofree void **ptrs = NULL;
+    size_t count = 0, capacity = 0;
+    if (fseek(f, (off_t)addr, SEEK_SET) != 0) {
+        fclose(f);
+        return NULL;
+    }
+    while (true) {
+        if (count == capacity) {
+            size_t c = capacity == 0 ? 64 : capacity * 2;
+            void **ps = realloc(ptrs, c * sizeof(ps[0]));
+            if (ps == NULL) {
+                fclose(f);
+                return NULL;
+            }
+            ptrs = ps;
+            capacity = c;
+        }
+        if (fread(&ptrs[count], sizeof(ptrs[count]), 1, f) != 1) {
+            fclose(f);
+            return NULL;
+        }
+        if (ptrs[count] == NULL)
+            break;
+        count++;
+    }
+
+    /* Gather the strings into a buffer, to be laid out after the array. These
+     * may be longer than a path, so we read each up to its terminator.
+     */
+    autofree char *data = NULL;
+    size_t size = 0;
+    FILE *buf = open_memstream(&data, &size);
+    if (buf == NULL) {
+        fclose(f);
+        return NULL;
+    }
+    autofree size_t *offsets = calloc(count + 1, sizeof(offsets[0]));
+    autofree char *line = NULL;
+    size_t line_sz = 0;
+    for (size_t i = 0; offsets != NULL && i < count; i++) {
+        if (fseek(f, (off_t)ptrs[i], SEEK_SET) != 0)
+            break;
+        ssize_t len = getdelim(&line, &line_sz, '\0', f);
+        if (len <= 0 || line[len - 1] != '\0')
+            break;
+        offsets[i] = (size_t)ftell(buf);
+        if (fwrite(line, (size_t)len, 1, buf) != 1)
+            break;
+        offsets[i + 1] = (size_t)ftell(buf);
+    }
+    fclose(f);
+    if (fclose(buf) != 0 || offsets == NULL ||
+            (count > 0 && offsets[count] == 0))
+        return NULL;
+
+    size_t table = (count + 1) * sizeof(char*);
+    char **strings = malloc(table + size);
+    if (strings == NULL)
+        return NULL;
+    char *base = (char*)strings + table;
+    memcpy(base, data, size);
+    for (size_t i = 0; i < count; i++)
+        strings[i] = base + offsets[i];
+    strings[count] = NULL;
+    return strings;
+}
 
-    if (fd == AT_FDCWD)
-        return strdup(cwd);
+long pt_pokereg(pid_t pid, off_t reg, long value) {
+    return ptrace(PTRACE_POKEUSER, pid, (void*)reg, (void*)value);
+}
 
+char *pt_fdpath(pid_t pid, int fd) {
     autofree char *fdlink = aprintf("/proc/%d/fd/%d", pid, fd);
     if (fdlink == NULL)
         return NULL;
@@ -121,21 +229,41 @@ void pt_passthrough(pid_t pid, int event) {
 }
 
 void pt_detach(pid_t pid) {
-    tkill(pid, SIGSTOP);
-    while (true) {
-        int status;
-        waitpid(pid, &status, __WALL);
-        if (WIFSTOPPED(status)) {
-            if (WSTOPSIG(status) == SIGSTOP) {
-                long r __attribute__((unused)) = ptrace(PTRACE_DETACH, pid, NULL, SIGCONT);
-                assert(r == 0);
-                break;
-            } else {
-                pt_passthrough(pid, status);
-            }
-        } else {
-            assert(WIFSIGNALED(status) || WIFEXITED(status));
-            break;
-        }
+    /* We can only detach from a process in a ptrace stop. As we attached with
+     * PTRACE_SEIZE, we can induce one without sending the process a signal.
+     */
+    if (ptrace(PTRACE_INTERRUPT, pid, NULL, NULL) != 0)
+        return;
+
+    /* We may be interrupted while waiting; see add_tracers. */
+    int status;
+    pid_t waited;
+    do {
+        waited = waitpid(pid, &status, __WALL);
+    } while (waited == -1 && errno == EINTR);
+    if (waited == -1 || !WIFSTOPPED(status))
+        return;
+
+    /* The process may have stopped for some other reason before it noticed
+     * our interrupt. If that was an incoming signal, we need to pass it on.
+     */
+    int sig = WSTOPSIG(status);
+    bool signalled = status >> 16 == 0 && sig != SIGSYSCALL;
+    long r __attribute__((unused)) = ptrace(PTRACE_DETACH, pid, NULL,
+        signalled ? sig : 0);
+    assert(r == 0);
+}
+
+long pt_handoff(pid_t pid) {
+    /* Once we detach, the pending SIGSTOP stops the process before it can run
+     * any further.
+     */
+    if (kill(pid, SIGSTOP) != 0)
+        return -1;
+    if (ptrace(PTRACE_DETACH, pid, NULL, NULL) != 0) {
+        /* Undo the SIGSTOP, which continuing discards. */
+        (void)kill(pid, SIGCONT);
+        return -1;
     }
+    return 0;
 }
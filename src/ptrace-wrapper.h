@@ -6,15 +6,23 @@
 
 #include <sys/types.h>
 
-/* Trace the calling process. */
-long pt_traceme(void);
+/* Stop the calling process, to give its parent an opportunity to attach with
+ * pt_seize.
+ */
+long pt_stopme(void);
 
-/* Setup default options for tracing. */
-long pt_setoptions(pid_t pid);
+/* Start tracing a process with our default options. These are inherited by
+ * its children, which are traced automatically. If we exit, all our tracees
+ * are killed.
+ */
+long pt_seize(pid_t pid);
 
 /* Continue execution of the (blocked) process until the next syscall. */
 long pt_runtosyscall(pid_t pid);
 
+/* As for pt_runtosyscall, but delivering the given signal to the process. */
+long pt_deliver(pid_t pid, int sig);
+
 /* Return the value of the given register in the process's user context. */
 long pt_peekreg(pid_t pid, off_t reg);
 
@@ -23,10 +31,26 @@ long pt_peekreg(pid_t pid, off_t reg);
  */
 char *pt_peekstring(pid_t pid, off_t reg);
 
-/* Return the path pointed to by the file descriptor in the given register.
- * Returns NULL on failure.
+/* Read 'len' bytes of the memory pointed to by the given register in the
+ * process's user context into 'buf'. Returns 0 on success.
  */
-char *pt_peekfd(pid_t pid, const char *cwd, off_t reg) __attribute__((nonnull));
+int pt_peekdata(pid_t pid, off_t reg, void *buf, size_t len);
+
+/* Return the NULL-terminated array of strings, like argv, pointed to by the
+ * given register in the process's user context. The array and the strings are
+ * a single allocation, to be released with free(). Returns NULL on failure.
+ */
+char **pt_peekstrings(pid_t pid, off_t reg);
+
+/* Set the value of the given register in the process's user context. Returns 0
+ * on success.
+ */
+long pt_pokereg(pid_t pid, off_t reg, long value);
+
+/* Return what the given file descriptor of a process refers to, according to
+ * /proc. Returns NULL on failure.
+ */
+char *pt_fdpath(pid_t pid, int fd);
 
 /* Retrieve the event message associated with the last ptrace event. */
 unsigned long pt_geteventmsg(pid_t pid);
@@ -39,9 +63,14 @@ long pt_continue(pid_t pid);
  */
 void pt_passthrough(pid_t pid, int event);
 
-/* Stop tracing the given (unblocked) process. */
+/* Stop tracing the given (unblocked) process. It keeps running untraced. */
 void pt_detach(pid_t pid);
 
+/* Stop tracing the given (blocked) process, leaving it stopped such that
+ * another thread can attach to it with pt_seize. Returns 0 on success.
+ */
+long pt_handoff(pid_t pid);
+
 /* Signal that gets delivered when we see a syscall from the target. See `man
  * ptrace` for more information.
  */
@@ -0,0 +1,244 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "ring.h"
+
+/* States of a record. Space in the ring is zeroed once consumed, so a record
+ * that has been reserved but not yet written reads as RECORD_EMPTY.
+ */
+enum {
+    RECORD_EMPTY = 0,
+    RECORD_READY = 1,
+    RECORD_SKIP = 2,   /* padding up to the end of the ring */
+};
+
+typedef struct {
+    uint32_t state;
+    uint32_t len;      /* bytes of data, or of padding for RECORD_SKIP */
+    unsigned char data[];
+} record_t;
+
+/* Records are kept aligned so their headers can be accessed atomically. */
+#define ALIGN(n) (((n) + sizeof(record_t) - 1) & ~(sizeof(record_t) - 1))
+
+/* The part of the ring in shared memory. The producers' and consumer's
+ * offsets are on separate cache lines so they do not contend.
+ */
+typedef struct {
+    uint64_t size;
+
+    /* Offset of the next byte to reserve, advanced by producers. Offsets only
+     * ever increase and are taken modulo 'size' to index 'data'.
+     */
+    uint64_t tail __attribute__((aligned(64)));
+
+    /* Offset of the next record to consume, advanced by the consumer. */
+    uint64_t head __attribute__((aligned(64)));
+
+    /* Set while the consumer is waiting to be woken. */
+    uint32_t waiting;
+
+    unsigned char data[] __attribute__((aligned(64)));
+} shared_t;
+
+struct ring {
+    shared_t *shared;
+    size_t mapped;
+    int memfd;
+    int eventfd;
+};
+
+static ring_t *map(int memfd, int eventfd, size_t mapped) {
+    ring_t *r = malloc(sizeof(*r));
+    if (r == NULL)
+        return NULL;
+
+    r->shared = mmap(NULL, mapped, PROT_READ|PROT_WRITE, MAP_SHARED, memfd,
+        0);
+    if (r->shared == MAP_FAILED) {
+        free(r);
+        return NULL;
+    }
+    r->mapped = mapped;
+    r->memfd = memfd;
+    r->eventfd = eventfd;
+    return r;
+}
+
+ring_t *ring_new(size_t size) {
+    assert(size >= sizeof(record_t) && (size & (size - 1)) == 0);
+
+    int memfd = memfd_create("xcache-ring", 0);
+    if (memfd == -1)
+        return NULL;
+
+    int efd = eventfd(0, EFD_NONBLOCK);
+    if (efd == -1) {
+        close(memfd);
+        return NULL;
+    }
+
+    size_t mapped = sizeof(shared_t) + size;
+    ring_t *r = NULL;
+    if (ftruncate(memfd, (off_t)mapped) != 0 ||
+            (r = map(memfd, efd, mapped)) == NULL) {
+        close(efd);
+        close(memfd);
+        return NULL;
+    }
+
+    /* The rest of the memfd starts out zeroed. */
+    r->shared->size = size;
+    return r;
+}
+
+ring_t *ring_attach(int memfd, int eventfd) {
+    struct stat st;
+    if (fstat(memfd, &st) != 0 || (size_t)st.st_size <= sizeof(shared_t))
+        return NULL;
+
+    ring_t *r = map(memfd, eventfd, (size_t)st.st_size);
+    if (r == NULL)
+        return NULL;
+
+    if (sizeof(shared_t) + r->shared->size != r->mapped) {
+        /* Not something we created. */
+        munmap(r->shared, r->mapped);
+        free(r);
+        return NULL;
+    }
+    return r;
+}
+
+void ring_free(ring_t *r) {
+    if (r == NULL)
+        return;
+    munmap(r->shared, r->mapped);
+    close(r->eventfd);
+    close(r->memfd);
+    free(r);
+}
+
+int ring_memfd(const ring_t *r) {
+    assert(r != NULL);
+    return r->memfd;
+}
+
+int ring_eventfd(const ring_t *r) {
+    assert(r != NULL);
+    return r->eventfd;
+}
+
+int ring_put(ring_t *r, const void *data, size_t len) {
+    assert(r != NULL);
+    shared_t *s = r->shared;
+
+    uint64_t need = ALIGN(sizeof(record_t) + len);
+    if (len > UINT32_MAX || need > s->size)
+        return -1;
+
+    /* Reserve space. A record that would run off the end of the ring is
+     * preceded by padding to take it back to the start.
+     */
+    uint64_t start = __atomic_load_n(&s->tail, __ATOMIC_RELAXED);
+    uint64_t pad, end;
+    do {
+        uint64_t offset = start & (s->size - 1);
+        pad = offset + need > s->size ? s->size - offset : 0;
+        end = start + pad + need;
+        if (end - __atomic_load_n(&s->head, __ATOMIC_ACQUIRE) > s->size)
+            return -1;
+    } while (!__atomic_compare_exchange_n(&s->tail, &start, end, true,
+        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    if (pad > 0) {
+        record_t *skip = (record_t*)&s->data[start & (s->size - 1)];
+        skip->len = (uint32_t)pad;
+        __atomic_store_n(&skip->state, RECORD_SKIP, __ATOMIC_RELEASE);
+    }
+
+    record_t *rec = (record_t*)&s->data[(start + pad) & (s->size - 1)];
+    memcpy(rec->data, data, len);
+    rec->len = (uint32_t)len;
+
+    /* Publishing the record and checking whether the consumer is waiting need
+     * to be ordered against the consumer doing the reverse in ring_sleep(),
+     * so one of us always sees the other.
+     */
+    __atomic_store_n(&rec->state, RECORD_READY, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&s->waiting, __ATOMIC_SEQ_CST)) {
+        uint64_t one = 1;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-result"
+        (void)write(r->eventfd, &one, sizeof(one));
+#pragma GCC diagnostic pop
+    }
+
+    return 0;
+}
+
+int ring_drain(ring_t *r, int (*cb)(const void *data, size_t len)) {
+    assert(r != NULL);
+    shared_t *s = r->shared;
+
+    uint64_t head = __atomic_load_n(&s->head, __ATOMIC_RELAXED);
+    while (true) {
+        record_t *rec = (record_t*)&s->data[head & (s->size - 1)];
+        uint32_t state = __atomic_load_n(&rec->state, __ATOMIC_ACQUIRE);
+        if (state == RECORD_EMPTY)
+            return 0;
+
+        size_t total = state == RECORD_SKIP ? rec->len :
+            ALIGN(sizeof(record_t) + rec->len);
+        int ret = state == RECORD_SKIP ? 0 : cb(rec->data, rec->len);
+
+        /* Zero the space before handing it back, so that whatever lands here
+         * next reads as empty until it is ready.
+         */
+        memset(rec, 0, total);
+        head += total;
+        __atomic_store_n(&s->head, head, __ATOMIC_RELEASE);
+
+        if (ret != 0)
+            return ret;
+    }
+}
+
+bool ring_sleep(ring_t *r) {
+    assert(r != NULL);
+    shared_t *s = r->shared;
+
+    __atomic_store_n(&s->waiting, 1, __ATOMIC_SEQ_CST);
+    record_t *rec = (record_t*)&s->data[
+        __atomic_load_n(&s->head, __ATOMIC_RELAXED) & (s->size - 1)];
+    if (__atomic_load_n(&rec->state, __ATOMIC_SEQ_CST) != RECORD_EMPTY) {
+        __atomic_store_n(&s->waiting, 0, __ATOMIC_RELAXED);
+        return false;
+    }
+    return true;
+}
+
+void ring_wake(ring_t *r) {
+    assert(r != NULL);
+    __atomic_store_n(&r->shared->waiting, 0, __ATOMIC_RELAXED);
+    uint64_t count;
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-result"
+    (void)read(r->eventfd, &count, sizeof(count));
+#pragma GCC diagnostic pop
+}
+
+bool ring_empty(const ring_t *r) {
+    assert(r != NULL);
+    const shared_t *s = r->shared;
+    return __atomic_load_n(&s->head, __ATOMIC_ACQUIRE) ==
+        __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,64 @@
+/* A ring buffer in shared memory for passing messages from traced processes to
+ * xcache without a syscall per message.
+ *
+ * Any number of producers, in any number of processes, append records to the
+ * ring concurrently and without locks. A single consumer removes them in the
+ * order they were reserved. The ring lives in a memfd, which producers map
+ * after inheriting it. When the consumer has nothing to do, it asks producers
+ * to wake it by writing to an eventfd.
+ *
+ * A producer that finds the ring full should fall back to some other channel.
+ * Records are never dropped silently, but a producer that dies between
+ * reserving space and completing its record stalls the ring, which the
+ * consumer can detect with ring_empty() once all producers are gone.
+ */
+
+#ifndef _XCACHE_RING_H_
+#define _XCACHE_RING_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct ring ring_t;
+
+/* Create a ring with 'size' bytes of space for records, which must be a power
+ * of two. The descriptors of the ring are inherited by children. Returns NULL
+ * on failure.
+ */
+ring_t *ring_new(size_t size);
+
+/* Attach to a ring created in another process, given its descriptors. Returns
+ * NULL on failure.
+ */
+ring_t *ring_attach(int memfd, int eventfd);
+
+/* Release a ring, closing its descriptors. */
+void ring_free(ring_t *r);
+
+int ring_memfd(const ring_t *r);
+int ring_eventfd(const ring_t *r);
+
+/* Append a record. Returns 0 on success or -1 if the ring has no room for it.
+ * This may be called concurrently by any number of producers.
+ */
+int ring_put(ring_t *r, const void *data, size_t len);
+
+/* Call 'cb' on each complete record at the front of the ring, in order,
+ * removing it. This stops early if 'cb' returns non-zero, in which case that
+ * value is returned. Only the consumer may call this.
+ */
+int ring_drain(ring_t *r, int (*cb)(const void *data, size_t len));
+
+/* Announce that the consumer is about to wait on the eventfd. Returns false if
+ * records arrived in the meantime, in which case the consumer should drain the
+ * ring instead.
+ */
+bool ring_sleep(ring_t *r);
+
+/* Announce that the consumer has woken up, consuming any pending wakeups. */
+void ring_wake(ring_t *r);
+
+/* Whether every record ever reserved has been consumed. */
+bool ring_empty(const ring_t *r);
+
+#endif
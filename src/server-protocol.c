@@ -0,0 +1,102 @@
+#include <assert.h>
+#include "comm-protocol.h"
+#include <limits.h>
+#include "server-protocol.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "util.h"
+
+char *server_socket(const char *cache_dir) {
+    char *path = aprintf("%s/" SERVER_SOCKET, cache_dir);
+    if (path == NULL)
+        return NULL;
+
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        free(path);
+        return NULL;
+    }
+
+    return path;
+}
+
+int write_int(int fd, int value) {
+    return write_data(fd, (unsigned char*)&value, sizeof(value));
+}
+
+int read_int(int fd, int *value) {
+    unsigned char *data;
+    ssize_t len = read_data(fd, &data);
+    if (len != sizeof(*value)) {
+        if (len > 0)
+            free(data);
+        return -1;
+    }
+    memcpy(value, data, sizeof(*value));
+    free(data);
+    return 0;
+}
+
+int write_string(int fd, const char *s) {
+    return write_data(fd, (const unsigned char*)s,
+        s == NULL ? 0 : strlen(s) + 1);
+}
+
+int read_string(int fd, char **s) {
+    ssize_t len = read_data(fd, (unsigned char**)s);
+    if (len < 0)
+        return -1;
+    if (len > 0 && (*s)[len - 1] != '\0') {
+        /* Not a string. */
+        free(*s);
+        return -1;
+    }
+    return 0;
+}
+
+int write_strings(int fd, char **strings) {
+    int count = 0;
+    for (char **p = strings; *p != NULL; p++)
+        count++;
+
+    if (write_int(fd, count) != 0)
+        return -1;
+
+    for (int i = 0; i < count; i++) {
+        if (write_string(fd, strings[i]) != 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+char **read_strings(int fd, int *count) {
+    int c;
+    if (read_int(fd, &c) != 0 || c < 0 || c >= INT_MAX / (int)sizeof(char*))
+        return NULL;
+
+    char **strings = calloc(c + 1, sizeof(char*));
+    if (strings == NULL)
+        return NULL;
+
+    for (int i = 0; i < c; i++) {
+        if (read_string(fd, &strings[i]) != 0 || strings[i] == NULL) {
+            free_strings(strings);
+            return NULL;
+        }
+    }
+
+    if (count != NULL)
+        *count = c;
+    return strings;
+}
+
+void free_strings(char **strings) {
+    if (strings == NULL)
+        return;
+    for (char **p = strings; *p != NULL; p++)
+        free(*p);
+    free(strings);
+}
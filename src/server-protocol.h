@@ -0,0 +1,49 @@
+/* Protocol spoken between the xcache client and the xcached server over a
+ * UNIX domain socket. This is built on the low level helpers in
+ * comm-protocol.h. Each connection carries a single request and its reply.
+ */
+
+#ifndef _XCACHE_SERVER_PROTOCOL_H_
+#define _XCACHE_SERVER_PROTOCOL_H_
+
+/* Name of the socket xcached listens on, relative to the cache directory. */
+#define SERVER_SOCKET "xcached.sock"
+
+/* Type of a request. */
+typedef enum {
+    REQ_LOCATE,  /* cache_locate() */
+    REQ_DUMP,    /* cache_dump() */
+    REQ_WRITE,   /* cache_write() */
+    REQ_WORTH,   /* cache_worth_tracing() */
+    REQ_OUTCOME, /* cache_record_outcome() */
+} request_tag_t;
+
+/* Return the path to the server socket for a given cache directory or NULL if
+ * the path would be too long to bind. It is the caller's responsibility to
+ * free the returned pointer.
+ */
+char *server_socket(const char *cache_dir);
+
+/* Send or receive an integer. Return 0 on success. */
+int write_int(int fd, int value);
+int read_int(int fd, int *value);
+
+/* Send or receive a string, which may be NULL. Return 0 on success. When
+ * reading, it is the caller's responsibility to free the returned string.
+ */
+int write_string(int fd, const char *s);
+int read_string(int fd, char **s);
+
+/* Send a NULL-terminated array of strings. Returns 0 on success. */
+int write_strings(int fd, char **strings);
+
+/* Receive an array of strings sent with write_strings. Returns a
+ * NULL-terminated array or NULL on error. The number of elements is written to
+ * 'count' if it is non-NULL. Free the result with free_strings.
+ */
+char **read_strings(int fd, int *count);
+
+/* Deallocate an array returned by read_strings. */
+void free_strings(char **strings);
+
+#endif
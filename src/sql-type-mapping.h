@@ -1,3 +1,4 @@
 X(int, int)
 X(mode_t, int)
 X(time_t, int64)
+X(int64_t, int64)
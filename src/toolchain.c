@@ -0,0 +1,73 @@
+#include <assert.h>
+#include <openssl/md5.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "toolchain.h"
+#include "util.h"
+
+/* Files and directories maintained by common package managers that change
+ * whenever packages are installed, removed or upgraded.
+ */
+static const char *package_dbs[] = {
+    "/var/lib/dpkg/status",      /* Debian, Ubuntu */
+    "/var/lib/rpm/rpmdb.sqlite", /* Fedora */
+    "/var/lib/rpm/Packages",     /* older RPM-based distributions */
+    "/var/lib/pacman/local",     /* Arch */
+    "/lib/apk/db/installed",     /* Alpine */
+};
+
+/* Mix the state of a path into the stamp. */
+static void add(MD5_CTX *ctx, const char *path) {
+    MD5_Update(ctx, path, strlen(path) + 1);
+
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        /* Still contribute something, so that the path appearing is noticed.
+         */
+        static const char missing[] = "<missing>";
+        MD5_Update(ctx, missing, sizeof(missing));
+        return;
+    }
+
+    MD5_Update(ctx, &st.st_dev, sizeof(st.st_dev));
+    MD5_Update(ctx, &st.st_ino, sizeof(st.st_ino));
+    MD5_Update(ctx, &st.st_size, sizeof(st.st_size));
+    MD5_Update(ctx, &st.st_mtim, sizeof(st.st_mtim));
+    MD5_Update(ctx, &st.st_ctim, sizeof(st.st_ctim));
+}
+
+char *toolchain_stamp(const char *prefixes) {
+    assert(prefixes != NULL);
+
+    MD5_CTX ctx;
+    MD5_Init(&ctx);
+
+    MD5_Update(&ctx, prefixes, strlen(prefixes));
+
+    for (size_t i = 0; i < sizeof(package_dbs) / sizeof(package_dbs[0]); i++)
+        add(&ctx, package_dbs[i]);
+
+    /* Also cover the prefix directories themselves, to catch files added to
+     * or removed from them outside the package manager.
+     */
+    autofree char *copy = strdup(prefixes);
+    if (copy == NULL)
+        return NULL;
+    for (char *p = copy, *nl; (nl = strchr(p, '\n')) != NULL; p = nl + 1) {
+        *nl = '\0';
+        add(&ctx, p);
+    }
+
+    unsigned char h[MD5_DIGEST_LENGTH];
+    MD5_Final(h, &ctx);
+
+    char *stamp = malloc(MD5_DIGEST_LENGTH * 2 + 1);
+    if (stamp == NULL)
+        return NULL;
+    for (unsigned int i = 0; i < MD5_DIGEST_LENGTH; i++)
+        sprintf(stamp + i * 2, "%02x", h[i]);
+    return stamp;
+}
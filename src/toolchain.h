@@ -0,0 +1,21 @@
+#ifndef _XCACHE_TOOLCHAIN_H_
+#define _XCACHE_TOOLCHAIN_H_
+
+/* Toolchain stamps.
+ *
+ * A typical compiler invocation reads hundreds of files from system
+ * locations, like headers and shared libraries, that only change when the
+ * system's packages are upgraded. Rather than recording and checking each of
+ * these individually, files under immutable prefixes (see policy.h) are
+ * collectively represented by a single stamp. This is derived from the state
+ * of the system package databases and of the prefix directories themselves,
+ * and so changes whenever packages are installed, removed or upgraded.
+ */
+
+/* Compute the current stamp for a newline-terminated list of prefixes, as
+ * returned by policy_prefixes(). Returns NULL on failure. It is the caller's
+ * responsibility to free the returned pointer.
+ */
+char *toolchain_stamp(const char *prefixes);
+
+#endif
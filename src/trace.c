@@ -2,28 +2,54 @@
 #include "arch_syscall.h"
 #include <assert.h>
 #include "collection/list.h"
+#include "cwd.h"
 #include <errno.h>
 #include <fcntl.h>
+#include "fdtable.h"
 #include "hook.h"
 #include <libgen.h>
+#include <linux/close_range.h>
 #include <linux/limits.h>
 #include "log.h"
 #include "message-protocol.h"
 #include <pthread.h>
 #include "ptrace-wrapper.h"
+#include "ring.h"
+#include <sched.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/ptrace.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include "trace.h"
 #include <unistd.h>
 #include "util.h"
 
+/* Size we try to grow the pipes capturing the target's output to, so that a
+ * chatty target fills them, and wakes the hook thread, less often. This is
+ * the limit for unprivileged users by default. Not getting it is harmless.
+ */
+#define CAPTURE_PIPE_SZ (1024 * 1024)
+
+/* Space in the ring libhook sends us messages through. This needs to hold the
+ * messages a target sends while the hook thread is busy. Any that do not fit
+ * go through the message pipe.
+ */
+#define MESSAGE_RING_SZ (1024 * 1024)
+
+/* Lowest descriptor we move the message pipe to in the target, out of the way
+ * of the descriptors it uses itself. libinterpose stops the target closing or
+ * replacing it.
+ */
+#define MESSAGE_PIPE_FD 1000
+
 static int proc_cmp(void *proc, void *pid) {
     proc_t *p = (proc_t*)proc;
     return p->pid != (pid_t)(unsigned long)pid;
@@ -33,15 +59,21 @@ int proc_update_cwd(proc_t *proc) {
     autofree char *cwdlink = aprintf("/proc/%d/cwd", proc->pid);
     if (cwdlink == NULL)
         return -1;
-    ssize_t sz = readlink(cwdlink, proc->cwd, sizeof(proc->cwd));
-    if (sz >= (ssize_t)sizeof(proc->cwd))
+    char cwd[PATH_MAX];
+    ssize_t sz = readlink(cwdlink, cwd, sizeof(cwd));
+    if (sz < 0 || sz >= (ssize_t)sizeof(cwd))
         return -1;
-    proc->cwd[sz] = '\0';
-    return 0;
+    cwd[sz] = '\0';
+    if (proc->cwd == NULL) {
+        proc->cwd = cwd_new(cwd);
+        return proc->cwd == NULL ? -1 : 0;
+    }
+    return cwd_set(proc->cwd, cwd);
 }
 
-/* Find the accompanying getenv hook library. We assume it lives in the same
- * directory as the xcache binary.
+/* Find one of the accompanying libraries we inject into the target, libhook
+ * or libinterpose. We assume they live in the same directory as the xcache
+ * binary.
  *
  * FIXME: You can't LD_PRELOAD a library from a path containing spaces. There's
  * not much we can directly do about this, but we could workaround it by
@@ -49,26 +81,55 @@ int proc_update_cwd(proc_t *proc) {
  * not worth it, but we should at least look into giving the user more feedback
  * about why the hook fails.
  */
-static char *locate_hooklib(const char *exe) {
+static char *locate_lib(const char *exe, const char *name) {
     autofree char *resolved = realpath(exe, NULL);
-    if (resolved == NULL)
-        return NULL;
+    if (resolved == NULL) {
+        /* We were probably run through $PATH, so 'exe' is not a path. */
+        resolved = my_exe();
+        if (resolved == NULL)
+            return NULL;
+    }
 
     char *root = dirname(resolved);
 
-    char *libhook = aprintf("%s/libhook.so", root);
+    char *lib = aprintf("%s/%s", root, name);
 
-    return libhook;
+    return lib;
 }
 
-int trace(target_t *t, char **argv, const char *tracer) {
+/* Add a library to the LD_PRELOAD of our environment. Returns 0 on success. */
+static int preload(const char *tracer, const char *name) {
+    autofree char *lib = locate_lib(tracer, name);
+    if (lib == NULL)
+        return -1;
+
+    char *ld_preload = getenv("LD_PRELOAD");
+    if (ld_preload == NULL) {
+        ld_preload = lib;
+    } else {
+        ld_preload = aprintf("%s %s", ld_preload, lib);
+        if (ld_preload == NULL)
+            return -1;
+    }
+    int r = setenv("LD_PRELOAD", ld_preload, 1);
+    if (ld_preload != lib)
+        free(ld_preload);
+    return r;
+}
+
+int trace(target_t *t, char **argv, const char *tracer, bool hook_getenv,
+        int (*interpose)(const char *path, filetype_t type, time_t mtime,
+            bool directory), const char *staging) {
     /* Zero out the struct so we can detect initialised data below. */
     memset(t, 0, sizeof(*t));
+    t->interpose = interpose;
     bool children_initialised = false,
          hook_initialised = false,
          env_initialised = false;
 
-    if (list(&t->children, proc_cmp) != 0)
+    t->tracer.target = t;
+    t->tracer.root = &t->root;
+    if (list(&t->tracer.children, proc_cmp) != 0)
         goto fail;
     children_initialised = true;
 
@@ -76,8 +137,12 @@ int trace(target_t *t, char **argv, const char *tracer) {
         t->stdout_pipe[0] = t->stdout_pipe[1] = 0;
         goto fail;
     }
+    (void)fcntl(t->stdout_pipe[1], F_SETPIPE_SZ, CAPTURE_PIPE_SZ);
+
+    if (staging == NULL)
+        staging = "/tmp";
 
-    t->outfile = strdup("/tmp/tmp.XXXXXX");
+    t->outfile = aprintf("%s/tmp.XXXXXX", staging);
     if (t->outfile == NULL)
         goto fail;
     t->outfd = mkstemp(t->outfile);
@@ -88,8 +153,9 @@ int trace(target_t *t, char **argv, const char *tracer) {
         t->stderr_pipe[0] = t->stderr_pipe[1] = 0;
         goto fail;
     }
+    (void)fcntl(t->stderr_pipe[1], F_SETPIPE_SZ, CAPTURE_PIPE_SZ);
 
-    t->errfile = strdup("/tmp/tmp.XXXXXX");
+    t->errfile = aprintf("%s/tmp.XXXXXX", staging);
     if (t->errfile == NULL)
         goto fail;
     t->errfd = mkstemp(t->errfile);
@@ -101,11 +167,31 @@ int trace(target_t *t, char **argv, const char *tracer) {
         goto fail;
     }
 
+    /* The target inherits the write end, so move it somewhere the target is
+     * unlikely to trip over it. Failing to is harmless.
+     */
+    {
+        int high = fcntl(t->msg_pipe[1], F_DUPFD, MESSAGE_PIPE_FD);
+        if (high != -1) {
+            close(t->msg_pipe[1]);
+            t->msg_pipe[1] = high;
+        }
+    }
+
     if (pipe(t->sig_pipe) != 0) {
         t->sig_pipe[0] = t->sig_pipe[1] = 0;
         goto fail;
     }
 
+    /* Without the ring, libhook falls back to the message pipe, so failing to
+     * create it is not an error.
+     */
+    if (tracer != NULL && hook_getenv) {
+        t->ring = ring_new(MESSAGE_RING_SZ);
+        if (t->ring == NULL)
+            DEBUG("failed to create message ring (%d)\n", errno);
+    }
+
     if (dict(&t->env) != 0)
         goto fail;
     env_initialised = true;
@@ -117,7 +203,21 @@ int trace(target_t *t, char **argv, const char *tracer) {
     /* The working directory of the initial (root) process will be the same as
      * ours.
      */
-    if (getcwd(t->root.cwd, sizeof(t->root.cwd)) == NULL)
+    {
+        autofree char *cwd = getcwd(NULL, 0);
+        if (cwd == NULL)
+            goto fail;
+        t->root.cwd = cwd_new(cwd);
+        if (t->root.cwd == NULL)
+            goto fail;
+    }
+
+    /* We do not know what the descriptors the root inherits from us refer to
+     * once it is running, so its table starts empty and lookups of these fall
+     * back to /proc.
+     */
+    t->root.fds = fdtable_new();
+    if (t->root.fds == NULL)
         goto fail;
 
     t->root.pid = fork();
@@ -136,39 +236,45 @@ int trace(target_t *t, char **argv, const char *tracer) {
             close(t->sig_pipe[0]);
             close(t->sig_pipe[1]);
 
-            /* Extend our environment to LD_PRELOAD a helper library into the
+            /* Extend our environment to LD_PRELOAD helper libraries into the
              * target. The idea behind this is to setup a channel between xcache
              * and the tracee for communicating extra information beyond
-             * syscalls. Note that if any of this fails, we just ignore it and
-             * continue without the extra library. This functionality is not
-             * critical.
+             * syscalls. Note that if libhook fails to load, we just ignore it
+             * and continue without it. This functionality is not critical.
+             * Without libinterpose though, we would see nothing at all.
              */
-            if (tracer != NULL) {
-                autofree char *lib = locate_hooklib(tracer);
-                if (lib != NULL) {
-                    char *ld_preload = getenv("LD_PRELOAD");
-                    if (ld_preload == NULL) {
-                        ld_preload = lib;
-                    } else {
-                        ld_preload = aprintf("%s %s", ld_preload, lib);
-                    }
-                    (void)setenv("LD_PRELOAD", ld_preload, 1);
-                    if (ld_preload != lib)
-                        free(ld_preload);
-
-                    /* Make sure libhook can find the pipe back to the
-                     * tracer.
-                     */
-                    autofree char *xcache_pipe = aprintf("%d", t->msg_pipe[1]);
-                    if (xcache_pipe != NULL) {
-                        (void)setenv(XCACHE_PIPE, xcache_pipe, 1);
-                    }
+            bool preloaded = false;
+            if (tracer != NULL && hook_getenv)
+                preloaded |= preload(tracer, "libhook.so") == 0;
+            if (interpose != NULL) {
+                if (tracer == NULL || preload(tracer, "libinterpose.so") != 0)
+                    exit(-1);
+                preloaded = true;
+            }
+            if (preloaded) {
+                /* Make sure the libraries can find the pipe back to the
+                 * tracer.
+                 */
+                autofree char *xcache_pipe = aprintf("%d", t->msg_pipe[1]);
+                if (xcache_pipe != NULL) {
+                    (void)setenv(XCACHE_PIPE, xcache_pipe, 1);
+                }
+            }
+            if (preloaded && hook_getenv && t->ring != NULL) {
+                /* libhook prefers the ring, as "<memfd>,<eventfd>". */
+                autofree char *xcache_ring = aprintf("%d,%d",
+                    ring_memfd(t->ring), ring_eventfd(t->ring));
+                if (xcache_ring != NULL) {
+                    (void)setenv(XCACHE_RING, xcache_ring, 1);
                 }
             }
 
-            long r = pt_traceme();
-            if (r != 0)
-                exit(-1);
+            if (interpose == NULL) {
+                /* Wait for the tracer to attach before we exec. */
+                long r = pt_stopme();
+                if (r != 0)
+                    exit(-1);
+            }
             execvp(argv[0], (char**)argv);
 
             /* Exec failed. Try to tell the tracer. */
@@ -187,17 +293,41 @@ int trace(target_t *t, char **argv, const char *tracer) {
     }
 
     assert(t->root.pid > 0);
+
+    if (interpose != NULL) {
+        /* The target runs untraced, reporting to the hook as it goes. */
+        t->root.state = IN_USER;
+        t->root.started = true;
+        return 0;
+    }
+
     int status;
-    waitpid(t->root.pid, &status, 0);
-    if (WIFEXITED(status)) {
-        /* Either ptrace or exec failed in the child. */
+    waitpid(t->root.pid, &status, WUNTRACED);
+    if (!WIFSTOPPED(status)) {
+        /* The child failed to stop itself. */
         DEBUG("tracee exited immediately\n");
         goto fail;
     }
 
-    long r = pt_setoptions(t->root.pid);
+    long r = pt_seize(t->root.pid);
     if (r != 0) {
-        DEBUG("failed to set default tracing options (%d)\n", errno);
+        DEBUG("failed to attach to tracee (%d)\n", errno);
+        goto fail;
+    }
+
+    /* Having attached, we are told of the stop the child is already in, from
+     * which we can resume it. Resuming it through ptrace alone would leave it
+     * stopped as far as job control is concerned, and it would stop again if
+     * we ever detached, so continue it properly. We pass the resulting
+     * SIGCONT on like any other signal.
+     */
+    if (kill(t->root.pid, SIGCONT) != 0) {
+        DEBUG("failed to continue tracee (%d)\n", errno);
+        goto fail;
+    }
+    waitpid(t->root.pid, &status, __WALL);
+    if (!WIFSTOPPED(status)) {
+        DEBUG("tracee exited before we could attach\n");
         goto fail;
     }
 
@@ -207,9 +337,12 @@ int trace(target_t *t, char **argv, const char *tracer) {
         goto fail;
     }
     t->root.state = IN_USER;
+    t->root.started = true;
     return 0;
 
 fail:
+    fdtable_release(t->root.fds);
+    cwd_release(t->root.cwd);
     if (hook_initialised)
         (void)hook_close(t);
     if (env_initialised)
@@ -222,16 +355,21 @@ fail:
         close(t->msg_pipe[0]);
     if (t->msg_pipe[1] > 0)
         close(t->msg_pipe[1]);
-    if (t->errfd > 0)
+    ring_free(t->ring);
+    if (t->errfd > 0) {
         close(t->errfd);
+        unlink(t->errfile);
+    }
     if (t->errfile != NULL)
         free(t->errfile);
     if (t->stderr_pipe[0] > 0)
         close(t->stderr_pipe[0]);
     if (t->stderr_pipe[1] > 0)
         close(t->stderr_pipe[1]);
-    if (t->outfd > 0)
+    if (t->outfd > 0) {
         close(t->outfd);
+        unlink(t->outfile);
+    }
     if (t->outfile != NULL)
         free(t->outfile);
     if (t->stdout_pipe[0] > 0)
@@ -239,7 +377,7 @@ fail:
     if (t->stdout_pipe[1] > 0)
         close(t->stdout_pipe[1]);
     if (children_initialised)
-        list_destroy(&t->children);
+        list_destroy(&t->tracer.children);
     return -1;
 }
 
@@ -301,6 +439,40 @@ char *syscall_getstring(syscall_t *syscall, int arg) {
     return pt_peekstring(syscall->proc->pid, offset);
 }
 
+int syscall_getdata(syscall_t *syscall, int arg, void *buf, size_t len) {
+    assert(arg > 0);
+
+    long offset = register_offset(arg);
+    if (offset == -1)
+        return -1;
+
+    return pt_peekdata(syscall->proc->pid, offset, buf, len);
+}
+
+char **syscall_getstrings(syscall_t *syscall, int arg) {
+    assert(arg > 0);
+
+    long offset = register_offset(arg);
+    if (offset == -1)
+        return NULL;
+
+    return pt_peekstrings(syscall->proc->pid, offset);
+}
+
+int syscall_exit_group(syscall_t *syscall, int status) {
+    assert(syscall->enter);
+
+    long offset = register_offset(1);
+    if (offset == -1)
+        return -1;
+
+    if (pt_pokereg(syscall->proc->pid, OFFSET(REG_SYSNO), SYS_exit_group) != 0
+            || pt_pokereg(syscall->proc->pid, offset, status) != 0)
+        return -1;
+    syscall->call = SYS_exit_group;
+    return 0;
+}
+
 long syscall_getarg(syscall_t *syscall, int arg) {
     long offset = register_offset(arg);
     if (offset == -1)
@@ -308,6 +480,26 @@ long syscall_getarg(syscall_t *syscall, int arg) {
     return pt_peekreg(syscall->proc->pid, offset);
 }
 
+bool target_channel(const target_t *tracee, int fd) {
+    if (tracee == NULL || fd < 0)
+        return false;
+    return fd == tracee->msg_pipe[1] ||
+        (tracee->ring != NULL && fd == ring_eventfd(tracee->ring));
+}
+
+char *proc_getfd(proc_t *proc, int fd) {
+    if (fd == AT_FDCWD)
+        return strdup(cwd_get(proc->cwd));
+
+    if (proc->fds != NULL) {
+        const char *path = fdtable_get(proc->fds, fd);
+        if (path != NULL)
+            return strdup(path);
+    }
+
+    return pt_fdpath(proc->pid, fd);
+}
+
 char *syscall_getfd(syscall_t *syscall, int arg) {
     assert(arg > 0);
 
@@ -315,52 +507,637 @@ char *syscall_getfd(syscall_t *syscall, int arg) {
     if (offset == -1)
         return NULL;
 
-    return pt_peekfd(syscall->proc->pid, syscall->proc->cwd, offset);
+    return proc_getfd(syscall->proc,
+        (int)pt_peekreg(syscall->proc->pid, offset));
+}
+
+/* Record the descriptor returned by a successful open-like syscall. If we
+ * cannot tell what it refers to, we forget it so that lookups fall back to
+ * /proc.
+ */
+static void track_open(syscall_t *s, int dirfd, int patharg, int flags) {
+    int fd = (int)s->result;
+    fdtable_t *fds = s->proc->fds;
+
+#ifdef O_TMPFILE
+    if ((flags & O_TMPFILE) == O_TMPFILE) {
+        /* An unnamed file in the given directory. */
+        fdtable_forget(fds, fd);
+        return;
+    }
+#endif
+
+    autofree char *path = syscall_getstring(s, patharg);
+    if (path == NULL) {
+        fdtable_forget(fds, fd);
+        return;
+    }
+
+    autofree char *base = path[0] == '/' ? strdup("/") :
+        proc_getfd(s->proc, dirfd);
+    if (base == NULL || base[0] != '/') {
+        fdtable_forget(fds, fd);
+        return;
+    }
+
+    autofree char *absolute = abspath(base, path);
+    if (absolute == NULL) {
+        fdtable_forget(fds, fd);
+        return;
+    }
+
+    (void)fdtable_set(fds, fd, absolute, (flags & O_CLOEXEC) != 0,
+        s->proc->data);
+}
+
+/* Follow the effect of a completed syscall on the descriptor table of the
+ * process that made it.
+ */
+static void track_fds(syscall_t *s) {
+    proc_t *p = s->proc;
+    if (p->fds == NULL)
+        return;
+
+    /* Most of the following only have an effect on success. close is the
+     * exception, as the descriptor is released even if it reports an error.
+     */
+    if (s->result < 0 && s->call != SYS_close)
+        return;
+
+    switch (s->call) {
+
+        case SYS_open:
+            track_open(s, AT_FDCWD, 1, (int)syscall_getarg(s, 2));
+            break;
+
+        case SYS_openat:
+            track_open(s, (int)syscall_getarg(s, 1), 2,
+                (int)syscall_getarg(s, 3));
+            break;
+
+#ifdef SYS_openat2
+        case SYS_openat2: {
+            uint64_t flags;
+            if (syscall_getdata(s, 3, &flags, sizeof(flags)) != 0) {
+                fdtable_forget(p->fds, (int)s->result);
+                break;
+            }
+            track_open(s, (int)syscall_getarg(s, 1), 2, (int)flags);
+            break;
+        }
+#endif
+
+        case SYS_creat:
+            track_open(s, AT_FDCWD, 1, O_CREAT|O_WRONLY|O_TRUNC);
+            break;
+
+        case SYS_dup:
+        case SYS_dup2:
+            (void)fdtable_dup(p->fds, (int)syscall_getarg(s, 1),
+                (int)s->result, false);
+            break;
+
+        case SYS_dup3:
+            (void)fdtable_dup(p->fds, (int)syscall_getarg(s, 1),
+                (int)s->result, (syscall_getarg(s, 3) & O_CLOEXEC) != 0);
+            break;
+
+        case SYS_fcntl:
+#ifdef SYS_fcntl64
+        case SYS_fcntl64:
+#endif
+            switch (syscall_getarg(s, 2)) {
+                case F_DUPFD:
+                    (void)fdtable_dup(p->fds, (int)syscall_getarg(s, 1),
+                        (int)s->result, false);
+                    break;
+                case F_DUPFD_CLOEXEC:
+                    (void)fdtable_dup(p->fds, (int)syscall_getarg(s, 1),
+                        (int)s->result, true);
+                    break;
+                case F_SETFD:
+                    fdtable_setcloexec(p->fds, (int)syscall_getarg(s, 1),
+                        (syscall_getarg(s, 3) & FD_CLOEXEC) != 0);
+                    break;
+            }
+            break;
+
+        case SYS_ioctl:
+            switch (syscall_getarg(s, 2)) {
+                case FIOCLEX:
+                    fdtable_setcloexec(p->fds, (int)syscall_getarg(s, 1), true);
+                    break;
+                case FIONCLEX:
+                    fdtable_setcloexec(p->fds, (int)syscall_getarg(s, 1),
+                        false);
+                    break;
+            }
+            break;
+
+        case SYS_close:
+            fdtable_forget(p->fds, (int)syscall_getarg(s, 1));
+            break;
+
+#ifdef SYS_close_range
+        case SYS_close_range: {
+            long flags = syscall_getarg(s, 3);
+            if ((flags & CLOSE_RANGE_UNSHARE) &&
+                    fdtable_unshare(&p->fds) != 0) {
+                fdtable_release(p->fds);
+                p->fds = NULL;
+                break;
+            }
+            fdtable_close_range(p->fds, (unsigned)syscall_getarg(s, 1),
+                (unsigned)syscall_getarg(s, 2),
+                (flags & CLOSE_RANGE_CLOEXEC) != 0);
+            break;
+        }
+#endif
+
+        case SYS_unshare:
+            if ((syscall_getarg(s, 1) & CLONE_FILES) &&
+                    fdtable_unshare(&p->fds) != 0) {
+                fdtable_release(p->fds);
+                p->fds = NULL;
+            }
+            break;
+
+        case SYS_pipe:
+        case SYS_pipe2: {
+            int pipefd[2];
+            if (syscall_getdata(s, 1, pipefd, sizeof(pipefd)) != 0) {
+                /* We no longer know which slots are in use. */
+                fdtable_release(p->fds);
+                p->fds = NULL;
+                break;
+            }
+            fdtable_forget(p->fds, pipefd[0]);
+            fdtable_forget(p->fds, pipefd[1]);
+            break;
+        }
+
+        /* The following create descriptors we have no path for. These can
+         * only take slots that are free, so forgetting them is just a
+         * safeguard in case we missed a close.
+         */
+        case SYS_accept:
+        case SYS_accept4:
+        case SYS_epoll_create:
+        case SYS_epoll_create1:
+        case SYS_eventfd:
+        case SYS_eventfd2:
+        case SYS_inotify_init:
+        case SYS_inotify_init1:
+#ifdef SYS_memfd_create
+        case SYS_memfd_create:
+#endif
+        case SYS_open_by_handle_at:
+#ifdef SYS_pidfd_open
+        case SYS_pidfd_open:
+#endif
+        case SYS_signalfd:
+        case SYS_signalfd4:
+        case SYS_socket:
+        case SYS_timerfd_create:
+            fdtable_forget(p->fds, (int)s->result);
+            break;
+    }
+}
+
+/* Determine the clone flags a parent passed when creating a child. Returns 0
+ * on success.
+ */
+static int clone_flags(pid_t parent, unsigned long *flags) {
+    switch (syscall_number(parent)) {
+
+        case SYS_clone:
+            *flags = (unsigned long)pt_peekreg(parent, register_offset(1));
+            return 0;
+
+#ifdef SYS_clone3
+        case SYS_clone3: {
+            /* The flags are the first member of the struct clone_args this
+             * points to.
+             */
+            uint64_t f;
+            if (pt_peekdata(parent, register_offset(1), &f, sizeof(f)) != 0)
+                return -1;
+            *flags = (unsigned long)f;
+            return 0;
+        }
+#endif
+
+        default:
+            /* fork and vfork share nothing we track. */
+            *flags = 0;
+            return 0;
+    }
+}
+
+/* Determine the parent of a process from /proc. Returns -1 on failure. */
+static pid_t parent_of(pid_t pid) {
+    autofree char *path = aprintf("/proc/%d/stat", pid);
+    if (path == NULL)
+        return -1;
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    char buf[512];
+    size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[len] = '\0';
+
+    /* The parent follows the command and state. The command is parenthesised
+     * but may itself contain parentheses, so find the last of these.
+     */
+    char *end = strrchr(buf, ')');
+    int ppid;
+    if (end == NULL || sscanf(end + 1, " %*c %d", &ppid) != 1)
+        return -1;
+    return (pid_t)ppid;
+}
+
+static proc_t *find_proc(tracer_t *tracer, pid_t pid) {
+    if (tracer->root != NULL && pid == tracer->root->pid)
+        return tracer->root;
+    return list_find(&tracer->children, (void*)(uintptr_t)pid);
+}
+
+/* Start tracking a new child process. If its parent is not known, its working
+ * directory is read from /proc. Returns NULL on failure.
+ */
+static proc_t *add_child(tracer_t *tracer, pid_t pid, proc_t *parent,
+        unsigned long flags) {
+    proc_t *p = calloc(1, sizeof(*p));
+    if (p == NULL)
+        return NULL;
+    p->pid = pid;
+    p->state = IN_USER;
+    if (parent == NULL) {
+        if (proc_update_cwd(p) != 0) {
+            free(p);
+            return NULL;
+        }
+    } else {
+        p->cwd = (flags & CLONE_FS) ? cwd_share(parent->cwd) :
+            cwd_fork(parent->cwd);
+        if (p->cwd == NULL) {
+            free(p);
+            return NULL;
+        }
+    }
+    if (list_add(&tracer->children, p) != 0) {
+        cwd_release(p->cwd);
+        free(p);
+        return NULL;
+    }
+    return p;
+}
+
+/* Forget a process, with its wait status if it exited or -1 if we stopped
+ * tracing it.
+ */
+static void free_proc(target_t *t, proc_t *p, int status) {
+    if (t->on_exit != NULL)
+        t->on_exit(p, status);
+    fdtable_release(p->fds);
+    cwd_release(p->cwd);
+    free(p);
 }
 
-syscall_t *next_syscall(target_t *tracee) {
-    assert(tracee != NULL);
-    if (tracee->root.state != IN_USER && tracee->root.state != IN_KERNEL) {
+/* Handle a fork event in a parent, registering its new child with a working
+ * directory and descriptor table derived from the parent's. Returns the child
+ * if it was held at its initial stop waiting for this, in which case the
+ * caller needs to start it.
+ */
+static proc_t *inherit(tracer_t *tracer, proc_t *parent, pid_t pid) {
+    target_t *t = tracer->target;
+    proc_t *child = find_proc(tracer, pid);
+    /* The parent we guessed for a held child may not be the thread that
+     * actually forked it, so go by this event.
+     */
+    bool held = child != NULL && child->held_by != 0;
+    if (child != NULL && !held) {
+        /* The child was already running when we registered it, so we cannot
+         * know what it has done with its descriptors in the meantime. It goes
+         * without a table. Its working directory was read from /proc.
+         */
+        return NULL;
+    }
+
+    unsigned long flags;
+    bool known = clone_flags(parent->pid, &flags) == 0;
+
+    if (held) {
+        /* The child has not run yet, so it can take the parent's working
+         * directory as if its initial stop had come second.
+         */
+        child->held_by = 0;
+        cwd_t *cwd = !known ? NULL : (flags & CLONE_FS) ?
+            cwd_share(parent->cwd) : cwd_fork(parent->cwd);
+        if (cwd != NULL) {
+            cwd_release(child->cwd);
+            child->cwd = cwd;
+        }
+    } else {
+        child = add_child(tracer, pid, known ? parent : NULL, flags);
+        if (child == NULL) {
+            DEBUG("warning: failed to register forked child %d\n", pid);
+            return NULL;
+        }
+    }
+    child->independent = known &&
+        !(flags & (CLONE_FILES|CLONE_FS|CLONE_THREAD));
+    if (t->on_fork != NULL)
+        t->on_fork(parent, child);
+
+    if (known && parent->fds != NULL)
+        child->fds = (flags & CLONE_FILES) ? fdtable_share(parent->fds) :
+            fdtable_copy(parent->fds);
+    return held ? child : NULL;
+}
+
+static void unblock(proc_t *proc) {
+    if (proc->state == SYSENTER) {
+        pt_continue(proc->pid);
+        proc->state = IN_KERNEL;
+    } else if (proc->state == SYSEXIT) {
+        pt_continue(proc->pid);
+        proc->state = IN_USER;
+    }
+}
+
+/* Stop tracing all of a tracer's processes other than the root, letting them
+ * continue untraced.
+ */
+static void abandon(tracer_t *tracer) {
+    void dealloc(void *data, void *_ __attribute__((unused))) {
+        proc_t *p = data;
+        unblock(p);
+        pt_detach(p->pid);
+        free_proc(tracer->target, p, -1);
+    }
+    list_foreach(&tracer->children, dealloc, NULL);
+    list_destroy(&tracer->children);
+    (void)list(&tracer->children, proc_cmp);
+}
+
+/* Try to hand a new child, at its initial stop, to an idle tracer. Returns 0
+ * if we did, in which case the child no longer belongs to 'tracer'.
+ */
+static int handoff(tracer_t *tracer, proc_t *p) {
+    target_t *t = tracer->target;
+    if (t->ntracers == 0 || !p->independent)
+        return -1;
+
+    /* The child's working directory string is shared with its parent, so it
+     * needs its own before another thread can touch it.
+     */
+    cwd_t *cwd = cwd_new(cwd_get(p->cwd));
+    if (cwd == NULL)
+        return -1;
+
+    /* Claim an idle tracer, so no one else hands it a process meanwhile. */
+    tracer_t *to = NULL;
+    pthread_mutex_lock(&t->lock);
+    for (unsigned i = 0; i < t->ntracers && !t->stopping; i++) {
+        if (t->tracers[i].idle) {
+            to = &t->tracers[i];
+            to->idle = false;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&t->lock);
+    if (to == NULL) {
+        cwd_release(cwd);
+        return -1;
+    }
+
+    if (pt_handoff(p->pid) != 0) {
+        DEBUG("failed to hand off process %d (errno: %d)\n", p->pid, errno);
+        pthread_mutex_lock(&t->lock);
+        to->idle = true;
+        pthread_cond_broadcast(&t->cond);
+        pthread_mutex_unlock(&t->lock);
+        cwd_release(cwd);
+        return -1;
+    }
+
+    (void)list_remove(&tracer->children, (void*)(uintptr_t)p->pid);
+    cwd_release(p->cwd);
+    p->cwd = cwd;
+
+    pthread_mutex_lock(&t->lock);
+    to->adopted = p;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+    IDEBUG("handed off process %d\n", p->pid);
+    return 0;
+}
+
+/* Wait for a process to be handed to an idle tracer and attach to it. Returns
+ * -1 when the tracer should stop instead.
+ */
+static int adopt(tracer_t *tracer) {
+    target_t *t = tracer->target;
+
+    pthread_mutex_lock(&t->lock);
+    tracer->idle = true;
+    /* Once claimed, we are committed to waiting for the process. */
+    while (tracer->adopted == NULL && !(tracer->idle && t->stopping))
+        pthread_cond_wait(&t->cond, &t->lock);
+    proc_t *p = tracer->adopted;
+    tracer->adopted = NULL;
+    tracer->idle = false;
+    pthread_mutex_unlock(&t->lock);
+
+    if (p == NULL)
+        return -1;
+
+    if (pt_seize(p->pid) != 0) {
+        /* The process may have been killed in the meantime. Otherwise, it can
+         * only run on untraced, so what we know about the target is
+         * incomplete.
+         */
+        if (errno != ESRCH) {
+            DEBUG("failed to attach to handed off process %d (errno: %d)\n",
+                p->pid, errno);
+            (void)kill(p->pid, SIGCONT);
+            __atomic_store_n(&t->bailout, true, __ATOMIC_RELEASE);
+        }
+        free_proc(t, p, -1);
+        return 0;
+    }
+
+    /* As for the root, continue the process properly rather than only through
+     * ptrace. The stop may not have happened yet, in which case continuing
+     * discards it.
+     */
+    if (kill(p->pid, SIGCONT) != 0) {
+        DEBUG("failed to continue handed off process %d (errno: %d)\n", p->pid,
+            errno);
+        pt_detach(p->pid);
+        __atomic_store_n(&t->bailout, true, __ATOMIC_RELEASE);
+        free_proc(t, p, -1);
+        return 0;
+    }
+
+    p->state = IN_USER;
+    p->started = true;
+    if (list_add(&tracer->children, p) != 0) {
+        pt_detach(p->pid);
+        __atomic_store_n(&t->bailout, true, __ATOMIC_RELEASE);
+        free_proc(t, p, -1);
+    }
+    return 0;
+}
+
+/* Set a new child going from its initial stop, handing it to an idle tracer
+ * if we can.
+ */
+static void start_child(tracer_t *tracer, proc_t *p) {
+    if (handoff(tracer, p) == 0)
+        return;
+    p->started = true;
+    if (pt_runtosyscall(p->pid) != 0)
+        DEBUG("warning: failed to continue forked child %d (errno: %d)\n",
+            p->pid, errno);
+}
+
+/* Start any children held waiting for the fork event of a parent that exited
+ * without delivering it. They go without what the parent would have told us.
+ */
+static void release_held(tracer_t *tracer, pid_t parent) {
+    while (true) {
+        proc_t *held = NULL;
+        void find(void *value, void *data __attribute__((unused))) {
+            proc_t *p = value;
+            if (held == NULL && p->held_by == parent)
+                held = p;
+        }
+        (void)list_foreach(&tracer->children, find, NULL);
+        if (held == NULL)
+            return;
+        held->held_by = 0;
+        start_child(tracer, held);
+    }
+}
+
+/* Once the root has exited, a well behaved target has no processes left, but
+ * a tracer may not yet have seen the exits of all of its own. Collect these
+ * without blocking. Anything left is still running.
+ */
+static void drain(tracer_t *tracer) {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, __WALL|__WNOTHREAD|WNOHANG)) > 0) {
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            proc_t *p = list_remove(&tracer->children, (void*)(uintptr_t)pid);
+            if (p != NULL)
+                free_proc(tracer->target, p, status);
+            continue;
+        }
+        /* A process still doing things. Let it go on and stop looking. */
+        int sig = WIFSTOPPED(status) && status >> 16 == 0 &&
+            WSTOPSIG(status) != SIGSYSCALL ? WSTOPSIG(status) : 0;
+        (void)pt_deliver(pid, sig);
+        break;
+    }
+}
+
+syscall_t *next_syscall(tracer_t *tracer) {
+    assert(tracer != NULL);
+    target_t *tracee = tracer->target;
+    proc_t *root = tracer->root;
+    if (root != NULL && root->state != IN_USER && root->state != IN_KERNEL) {
         DEBUG("attempt to retrieve a syscall from a stopped process\n");
         return NULL;
     }
 
 retry:;
-    int status;
-    pid_t pid = waitpid(-1, &status, __WALL);
+    /* Give up as soon as another tracer finds it cannot follow its part of
+     * the target.
+     */
+    if (__atomic_load_n(&tracee->bailout, __ATOMIC_ACQUIRE))
+        return NULL;
 
-    if (WIFEXITED(status)) {
-        if (pid != tracee->root.pid) {
-            /* A forked child exited. */
-            IDEBUG("child %d exited\n", pid);
-            autofree proc_t *p = list_remove(&tracee->children,
-                (void*)(uintptr_t)pid);
-            assert(p != NULL && p->pid == pid);
+    if (root == NULL) {
+        if (__atomic_load_n(&tracee->stopping, __ATOMIC_ACQUIRE)) {
+            if (tracee->root.state == TERMINATED)
+                drain(tracer);
+            return NULL;
+        }
+        if (list_empty(&tracer->children)) {
+            if (adopt(tracer) != 0)
+                return NULL;
             goto retry;
         }
+    }
+
+    /* Other tracer threads wait on their own processes, so we must only wait
+     * on ours.
+     */
+    int status;
+    pid_t pid = waitpid(-1, &status, __WALL|__WNOTHREAD);
+    if (pid == -1) {
+        if (errno == EINTR) {
+            /* We were woken to check whether we should stop. */
+            goto retry;
+        }
+        DEBUG("failed to wait for traced processes (errno: %d)\n", errno);
+        return NULL;
+    }
+
+    bool is_root = root != NULL && pid == root->pid;
+    if (!is_root && (WIFEXITED(status) || WIFSIGNALED(status))) {
+        /* A forked child exited. */
+        IDEBUG("child %d exited\n", pid);
+        proc_t *p = list_remove(&tracer->children, (void*)(uintptr_t)pid);
+        assert(p != NULL && p->pid == pid);
+        free_proc(tracee, p, status);
+        release_held(tracer, pid);
+        goto retry;
+    }
+
+    if (WIFEXITED(status)) {
         /* In the following we are assuming a well behaved tracee that waits on
          * all its forked children. That is, exit of the root process implies
          * the entire operation has completed.
          */
-        tracee->root.state = TERMINATED;
+        root->state = TERMINATED;
         tracee->exit_status = WEXITSTATUS(status);
         DEBUG("tracee exited with status %d\n", tracee->exit_status);
         return NULL;
     }
 
+    if (WIFSIGNALED(status)) {
+        root->state = TERMINATED;
+        tracee->exit_signal = WTERMSIG(status);
+        tracee->exit_status = (1 << 7)|WTERMSIG(status);
+        DEBUG("tracee terminated by signal %d\n", tracee->exit_signal);
+        return NULL;
+    }
+
     if (WIFSTOPPED(status) && WSTOPSIG(status) == SIGTRAP &&
             ((status >> 8) == (SIGTRAP|PTRACE_EVENT_FORK << 8) ||
              (status >> 8) == (SIGTRAP|PTRACE_EVENT_VFORK << 8) ||
              (status >> 8) == (SIGTRAP|PTRACE_EVENT_CLONE << 8))) {
-        /* The target called fork (or a cousin of). Unless I've missed
-         * something in the ptrace docs, the only way to also trace forked
-         * children is to set PTRACE_O_FORK and friends on the root process.
-         * Unfortunately the result of this is that we get two events that tell
-         * us the same thing: a SIGTRAP in the parent on fork (this case) and a
-         * SIGSTOP in the child before execution (handled below). It's simpler
-         * to just ignore the SIGTRAP in the parent and start tracking the
-         * child when we receive its initial SIGSTOP.
+        /* The target called fork (or a cousin of). Because we set
+         * PTRACE_O_TRACEFORK and friends, the child is already traced with
+         * our options. We get two events that tell us the same thing: a
+         * SIGTRAP in the parent on fork (this case) and an initial stop in
+         * the child before execution (handled below). These can arrive in
+         * either order. The parent is still in the clone syscall here, so
+         * this is where we register the child and tell what it shares with
+         * its parent.
          */
+        proc_t *parent = find_proc(tracer, pid);
+        pid_t child = (pid_t)pt_geteventmsg(pid);
+        proc_t *held = parent != NULL && child > 0 ?
+            inherit(tracer, parent, child) : NULL;
+        if (held != NULL)
+            start_child(tracer, held);
+
         long r = pt_runtosyscall(pid);
         if (r != 0)
             DEBUG("failed to resume parent process %d (errno: %d)\n", pid,
@@ -393,6 +1170,13 @@ retry:;
             oldpid = pid;
         }
 
+        /* Close-on-exec descriptors are now gone. */
+        proc_t *p = find_proc(tracer, pid);
+        if (p != NULL && p->fds != NULL && fdtable_exec(&p->fds) != 0) {
+            fdtable_release(p->fds);
+            p->fds = NULL;
+        }
+
         if (pt_runtosyscall(oldpid) != 0)
             DEBUG("failed to resume execing process %d\n", oldpid);
 
@@ -400,36 +1184,48 @@ retry:;
     }
 
     assert(WIFSTOPPED(status));
-    proc_t *p;
-    if (pid == tracee->root.pid)
-        p = &tracee->root;
-    else
-        p = list_find(&tracee->children, (void*)(uintptr_t)pid);
-    if (p == NULL) {
-        /* We've hit a signal in a new (untraced) process. This is the first
-         * we've seen of a forked child process, so let's start tracing it.
+    proc_t *p = find_proc(tracer, pid);
+    if (p == NULL || !p->started) {
+        /* This is the initial stop of a new child process. We have usually
+         * registered it already, when its parent's fork event arrived, and
+         * only need to set it going.
          */
-        assert(WSTOPSIG(status) == SIGSTOP);
-        p = malloc(sizeof(*p));
-        if (p == NULL)
-            return NULL;
-        p->pid = pid;
-        p->state = IN_USER;
-        if (proc_update_cwd(p) != 0) {
-            free(p);
-            return NULL;
+        assert(status >> 16 == PTRACE_EVENT_STOP);
+        if (p == NULL) {
+            p = add_child(tracer, pid, NULL, 0);
+            if (p == NULL)
+                return NULL;
+            /* If the parent is ours, it is still in the clone syscall and its
+             * fork event is on its way. Hold the child here until then, so it
+             * can inherit what we know about the parent (see inherit()).
+             */
+            proc_t *parent = find_proc(tracer, parent_of(pid));
+            if (parent != NULL) {
+                p->held_by = parent->pid;
+                goto retry;
+            }
         }
-        list_add(&tracee->children, p);
-        if (pt_setoptions(pid) != 0)
-            DEBUG("warning: failed to set default tracing options for forked "
-                "child %d\n", pid);
-        long r = pt_runtosyscall(pid);
-        if (r != 0)
-            DEBUG("warning: failed to continue forked child %d (errno: %d)\n",
-                pid, errno);
+        start_child(tracer, p);
         /* We still don't have a syscall for the caller, so try again. */
         goto retry;
     }
+
+    if (status >> 16 == PTRACE_EVENT_STOP) {
+        /* The process was stopped by SIGSTOP or similar. We do not support job
+         * control of the target, so just let it continue.
+         */
+        if (pt_runtosyscall(pid) != 0)
+            DEBUG("failed to resume stopped process %d\n", pid);
+        goto retry;
+    }
+
+    if (WSTOPSIG(status) != SIGSYSCALL) {
+        /* The process received a signal, which we need to pass on. */
+        if (pt_deliver(pid, WSTOPSIG(status)) != 0)
+            DEBUG("failed to deliver signal %d to process %d\n",
+                WSTOPSIG(status), pid);
+        goto retry;
+    }
     syscall_t *s = malloc(sizeof(*s));
     if (s == NULL)
         return NULL;
@@ -445,8 +1241,10 @@ retry:;
          */
         IDEBUG("warning: target appears to have invoked syscall %ld directly "
             "(not via libc stubs)\n", syscall_number(pid));
-    if (!s->enter)
+    if (!s->enter) {
         s->result = syscall_result(pid);
+        track_fds(s);
+    }
     if (p->state == IN_USER)
         p->state = SYSENTER;
     else {
@@ -471,45 +1269,149 @@ int acknowledge_syscall(syscall_t *syscall) {
     return (int)r;
 }
 
-static int finish(pid_t pid) {
+static int finish(pid_t pid, int *sig) {
     while (true) {
         int status;
         waitpid(pid, &status, 0);
         if (WIFSTOPPED(status)) {
             pt_passthrough(pid, status);
         } else if (WIFEXITED(status)) {
+            *sig = 0;
             return WEXITSTATUS(status);
         } else {
             assert(WIFSIGNALED(status));
+            *sig = WTERMSIG(status);
             return (1 << 7)|WTERMSIG(status);
         }
     }
 }
 
-void unblock(proc_t *proc) {
-    if (proc->state == SYSENTER) {
-        pt_continue(proc->pid);
-        proc->state = IN_KERNEL;
-    } else if (proc->state == SYSEXIT) {
-        pt_continue(proc->pid);
-        proc->state = IN_USER;
+/* Signal with which we interrupt an additional tracer blocked in waitpid. */
+#define SIGWAKE SIGUSR1
+
+static void wake(int sig __attribute__((unused))) {
+}
+
+static void *tracer_main(void *arg) {
+    tracer_t *tracer = arg;
+    target_t *t = tracer->target;
+
+    int r = tracer->run(tracer);
+
+    /* Anything we are still tracing at this point is outliving the root, so
+     * we cannot know everything it does.
+     */
+    if (r != 0 || !list_empty(&tracer->children))
+        __atomic_store_n(&t->bailout, true, __ATOMIC_RELEASE);
+    abandon(tracer);
+
+    pthread_mutex_lock(&t->lock);
+    tracer->stopped = true;
+    pthread_cond_broadcast(&t->cond);
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+int add_tracers(target_t *t, unsigned n, int (*run)(tracer_t *tracer)) {
+    assert(t->ntracers == 0);
+    assert(run != NULL);
+
+    if (n == 0)
+        return 0;
+
+    /* No SA_RESTART, so that the signal interrupts waitpid. */
+    struct sigaction sa = {
+        .sa_handler = wake,
+    };
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGWAKE, &sa, NULL) != 0)
+        return -1;
+
+    t->tracers = calloc(n, sizeof(t->tracers[0]));
+    if (t->tracers == NULL)
+        return -1;
+    if (pthread_mutex_init(&t->lock, NULL) != 0) {
+        free(t->tracers);
+        t->tracers = NULL;
+        return -1;
+    }
+    if (pthread_cond_init(&t->cond, NULL) != 0) {
+        pthread_mutex_destroy(&t->lock);
+        free(t->tracers);
+        t->tracers = NULL;
+        return -1;
     }
+
+    unsigned i;
+    for (i = 0; i < n; i++) {
+        tracer_t *tracer = &t->tracers[i];
+        tracer->target = t;
+        tracer->run = run;
+        if (list(&tracer->children, proc_cmp) != 0)
+            break;
+        if (pthread_create(&tracer->thread, NULL, tracer_main, tracer) != 0) {
+            list_destroy(&tracer->children);
+            break;
+        }
+    }
+    /* The threads only look at each other once they have been handed a
+     * process, which cannot happen before we return.
+     */
+    t->ntracers = i;
+    return i == n ? 0 : -1;
 }
 
-int complete(target_t *tracee) {
-    if (tracee->root.state != TERMINATED) {
-        void dealloc(void *data, void *_ __attribute__((unused))) {
-            proc_t *p = data;
-            unblock(p);
-            pt_detach(p->pid);
-            free(p);
+/* Stop the additional tracers. If the root has exited, they finish with
+ * whatever they are tracing. Otherwise they detach from it.
+ */
+static void stop_tracers(target_t *t) {
+    if (t->ntracers == 0)
+        return;
+
+    pthread_mutex_lock(&t->lock);
+    __atomic_store_n(&t->stopping, true, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&t->cond);
+
+    for (unsigned i = 0; i < t->ntracers; i++) {
+        tracer_t *tracer = &t->tracers[i];
+        /* A tracer may be blocked waiting on its processes. We cannot tell
+         * whether it has yet noticed it should stop, so keep interrupting it
+         * until it has.
+         */
+        while (!tracer->stopped) {
+            (void)pthread_kill(tracer->thread, SIGWAKE);
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            (void)pthread_cond_timedwait(&t->cond, &t->lock, &deadline);
         }
-        list_foreach(&tracee->children, dealloc, NULL);
-        list_destroy(&tracee->children);
+    }
+    pthread_mutex_unlock(&t->lock);
+
+    for (unsigned i = 0; i < t->ntracers; i++) {
+        pthread_join(t->tracers[i].thread, NULL);
+        list_destroy(&t->tracers[i].children);
+    }
+}
+
+int complete(target_t *tracee) {
+    if (tracee->interpose != NULL && tracee->root.state != TERMINATED) {
+        tracee->exit_status = finish(tracee->root.pid, &tracee->exit_signal);
+        tracee->root.state = TERMINATED;
+    } else if (tracee->root.state != TERMINATED) {
+        abandon(&tracee->tracer);
         unblock(&tracee->root);
         pt_detach(tracee->root.pid);
-        tracee->exit_status = finish(tracee->root.pid);
+        /* Let go of the rest of the target before we wait for it. */
+        stop_tracers(tracee);
+        tracee->exit_status = finish(tracee->root.pid, &tracee->exit_signal);
         tracee->root.state = TERMINATED;
+    } else {
+        stop_tracers(tracee);
     }
     (void)hook_close(tracee);
     /* Now that we've closed the hook thread and the tracee has exited, we no
@@ -525,6 +1427,8 @@ int complete(target_t *tracee) {
     close(tracee->msg_pipe[1]);
     close(tracee->sig_pipe[0]);
     close(tracee->sig_pipe[1]);
+    ring_free(tracee->ring);
+    tracee->ring = NULL;
     tracee->root.state = FINALISED;
     return tracee->exit_status;
 }
@@ -545,6 +1449,13 @@ int delete(target_t *tracee) {
     if (tracee->outfile != NULL)
         free(tracee->outfile);
     dict_destroy(&tracee->env);
-    list_destroy(&tracee->children);
+    list_destroy(&tracee->tracer.children);
+    if (tracee->tracers != NULL) {
+        pthread_cond_destroy(&tracee->cond);
+        pthread_mutex_destroy(&tracee->lock);
+        free(tracee->tracers);
+    }
+    fdtable_release(tracee->root.fds);
+    cwd_release(tracee->root.cwd);
     return 0;
 }
@@ -3,9 +3,14 @@
 
 #include "collection/dict.h"
 #include "collection/list.h"
+#include "cwd.h"
+#include "fdtable.h"
+#include "filetype.h"
 #include <linux/limits.h>
 #include <pthread.h>
+#include "ring.h"
 #include <stdbool.h>
+#include <time.h>
 #include <unistd.h>
 
 /* A process being tracked. The processes we deal with are always either the
@@ -31,29 +36,122 @@ typedef struct {
         FINALISED,   /* Exited and xcache metadata cleaned up */
     } state;
 
-    /* Current working directory of the process. */
-    char cwd[PATH_MAX];
+    /* Current working directory of the process. This may be shared with
+     * other processes.
+     */
+    cwd_t *cwd;
+
+    /* Mirror of the process's file descriptor table, or NULL if we could not
+     * follow it. This may be shared with other processes.
+     */
+    fdtable_t *fds;
+
+    /* Whether we have seen the initial stop of this process. A child is
+     * registered when its parent's fork event arrives, which may be before
+     * the child itself reports.
+     */
+    bool started;
+
+    /* If the process reported its initial stop before its parent's fork event
+     * arrived, its parent's pid according to /proc. It is held at that stop
+     * until the event arrives so that it can inherit what we know about the
+     * parent, or until that parent exits.
+     */
+    pid_t held_by;
+
+    /* Whether the process is inside a syscall that may modify the
+     * filesystem. This is maintained by the caller of next_syscall().
+     */
+    bool modifying;
+
+    /* Whether the process shares nothing we track with its parent, such that
+     * it can be traced by a different thread.
+     */
+    bool independent;
+
+    /* State the caller attaches to the process. See 'on_fork' and 'on_exit' in
+     * target_t. Descriptors the process opens are recorded in 'fds' with this
+     * as their owner.
+     */
+    void *data;
 
 } proc_t;
 
+struct target;
+
+/* A thread tracing part of a target. ptrace only lets the thread that attached
+ * to a process control it, so every process we trace belongs to a single
+ * tracer. The thread that called trace() traces the root. Any additional
+ * tracers (see add_tracers()) wait to be handed children as they are forked
+ * and then trace these and their descendants.
+ */
+typedef struct tracer {
+
+    struct target *target;
+
+    /* The root, if this tracer is tracing it, or NULL. */
+    proc_t *root;
+
+    /* Processes other than the root traced by this thread. */
+    list_t children;
+
+    /* The following are only used for additional tracers and are protected by
+     * the target's 'lock'.
+     */
+
+    pthread_t thread;
+
+    /* Function the thread runs. This should retrieve syscalls for this tracer
+     * with next_syscall() until there are none left and return 0 on success.
+     */
+    int (*run)(struct tracer *tracer);
+
+    /* Whether this tracer is waiting to be handed a process. */
+    bool idle;
+
+    /* A process handed to this tracer that it has not yet attached to. */
+    proc_t *adopted;
+
+    /* Whether the thread has stopped tracing. */
+    bool stopped;
+
+} tracer_t;
+
 /* Representation of a process to be traced. */
-typedef struct {
+typedef struct target {
 
     /* The exit code of the process. This only gets filled in after the process
      * exits.
      */
     unsigned char exit_status;
 
+    /* The signal that terminated the process, or 0 if it exited normally. In
+     * the former case, 'exit_status' is 128 plus the signal, as a shell would
+     * report it.
+     */
+    int exit_signal;
+
     /* The initial process that is executed. If the process never forks, this
      * will be the only PID we track.
      */
     proc_t root;
 
-    /* A list of proc_ts that are children forked off from 'root'. We need to
-     * track these similarly to `strace -f` in order to keep tabs on everything
-     * the program is doing.
+    /* The thread tracing 'root'. Its children are descendants forked off from
+     * 'root'. We need to track these similarly to `strace -f` in order to keep
+     * tabs on everything the program is doing.
      */
-    list_t children;
+    tracer_t tracer;
+
+    /* Additional tracers, to which descendants of 'root' may be handed off. */
+    tracer_t *tracers;
+    unsigned ntracers;
+
+    /* Protects the additional tracers' hand off state. */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /* Set when additional tracers should stop. */
+    bool stopping;
 
     /* Temporary files that are used to store the contents of stdout and
      * stderr while tracing a program. These are created when we start tracing
@@ -75,6 +173,12 @@ typedef struct {
     int msg_pipe[2];    /* Written by libhook, read by the hook. */
     int sig_pipe[2];    /* Written by the xcache main thread, read by the hook. */
 
+    /* Shared memory libhook writes messages to in preference to 'msg_pipe',
+     * as this needs no syscalls. NULL if this could not be set up, in which
+     * case libhook uses the pipe throughout.
+     */
+    ring_t *ring;
+
     /* Subordinate thread to read from various pipes written by the tracee. We
      * do this in a subordindate thread to avoid interferring with the
      * monitoring of syscalls in the main thread. The main thread eventually
@@ -88,6 +192,30 @@ typedef struct {
      */
     dict_t env;
 
+    /* If we are observing the target through libinterpose rather than ptrace,
+     * the function to pass each file access it reports to. This is called from
+     * the hook thread and returns 0 on success.
+     */
+    int (*interpose)(const char *path, filetype_t type, time_t mtime,
+        bool directory);
+
+    /* Set by the hook if libinterpose could not follow the target or one of
+     * its reports could not be processed, or by an additional tracer that
+     * could not follow its processes. The dependencies collected for the
+     * target are then incomplete.
+     */
+    bool bailout;
+
+    /* Optional callbacks to follow the processes of the target, which the
+     * caller may set after trace() and before it first calls next_syscall().
+     * 'on_fork' is called when a child is registered with a known parent,
+     * before the child runs. 'on_exit' is called before a process other than
+     * the root is forgotten, with its wait status or -1 if we stopped tracing
+     * it. Both are called from the thread tracing the process.
+     */
+    void (*on_fork)(proc_t *parent, proc_t *child);
+    void (*on_exit)(proc_t *proc, int status);
+
 } target_t;
 
 /* A detected syscall from the tracee. */
@@ -119,20 +247,38 @@ typedef struct {
  *    function calls in this module.
  *  argv - The process to trace. This needs to conform to the usual standard of
  *    being a NULL-terminated array of arguments.
- *  tracer - The path to the xcache binary itself. This should be used by the
- *    called to indicate whether they want libhook injected into the
- *    target. If you pass a NULL pointer it will not be injected. The reason
- *    for not injecting libhook is typically that the target does not
- *    link against libdl, which makes library hooking a bit difficult.
+ *  tracer - The path to the xcache binary itself. This is used to locate the
+ *    helper libraries we inject into the target. If you pass a NULL pointer
+ *    neither will be injected. The reason for not injecting libhook is
+ *    typically that the target does not link against libdl, which makes
+ *    library hooking a bit difficult.
+ *  hook_getenv - Whether to inject libhook to observe getenv calls.
+ *  interpose - If non-NULL, inject libinterpose instead of tracing the target
+ *    with ptrace and pass file accesses it reports to this function. In this
+ *    case next_syscall() must not be called and the caller should proceed
+ *    straight to complete().
+ *  staging - Directory to create the files capturing the target's stdout and
+ *    stderr in, or NULL for /tmp. If this is the cache's staging directory
+ *    (see cache_staging()), they can later be moved into the cache rather
+ *    than copied.
  * Returns 0 on success.
  */
-int trace(target_t *t, char **argv, const char *tracer);
+int trace(target_t *t, char **argv, const char *tracer, bool hook_getenv,
+    int (*interpose)(const char *path, filetype_t type, time_t mtime,
+        bool directory), const char *staging);
 
-/* Wait for the next syscall from the given target and return it. Note that
- * when this function returns the target will be blocked (SIGTRAP) and you will
- * need to call acknowledge_syscall() to resume the target.
+/* Start 'n' additional threads to share the tracing of the target, each
+ * running 'run'. Returns 0 on success.
  */
-syscall_t *next_syscall(target_t *tracee);
+int add_tracers(target_t *t, unsigned n, int (*run)(tracer_t *tracer));
+
+/* Wait for the next syscall from the processes of the given tracer and return
+ * it. This must be called from the tracer's own thread. Note that when this
+ * function returns the process will be blocked (SIGTRAP) and you will need to
+ * call acknowledge_syscall() to resume it. Returns NULL once the tracer has
+ * nothing more to trace.
+ */
+syscall_t *next_syscall(tracer_t *tracer);
 
 /* Resume the target who initiated the given syscall. Returns 0 on success. */
 int acknowledge_syscall(syscall_t *syscall);
@@ -141,7 +287,8 @@ int acknowledge_syscall(syscall_t *syscall);
  * you're bailing out of tracing a given target and just want to let it resume
  * its execution unmonitored. Note that this function assumes that any or all
  * of the root and children of this target may currently be trapped, and it
- * takes care of unblocking them.
+ * takes care of unblocking them. Any additional tracers are stopped and joined
+ * first.
  */
 int complete(target_t *tracee);
 
@@ -153,18 +300,46 @@ int delete(target_t *tracee);
 /* Retrieve a string argument to a syscall. */
 char *syscall_getstring(syscall_t *syscall, int arg);
 
+/* Retrieve the data pointed to by an argument to a syscall. Returns 0 on
+ * success.
+ */
+int syscall_getdata(syscall_t *syscall, int arg, void *buf, size_t len);
+
+/* Retrieve an argument to a syscall that is a NULL-terminated array of
+ * strings, like the argv of execve. The result is a single allocation to be
+ * released with free(). Returns NULL on failure.
+ */
+char **syscall_getstrings(syscall_t *syscall, int arg);
+
+/* Turn a syscall the process is entering into exit_group(status), such that the
+ * process exits instead. Returns 0 on success.
+ */
+int syscall_exit_group(syscall_t *syscall, int status);
+
 /* Retrieve an integral argument to a syscall. */
 long syscall_getarg(syscall_t *syscall, int arg);
 
-/* Retrieve the path of a file descriptor argument to a syscall. */
+/* Whether a descriptor in a traced process is one of the channels libhook
+ * uses to report to us.
+ */
+bool target_channel(const target_t *tracee, int fd);
+
+/* Retrieve the path of a descriptor of a process. See syscall_getfd. */
+char *proc_getfd(proc_t *proc, int fd);
+
+/* Retrieve the path of a file descriptor argument to a syscall. Descriptors we
+ * have seen opened are answered from our mirror of the process's descriptor
+ * table. For others, this asks the kernel and the result may not be a path
+ * (e.g. "pipe:[1234]").
+ */
 char *syscall_getfd(syscall_t *syscall, int arg);
 
 /* XXX: consider removing these. */
 const char *get_stdout(target_t *tracee);
 const char *get_stderr(target_t *tracee);
 
-/* Update the recorded current working directory of a process. Returns 0 on
- * success.
+/* Update the recorded current working directory of a process from /proc.
+ * Returns 0 on success.
  */
 int proc_update_cwd(proc_t *proc) __attribute__((nonnull));
 
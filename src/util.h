@@ -8,8 +8,10 @@
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/stat.h>
 
 /** \brief Join two paths and normalise the result.
  *
@@ -68,6 +70,17 @@ static inline void autofree_(void *p) {
  */
 char *filehash(const char *filename);
 
+/** \brief Hash a string, for picking a bucket or shard.
+ *
+ * This is fast but not cryptographic, so callers that need to know two
+ * strings are the same must still compare them.
+ *
+ * @param s String to hash. This need not be NUL-terminated.
+ * @param len Number of bytes of `s` to hash.
+ * @return The hash.
+ */
+uint64_t hash(const char *s, size_t len);
+
 /** \brief Copy a file, preserving the permissions, owner and group if
  * possible.
  *
@@ -77,6 +90,14 @@ char *filehash(const char *filename);
  */
 int cp(const char *from, const char *to);
 
+/** \brief Write the contents of a file to an open file descriptor.
+ *
+ * @param from Absolute path of source.
+ * @param fd Destination to write to.
+ * @return 0 on success, -1 on failure.
+ */
+int cat(const char *from, int fd);
+
 /** \brief Equivalent of `mkdir -p`.
  *
  * @param path An absolute or relative path to the final directory to create.
@@ -118,6 +139,61 @@ size_t reduce(const char *path, size_t reduction);
  */
 bool get(char *buffer, size_t limit, FILE *f);
 
+/** \brief Run a set of jobs across a pool of threads.
+ *
+ * Jobs are started in index order, but may complete in any order. Once any job
+ * fails, no further jobs are started, though those already running are
+ * allowed to finish.
+ *
+ * @param count Number of jobs.
+ * @param threads Maximum number of threads to use, including the caller's, or
+ *   0 for the number of CPUs.
+ * @param fn Function to run each job. This may be called concurrently from
+ *   multiple threads.
+ * @return 0 if all jobs succeeded or the non-zero value returned by the first
+ *   job to fail.
+ */
+int parallel(size_t count, unsigned threads, int (*fn)(size_t index));
+
+/** \brief Reusable state for stat_all().
+ *
+ * Setting up io_uring costs several syscalls and mappings, so callers that
+ * stat batch after batch should keep one of these around rather than paying
+ * for it each time. A context must not be used by two calls at once.
+ */
+typedef struct stat_ring stat_ring_t;
+
+/** \brief Create a context for stat_all().
+ *
+ * @return The context or NULL on out-of-memory.
+ */
+stat_ring_t *stat_ring_new(void);
+
+/** \brief Release a context created by stat_ring_new().
+ *
+ * @param ring The context, which may be NULL.
+ */
+void stat_ring_free(stat_ring_t *ring);
+
+/** \brief Stat a batch of files concurrently.
+ *
+ * Uses io_uring where available and a pool of threads otherwise. This is
+ * intended for validating many files at once on filesystems where the latency
+ * of each stat adds up.
+ *
+ * @param ring Context to reuse, or NULL to set one up just for this call.
+ * @param count Number of files.
+ * @param paths Absolute paths of the files to stat.
+ * @param check Function to receive each result. It is passed the index of
+ *   the file and either its stat data or NULL and the error encountered. This
+ *   may be called concurrently from multiple threads. If it returns non-zero,
+ *   no further files are stat-ed.
+ * @return 0 if all checks passed or the non-zero value from the first check
+ *   to fail.
+ */
+int stat_all(stat_ring_t *ring, size_t count, const char **paths,
+    int (*check)(size_t index, const struct stat *st, int err));
+
 typedef struct file_iter file_iter_t;
 file_iter_t *file_iter(const char *path);
 void file_iter_destroy(file_iter_t *fi);
@@ -1,6 +1,8 @@
 #include <assert.h>
 #include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,6 +14,83 @@
 #include <unistd.h>
 #include "../util.h"
 
+/* Wait for a non-blocking descriptor to become writable. Returns 0 on success.
+ */
+static int wait_writable(int fd) {
+    struct pollfd pfd = {
+        .fd = fd,
+        .events = POLLOUT,
+    };
+    while (poll(&pfd, 1, -1) < 0) {
+        if (errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
+
+/* Write all of a buffer, retrying short and interrupted writes. Returns 0 on
+ * success.
+ */
+static int write_all(int fd, const char *buffer, size_t len) {
+    for (size_t done = 0; done < len; ) {
+        ssize_t w = write(fd, buffer + done, len - done);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (wait_writable(fd) != 0)
+                return -1;
+            continue;
+        }
+        if (w <= 0)
+            return -1;
+        done += (size_t)w;
+    }
+    return 0;
+}
+
+/* Copy 'sz' bytes from the current offset of 'in' to 'out'. sendfile may copy
+ * less than asked for, so keep going until it has copied everything. Returns 0
+ * on success.
+ */
+static int copy(int in, int out, size_t sz) {
+    size_t done = 0;
+    while (done < sz) {
+        ssize_t w = sendfile(out, in, NULL, sz - done);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (wait_writable(out) != 0)
+                return -1;
+            continue;
+        }
+        if (w < 0 && (errno == EINVAL || errno == ENOSYS))
+            break;
+        if (w <= 0) {
+            /* An error, or the file got shorter under us. */
+            return -1;
+        }
+        done += (size_t)w;
+    }
+
+    /* sendfile cannot write to some descriptors, like a file opened with
+     * O_APPEND, so copy the rest ourselves. It leaves the offset of 'in' after
+     * whatever it did copy.
+     */
+    char buffer[64 * 1024];
+    while (done < sz) {
+        size_t want = sz - done < sizeof(buffer) ? sz - done : sizeof(buffer);
+        ssize_t len = read(in, buffer, want);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0)
+            return -1;
+        if (write_all(out, buffer, (size_t)len) != 0)
+            return -1;
+        done += (size_t)len;
+    }
+    return 0;
+}
+
 int cp(const char *from, const char *to) {
     assert(from != NULL);
     assert(to != NULL);
@@ -44,15 +123,35 @@ int cp(const char *from, const char *to) {
             return -1;
         }
     }
-    ssize_t written = sendfile(out, in, NULL, sz);
+    int r = copy(in, out, sz);
     if (out != STDOUT_FILENO && out != STDERR_FILENO)
         close(out);
     close(in);
     chmod(from, st.st_mode);
-    if ((size_t)written != sz) {
+    if (r != 0) {
         /* We somehow failed to copy the entire file. */
         unlink(to);
         return -1;
     }
     return 0;
 }
+
+int cat(const char *from, int fd) {
+    assert(from != NULL);
+    assert(fd >= 0);
+
+    int in = open(from, O_RDONLY);
+    if (in < 0)
+        return -1;
+
+    struct stat st;
+    if (fstat(in, &st) != 0) {
+        close(in);
+        return -1;
+    }
+    size_t sz = st.st_size;
+
+    int r = copy(in, fd, sz);
+    close(in);
+    return r;
+}
@@ -0,0 +1,13 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "../util.h"
+
+uint64_t hash(const char *s, size_t len) {
+    /* FNV-1a */
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
@@ -35,14 +35,14 @@ int mkdirp(const char *path) {
     for (char *p = abspath + 1; *p != '\0'; p++) {
         if (*p == '/') {
             *p = '\0';
-            int r = mkdir(path, 0775);
+            int r = mkdir(abspath, 0775);
             if (r != 0 && errno != EEXIST) {
                 return -1;
             }
             *p = '/';
         }
     }
-    if (mkdir(path, 0775) != 0 && errno != EEXIST)
+    if (mkdir(abspath, 0775) != 0 && errno != EEXIST)
         return -1;
     return 0;
 }
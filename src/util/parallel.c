@@ -0,0 +1,59 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "../util.h"
+
+/* Upper bound on the number of threads we will start. */
+#define MAX_THREADS 64
+
+int parallel(size_t count, unsigned threads, int (*fn)(size_t index)) {
+    assert(fn != NULL);
+
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus < 1 ? 1 : (unsigned)cpus;
+    }
+    if (threads > MAX_THREADS)
+        threads = MAX_THREADS;
+    if (threads > count)
+        threads = count;
+
+    size_t next = 0;
+    int result = 0;
+
+    /* Each thread, including our own, repeatedly claims the next job until
+     * there are none left or someone has failed.
+     */
+    void *work(void *arg __attribute__((unused))) {
+        while (__atomic_load_n(&result, __ATOMIC_ACQUIRE) == 0) {
+            size_t index = __atomic_fetch_add(&next, 1, __ATOMIC_ACQ_REL);
+            if (index >= count)
+                break;
+            int r = fn(index);
+            if (r != 0) {
+                int expected = 0;
+                __atomic_compare_exchange_n(&result, &expected, r, false,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+            }
+        }
+        return NULL;
+    }
+
+    pthread_t tids[MAX_THREADS];
+    unsigned started = 0;
+    for (unsigned i = 1; i < threads; i++) {
+        /* If we fail to start a thread, carry on with those we have. */
+        if (pthread_create(&tids[started], NULL, work, NULL) != 0)
+            break;
+        started++;
+    }
+
+    (void)work(NULL);
+
+    for (unsigned i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+
+    return result;
+}
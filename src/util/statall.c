@@ -0,0 +1,350 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include "../util.h"
+
+/* Number of stats we have in flight at once when using io_uring. This also
+ * bounds how much work is wasted when an early result is a mismatch.
+ */
+#define BATCH 64
+
+/* Below this many files, the setup cost of io_uring or threads is not worth
+ * it.
+ */
+#define SERIAL_THRESHOLD 4
+
+/* Number of threads to use when we cannot use io_uring. Stats are I/O bound on
+ * the filesystems where this matters, so we do not limit this to the number of
+ * CPUs.
+ */
+#define THREADS 16
+
+typedef struct {
+    int fd;
+
+    void *sq_ptr;
+    size_t sq_sz;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    size_t sqes_sz;
+
+    void *cq_ptr;
+    size_t cq_sz;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+} ring_t;
+
+static void ring_close(ring_t *r) {
+    munmap(r->sqes, r->sqes_sz);
+    if (r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_sz);
+    munmap(r->sq_ptr, r->sq_sz);
+    close(r->fd);
+}
+
+/* Set up an io_uring instance. We do this by hand rather than depending on
+ * liburing for the handful of operations we need.
+ */
+static int ring_open(ring_t *r, unsigned entries) {
+#ifdef __NR_io_uring_setup
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+        return -1;
+
+    r->sq_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_sz > r->sq_sz)
+            r->sq_sz = r->cq_sz;
+        r->cq_sz = r->sq_sz;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_sz, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED) {
+        close(r->fd);
+        return -1;
+    }
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ptr = r->sq_ptr;
+    } else {
+        r->cq_ptr = mmap(NULL, r->cq_sz, PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED) {
+            munmap(r->sq_ptr, r->sq_sz);
+            close(r->fd);
+            return -1;
+        }
+    }
+
+    r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_sz, PROT_READ|PROT_WRITE,
+        MAP_SHARED|MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        if (r->cq_ptr != r->sq_ptr)
+            munmap(r->cq_ptr, r->cq_sz);
+        munmap(r->sq_ptr, r->sq_sz);
+        close(r->fd);
+        return -1;
+    }
+
+    r->sq_tail = (unsigned*)((char*)r->sq_ptr + p.sq_off.tail);
+    r->sq_mask = (unsigned*)((char*)r->sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)((char*)r->sq_ptr + p.sq_off.array);
+    r->cq_head = (unsigned*)((char*)r->cq_ptr + p.cq_off.head);
+    r->cq_tail = (unsigned*)((char*)r->cq_ptr + p.cq_off.tail);
+    r->cq_mask = (unsigned*)((char*)r->cq_ptr + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)((char*)r->cq_ptr + p.cq_off.cqes);
+
+    return 0;
+#else
+    (void)r;
+    (void)entries;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+static int ring_enter(ring_t *r, unsigned submit, unsigned wait) {
+#ifdef __NR_io_uring_enter
+    return (int)syscall(__NR_io_uring_enter, r->fd, submit, wait,
+        wait > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+#else
+    (void)r;
+    (void)submit;
+    (void)wait;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+/* Translate the result of statx into the more familiar struct stat. */
+static void from_statx(struct stat *st, const struct statx *stx) {
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+    st->st_ino = stx->stx_ino;
+    st->st_mode = stx->stx_mode;
+    st->st_nlink = stx->stx_nlink;
+    st->st_uid = stx->stx_uid;
+    st->st_gid = stx->stx_gid;
+    st->st_size = stx->stx_size;
+    st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+    st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+}
+
+/* Stat a single file and pass the result on. */
+static int stat_one(const char *path, size_t index,
+        int (*check)(size_t index, const struct stat *st, int err)) {
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return check(index, NULL, errno);
+    return check(index, &st, 0);
+}
+
+struct stat_ring {
+    /* Whether we have tried to set up 'ring' yet. This is put off until the
+     * first batch large enough to need it.
+     */
+    bool tried;
+
+    /* Whether 'ring' is set up and still safe to use. A ring we could not
+     * drive to completion is never used again.
+     */
+    bool usable;
+
+    /* Whether 'ring' needs to be closed. */
+    bool open;
+
+    ring_t ring;
+
+    /* Buffers the kernel writes statx results into, one per entry in a
+     * batch.
+     */
+    struct statx *results;
+
+    /* Whether we gave up waiting on operations that may still write to
+     * 'results'.
+     */
+    bool abandoned;
+};
+
+stat_ring_t *stat_ring_new(void) {
+    return calloc(1, sizeof(stat_ring_t));
+}
+
+void stat_ring_free(stat_ring_t *s) {
+    if (s == NULL)
+        return;
+    if (s->open)
+        ring_close(&s->ring);
+    /* If we abandoned operations in flight, the kernel may yet write to
+     * 'results', so we leak it rather than risk corruption.
+     */
+    if (!s->abandoned)
+        free(s->results);
+    free(s);
+}
+
+/* Set up the ring of a context, if we have not tried already. Returns whether
+ * it can be used.
+ */
+static bool ring_ready(stat_ring_t *s) {
+    if (!s->tried) {
+        s->tried = true;
+        s->results = calloc(BATCH, sizeof(s->results[0]));
+        if (s->results != NULL && ring_open(&s->ring, BATCH) == 0)
+            s->open = s->usable = true;
+    }
+    return s->usable;
+}
+
+/* Stat the files using io_uring. Returns 0 if all checks passed or the first
+ * non-zero value from a check. If the ring fails us, we stop early and it is
+ * marked unusable. Either way, 'done' is set to the number of leading files
+ * that were passed to 'check'; the caller is responsible for the rest.
+ */
+static int stat_all_uring(stat_ring_t *s, size_t count, const char **paths,
+        int (*check)(size_t index, const struct stat *st, int err),
+        size_t *done) {
+    assert(s->usable);
+    ring_t *r = &s->ring;
+    struct statx *results = s->results;
+
+    int ret = 0;
+    *done = 0;
+    for (size_t base = 0; base < count && ret == 0; base += BATCH) {
+        unsigned n = count - base < BATCH ? count - base : BATCH;
+
+        unsigned tail = *r->sq_tail;
+        for (unsigned i = 0; i < n; i++) {
+            unsigned idx = (tail + i) & *r->sq_mask;
+            struct io_uring_sqe *sqe = &r->sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_STATX;
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (uint64_t)(uintptr_t)paths[base + i];
+            sqe->len = STATX_BASIC_STATS;
+            sqe->off = (uint64_t)(uintptr_t)&results[i];
+            sqe->user_data = i;
+            r->sq_array[idx] = idx;
+        }
+        __atomic_store_n(r->sq_tail, tail + n, __ATOMIC_RELEASE);
+
+        /* The kernel may consume fewer entries than we ask it to, so keep
+         * going until it has them all. If it stops taking them, e.g. because
+         * we are running somewhere io_uring is forbidden, the rest are left to
+         * our caller. As the ring is never entered again, they are discarded
+         * when it is closed.
+         */
+        unsigned submitted = 0;
+        while (submitted < n) {
+            int taken = ring_enter(r, n - submitted, 0);
+            if (taken < 0 && errno == EINTR)
+                continue;
+            if (taken <= 0)
+                break;
+            submitted += (unsigned)taken;
+        }
+        if (submitted < n)
+            s->usable = false;
+
+        /* Reap everything submitted, even if we find a mismatch part way
+         * through, as the kernel may still be writing into 'results'.
+         */
+        unsigned reaped = 0;
+        while (reaped < submitted) {
+            unsigned head = *r->cq_head;
+            unsigned ctail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+            if (head == ctail) {
+                if (ring_enter(r, 0, 1) < 0 && errno != EINTR) {
+                    s->usable = false;
+                    s->abandoned = true;
+                    return -1;
+                }
+                continue;
+            }
+            for (; head != ctail; head++, reaped++) {
+                const struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+                size_t i = (size_t)cqe->user_data;
+                if (ret != 0)
+                    continue;
+                if (cqe->res == -EINVAL) {
+                    /* Older kernel without support for this operation. */
+                    ret = stat_one(paths[base + i], base + i, check);
+                } else if (cqe->res < 0) {
+                    ret = check(base + i, NULL, -cqe->res);
+                } else {
+                    struct stat st;
+                    from_statx(&st, &results[i]);
+                    ret = check(base + i, &st, 0);
+                }
+            }
+            __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+        }
+
+        *done = base + submitted;
+        if (!s->usable)
+            break;
+    }
+
+    return ret;
+}
+
+int stat_all(stat_ring_t *ring, size_t count, const char **paths,
+        int (*check)(size_t index, const struct stat *st, int err)) {
+    assert(paths != NULL);
+    assert(check != NULL);
+
+    if (count < SERIAL_THRESHOLD) {
+        for (size_t i = 0; i < count; i++) {
+            int r = stat_one(paths[i], i, check);
+            if (r != 0)
+                return r;
+        }
+        return 0;
+    }
+
+    /* Without a context of the caller's, we make do with a temporary one. */
+    stat_ring_t *temporary = NULL;
+    if (ring == NULL)
+        ring = temporary = stat_ring_new();
+
+    size_t done = 0;
+    if (ring != NULL && ring_ready(ring)) {
+        int r = stat_all_uring(ring, count, paths, check, &done);
+        if (r != 0 || done == count) {
+            stat_ring_free(temporary);
+            return r;
+        }
+    }
+    stat_ring_free(temporary);
+
+    int job(size_t index) {
+        return stat_one(paths[done + index], done + index, check);
+    }
+    return parallel(count - done, THREADS, job);
+}
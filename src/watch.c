@@ -0,0 +1,361 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+#include "util.h"
+#include "watch.h"
+
+/* Identifying value at the start of the shared file. */
+#define MAGIC 0x78637762 /* "xcwb" */
+
+/* Number of directories the table can record. */
+#define CAPACITY (1U << 16)
+
+/* Space for the paths of those directories, in bytes. */
+#define NAMES (CAPACITY * 128U)
+
+/* If the watcher has not touched its heartbeat within this time, assume it has
+ * died.
+ */
+#define STALE (5 * (int64_t)1000000000)
+
+/* A directory we have seen. Slots are never removed, so a reader that finds an
+ * empty slot during probing knows the directory is not present. Different
+ * paths can share a hash, so the path itself is kept too and is what decides
+ * whether a slot is the one we want.
+ */
+typedef struct {
+    uint64_t hash;       /* hash of the path; 0 for an empty slot */
+    uint32_t name;       /* offset of the path in table_t.names */
+    uint32_t name_len;   /* length of the path */
+    int64_t watched_at;  /* when we started watching this directory */
+    int64_t dirty_at;    /* when the contents last changed */
+    int64_t moved_at;    /* when the directory itself was moved or removed */
+    int64_t absent;      /* non-zero if the directory did not exist */
+} slot_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t capacity;
+    int64_t alive_at;    /* last heartbeat from the watcher */
+    int64_t reset_at;    /* last time we may have lost events */
+    int64_t synced_at;   /* last time we saw WATCH_SYNC touched */
+    uint32_t names_size; /* size of the path storage following the slots */
+    uint32_t names_used; /* how much of it has been handed out */
+    slot_t slots[];
+    /* char names[names_size]; */
+} table_t;
+
+struct watch {
+    table_t *table;
+    size_t size;
+    char *path; /* path to the shared file, only set for the watcher */
+    char *sync; /* path to WATCH_SYNC, only set for readers */
+};
+
+int64_t watch_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Find the slot for the first 'len' characters of a path. If 'create' is set,
+ * an empty slot is claimed for it if it is not present. Returns NULL if the
+ * path is not present (or the table is full).
+ */
+static slot_t *find(table_t *t, const char *path, size_t len, bool create) {
+    char *names = (char*)&t->slots[t->capacity];
+    uint64_t h = hash(path, len);
+    if (h == 0) /* reserved for an empty slot */
+        h = 1;
+    for (uint32_t i = 0; i < t->capacity; i++) {
+        slot_t *s = &t->slots[(h + i) % t->capacity];
+        uint64_t sh = __atomic_load_n(&s->hash, __ATOMIC_ACQUIRE);
+        if (sh == h && s->name_len == len && s->name <= t->names_size &&
+                len <= t->names_size - s->name &&
+                memcmp(&names[s->name], path, len) == 0)
+            return s;
+        if (sh == 0) {
+            if (!create)
+                return NULL;
+            if (len > t->names_size - t->names_used)
+                return NULL;
+            /* Only the watcher creates slots, so there is no need to worry
+             * about someone else claiming this one under us. The hash is
+             * published last so readers never see a half initialised slot.
+             */
+            memcpy(&names[t->names_used], path, len);
+            s->name = t->names_used;
+            s->name_len = len;
+            t->names_used += len;
+            s->watched_at = 0;
+            s->dirty_at = 0;
+            s->moved_at = 0;
+            s->absent = 0;
+            __atomic_store_n(&s->hash, h, __ATOMIC_RELEASE);
+            return s;
+        }
+    }
+    return NULL;
+}
+
+static size_t table_size(uint32_t capacity, uint32_t names_size) {
+    return sizeof(table_t) + capacity * sizeof(slot_t) + names_size;
+}
+
+watch_t *watch_open(const char *cache_dir) {
+    autofree char *path = aprintf("%s/" WATCH_FILE, cache_dir);
+    if (path == NULL)
+        return NULL;
+
+    int fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(table_t)) {
+        close(fd);
+        return NULL;
+    }
+
+    table_t *t = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (t == MAP_FAILED)
+        return NULL;
+
+    if (t->magic != MAGIC || (size_t)st.st_size != table_size(t->capacity, t->names_size) ||
+            watch_time() - __atomic_load_n(&t->alive_at, __ATOMIC_ACQUIRE) >
+                STALE) {
+        munmap(t, st.st_size);
+        return NULL;
+    }
+
+    watch_t *w = malloc(sizeof(*w));
+    if (w == NULL) {
+        munmap(t, st.st_size);
+        return NULL;
+    }
+    w->sync = aprintf("%s/" WATCH_SYNC, cache_dir);
+    if (w->sync == NULL) {
+        free(w);
+        munmap(t, st.st_size);
+        return NULL;
+    }
+    w->table = t;
+    w->size = st.st_size;
+    w->path = NULL;
+    return w;
+}
+
+bool watch_alive(watch_t *w) {
+    return watch_time() -
+        __atomic_load_n(&w->table->alive_at, __ATOMIC_ACQUIRE) <= STALE;
+}
+
+bool watch_sync(watch_t *w, int timeout) {
+    assert(w != NULL);
+    assert(w->sync != NULL);
+
+    /* inotify delivers events in the order they happened, so once the watcher
+     * has seen our touch it has also seen everything that came before it.
+     */
+    int64_t start = watch_time();
+    if (utimensat(AT_FDCWD, w->sync, NULL, 0) != 0)
+        return false;
+
+    int64_t deadline = start + (int64_t)timeout * 1000000;
+    long delay = 10000; /* ns */
+    while (__atomic_load_n(&w->table->synced_at, __ATOMIC_ACQUIRE) < start) {
+        if (!watch_alive(w) || watch_time() > deadline)
+            return false;
+        struct timespec ts = { .tv_sec = 0, .tv_nsec = delay };
+        nanosleep(&ts, NULL);
+        if (delay < 1000000)
+            delay *= 2;
+    }
+    return true;
+}
+
+/* Check a slot was being watched before 'since' and has not been moved since.
+ */
+static bool steady(const slot_t *s, int64_t since) {
+    return s != NULL &&
+        __atomic_load_n(&s->watched_at, __ATOMIC_ACQUIRE) < since &&
+        __atomic_load_n(&s->moved_at, __ATOMIC_ACQUIRE) < since;
+}
+
+bool watch_clean(watch_t *w, const char *path, int64_t since) {
+    assert(w != NULL);
+    assert(path != NULL);
+
+    table_t *t = w->table;
+
+    if (!watch_alive(w))
+        return false;
+    if (__atomic_load_n(&t->reset_at, __ATOMIC_ACQUIRE) >= since)
+        return false;
+
+    if (path[0] != '/')
+        return false;
+
+    const char *last_slash = strrchr(path, '/');
+    size_t dir_len = last_slash == path ? 1 : (size_t)(last_slash - path);
+
+    /* Walk down from the root. Each directory on the way must not have been
+     * moved out from under us. If we reach one that is known not to exist,
+     * nothing beneath it can have appeared either without its parent noticing.
+     */
+    for (size_t len = 1; len <= dir_len; len++) {
+        if (len > 1 && path[len] != '/')
+            continue;
+        const slot_t *s = find(t, path, len, false);
+        if (!steady(s, since))
+            return false;
+        if (__atomic_load_n(&s->absent, __ATOMIC_ACQUIRE))
+            return true;
+    }
+
+    /* The containing directory must not have seen any changes. */
+    const slot_t *dir = find(t, path, dir_len, false);
+    if (__atomic_load_n(&dir->dirty_at, __ATOMIC_ACQUIRE) >= since)
+        return false;
+
+    /* If the path itself is a directory we watch, it must also be unchanged. */
+    const slot_t *self = find(t, path, strlen(path), false);
+    if (self != NULL && (!steady(self, since) ||
+            __atomic_load_n(&self->dirty_at, __ATOMIC_ACQUIRE) >= since))
+        return false;
+
+    return true;
+}
+
+void watch_close(watch_t *w) {
+    assert(w != NULL);
+    munmap(w->table, w->size);
+    free(w->path);
+    free(w->sync);
+    free(w);
+}
+
+watch_t *watch_create(const char *cache_dir) {
+    watch_t *w = calloc(1, sizeof(*w));
+    if (w == NULL)
+        return NULL;
+
+    w->path = aprintf("%s/" WATCH_FILE, cache_dir);
+    if (w->path == NULL) {
+        free(w);
+        return NULL;
+    }
+
+    /* Build the table off to the side and then move it into place, so
+     * readers never see it partially initialised.
+     */
+    autofree char *tmp = aprintf("%s.XXXXXX", w->path);
+    if (tmp == NULL) {
+        free(w->path);
+        free(w);
+        return NULL;
+    }
+    int fd = mkstemp(tmp);
+    if (fd < 0) {
+        free(w->path);
+        free(w);
+        return NULL;
+    }
+
+    w->size = table_size(CAPACITY, NAMES);
+    if (ftruncate(fd, w->size) != 0) {
+        close(fd);
+        unlink(tmp);
+        free(w->path);
+        free(w);
+        return NULL;
+    }
+
+    w->table = mmap(NULL, w->size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (w->table == MAP_FAILED) {
+        unlink(tmp);
+        free(w->path);
+        free(w);
+        return NULL;
+    }
+
+    w->table->capacity = CAPACITY;
+    w->table->names_size = NAMES;
+    w->table->names_used = 0;
+    w->table->reset_at = 0;
+    w->table->synced_at = 0;
+    w->table->alive_at = watch_time();
+    __atomic_store_n(&w->table->magic, MAGIC, __ATOMIC_RELEASE);
+
+    if (rename(tmp, w->path) != 0) {
+        munmap(w->table, w->size);
+        unlink(tmp);
+        free(w->path);
+        free(w);
+        return NULL;
+    }
+
+    return w;
+}
+
+bool watch_add(watch_t *w, const char *dir) {
+    slot_t *s = find(w->table, dir, strlen(dir), true);
+    if (s == NULL)
+        return false;
+    __atomic_store_n(&s->absent, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&s->watched_at, watch_time(), __ATOMIC_RELEASE);
+    return true;
+}
+
+bool watch_absent(watch_t *w, const char *dir) {
+    slot_t *s = find(w->table, dir, strlen(dir), true);
+    if (s == NULL)
+        return false;
+    __atomic_store_n(&s->absent, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&s->watched_at, watch_time(), __ATOMIC_RELEASE);
+    return true;
+}
+
+void watch_dirty(watch_t *w, const char *dir) {
+    slot_t *s = find(w->table, dir, strlen(dir), false);
+    if (s != NULL)
+        __atomic_store_n(&s->dirty_at, watch_time(), __ATOMIC_RELEASE);
+}
+
+void watch_moved(watch_t *w, const char *path) {
+    slot_t *s = find(w->table, path, strlen(path), false);
+    if (s != NULL)
+        __atomic_store_n(&s->moved_at, watch_time(), __ATOMIC_RELEASE);
+}
+
+void watch_synced(watch_t *w) {
+    __atomic_store_n(&w->table->synced_at, watch_time(), __ATOMIC_RELEASE);
+}
+
+void watch_reset(watch_t *w) {
+    __atomic_store_n(&w->table->reset_at, watch_time(), __ATOMIC_RELEASE);
+}
+
+void watch_heartbeat(watch_t *w) {
+    __atomic_store_n(&w->table->alive_at, watch_time(), __ATOMIC_RELEASE);
+}
+
+void watch_destroy(watch_t *w) {
+    assert(w->path != NULL);
+    /* Make sure anyone who still has the table mapped stops trusting it. */
+    watch_reset(w);
+    __atomic_store_n(&w->table->alive_at, 0, __ATOMIC_RELEASE);
+    unlink(w->path);
+    watch_close(w);
+}
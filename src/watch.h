@@ -0,0 +1,103 @@
+/* Shared record of filesystem changes, maintained by xcache-watch.
+ *
+ * The watcher places inotify watches on the directories containing the inputs
+ * of cache entries and publishes what it sees in a memory mapped file in the
+ * cache directory. For each watched directory it records when the watch was
+ * established, when the directory's contents last changed and when the
+ * directory itself was last moved or removed. Lookups can consult this to
+ * determine that an input cannot have changed since a given point in time
+ * without having to stat it.
+ *
+ * All times are nanoseconds since the epoch, as returned by watch_time().
+ */
+
+#ifndef _XCACHE_WATCH_H_
+#define _XCACHE_WATCH_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Name of the shared file, relative to the cache directory. */
+#define WATCH_FILE "watch.map"
+
+/* Directory readers touch to synchronise with the watcher, relative to the
+ * cache directory.
+ */
+#define WATCH_SYNC "watch.sync"
+
+typedef struct watch watch_t;
+
+/* Current time in the format used by the watcher. */
+int64_t watch_time(void);
+
+/* Map the shared file for reading. Returns NULL if there is no watcher
+ * running for the given cache directory.
+ */
+watch_t *watch_open(const char *cache_dir);
+
+/* Whether the watcher behind a shared file is still running. If not, callers
+ * should close it and try to open a new one.
+ */
+bool watch_alive(watch_t *w);
+
+/* Wait for the watcher to catch up with every change made before this call.
+ * Events reach the watcher asynchronously, so until this returns true the
+ * table may not yet reflect a change that has already happened. Returns false
+ * if the watcher did not catch up within 'timeout' milliseconds, in which case
+ * the table should not be trusted.
+ */
+bool watch_sync(watch_t *w, int timeout);
+
+/* Determine whether a path is known to have been unchanged since 'since'. This
+ * is true if the path's directory and all its ancestors were being watched
+ * (or known to be absent) before 'since' and no relevant change has been seen
+ * since. A false return
+ * means only that we do not know, and the caller should check for itself.
+ */
+bool watch_clean(watch_t *w, const char *path, int64_t since);
+
+/* Unmap a shared file opened with watch_open or watch_create. */
+void watch_close(watch_t *w);
+
+/* The following are for use by the watcher itself. */
+
+/* Create a fresh shared file, replacing any existing one. Returns NULL on
+ * failure.
+ */
+watch_t *watch_create(const char *cache_dir);
+
+/* Record that a directory has started being watched. Returns false if the
+ * table is full.
+ */
+bool watch_add(watch_t *w, const char *dir);
+
+/* Record that a directory does not exist. Its parent must already be watched,
+ * so that its creation is seen. Returns false if the table is full.
+ */
+bool watch_absent(watch_t *w, const char *dir);
+
+/* Record that the contents of a directory have changed. */
+void watch_dirty(watch_t *w, const char *dir);
+
+/* Record that a path has been moved, removed or replaced. */
+void watch_moved(watch_t *w, const char *path);
+
+/* Record that the watcher has seen a reader touch WATCH_SYNC, and hence has
+ * processed every event that preceded it.
+ */
+void watch_synced(watch_t *w);
+
+/* Record that events may have been lost, invalidating everything. */
+void watch_reset(watch_t *w);
+
+/* Indicate that the watcher is still alive. Readers disregard the shared file
+ * if this is not called regularly.
+ */
+void watch_heartbeat(watch_t *w);
+
+/* Tear down a shared file created with watch_create, so readers no longer
+ * trust it.
+ */
+void watch_destroy(watch_t *w);
+
+#endif
@@ -0,0 +1,404 @@
+/* Filesystem watcher for xcache.
+ *
+ * Validating a cache entry normally involves a stat of every one of its
+ * inputs. For large builds this dominates the cost of a hit, even though the
+ * vast majority of inputs have not changed since the last time we looked. This
+ * daemon places inotify watches on the directories containing inputs of cache
+ * entries and publishes the changes it sees (see watch.h). Lookups that find
+ * no relevant change since they last confirmed an entry's inputs can skip
+ * checking them altogether.
+ *
+ * The watcher is purely advisory. If it is not running, falls behind or runs
+ * out of watches, lookups simply fall back to checking inputs themselves.
+ */
+
+#include <assert.h>
+#include "cache.h"
+#include "collection/dict.h"
+#include <errno.h>
+#include <limits.h>
+#include "log.h"
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <time.h>
+#include <unistd.h>
+#include "util.h"
+#include "watch.h"
+
+/* How often (in seconds) to look for inputs of new cache entries. */
+#define RESCAN_INTERVAL 10
+
+/* Events that indicate the contents of a directory have changed. */
+#define MASK (IN_ATTRIB|IN_MODIFY|IN_CLOSE_WRITE|IN_CREATE|IN_DELETE| \
+              IN_MOVED_FROM|IN_MOVED_TO|IN_DELETE_SELF|IN_MOVE_SELF| \
+              IN_ONLYDIR)
+
+static const char *cache_dir = NULL;
+
+/* Set by our signal handler to indicate we should shut down. */
+static volatile sig_atomic_t stop = 0;
+
+static int inotify_fd;
+
+/* Watch descriptor for WATCH_SYNC. */
+static int sync_wd = -1;
+
+static watch_t *watch;
+
+/* Directories we are watching, indexed by watch descriptor. */
+static char **paths = NULL;
+static size_t paths_sz = 0;
+
+/* The same directories, for lookup by path. */
+static dict_t watched;
+
+/* Directories we have recorded as not existing. */
+static dict_t absent;
+
+/* Set when we have run out of watches or table space, after which we stop
+ * trying to watch further directories.
+ */
+static bool full = false;
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage:\n"
+        "  %s [options]\n"
+        "\n"
+        "Options:\n"
+        "  --cache-dir <dir>\n"
+        "  -c <dir>           Watch inputs of the cache in <dir>.\n"
+        "  --help\n"
+        "  -?                 Print this help information and exit.\n"
+        "  --log <file>\n"
+        "  -l <file>          Direct any output to <file>. Defaults to stderr.\n"
+        "  --quiet\n"
+        "  -q                 Show less output.\n"
+        "  --verbose\n"
+        "  -v                 Show more output.\n"
+        "  --version          Output version information and then exit.\n"
+        , prog);
+}
+
+static void parse_arguments(int argc, char **argv) {
+    for (int index = 1; index < argc; index++) {
+        if ((!strcmp(argv[index], "--cache-dir") ||
+             !strcmp(argv[index], "-c")) &&
+            index < argc - 1) {
+            cache_dir = argv[++index];
+        } else if ((!strcmp(argv[index], "--log") ||
+                    !strcmp(argv[index], "-l")) &&
+                   index < argc - 1) {
+            if (log_init(argv[++index]) != 0) {
+                usage(argv[0]);
+                exit(-1);
+            }
+        } else if (!strcmp(argv[index], "--quiet") ||
+                   !strcmp(argv[index], "-q")) {
+            verbosity--;
+        } else if (!strcmp(argv[index], "--verbose") ||
+                   !strcmp(argv[index], "-v")) {
+            verbosity++;
+        } else if (!strcmp(argv[index], "--version")) {
+            printf("xcache-watch %d.%02d\n", VERSION_MAJOR, VERSION_MINOR);
+            exit(0);
+        } else if (!strcmp(argv[index], "--help") ||
+                   !strcmp(argv[index], "-?")) {
+            usage(argv[0]);
+            exit(0);
+        } else {
+            usage(argv[0]);
+            exit(-1);
+        }
+    }
+}
+
+/* Record that a directory does not exist. The caller must already be watching
+ * its parent.
+ */
+static void absent_dir(const char *dir) {
+    if (dict_contains(&absent, dir))
+        return;
+
+    char *key = strdup(dir);
+    if (key == NULL)
+        return;
+    (void)dict_add(&absent, key, NULL);
+
+    if (!watch_absent(watch, dir)) {
+        INFO("Watch table full; not watching any more directories\n");
+        full = true;
+    }
+    DEBUG("Watching for creation of %s\n", dir);
+}
+
+/* Start watching a directory, if we are not already. Returns true if the
+ * directory is being watched.
+ */
+static bool watch_dir(const char *dir) {
+    if (dict_contains(&watched, dir))
+        return true;
+    if (full || dict_contains(&absent, dir))
+        return false;
+
+    int wd = inotify_add_watch(inotify_fd, dir, MASK);
+    if (wd < 0) {
+        if (errno == ENOSPC) {
+            INFO("Out of inotify watches; not watching any more directories\n");
+            full = true;
+        } else if (errno == ENOENT || errno == ENOTDIR) {
+            absent_dir(dir);
+        }
+        return false;
+    }
+
+    if ((size_t)wd >= paths_sz) {
+        size_t sz = paths_sz == 0 ? 64 : paths_sz;
+        while (sz <= (size_t)wd)
+            sz *= 2;
+        char **p = realloc(paths, sz * sizeof(p[0]));
+        if (p == NULL) {
+            inotify_rm_watch(inotify_fd, wd);
+            return false;
+        }
+        memset(p + paths_sz, 0, (sz - paths_sz) * sizeof(p[0]));
+        paths = p;
+        paths_sz = sz;
+    }
+
+    /* If this directory is reachable through a path we are already watching,
+     * inotify hands us back the existing descriptor. We can only report events
+     * against one path, so leave this one unwatched.
+     */
+    if (paths[wd] != NULL)
+        return false;
+
+    char *path = strdup(dir);
+    char *key = strdup(dir);
+    if (path == NULL || key == NULL) {
+        free(path);
+        free(key);
+        inotify_rm_watch(inotify_fd, wd);
+        return false;
+    }
+    paths[wd] = path;
+    (void)dict_add(&watched, key, NULL);
+
+    /* Note this happens after the watch is in place, so any later change is
+     * guaranteed to be seen.
+     */
+    if (!watch_add(watch, dir)) {
+        INFO("Watch table full; not watching any more directories\n");
+        full = true;
+    }
+    DEBUG("Watching %s\n", dir);
+    return true;
+}
+
+/* Stop tracking a directory whose watch has gone away. */
+static void unwatch_dir(int wd) {
+    assert(wd >= 0 && (size_t)wd < paths_sz && paths[wd] != NULL);
+    (void)dict_remove(&watched, paths[wd]);
+    free(paths[wd]);
+    paths[wd] = NULL;
+}
+
+/* Watch the directory containing each input, along with all its ancestors. If
+ * one of these does not exist, we instead watch for its creation.
+ */
+static int rescan(cache_t *cache) {
+    int f(const char *filename) {
+        if (filename[0] != '/')
+            return 0;
+
+        autofree char *path = strdup(filename);
+        if (path == NULL)
+            return -1;
+
+        if (!watch_dir("/"))
+            return full ? 1 : 0;
+        for (char *p = strchr(path + 1, '/'); p != NULL;
+                p = strchr(p + 1, '/')) {
+            *p = '\0';
+            bool ok = watch_dir(path);
+            *p = '/';
+            if (!ok)
+                break;
+        }
+        return full ? 1 : 0;
+    }
+    int r = cache_for_all_inputs(cache, f);
+    return r < 0 ? -1 : 0;
+}
+
+/* Process all pending events. */
+static void drain(void) {
+    char buffer[sizeof(struct inotify_event) + NAME_MAX + 1]
+        __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (true) {
+        ssize_t len = read(inotify_fd, buffer, sizeof(buffer));
+        if (len <= 0)
+            return;
+
+        for (char *p = buffer; p < buffer + len; ) {
+            const struct inotify_event *e = (const struct inotify_event*)p;
+            p += sizeof(*e) + e->len;
+
+            if (e->mask & IN_Q_OVERFLOW) {
+                INFO("inotify queue overflowed; invalidating everything\n");
+                watch_reset(watch);
+                continue;
+            }
+
+            /* A reader waiting for us to catch up. Everything queued before
+             * this has now been processed.
+             */
+            if (e->wd == sync_wd && e->len == 0)
+                watch_synced(watch);
+
+            if (e->wd < 0 || (size_t)e->wd >= paths_sz || paths[e->wd] == NULL)
+                continue;
+            const char *dir = paths[e->wd];
+
+            if (e->mask & (IN_DELETE_SELF|IN_MOVE_SELF|IN_IGNORED|IN_UNMOUNT)) {
+                DEBUG("Lost %s\n", dir);
+                watch_moved(watch, dir);
+                watch_dirty(watch, dir);
+                if (!(e->mask & IN_IGNORED))
+                    inotify_rm_watch(inotify_fd, e->wd);
+                unwatch_dir(e->wd);
+                continue;
+            }
+
+            watch_dirty(watch, dir);
+
+            /* The entry that changed may itself be a directory we watch, in
+             * which case anything we know about beneath it is now suspect.
+             */
+            if (e->len > 0) {
+                autofree char *child = strcmp(dir, "/") == 0 ?
+                    aprintf("/%s", e->name) : aprintf("%s/%s", dir, e->name);
+                if (child == NULL) {
+                    watch_reset(watch);
+                } else {
+                    watch_moved(watch, child);
+                    /* If we were waiting for this to appear, it can now be
+                     * watched on our next scan.
+                     */
+                    (void)dict_remove(&absent, child);
+                }
+            }
+        }
+    }
+}
+
+static void handler(int signum __attribute__((unused))) {
+    stop = 1;
+}
+
+int main(int argc, char **argv) {
+    parse_arguments(argc, argv);
+
+    if (cache_dir == NULL) {
+        char *home = getenv("HOME");
+        if (home == NULL || (cache_dir = aprintf("%s/.xcache", home)) == NULL) {
+            ERROR("Failed to determine default cache directory\n");
+            return -1;
+        }
+    }
+
+    if (mkdirp(cache_dir) != 0) {
+        ERROR("Failed to create cache directory \"%s\"\n", cache_dir);
+        return -1;
+    }
+
+    cache_t *cache = cache_open(cache_dir, false);
+    if (cache == NULL) {
+        ERROR("Failed to open cache\n");
+        return -1;
+    }
+
+    inotify_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        ERROR("Failed to initialise inotify\n");
+        cache_close(cache);
+        return -1;
+    }
+
+    if (dict(&watched) != 0 || dict(&absent) != 0) {
+        ERROR("Failed to create dictionary\n");
+        close(inotify_fd);
+        cache_close(cache);
+        return -1;
+    }
+
+    /* Readers touch this to wait for us to catch up (see watch_sync()). This
+     * must be watched before the table appears, so no reader can touch it
+     * unseen.
+     */
+    autofree char *sync = aprintf("%s/" WATCH_SYNC, cache_dir);
+    if (sync == NULL || mkdirp(sync) != 0 ||
+            (sync_wd = inotify_add_watch(inotify_fd, sync,
+                IN_ATTRIB|IN_ONLYDIR)) < 0) {
+        ERROR("Failed to watch %s/" WATCH_SYNC "\n", cache_dir);
+        dict_destroy(&absent);
+        dict_destroy(&watched);
+        close(inotify_fd);
+        cache_close(cache);
+        return -1;
+    }
+
+    watch = watch_create(cache_dir);
+    if (watch == NULL) {
+        ERROR("Failed to create %s/" WATCH_FILE "\n", cache_dir);
+        dict_destroy(&absent);
+        dict_destroy(&watched);
+        close(inotify_fd);
+        cache_close(cache);
+        return -1;
+    }
+
+    struct sigaction sa = {
+        .sa_handler = handler,
+    };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    INFO("Watching inputs of %s\n", cache_dir);
+
+    time_t last_scan = 0;
+    while (!stop) {
+        time_t now = time(NULL);
+        if (!full && now - last_scan >= RESCAN_INTERVAL) {
+            if (rescan(cache) != 0)
+                DEBUG("failed to scan cache inputs\n");
+            last_scan = now;
+        }
+
+        struct pollfd pfd = {
+            .fd = inotify_fd,
+            .events = POLLIN,
+        };
+        if (poll(&pfd, 1, 1000) > 0)
+            drain();
+
+        watch_heartbeat(watch);
+    }
+
+    INFO("Shutting down\n");
+    watch_destroy(watch);
+    for (size_t i = 0; i < paths_sz; i++)
+        free(paths[i]);
+    free(paths);
+    dict_destroy(&absent);
+    dict_destroy(&watched);
+    close(inotify_fd);
+    cache_close(cache);
+    return 0;
+}
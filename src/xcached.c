@@ -0,0 +1,594 @@
+/* Persistent xcache server.
+ *
+ * Every invocation of xcache pays for process startup, opening the cache
+ * database and preparing its queries before it can even begin to look for a
+ * matching entry. For build systems issuing tens of thousands of invocations,
+ * this adds up. This server keeps a cache open and serves lookups, retrievals
+ * and insertions on behalf of xcache clients over a UNIX domain socket in the
+ * cache directory. Clients that cannot reach a server fall back to accessing
+ * the cache directly, so running this is always optional.
+ *
+ * Note that tracing is still performed by the client. The server only ever
+ * handles the cache operations either side of it.
+ *
+ * Connections are served by a fixed pool of worker threads, each accepting on
+ * the shared socket with its own handle to the cache, so that one slow or
+ * stalled client does not hold up everyone else.
+ */
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include "cache.h"
+#include "collection/dict.h"
+#include "comm-protocol.h"
+#include "depset.h"
+#include <errno.h>
+#include <limits.h>
+#include "log.h"
+#include <pthread.h>
+#include "server-protocol.h"
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include "util.h"
+
+static const char *cache_dir = NULL;
+
+static bool statistics = true;
+
+/* Our cache's staging directory. See cache_staging(). */
+static char *staging;
+
+/* Set by our signal handler to indicate we should shut down. */
+static volatile sig_atomic_t stop = 0;
+
+/* Number of connections we serve concurrently. */
+#define WORKERS 8
+
+/* How long, in seconds, a client may leave us waiting on its end of the
+ * connection before we give up on it.
+ */
+#define CONNECTION_TIMEOUT 10
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage:\n"
+        "  %s [options]\n"
+        "\n"
+        "Options:\n"
+        "  --cache-dir <dir>\n"
+        "  -c <dir>           Serve the cache in <dir>.\n"
+        "  --help\n"
+        "  -?                 Print this help information and exit.\n"
+        "  --log <file>\n"
+        "  -l <file>          Direct any output to <file>. Defaults to stderr.\n"
+        "  --no-statistics    Do not log statistics in cache database.\n"
+        "  --quiet\n"
+        "  -q                 Show less output.\n"
+        "  --statistics       Log statistics in cache database (default).\n"
+        "  --verbose\n"
+        "  -v                 Show more output.\n"
+        "  --version          Output version information and then exit.\n"
+        , prog);
+}
+
+static void parse_arguments(int argc, char **argv) {
+    for (int index = 1; index < argc; index++) {
+        if ((!strcmp(argv[index], "--cache-dir") ||
+             !strcmp(argv[index], "-c")) &&
+            index < argc - 1) {
+            cache_dir = argv[++index];
+        } else if ((!strcmp(argv[index], "--log") ||
+                    !strcmp(argv[index], "-l")) &&
+                   index < argc - 1) {
+            if (log_init(argv[++index]) != 0) {
+                usage(argv[0]);
+                exit(-1);
+            }
+        } else if (!strcmp(argv[index], "--no-statistics")) {
+            statistics = false;
+        } else if (!strcmp(argv[index], "--quiet") ||
+                   !strcmp(argv[index], "-q")) {
+            verbosity--;
+        } else if (!strcmp(argv[index], "--statistics")) {
+            statistics = true;
+        } else if (!strcmp(argv[index], "--verbose") ||
+                   !strcmp(argv[index], "-v")) {
+            verbosity++;
+        } else if (!strcmp(argv[index], "--version")) {
+            printf("xcached %d.%02d\n", VERSION_MAJOR, VERSION_MINOR);
+            exit(0);
+        } else if (!strcmp(argv[index], "--help") ||
+                   !strcmp(argv[index], "-?")) {
+            usage(argv[0]);
+            exit(0);
+        } else {
+            usage(argv[0]);
+            exit(-1);
+        }
+    }
+}
+
+static void handle_locate(cache_t *cache, int sock) {
+    autofree char *cwd = NULL;
+    if (read_string(sock, &cwd) != 0 || cwd == NULL)
+        return;
+
+    int argc;
+    char **argv = read_strings(sock, &argc);
+    if (argv == NULL)
+        return;
+
+    char **envp = read_strings(sock, NULL);
+    if (envp == NULL) {
+        free_strings(argv);
+        return;
+    }
+
+    int failures;
+    if (read_int(sock, &failures) != 0) {
+        free_strings(envp);
+        free_strings(argv);
+        return;
+    }
+
+    int id = argc == 0 ? -1 :
+        cache_locate(cache, cwd, argc, argv, envp, failures != 0);
+    (void)write_int(sock, id);
+
+    free_strings(envp);
+    free_strings(argv);
+}
+
+static void handle_dump(cache_t *cache, int sock) {
+    int id;
+    if (read_int(sock, &id) != 0)
+        return;
+
+    int outfd = read_fd(sock);
+    if (outfd < 0)
+        return;
+    int errfd = read_fd(sock);
+    if (errfd < 0) {
+        close(outfd);
+        return;
+    }
+
+    int status, sig;
+    int r = cache_dump(cache, id, outfd, errfd, &status, &sig);
+    if (write_int(sock, r) == 0 && r == 0) {
+        (void)write_int(sock, status);
+        (void)write_int(sock, sig);
+    }
+
+    close(errfd);
+    close(outfd);
+}
+
+/* Receive an optional file sent by the client. Returns 0 on success and sets
+ * 'fd' to the received descriptor or -1 if the client had no file to send.
+ */
+static int read_file(int sock, int *fd) {
+    int present;
+    if (read_int(sock, &present) != 0)
+        return -1;
+    if (!present) {
+        *fd = -1;
+        return 0;
+    }
+    *fd = read_fd(sock);
+    return *fd < 0 ? -1 : 0;
+}
+
+/* Return a path to a file the client sent us. This is its own path if it is
+ * in our staging directory, or the path to our descriptor otherwise. Returns
+ * NULL on failure.
+ */
+static char *staged(int fd) {
+    autofree char *link = aprintf("/proc/self/fd/%d", fd);
+    if (link == NULL)
+        return NULL;
+
+    char path[PATH_MAX];
+    ssize_t len = readlink(link, path, sizeof(path));
+    if (staging != NULL && len > 0 && (size_t)len < sizeof(path)) {
+        path[len] = '\0';
+        size_t prefix = strlen(staging);
+        struct stat st1, st2;
+        /* Check it is still there, and not some other file since put there. */
+        if (strncmp(path, staging, prefix) == 0 && path[prefix] == '/' &&
+                fstat(fd, &st1) == 0 && stat(path, &st2) == 0 &&
+                st1.st_dev == st2.st_dev && st1.st_ino == st2.st_ino)
+            return strdup(path);
+    }
+
+    char *p = link;
+    link = NULL;
+    return p;
+}
+
+static void handle_write(cache_t *cache, int sock) {
+    autofree char *cwd = NULL;
+    if (read_string(sock, &cwd) != 0 || cwd == NULL)
+        return;
+
+    int argc;
+    char **argv = read_strings(sock, &argc);
+    if (argv == NULL)
+        return;
+
+    depset_t *deps = depset_new();
+    if (deps == NULL) {
+        free_strings(argv);
+        return;
+    }
+
+    dict_t env;
+    bool env_initialised = false;
+    int outfd = -1, errfd = -1;
+    autofree char *outfile = NULL;
+    autofree char *errfile = NULL;
+    autofree char *prefixes = NULL;
+    autofree char *stamp = NULL;
+
+    while (true) {
+        autofree char *filename = NULL;
+        if (read_string(sock, &filename) != 0)
+            goto done;
+        if (filename == NULL)
+            break;
+
+        int type;
+        if (read_int(sock, &type) != 0)
+            goto done;
+
+        unsigned char *data;
+        ssize_t len = read_data(sock, &data);
+        if (len != sizeof(time_t)) {
+            if (len > 0)
+                free(data);
+            goto done;
+        }
+        time_t mtime;
+        memcpy(&mtime, data, sizeof(mtime));
+        free(data);
+
+        if (depset_insert(deps, filename, (filetype_t)type, mtime) != 0)
+            goto done;
+    }
+
+    if (dict(&env) != 0)
+        goto done;
+    env_initialised = true;
+
+    while (true) {
+        char *name;
+        if (read_string(sock, &name) != 0)
+            goto done;
+        if (name == NULL)
+            break;
+
+        char *value;
+        if (read_string(sock, &value) != 0) {
+            free(name);
+            goto done;
+        }
+
+        if (dict_add(&env, name, value) != 0) {
+            free(value);
+            free(name);
+            goto done;
+        }
+    }
+
+    if (read_file(sock, &outfd) != 0 || read_file(sock, &errfd) != 0)
+        goto done;
+
+    if (read_string(sock, &prefixes) != 0 || read_string(sock, &stamp) != 0 ||
+            (stamp != NULL && prefixes == NULL))
+        goto done;
+
+    int status, sig, ttl;
+    if (read_int(sock, &status) != 0 || read_int(sock, &sig) != 0 ||
+            read_int(sock, &ttl) != 0 || ttl < 0)
+        goto done;
+
+    /* The client normally captures output in our staging directory, in which
+     * case we can move the files into place. Otherwise we refer to its files
+     * through our own descriptors to them.
+     */
+    if (outfd != -1)
+        outfile = staged(outfd);
+    if (errfd != -1)
+        errfile = staged(errfd);
+    if ((outfd != -1 && outfile == NULL) || (errfd != -1 && errfile == NULL))
+        goto done;
+
+    int r = argc == 0 ? -1 :
+        cache_write(cache, cwd, argc, argv, deps, &env, outfile, errfile,
+            prefixes, stamp, status, sig, (unsigned)ttl);
+    (void)write_int(sock, r);
+
+done:
+    if (errfd != -1)
+        close(errfd);
+    if (outfd != -1)
+        close(outfd);
+    if (env_initialised)
+        dict_destroy(&env);
+    depset_destroy(deps);
+    free_strings(argv);
+}
+
+static void handle_worth(cache_t *cache, int sock) {
+    autofree char *cwd = NULL;
+    if (read_string(sock, &cwd) != 0 || cwd == NULL)
+        return;
+
+    int argc;
+    char **argv = read_strings(sock, &argc);
+    if (argv == NULL)
+        return;
+
+    int skip_after, reprobe;
+    if (read_int(sock, &skip_after) == 0 && read_int(sock, &reprobe) == 0 &&
+            skip_after >= 0 && reprobe >= 0) {
+        bool worth = argc == 0 ||
+            cache_worth_tracing(cache, cwd, argc, argv, (unsigned)skip_after,
+                (unsigned)reprobe);
+        (void)write_int(sock, worth ? 1 : 0);
+    }
+
+    free_strings(argv);
+}
+
+static void handle_outcome(cache_t *cache, int sock) {
+    autofree char *cwd = NULL;
+    if (read_string(sock, &cwd) != 0 || cwd == NULL)
+        return;
+
+    int argc;
+    char **argv = read_strings(sock, &argc);
+    if (argv == NULL)
+        return;
+
+    int traced, inherent;
+    autofree char *reason = NULL;
+    unsigned char *data = NULL;
+    ssize_t len = 0;
+    if (read_int(sock, &traced) != 0 || read_string(sock, &reason) != 0 ||
+            read_int(sock, &inherent) != 0)
+        goto done;
+    len = read_data(sock, &data);
+    if (len != sizeof(int64_t))
+        goto done;
+    int64_t us;
+    memcpy(&us, data, sizeof(us));
+
+    /* Check what cache_record_outcome would otherwise assert. */
+    int r = argc == 0 || (!traced && reason != NULL) ||
+            (reason == NULL && inherent) ? -1 :
+        cache_record_outcome(cache, cwd, argc, argv, traced != 0, reason,
+            inherent != 0, us);
+    (void)write_int(sock, r);
+
+done:
+    if (len > 0)
+        free(data);
+    free_strings(argv);
+}
+
+/* Handle a single request from a client. */
+static void serve(cache_t *cache, int sock) {
+    /* Note that clients that vanish before sending anything are
+     * unremarkable.
+     */
+    int tag;
+    if (read_int(sock, &tag) != 0)
+        return;
+
+    switch (tag) {
+        case REQ_LOCATE:
+            handle_locate(cache, sock);
+            break;
+
+        case REQ_DUMP:
+            handle_dump(cache, sock);
+            break;
+
+        case REQ_WRITE:
+            handle_write(cache, sock);
+            break;
+
+        case REQ_WORTH:
+            handle_worth(cache, sock);
+            break;
+
+        case REQ_OUTCOME:
+            handle_outcome(cache, sock);
+            break;
+
+        default:
+            DEBUG("received unknown request %d\n", tag);
+    }
+}
+
+static void handler(int signum __attribute__((unused))) {
+    stop = 1;
+}
+
+typedef struct {
+    pthread_t thread;
+    cache_t *cache;
+    int sock;
+} worker_t;
+
+/* Main loop of a worker thread. Connections are accepted until the listening
+ * socket is shut down.
+ */
+static void *work(void *arg) {
+    worker_t *w = arg;
+
+    const struct timeval timeout = {
+        .tv_sec = CONNECTION_TIMEOUT,
+    };
+
+    while (true) {
+        int conn = accept4(w->sock, NULL, NULL, SOCK_CLOEXEC);
+        if (conn < 0) {
+            if (stop)
+                break;
+            if (errno != EINTR && errno != ECONNABORTED)
+                DEBUG("failed to accept connection (%d)\n", errno);
+            continue;
+        }
+
+        /* A client that stops talking to us mid-request only costs us this
+         * connection, not the worker.
+         */
+        if (setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                    sizeof(timeout)) != 0 ||
+                setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                    sizeof(timeout)) != 0) {
+            DEBUG("failed to set timeout on connection (%d)\n", errno);
+            close(conn);
+            continue;
+        }
+
+        serve(w->cache, conn);
+        close(conn);
+    }
+
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    parse_arguments(argc, argv);
+
+    if (cache_dir == NULL) {
+        char *home = getenv("HOME");
+        if (home == NULL || (cache_dir = aprintf("%s/.xcache", home)) == NULL) {
+            ERROR("Failed to determine default cache directory\n");
+            return -1;
+        }
+    }
+
+    if (mkdirp(cache_dir) != 0) {
+        ERROR("Failed to create cache directory \"%s\"\n", cache_dir);
+        return -1;
+    }
+
+    autofree char *path = server_socket(cache_dir);
+    if (path == NULL) {
+        ERROR("Path to socket in \"%s\" is too long\n", cache_dir);
+        return -1;
+    }
+
+    struct sockaddr_un addr = {
+        .sun_family = AF_UNIX,
+    };
+    strcpy(addr.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        ERROR("Failed to create socket\n");
+        return -1;
+    }
+
+    /* If there is a socket left lying around, check whether someone is still
+     * serving on it before we take it over.
+     */
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+        ERROR("Another server is already running on %s\n", path);
+        close(sock);
+        return -1;
+    }
+    (void)unlink(path);
+
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+            listen(sock, SOMAXCONN) != 0) {
+        ERROR("Failed to listen on %s\n", path);
+        close(sock);
+        return -1;
+    }
+
+    /* Each worker has its own handle to the cache, as a cache_t is not safe to
+     * use from multiple threads at once.
+     */
+    worker_t workers[WORKERS];
+    for (unsigned int i = 0; i < WORKERS; i++) {
+        workers[i].cache = cache_open(cache_dir, statistics);
+        if (workers[i].cache == NULL) {
+            ERROR("Failed to open cache\n");
+            while (i-- > 0)
+                cache_close(workers[i].cache);
+            unlink(path);
+            close(sock);
+            return -1;
+        }
+        workers[i].sock = sock;
+    }
+
+    /* Failing this only means copying output from clients. */
+    staging = cache_staging(cache_dir);
+
+    /* Clients that disappear mid-request should not take us down with them.
+     */
+    signal(SIGPIPE, SIG_IGN);
+
+    struct sigaction sa = {
+        .sa_handler = handler,
+    };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    /* Leave the shutdown signals to this thread. The workers inherit this
+     * mask, and we unblock them again only while waiting for one.
+     */
+    sigset_t signals, old;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, &old);
+
+    unsigned int started = 0;
+    for (; started < WORKERS; started++) {
+        if (pthread_create(&workers[started].thread, NULL, work,
+                &workers[started]) != 0) {
+            ERROR("Failed to start worker thread\n");
+            stop = 1;
+            break;
+        }
+    }
+
+    if (started == WORKERS)
+        INFO("Serving %s\n", cache_dir);
+
+    while (!stop)
+        sigsuspend(&old);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    INFO("Shutting down\n");
+
+    /* Wake any workers blocked in accept. Those in the middle of a request
+     * finish it first.
+     */
+    (void)shutdown(sock, SHUT_RDWR);
+    for (unsigned int i = 0; i < started; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    free(staging);
+    for (unsigned int i = 0; i < WORKERS; i++)
+        cache_close(workers[i].cache);
+    unlink(path);
+    close(sock);
+    return started == WORKERS ? 0 : -1;
+}
@@ -0,0 +1,24 @@
+#!/bin/bash -e
+
+# Test we can cache creating a static archive with ar.
+
+if ! command -v ar >/dev/null; then
+    echo "ar not available; skipping" >&2
+    exit 0
+fi
+
+CACHE=$(mktemp -d)
+SCRATCH=$(mktemp -d)
+trap "rm -rf ${CACHE} ${SCRATCH}" EXIT
+
+cd ${SCRATCH}
+echo "hello" >a.txt
+echo "world" >b.txt
+
+xcache --cache-dir ${CACHE} -v -v -v ar rcs libab.a a.txt b.txt 2>&1 | grep "Failed to locate cache entry"
+
+# ar updates an existing archive, so we need to start from scratch again to
+# match the entry we just created.
+rm libab.a
+xcache --cache-dir ${CACHE} -v -v -v ar rcs libab.a a.txt b.txt 2>&1 | grep "Found matching cache entry"
+ar t libab.a | grep "b.txt"
@@ -0,0 +1,34 @@
+#!/bin/bash -e
+
+# Test that with --async-commit the cache entry is written after xcache has
+# exited, and is found once the background writer is done.
+
+CACHE=$(mktemp -d)
+SCRATCH=$(mktemp -d)
+trap "rm -rf ${CACHE} ${SCRATCH}" EXIT
+
+cd ${SCRATCH}
+echo "hello world" >input
+
+# The background writer must not hold on to our output, or this would hang.
+xcache --cache-dir ${CACHE} --async-commit -v -v -v sh -c 'cat input >output' \
+    2>&1 | grep "Writing cache entry in the background"
+
+# Wait for the writer to finish.
+for i in $(seq 100); do
+    [ -z "$(ls -A ${CACHE}/pending)" ] && break
+    sleep 0.1
+done
+[ -z "$(ls -A ${CACHE}/pending)" ]
+
+rm output
+xcache --cache-dir ${CACHE} --async-commit -v -v -v sh -c 'cat input >output' \
+    2>&1 | grep "Found matching cache entry"
+[ "$(cat output)" = "hello world" ]
+
+# With no room for background writes, the entry is written in the foreground.
+echo "goodbye" >input2
+xcache --cache-dir ${CACHE} --async-commit --async-limit 0 -v -v -v \
+    cat input2 2>&1 | grep "Adding cache entry"
+xcache --cache-dir ${CACHE} -v -v -v cat input2 2>&1 | \
+    grep "Found matching cache entry"
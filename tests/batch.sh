@@ -0,0 +1,64 @@
+#!/bin/bash -e
+
+# Test that xcache --batch runs a stream of commands, caching them as xcache
+# would for each, and replays them from cache when they are requested again.
+
+CACHE=$(mktemp -d)
+SCRATCH=$(mktemp -d)
+trap "rm -rf ${CACHE} ${SCRATCH}" EXIT
+
+cd ${SCRATCH}
+echo "hello world" >input
+echo "goodbye world" >input2
+
+# Send each command given to xcache --batch in a request, and print a line for
+# each reply, in order of the requests, of its exit status and whether it was a
+# cache hit.
+cat - >client.py <<EOT
+import os, struct, subprocess, sys
+
+def data(b):
+    return struct.pack('N', len(b)) + b
+
+def string(s):
+    return data(s.encode() + b'\0')
+
+def strings(ss):
+    return data(struct.pack('i', len(ss))) + b''.join(string(s) for s in ss)
+
+requests = b''
+for i, command in enumerate(sys.argv[1:]):
+    requests += string(os.getcwd()) + strings(['sh', '-c', command]) + \\
+        strings(['%s=%s' % kv for kv in os.environ.items()]) + \\
+        string('out%d' % i) + string('err%d' % i)
+
+p = subprocess.run(['xcache', '--cache-dir', '${CACHE}', '--batch',
+    '--jobs', '2'], input=requests, stdout=subprocess.PIPE, check=True)
+
+replies = {}
+out = p.stdout
+while out:
+    fields = []
+    for _ in range(3):
+        (n,) = struct.unpack_from('N', out)
+        (v,) = struct.unpack_from('i', out, struct.calcsize('N'))
+        fields.append(v)
+        out = out[struct.calcsize('N') + n:]
+    replies[fields[0]] = fields[1:]
+
+for i in sorted(replies):
+    print(*replies[i])
+EOT
+
+python3 client.py 'cat input >output; echo hello' 'cat input2; exit 3' >replies
+[ "$(cat replies)" = "$(printf '0 0\n3 0')" ]
+[ "$(cat out0)" = "hello" ]
+[ "$(cat out1)" = "goodbye world" ]
+[ "$(cat output)" = "hello world" ]
+
+rm output out0 out1
+python3 client.py 'cat input >output; echo hello' 'cat input2; exit 3' >replies
+[ "$(cat replies)" = "$(printf '0 1\n3 0')" ]
+[ "$(cat out0)" = "hello" ]
+[ "$(cat out1)" = "goodbye world" ]
+[ "$(cat output)" = "hello world" ]
@@ -0,0 +1,73 @@
+#!/bin/bash -e
+
+# Test that with --cache-failures we cache targets that fail, and replay their
+# exit status or the signal that killed them.
+
+CACHE=$(mktemp -d)
+SCRATCH=$(mktemp -d)
+trap "rm -rf ${CACHE} ${SCRATCH}" EXIT
+
+cd ${SCRATCH}
+echo "hello world" >input
+
+# Without --cache-failures, a failing target is not cached.
+status=0
+xcache --cache-dir ${CACHE} -v -v -v sh -c 'cat input; exit 3' >out 2>log || \
+    status=$?
+[ ${status} -eq 3 ]
+! grep "Adding cache entry" log
+
+status=0
+xcache --cache-dir ${CACHE} --cache-failures -v -v -v \
+    sh -c 'cat input; echo oops >&2; exit 3' >out 2>log || status=$?
+[ ${status} -eq 3 ]
+grep "Adding cache entry" log
+
+status=0
+xcache --cache-dir ${CACHE} --cache-failures -v -v -v \
+    sh -c 'cat input; echo oops >&2; exit 3' >out 2>log || status=$?
+[ ${status} -eq 3 ]
+grep "Found matching cache entry" log
+grep "oops" log
+[ "$(cat out)" = "hello world" ]
+
+# The entry is only used by those who asked for failures to be cached.
+status=0
+xcache --cache-dir ${CACHE} -v -v -v \
+    sh -c 'cat input; echo oops >&2; exit 3' >out 2>log || status=$?
+[ ${status} -eq 3 ]
+grep "Cache entry is of an unsuccessful run" log
+! grep "Found matching cache entry" log
+
+# A target that crashes is replayed by us being killed by the same signal.
+ulimit -c 0
+for i in 1 2; do
+    status=0
+    xcache --cache-dir ${CACHE} --cache-failures -v -v -v \
+        sh -c 'cat input; kill -ABRT $$' >out 2>log || status=$?
+    [ ${status} -eq 134 ]
+    [ "$(cat out)" = "hello world" ]
+done
+grep "Replaying termination by signal 6" log
+
+# A target killed from outside, like by a timeout, is not cached.
+for i in 1 2; do
+    status=0
+    xcache --cache-dir ${CACHE} --cache-failures -v -v -v \
+        sh -c 'cat input; kill -TERM $$' >out 2>log || status=$?
+    [ ${status} -eq 143 ]
+    ! grep "Found matching cache entry" log
+done
+grep "killed by signal 15" log
+
+# Entries of failed runs expire.
+status=0
+xcache --cache-dir ${CACHE} --cache-failures --failure-ttl 1 -v -v -v \
+    sh -c 'cat input; exit 4' >out 2>log || status=$?
+[ ${status} -eq 4 ]
+sleep 2
+status=0
+xcache --cache-dir ${CACHE} --cache-failures --failure-ttl 1 -v -v -v \
+    sh -c 'cat input; exit 4' >out 2>log || status=$?
+[ ${status} -eq 4 ]
+grep "has expired" log
@@ -0,0 +1,29 @@
+#!/bin/bash -e
+
+# Test we can cache a simple invocation of Clang.
+
+if ! command -v clang >/dev/null; then
+    echo "clang not available; skipping" >&2
+    exit 0
+fi
+
+CACHE=$(mktemp -d)
+SCRATCH=$(mktemp -d)
+trap "rm -rf ${CACHE} ${SCRATCH}" EXIT
+
+cd ${SCRATCH}
+cat - >main.c <<EOT
+#include <stdio.h>
+
+int main(void) {
+    printf("hello world\n");
+    return 0;
+}
+EOT
+
+xcache --cache-dir ${CACHE} -v -v -v clang -c main.c 2>&1 | grep "Failed to locate cache entry"
+xcache --cache-dir ${CACHE} -v -v -v clang -c main.c 2>&1 | grep "Found matching cache entry"
+
+xcache --cache-dir ${CACHE} -v -v -v clang -o main main.o 2>&1 | grep "Failed to locate cache entry"
+xcache --cache-dir ${CACHE} -v -v -v clang -o main main.o 2>&1 | grep "Found matching cache entry"
+[ "$(./main)" = "hello world" ]
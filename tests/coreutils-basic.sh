@@ -0,0 +1,39 @@
+#!/bin/bash -e
+
+# Test that common file-manipulating coreutils can be cached, under both
+# tracing backends. These exercise the *at() family of syscalls.
+
+CACHE=$(mktemp -d)
+SCRATCH=$(mktemp -d)
+trap "rm -rf ${CACHE} ${SCRATCH}" EXIT
+
+cd ${SCRATCH}
+echo "hello world" >input
+
+for backend in "" --interpose; do
+    for cmd in "cp input copy" \
+               "ln -sf input link" \
+               "install -m 0644 input installed" \
+               "mkdir -p directory" \
+               "truncate -s 100 sized" \
+               "rm -f nonexistent"; do
+        xcache --cache-dir ${CACHE} --no-server ${backend} -v -v -v ${cmd} 2>&1 | grep "Adding cache entry"
+        xcache --cache-dir ${CACHE} --no-server ${backend} -v -v -v ${cmd} 2>&1 | grep "Found matching cache entry"
+    done
+    rm -rf ${CACHE}/*
+done
+
+# The copy should still be intact after it was replayed.
+[ "$(cat copy)" = "hello world" ]
+
+# A replayed symlink should be a symlink again, not a copy of what it points to.
+for backend in "" --interpose; do
+    rm -f link
+    xcache --cache-dir ${CACHE} --no-server ${backend} -v -v -v ln -s input link 2>&1 | grep "Adding cache entry"
+    rm -f link
+    xcache --cache-dir ${CACHE} --no-server ${backend} -v -v -v ln -s input link 2>&1 | grep "Found matching cache entry"
+    [ -L link ]
+    [ "$(readlink link)" = "input" ]
+    rm -rf ${CACHE}/*
+done
+[ "$(cat input)" = "hello world" ]
@@ -0,0 +1,31 @@
+#!/bin/bash -e
+
+# Test that we follow the working directory of the target and its children
+# through relative changes of directory.
+
+CACHE=$(mktemp -d)
+SCRATCH=$(mktemp -d)
+trap "rm -rf ${CACHE} ${SCRATCH}" EXIT
+
+cd ${SCRATCH}
+mkdir -p a/b
+echo "hello world" >a/b/input
+echo "hello again" >a/other
+ln -s a/b link
+
+# The subshell is a forked child that starts in its parent's directory. The
+# ".." after the symlink takes us to a, not back to the scratch directory.
+# Changing into the symlink itself leaves us in a/b, so a ".." in a path the
+# target then opens also leads to a.
+CMD='cd a && (cd b && cat input) && cd -P ../link/.. && cat b/input && cd ../link && cat ../other'
+
+xcache --cache-dir ${CACHE} -v -v -v sh -c "${CMD}" 2>&1 | grep "Adding cache entry"
+xcache --cache-dir ${CACHE} -v -v -v sh -c "${CMD}" 2>&1 | grep "Found matching cache entry"
+
+sleep 1
+echo "goodbye world" >a/b/input
+[ "$(xcache --cache-dir ${CACHE} sh -c "${CMD}")" = "$(printf 'goodbye world\ngoodbye world\nhello again')" ]
+
+sleep 1
+echo "goodbye again" >a/other
+[ "$(xcache --cache-dir ${CACHE} sh -c "${CMD}")" = "$(printf 'goodbye world\ngoodbye world\ngoodbye again')" ]
@@ -0,0 +1,37 @@
+#!/bin/bash -e
+
+# Test that a variable looked up over and over, which libhook only reports the
+# first time, is still a dependency of the target. A later lookup of another
+# variable should also still be reported.
+
+if ! command -v gcc >/dev/null; then
+    echo "gcc not available; skipping" >&2
+    exit 0
+fi
+
+CACHE=$(mktemp -d)
+SCRATCH=$(mktemp -d)
+trap "rm -rf ${CACHE} ${SCRATCH}" EXIT
+
+cd ${SCRATCH}
+cat - >lookup.c <<EOT
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(void) {
+    unsigned n = 0;
+    for (unsigned i = 0; i < 100000; i++)
+        n += getenv("XCACHE_TEST_REPEATED") != NULL;
+    printf("%u %s\n", n, getenv("XCACHE_TEST_ONCE"));
+    return 0;
+}
+EOT
+gcc -o lookup lookup.c
+
+export XCACHE_TEST_REPEATED=1 XCACHE_TEST_ONCE=a
+xcache --cache-dir ${CACHE} -v -v -v ./lookup 2>&1 | grep "Adding cache entry"
+xcache --cache-dir ${CACHE} -v -v -v ./lookup 2>&1 | grep "Found matching cache entry"
+
+XCACHE_TEST_REPEATED=2 xcache --cache-dir ${CACHE} -v -v -v ./lookup 2>&1 | grep "Adding cache entry"
+XCACHE_TEST_ONCE=b xcache --cache-dir ${CACHE} -v -v -v ./lookup 2>&1 | grep "Adding cache entry"
+[ "$(XCACHE_TEST_ONCE=b xcache --cache-dir ${CACHE} ./lookup)" = "100000 b" ]
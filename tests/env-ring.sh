@@ -0,0 +1,35 @@
+#!/bin/bash -e
+
+# Test that environment variables read by many processes at once are all
+# reported. libhook passes these to us through a ring in shared memory, which
+# concurrent processes append to without taking turns.
+
+if ! command -v python3 >/dev/null; then
+    echo "python3 not available; skipping" >&2
+    exit 0
+fi
+
+CACHE=$(mktemp -d)
+SCRATCH=$(mktemp -d)
+trap "rm -rf ${CACHE} ${SCRATCH}" EXIT
+
+cd ${SCRATCH}
+cat - >Makefile <<EOT
+all: \$(patsubst %,out%,1 2 3 4 5 6 7 8)
+
+out%:
+	python3 -c 'open("\$@", "w").write("\$@")'
+EOT
+
+export PYTHONIOENCODING=utf-8
+xcache --cache-dir ${CACHE} -v -v -v make -j8 2>&1 | grep "Adding cache entry"
+[ "$(cat out8)" = "out8" ]
+
+# Python's interpreter reads PYTHONIOENCODING with getenv while starting up.
+rm -f out*
+xcache --cache-dir ${CACHE} -v -v -v make -j8 2>&1 | grep "Found matching cache entry"
+[ "$(cat out8)" = "out8" ]
+
+rm -f out*
+PYTHONIOENCODING=latin-1 xcache --cache-dir ${CACHE} -v -v -v make -j8 2>&1 | grep "Adding cache entry"
+[ "$(cat out8)" = "out8" ]
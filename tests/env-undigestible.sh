@@ -0,0 +1,39 @@
+#!/bin/bash -e
+
+# Test that a target looking up a variable whose name cannot be put in an
+# environment digest is still cached, with its variables checked one by one.
+
+if ! command -v gcc >/dev/null; then
+    echo "gcc not available; skipping" >&2
+    exit 0
+fi
+
+CACHE=$(mktemp -d)
+SCRATCH=$(mktemp -d)
+trap "rm -rf ${CACHE} ${SCRATCH}" EXIT
+
+cd ${SCRATCH}
+cat - >lookup.c <<EOT
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(void) {
+    printf("%s %s\n", getenv("A\nB") == NULL ? "unset" : "set",
+        getenv("XCACHE_TEST_VAR"));
+    return 0;
+}
+EOT
+gcc -o lookup lookup.c
+
+# xcache itself must also succeed, so we check its exit status rather than
+# only what it prints.
+export XCACHE_TEST_VAR=a
+OUT=$(xcache --cache-dir ${CACHE} ./lookup)
+[ "${OUT}" = "unset a" ]
+xcache --cache-dir ${CACHE} -v -v -v ./lookup 2>&1 | grep "Found matching cache entry"
+OUT=$(xcache --cache-dir ${CACHE} ./lookup)
+[ "${OUT}" = "unset a" ]
+
+# Without a digest, a change in a variable should still be noticed.
+OUT=$(XCACHE_TEST_VAR=b xcache --cache-dir ${CACHE} ./lookup)
+[ "${OUT}" = "unset b" ]
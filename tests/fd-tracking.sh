@@ -0,0 +1,54 @@
+#!/bin/bash -e
+
+# Test that files reached through file descriptors are tracked. The helper
+# below opens a directory, duplicates the descriptor, writes relative to the
+# duplicate and then changes into the directory with fchdir, all of which need
+# the tracer to know what each descriptor refers to.
+
+if ! command -v gcc >/dev/null; then
+    echo "gcc not available; skipping" >&2
+    exit 0
+fi
+
+CACHE=$(mktemp -d)
+SCRATCH=$(mktemp -d)
+trap "rm -rf ${CACHE} ${SCRATCH}" EXIT
+
+cd ${SCRATCH}
+mkdir dir
+echo "hello world" >dir/input
+cat - >helper.c <<EOT
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+int main(void) {
+    int dir = open("dir", O_RDONLY|O_DIRECTORY);
+    int copy = fcntl(dir, F_DUPFD_CLOEXEC, 10);
+    close(dir);
+
+    int out = openat(copy, "output", O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    (void)write(out, "written\n", 8);
+    close(out);
+
+    if (fchdir(copy) != 0)
+        return 1;
+    FILE *in = fopen("input", "r");
+    char buf[100];
+    if (in == NULL || fgets(buf, sizeof(buf), in) == NULL)
+        return 1;
+    fputs(buf, stdout);
+    return 0;
+}
+EOT
+gcc -o helper helper.c
+
+xcache --cache-dir ${CACHE} -v -v -v ./helper 2>&1 | grep "Adding cache entry"
+rm dir/output
+xcache --cache-dir ${CACHE} -v -v -v ./helper 2>&1 | grep "Found matching cache entry"
+[ "$(cat dir/output)" = "written" ]
+
+# Changing the file read after fchdir should be noticed.
+sleep 1
+echo "goodbye world" >dir/input
+[ "$(xcache --cache-dir ${CACHE} ./helper)" = "goodbye world" ]
@@ -21,3 +21,8 @@ EOT
 xcache --cache-dir ${CACHE} -v -v -v gcc main.c 2>&1 | grep "Failed to locate cache entry"
 
 xcache --cache-dir ${CACHE} -v -v -v gcc main.c 2>&1 | grep "Found matching cache entry"
+
+# The same should work when following GCC through libinterpose.
+rm -rf ${CACHE}/*
+xcache --cache-dir ${CACHE} --interpose -v -v -v gcc main.c 2>&1 | grep "Failed to locate cache entry"
+xcache --cache-dir ${CACHE} --interpose -v -v -v gcc main.c 2>&1 | grep "Found matching cache entry"
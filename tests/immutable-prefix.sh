@@ -0,0 +1,25 @@
+#!/bin/bash -e
+
+# Test that files are only left to the toolchain stamp when asked, and that the
+# stamp notices a change to the listing of an immutable prefix.
+
+TMP=$(mktemp -d)
+mkdir ${TMP}/sub
+echo hello >${TMP}/sub/h
+
+# By default, a file is checked individually wherever it lives.
+CACHE=$(mktemp -d)
+xcache --cache-dir ${CACHE} --no-server cat ${TMP}/sub/h
+echo goodbye >${TMP}/sub/h
+touch -d "2000-01-01" ${TMP}/sub/h
+[ "$(xcache --cache-dir ${CACHE} --no-server cat ${TMP}/sub/h)" = "goodbye" ]
+
+# Under an immutable prefix, the entry instead depends on the stamp, which
+# changes when something is added to the prefix.
+CACHE=$(mktemp -d)
+xcache --cache-dir ${CACHE} --no-server --immutable ${TMP}/ cat ${TMP}/sub/h
+xcache --cache-dir ${CACHE} --no-server --immutable ${TMP}/ -v -v -v \
+    cat ${TMP}/sub/h 2>&1 | grep "Found matching cache entry"
+touch ${TMP}/new
+xcache --cache-dir ${CACHE} --no-server --immutable ${TMP}/ -v -v -v \
+    cat ${TMP}/sub/h 2>&1 | grep "Toolchain has changed"
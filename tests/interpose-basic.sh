@@ -0,0 +1,22 @@
+#!/bin/bash -e
+
+# Test that xcache can observe a dynamically linked target through
+# libinterpose, and that it notices when its inputs change.
+
+CACHE=$(mktemp -d)
+TMP=$(mktemp -d)
+trap "rm -rf ${CACHE} ${TMP}" EXIT
+
+echo "hello world" >${TMP}/input
+
+xcache --cache-dir ${CACHE} --no-server --interpose -v -v -v cat ${TMP}/input 2>&1 | grep "Adding cache entry"
+xcache --cache-dir ${CACHE} --no-server --interpose -v -v -v cat ${TMP}/input 2>&1 | grep "Found matching cache entry"
+
+# Give the input a different timestamp.
+sleep 1
+echo "goodbye world" >${TMP}/input
+[ "$(xcache --cache-dir ${CACHE} --no-server --interpose cat ${TMP}/input)" = "goodbye world" ]
+
+# Changes of ownership are not supported, so the target should not be cached.
+touch ${TMP}/file
+xcache --cache-dir ${CACHE} --no-server --interpose -v -v -v chown $(id -u) ${TMP}/file 2>&1 | grep "libinterpose cannot follow the target"
@@ -0,0 +1,36 @@
+#!/bin/bash -e
+
+# Test that a target closing every descriptor it does not know about, as
+# daemons and some build tools do, does not close the pipe libinterpose reports
+# through. Otherwise the inputs it reads afterwards would go unrecorded.
+
+if ! command -v python3 >/dev/null; then
+    echo "python3 not available; skipping" >&2
+    exit 0
+fi
+
+CACHE=$(mktemp -d)
+TMP=$(mktemp -d)
+trap "rm -rf ${CACHE} ${TMP}" EXIT
+
+cd ${TMP}
+echo "hello world" >input
+cat - >target.py <<EOT
+import os
+os.closerange(3, 4096)
+for fd in range(3, 4096):
+    try:
+        os.close(fd)
+    except OSError:
+        pass
+print(open('input').read(), end='')
+EOT
+
+xcache --cache-dir ${CACHE} --no-server --interpose -v -v -v \
+    python3 target.py 2>&1 | grep "Adding cache entry"
+
+# Give the input a different timestamp.
+sleep 1
+echo "goodbye world" >input
+[ "$(xcache --cache-dir ${CACHE} --no-server --interpose python3 target.py)" = \
+    "goodbye world" ]
@@ -0,0 +1,39 @@
+#!/bin/bash -e
+
+# Test that output too large to fit in a pipe is captured and replicated
+# faithfully, whatever our own stdout refers to.
+
+CACHE=$(mktemp -d)
+SCRATCH=$(mktemp -d)
+trap "rm -rf ${CACHE} ${SCRATCH}" EXIT
+
+cd ${SCRATCH}
+seq 1 500000 >expected
+
+xcache --cache-dir ${CACHE} sh -c 'cat expected; cat expected >&2' \
+    >out 2>err
+cmp out expected
+cmp err expected
+
+# A pipe, which we can tee straight into.
+rm -rf ${CACHE}/*
+[ "$(xcache --cache-dir ${CACHE} cat expected | md5sum)" = \
+    "$(md5sum <expected)" ]
+
+# A file opened for appending, which splice cannot write to.
+rm -rf ${CACHE}/*
+echo "first" >out
+xcache --cache-dir ${CACHE} cat expected >>out
+[ "$(head -n 1 out)" = "first" ]
+[ "$(tail -n +2 out | md5sum)" = "$(md5sum <expected)" ]
+
+# The cached copy should be the same, including when appended.
+xcache --cache-dir ${CACHE} -v -v -v cat expected 2>err >out
+grep "Found matching cache entry" err
+cmp out expected
+xcache --cache-dir ${CACHE} cat expected >>out
+[ "$(wc -l <out)" -eq 1000000 ]
+
+# Captured output is staged in the cache and moved into place, leaving nothing
+# behind.
+[ -z "$(ls ${CACHE}/staging)" ]
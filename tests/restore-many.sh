@@ -0,0 +1,35 @@
+#!/bin/bash -e
+
+# Test that an entry with many outputs, spread over nested directories and
+# sharing contents, is restored completely with the right modes and
+# timestamps.
+
+CACHE=$(mktemp -d)
+SCRATCH=$(mktemp -d)
+trap "rm -rf ${CACHE} ${SCRATCH}" EXIT
+
+cd ${SCRATCH}
+cat - >generate.sh <<EOT
+for i in \$(seq 1 200); do
+    mkdir -p out/\$((i % 7))/\$((i % 3))
+    echo "file \$((i % 10))" >out/\$((i % 7))/\$((i % 3))/\${i}.txt
+done
+chmod 0755 out/1/1/1.txt
+echo done
+EOT
+
+xcache --cache-dir ${CACHE} -v -v -v bash generate.sh 2>&1 | grep "Adding cache entry"
+find out -type f | sort | xargs stat -c '%n %a %Y' >expected.txt
+
+rm -rf out
+xcache --cache-dir ${CACHE} -v -v -v bash generate.sh 2>&1 | grep "Found matching cache entry"
+find out -type f | sort | xargs stat -c '%n %a %Y' >actual.txt
+diff expected.txt actual.txt
+[ "$(cat out/4/0/123.txt)" = "file 3" ]
+
+# Restoring over existing, longer files should replace their contents.
+for f in out/*/*/*.txt; do
+    echo "some much longer stale contents" >${f}
+done
+xcache --cache-dir ${CACHE} -v -v -v bash generate.sh 2>&1 | grep "Found matching cache entry"
+[ "$(cat out/4/0/123.txt)" = "file 3" ]
@@ -0,0 +1,33 @@
+#!/bin/bash -e
+
+# Test that a target run by two xcaches at once only runs once, with the second
+# waiting for the first and then using its entry.
+
+CACHE=$(mktemp -d)
+SCRATCH=$(mktemp -d)
+trap "rm -rf ${CACHE} ${SCRATCH}" EXIT
+
+cd ${SCRATCH}
+echo "hello world" >input
+
+xcache --cache-dir ${CACHE} -v -v -v sh -c 'sleep 2; cat input' >out1 \
+    2>log1 &
+first=$!
+sleep 0.5
+xcache --cache-dir ${CACHE} -v -v -v sh -c 'sleep 2; cat input' >out2 2>log2
+wait ${first}
+
+grep "Adding cache entry" log1
+grep "Waited for another xcache running this target" log2
+grep "Found matching cache entry" log2
+[ "$(cat out2)" = "hello world" ]
+
+# A holder that hangs around should not hold us up for longer than we asked.
+echo "goodbye" >input2
+xcache --cache-dir ${CACHE} -v -v -v sh -c 'sleep 4; cat input2' >/dev/null \
+    2>&1 &
+first=$!
+sleep 0.5
+xcache --cache-dir ${CACHE} --lock-timeout 1 -v -v -v \
+    sh -c 'sleep 4; cat input2' 2>&1 | grep "Gave up waiting"
+wait ${first}
@@ -0,0 +1,52 @@
+#!/bin/bash -e
+
+# Test that we stop tracing a target that never turns out to be cacheable, and
+# that we try tracing it again after a while.
+
+CACHE=$(mktemp -d)
+SCRATCH=$(mktemp -d)
+trap "rm -rf ${CACHE} ${SCRATCH}" EXIT
+
+cd ${SCRATCH}
+echo "hello world" >input
+
+# A target that makes a syscall we do not handle is never cached.
+for i in 1 2; do
+    xcache --cache-dir ${CACHE} --skip-after 2 --reprobe 2 -v -v -v \
+        sh -c 'cat input; rm -f fifo; mkfifo fifo' >out 2>log
+    grep "Target could not be cached: unhandled syscall" log
+done
+
+# Having wasted two traced runs on it, we should now just run it.
+for i in 1 2; do
+    xcache --cache-dir ${CACHE} --skip-after 2 --reprobe 2 -v -v -v \
+        sh -c 'cat input; rm -f fifo; mkfifo fifo' >out 2>log
+    grep "Not tracing" log
+    [ "$(cat out)" = "hello world" ]
+done
+
+# After two untraced runs, we should try again.
+xcache --cache-dir ${CACHE} --skip-after 2 --reprobe 2 -v -v -v \
+    sh -c 'cat input; rm -f fifo; mkfifo fifo' >out 2>log
+grep "Tracing again" log
+
+# An invocation of the same program we have not seen before is not traced
+# either, as no run of it has been cached.
+xcache --cache-dir ${CACHE} --skip-after 2 --reprobe 2 -v -v -v \
+    sh -c 'rm -f fifo; mkfifo fifo' >out 2>log
+grep "Not tracing" log
+
+# A target that fails is not cached, and after a while is no longer traced.
+for i in 1 2; do
+    ! xcache --cache-dir ${CACHE} --skip-after 2 -v -v -v \
+        cat input missing >out 2>log
+    grep "Target could not be cached: exited with status 1" log
+done
+! xcache --cache-dir ${CACHE} --skip-after 2 -v -v -v \
+    cat input missing >out 2>log
+grep "Not tracing" log
+
+# But that says nothing about the program, so a different invocation of it is
+# still traced.
+xcache --cache-dir ${CACHE} --skip-after 2 -v -v -v cat input 2>&1 >out | \
+    grep "Adding cache entry"
@@ -0,0 +1,31 @@
+#!/bin/bash -e
+
+# Test that files left in the staging directory by an xcache that died are
+# removed, while those still in use are left alone.
+
+CACHE=$(mktemp -d)
+trap "rm -rf ${CACHE}" EXIT
+
+xcache --cache-dir ${CACHE} true
+STAGING=${CACHE}/staging
+[ -d ${STAGING} ]
+
+# An old file nobody has open is stale.
+echo stale > ${STAGING}/tmp.stale
+touch -d "2000-01-01" ${STAGING}/tmp.stale
+
+# An old file someone still has open may be the output of a quiet target.
+echo held > ${STAGING}/tmp.held
+touch -d "2000-01-01" ${STAGING}/tmp.held
+sleep 30 < ${STAGING}/tmp.held &
+HOLDER=$!
+trap "kill ${HOLDER}; rm -rf ${CACHE}" EXIT
+
+# A recent file may be about to be used.
+echo fresh > ${STAGING}/tmp.fresh
+
+xcache --cache-dir ${CACHE} true
+
+[ ! -e ${STAGING}/tmp.stale ]
+[ -e ${STAGING}/tmp.held ]
+[ -e ${STAGING}/tmp.fresh ]
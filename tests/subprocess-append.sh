@@ -0,0 +1,18 @@
+#!/bin/bash -e
+
+# Test that a program writing to a descriptor it inherited is not replayed from
+# the cache, which would overwrite the file rather than append to it.
+
+CACHE=$(mktemp -d)
+SCRATCH=$(mktemp -d)
+trap "rm -rf ${CACHE} ${SCRATCH}" EXIT
+
+cd ${SCRATCH}
+# Back date the log, so that appending to it is visible to a stat.
+touch -d "2000-01-01" log
+
+for i in 1 2; do
+    xcache --cache-dir ${CACHE} --cache-subprocess \
+        sh -c "sh -c 'echo hello' >>log; true"
+done
+[ "$(cat log)" = "$(printf 'hello\nhello')" ]
@@ -0,0 +1,38 @@
+#!/bin/bash -e
+
+# Test that programs run by a build are cached individually and replayed when
+# the build as a whole has to be re-run.
+
+CACHE=$(mktemp -d)
+SCRATCH=$(mktemp -d)
+trap "rm -rf ${CACHE} ${SCRATCH}" EXIT
+
+cd ${SCRATCH}
+echo "first" >in1
+echo "second" >in2
+cat - >Makefile <<EOT
+all: out1 out2
+	cat out1 out2 >all
+
+out%: in%
+	tr a-z A-Z <\$< >\$@
+EOT
+
+xcache --cache-dir ${CACHE} --cache-subprocess -v -v -v make 2>&1 | grep "Added cache entry for subprocess"
+[ "$(cat all)" = "$(printf 'FIRST\nSECOND')" ]
+
+# Change one input and lose one output, so the build as a whole is re-run. The
+# recipe for out1 should come from the cache, and its output with it.
+sleep 1
+echo "changed" >in2
+rm -f out1
+xcache --cache-dir ${CACHE} --cache-subprocess -v -v -v make 2>&1 | grep "Found matching cache entry for subprocess"
+[ "$(cat out1)" = "FIRST" ]
+[ "$(cat all)" = "$(printf 'FIRST\nCHANGED')" ]
+
+# Recipes that write to the terminal cannot be replayed.
+cat - >Makefile <<EOT
+all:
+	echo hello
+EOT
+xcache --cache-dir ${CACHE} --cache-subprocess -v -v -v make 2>&1 >/dev/null | (! grep "Added cache entry for subprocess")
@@ -0,0 +1,36 @@
+#!/bin/bash -e
+
+# Test that a parallel build traced by several threads is cached correctly.
+# Make's recipes are handed off to whichever tracer threads are idle, so the
+# outputs and inputs of the cache entry come from more than one of them.
+
+CACHE=$(mktemp -d)
+SCRATCH=$(mktemp -d)
+trap "rm -rf ${CACHE} ${SCRATCH}" EXIT
+
+cd ${SCRATCH}
+for i in 1 2 3 4 5 6 7 8; do
+    echo "input ${i}" >in${i}
+done
+cat - >Makefile <<EOT
+all: \$(patsubst in%,out%,\$(wildcard in*))
+	cat \$^ >all
+
+out%: in%
+	sh -c 'sleep 0.1; tr a-z A-Z <\$< >\$@'
+EOT
+
+xcache --cache-dir ${CACHE} --tracers 4 -v -v -v make -j8 2>&1 | grep "Adding cache entry"
+[ "$(head -n 1 all)" = "INPUT 1" ]
+
+rm -f all out*
+xcache --cache-dir ${CACHE} --tracers 4 -v -v -v make -j8 2>&1 | grep "Found matching cache entry"
+[ "$(wc -l <all)" -eq 8 ]
+[ "$(cat out8)" = "INPUT 8" ]
+
+# Changing an input read in a handed off subtree should invalidate the entry,
+# so that the target is traced again.
+sleep 1
+echo "changed" >in5
+xcache --cache-dir ${CACHE} --tracers 4 -v -v -v make -j8 2>&1 | grep "Adding cache entry"
+[ "$(cat out5)" = "CHANGED" ]
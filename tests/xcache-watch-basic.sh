@@ -0,0 +1,32 @@
+#!/bin/bash -e
+
+# Test that lookups can rely on xcache-watch to skip checking inputs, and that
+# a change it sees still invalidates the entry.
+
+CACHE=$(mktemp -d)
+TMP=$(mktemp -d)
+
+echo hello >${TMP}/input
+
+xcache --cache-dir ${CACHE} --no-server cat ${TMP}/input
+
+xcache-watch --cache-dir ${CACHE} &
+WATCHER=$!
+trap "kill ${WATCHER}" EXIT
+
+# Wait for the watcher to publish its table. Lookups synchronise with it from
+# then on, so no further waiting is needed.
+for i in $(seq 50); do
+    [ -e ${CACHE}/watch.map ] && break
+    sleep 0.1
+done
+
+# The first lookup checks the inputs itself. The second can rely on the watcher.
+xcache --cache-dir ${CACHE} --no-server cat ${TMP}/input >/dev/null
+xcache --cache-dir ${CACHE} --no-server -v -v -v cat ${TMP}/input 2>&1 | grep "Watcher reports no changes"
+
+# Change the input and give it a distinct timestamp, so the change is visible
+# to a stat as well. The very next lookup must notice it.
+echo goodbye >${TMP}/input
+touch -d "2000-01-01" ${TMP}/input
+[ "$(xcache --cache-dir ${CACHE} --no-server cat ${TMP}/input)" = "goodbye" ]
@@ -0,0 +1,38 @@
+#!/bin/bash -e
+
+# Test that lookups do not rely on xcache-watch for an input reached through a
+# symbolic link, as the watcher only sees the directory holding the link.
+
+CACHE=$(mktemp -d)
+TMP=$(mktemp -d)
+
+mkdir ${TMP}/a ${TMP}/b
+echo hello >${TMP}/b/real
+ln -s ../b/real ${TMP}/a/link
+
+xcache --cache-dir ${CACHE} --no-server cat ${TMP}/a/link
+
+xcache-watch --cache-dir ${CACHE} &
+WATCHER=$!
+trap "kill ${WATCHER}" EXIT
+
+# Wait for the watcher to publish its table. Lookups synchronise with it from
+# then on, so no further waiting is needed.
+for i in $(seq 50); do
+    [ -e ${CACHE}/watch.map ] && break
+    sleep 0.1
+done
+
+# Neither lookup should take the watcher's word for it.
+xcache --cache-dir ${CACHE} --no-server cat ${TMP}/a/link >/dev/null
+OUT=$(xcache --cache-dir ${CACHE} --no-server -v -v -v cat ${TMP}/a/link 2>&1)
+if echo "${OUT}" | grep -q "Watcher reports no changes"; then
+    echo "watcher trusted for an input behind a symbolic link" >&2
+    exit 1
+fi
+
+# Change the target, which is outside any directory the watcher knows of. The
+# next lookup must notice.
+echo goodbye >${TMP}/b/real
+touch -d "2000-01-01" ${TMP}/b/real
+[ "$(xcache --cache-dir ${CACHE} --no-server cat ${TMP}/a/link)" = "goodbye" ]
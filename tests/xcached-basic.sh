@@ -0,0 +1,55 @@
+#!/bin/bash -e
+
+# Test that xcache defers to a running xcached and can retrieve entries through
+# it.
+
+CACHE=$(mktemp -d)
+
+xcached --cache-dir ${CACHE} &
+SERVER=$!
+trap "kill ${SERVER}" EXIT
+
+# Give the server a moment to start listening.
+for i in $(seq 50); do
+    [ -S ${CACHE}/xcached.sock ] && break
+    sleep 0.1
+done
+
+xcache --cache-dir ${CACHE} -v -v -v echo "hello world" 2>&1 | grep "Using xcached"
+xcache --cache-dir ${CACHE} -v -v -v echo "hello world" 2>&1 | grep "Found matching cache entry"
+
+# The cached output should be replicated faithfully.
+[ "$(xcache --cache-dir ${CACHE} echo "hello world")" = "hello world" ]
+
+# A client that connects and then says nothing should not hold up anyone else.
+if command -v python3 >/dev/null; then
+    python3 -c "
+import socket, time
+s = socket.socket(socket.AF_UNIX)
+s.connect('${CACHE}/xcached.sock')
+time.sleep(5)
+" &
+    STALLED=$!
+    sleep 0.5
+    [ "$(timeout 3 xcache --cache-dir ${CACHE} echo "hello world")" = \
+        "hello world" ]
+    kill ${STALLED}
+fi
+
+# Deciding whether a target is worth tracing also goes through the server.
+cd ${CACHE}
+for i in 1 2; do
+    xcache --cache-dir ${CACHE} --skip-after 2 -v -v -v \
+        sh -c 'rm -f fifo; mkfifo fifo' 2>&1 | \
+        grep "Target could not be cached: unhandled syscall"
+done
+xcache --cache-dir ${CACHE} --skip-after 2 -v -v -v \
+    sh -c 'rm -f fifo; mkfifo fifo' 2>&1 | grep "Running target without tracing"
+rm -f fifo
+cd - >/dev/null
+
+# Without a server, xcache should quietly use the cache itself.
+kill ${SERVER}
+wait ${SERVER} || true
+trap - EXIT
+[ "$(xcache --cache-dir ${CACHE} echo "hello world")" = "hello world" ]